@@ -0,0 +1,112 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Bump allocator for memory that dies together: the cJSON tree of one
+// streamed event, everything else scratch during a turn. Allocation is a
+// pointer bump in one block; arena_reset forgets it all at once. When the
+// block runs out, further allocations get blocks of their own, and the next
+// reset replaces the lot with one block big enough for all of it, so after
+// the first few turns every reset is just "used = 0" and nothing touches
+// malloc. The counters are what /mem reports.
+
+#define ARENA_FIRST_BLOCK (16 * 1024)
+#define ARENA_ALIGN 16
+
+struct arena_overflow {
+    struct arena_overflow *next;
+    size_t size;
+};
+
+struct arena {
+    char *block;
+    size_t size, used;
+    struct arena_overflow *overflow;    // allocations that didn't fit the block
+    size_t overflow_bytes;
+    unsigned long allocs;               // served, since the start
+    unsigned long mallocs;              // of them, how many had to call malloc
+    unsigned long resets;
+    size_t peak;                        // most bytes in use between two resets
+};
+
+static struct arena scratch_arena;
+
+static void *arena_alloc(struct arena *a, size_t n) {
+    n = (n + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+    a->allocs++;
+    if(!a->block && !a->overflow) {
+        a->block = malloc(ARENA_FIRST_BLOCK);
+        if(a->block) {
+            a->size = ARENA_FIRST_BLOCK;
+            a->mallocs++;
+        }
+    }
+    if(a->used + n <= a->size) {
+        void *p = a->block + a->used;
+        a->used += n;
+        if(a->used + a->overflow_bytes > a->peak) a->peak = a->used + a->overflow_bytes;
+        return p;
+    }
+    // the header is padded so what follows it stays aligned
+    size_t head = (sizeof(struct arena_overflow) + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+    struct arena_overflow *o = malloc(head + n);
+    if(!o) return NULL;
+    a->mallocs++;
+    o->next = a->overflow;
+    o->size = n;
+    a->overflow = o;
+    a->overflow_bytes += n;
+    if(a->used + a->overflow_bytes > a->peak) a->peak = a->used + a->overflow_bytes;
+    return (char *)o + head;
+}
+
+static void arena_reset(struct arena *a) {
+    a->resets++;
+    if(a->overflow) {
+        size_t size = a->size ? a->size : ARENA_FIRST_BLOCK;
+        while(size < a->used + a->overflow_bytes) size *= 2;
+        while(a->overflow) {
+            struct arena_overflow *next = a->overflow->next;
+            free(a->overflow);
+            a->overflow = next;
+        }
+        a->overflow_bytes = 0;
+        free(a->block);
+        a->block = malloc(size);
+        a->size = a->block ? size : 0;
+        if(a->block) a->mallocs++;
+    }
+    a->used = 0;
+}
+
+static void arena_free(struct arena *a) {
+    while(a->overflow) {
+        struct arena_overflow *next = a->overflow->next;
+        free(a->overflow);
+        a->overflow = next;
+    }
+    free(a->block);
+    a->block = NULL;
+    a->size = a->used = a->overflow_bytes = 0;
+}
+
+// cJSON_InitHooks(&(cJSON_Hooks){ arena_cjson_malloc, arena_cjson_free }):
+// every cJSON allocation comes from the scratch arena and cJSON_Delete
+// frees nothing, so a tree must not outlive the next arena_reset.
+static void *arena_cjson_malloc(size_t n) {
+    return arena_alloc(&scratch_arena, n);
+}
+
+static void arena_cjson_free(void *p) {
+    (void)p;
+}
+
+static void arena_print_stats(const struct arena *a, const char *name) {
+    printf("%s: %lu allocations, %lu of them from malloc, %lu resets, block %zu kB, peak %zu kB\n", name, a->allocs,
+           a->mallocs, a->resets, a->size / 1024, (a->peak + 1023) / 1024);
+}
+
+#endif
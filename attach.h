@@ -0,0 +1,497 @@
+#ifndef ATTACH_H
+#define ATTACH_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <curl/curl.h>
+
+// /attach <path>: files that go with the next message, text files as a text
+// block and PNG, JPEG, GIF or WebP images as an image block.
+//
+// Neither the history nor the request body ever holds the file. The user
+// message stores a reference to it in place of the content block:
+//
+//   \1 kind mime \2 size \2 mtime \2 absolute path \1
+//
+// (kind 't' or 'i'; raw control bytes never occur in serialized JSON, so
+// the reference can't be confused with content). The journal, --resume and
+// the response cache key see only that. When a request body carrying
+// references is posted (transport_post), attach_stream_open splits it into
+// pieces and the upload is produced by a curl read callback: the JSON in
+// between is copied, and each file is mapped and JSON-escaped or
+// base64-encoded straight into curl's upload buffer. The image block is
+// written the way the API at the URL wants it (Anthropic's /messages or
+// OpenAI's chat completions). A file that is gone by then is replaced by a
+// line saying so; one that changed is sent as it is now.
+// (The /attach commands are marked unused for llmproxy, which only includes
+// this through transport.h.)
+
+#define ATTACH_MAX 8                 // pending for one message
+#define ATTACH_MARK '\1'
+#define ATTACH_FIELD '\2'
+#define ATTACH_IMAGE_TOKENS 1600     // rough; the APIs count by pixels
+#define ATTACH_SNIFF 4096            // bytes looked at to tell text from binary
+
+struct attach_file {
+    char path[PATH_MAX];
+    const char *mime;                // NULL for text
+    long long size;
+    long long mtime;
+};
+
+static struct attach_file attach_pending[ATTACH_MAX];
+static int attach_num_pending = 0;
+
+enum { ATTACH_COPY, ATTACH_ESCAPE, ATTACH_BASE64 };
+
+struct attach_piece {
+    int encode;                      // ATTACH_COPY: data; otherwise map
+    const char *data;
+    size_t len;                      // input bytes
+    char *owned;                     // data, if it was made for this stream
+    int fd;
+    unsigned char *map;
+};
+
+struct attach_stream {
+    struct attach_piece *pieces;
+    int num_pieces, cap_pieces;
+    curl_off_t total;                // bytes the read callback will produce
+    int piece;                       // where the read callback is
+    size_t at;                       // input offset in that piece
+    char pending[8];                 // an escape or base64 group that didn't fit
+    int pending_len, pending_at;
+};
+
+static const char *attach_image_type(const unsigned char *p, size_t n) {
+    if(n >= 8 && memcmp(p, "\x89PNG\r\n\x1a\n", 8) == 0) return "image/png";
+    if(n >= 3 && memcmp(p, "\xff\xd8\xff", 3) == 0) return "image/jpeg";
+    if(n >= 6 && (memcmp(p, "GIF87a", 6) == 0 || memcmp(p, "GIF89a", 6) == 0)) return "image/gif";
+    if(n >= 12 && memcmp(p, "RIFF", 4) == 0 && memcmp(p + 8, "WEBP", 4) == 0) return "image/webp";
+    return NULL;
+}
+
+// Length of the valid UTF-8 sequence at p, 0 if there is none
+static int attach_utf8_len(const unsigned char *p, size_t left) {
+    unsigned char c = p[0];
+    int n;
+    uint32_t cp;
+    if(c < 0x80) return 1;
+    if(c >= 0xc2 && c <= 0xdf) n = 2, cp = c & 0x1f;
+    else if(c >= 0xe0 && c <= 0xef) n = 3, cp = c & 0x0f;
+    else if(c >= 0xf0 && c <= 0xf4) n = 4, cp = c & 0x07;
+    else return 0;
+    if(left < (size_t)n) return 0;
+    for(int i = 1; i < n; i++) {
+        if((p[i] & 0xc0) != 0x80) return 0;
+        cp = cp << 6 | (p[i] & 0x3f);
+    }
+    if((n == 3 && (cp < 0x800 || (cp >= 0xd800 && cp <= 0xdfff))) || (n == 4 && (cp < 0x10000 || cp > 0x10ffff))) {
+        return 0;
+    }
+    return n;
+}
+
+// Escape the unit at p (one byte or one UTF-8 sequence) into out, which has
+// room for 6 bytes. Returns the bytes written; *used gets the input taken.
+// Same rules as jsonbuf_string, plus invalid UTF-8 becomes U+FFFD, which
+// the APIs would otherwise reject the whole request for.
+static int attach_escape_unit(const unsigned char *p, size_t left, char *out, size_t *used) {
+    static const char hex[] = "0123456789abcdef";
+    unsigned char c = *p;
+    *used = 1;
+    switch(c) {
+        case '"': memcpy(out, "\\\"", 2); return 2;
+        case '\\': memcpy(out, "\\\\", 2); return 2;
+        case '\b': memcpy(out, "\\b", 2); return 2;
+        case '\f': memcpy(out, "\\f", 2); return 2;
+        case '\n': memcpy(out, "\\n", 2); return 2;
+        case '\r': memcpy(out, "\\r", 2); return 2;
+        case '\t': memcpy(out, "\\t", 2); return 2;
+    }
+    if(c < 32) {
+        memcpy(out, "\\u00", 4);
+        out[4] = hex[c >> 4];
+        out[5] = hex[c & 15];
+        return 6;
+    }
+    int n = attach_utf8_len(p, left);
+    if(n == 0) {
+        memcpy(out, "\\ufffd", 6);
+        return 6;
+    }
+    memcpy(out, p, n);
+    *used = n;
+    return n;
+}
+
+static int attach_plain(unsigned char c) {
+    return c >= 32 && c < 0x80 && c != '"' && c != '\\';
+}
+
+static size_t attach_escaped_len(const unsigned char *p, size_t len) {
+    size_t out = 0;
+    char unit[6];
+    for(size_t i = 0; i < len;) {
+        if(attach_plain(p[i])) {
+            out++;
+            i++;
+            continue;
+        }
+        size_t used;
+        out += attach_escape_unit(p + i, len - i, unit, &used);
+        i += used;
+    }
+    return out;
+}
+
+// Runs of plain ASCII are copied as they are; everything else a unit at a
+// time. Returns the bytes written to out; *in advances.
+static size_t attach_escape(const unsigned char *p, size_t len, size_t *in, char *out, size_t room,
+                            char *spill, int *spill_len) {
+    size_t o = 0, i = *in;
+    while(i < len && o < room) {
+        size_t run = 0, max = len - i < room - o ? len - i : room - o;
+        while(run < max && attach_plain(p[i + run])) run++;
+        memcpy(out + o, p + i, run);
+        o += run;
+        i += run;
+        if(i == len || o == room) break;
+        size_t used;
+        char unit[6];
+        int n = attach_escape_unit(p + i, len - i, unit, &used);
+        i += used;
+        if((size_t)n <= room - o) {
+            memcpy(out + o, unit, n);
+            o += n;
+        } else {
+            // finish it on the next call
+            size_t fit = room - o;
+            memcpy(out + o, unit, fit);
+            o += fit;
+            memcpy(spill, unit + fit, n - fit);
+            *spill_len = n - (int)fit;
+        }
+    }
+    *in = i;
+    return o;
+}
+
+// Base64 through a table of all 4096 12-bit values, two output bytes per
+// lookup: a 3-byte group is two loads and two 2-byte stores.
+static uint16_t attach_b64_pairs[4096];
+
+static void attach_b64_init(void) {
+    static const char alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    if(attach_b64_pairs[1]) return;
+    for(int v = 0; v < 4096; v++) {
+        char pair[2] = { alphabet[v >> 6], alphabet[v & 63] };
+        memcpy(&attach_b64_pairs[v], pair, 2);
+    }
+}
+
+static size_t attach_b64(const unsigned char *p, size_t len, size_t *in, char *out, size_t room, char *spill,
+                         int *spill_len) {
+    size_t i = *in, o = 0;
+    size_t groups = (len - i) / 3;
+    if(groups > room / 4) groups = room / 4;
+    for(size_t g = 0; g < groups; g++, i += 3, o += 4) {
+        uint32_t v = (uint32_t)p[i] << 16 | (uint32_t)p[i + 1] << 8 | p[i + 2];
+        memcpy(out + o, &attach_b64_pairs[v >> 12], 2);
+        memcpy(out + o + 2, &attach_b64_pairs[v & 0xfff], 2);
+    }
+    // the last group, padded, or one that doesn't fit whole any more
+    if(i < len && o < room) {
+        unsigned char last[3] = { 0, 0, 0 };
+        size_t n = len - i < 3 ? len - i : 3;
+        memcpy(last, p + i, n);
+        uint32_t v = (uint32_t)last[0] << 16 | (uint32_t)last[1] << 8 | last[2];
+        char group[4];
+        memcpy(group, &attach_b64_pairs[v >> 12], 2);
+        memcpy(group + 2, &attach_b64_pairs[v & 0xfff], 2);
+        if(n < 3) group[3] = '=';
+        if(n < 2) group[2] = '=';
+        i += n;
+        size_t fit = room - o < 4 ? room - o : 4;
+        memcpy(out + o, group, fit);
+        o += fit;
+        if(fit < 4) {
+            memcpy(spill, group + fit, 4 - fit);
+            *spill_len = 4 - (int)fit;
+        }
+    }
+    *in = i;
+    return o;
+}
+
+static void attach_print_size(long long bytes) {
+    if(bytes < 10240) printf("%lld B", bytes);
+    else if(bytes < 10 * 1024 * 1024) printf("%.1f kB", bytes / 1024.0);
+    else printf("%.1f MB", bytes / (1024.0 * 1024.0));
+}
+
+// /attach <path>
+__attribute__((unused)) static void attach_add(const char *path) {
+    if(attach_num_pending >= ATTACH_MAX) {
+        fprintf(stderr, "At most %d files per message\n", ATTACH_MAX);
+        return;
+    }
+    struct attach_file *a = &attach_pending[attach_num_pending];
+    if(!realpath(path, a->path)) {
+        perror(path);
+        return;
+    }
+    if(strchr(a->path, ATTACH_MARK) || strchr(a->path, ATTACH_FIELD)) {
+        fprintf(stderr, "%s: can't attach a file with control characters in its name\n", path);
+        return;
+    }
+    int fd = open(a->path, O_RDONLY);
+    struct stat st;
+    if(fd < 0 || fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+        if(fd >= 0) fprintf(stderr, "%s: not a regular file\n", path);
+        else perror(path);
+        if(fd >= 0) close(fd);
+        return;
+    }
+    unsigned char head[ATTACH_SNIFF];
+    ssize_t n = read(fd, head, sizeof(head));
+    close(fd);
+    if(n < 0) {
+        perror(path);
+        return;
+    }
+    a->mime = attach_image_type(head, (size_t)n);
+    if(!a->mime && memchr(head, 0, (size_t)n)) {
+        fprintf(stderr, "%s: neither text nor a PNG, JPEG, GIF or WebP image\n", path);
+        return;
+    }
+    a->size = st.st_size;
+    a->mtime = st.st_mtime;
+    attach_num_pending++;
+    printf("Attached %s (%s, ", a->path, a->mime ? a->mime : "text");
+    attach_print_size(a->size);
+    printf("), it goes with your next message\n");
+}
+
+__attribute__((unused)) static void attach_list(void) {
+    if(attach_num_pending == 0) {
+        printf("Nothing attached. /attach <path> adds a text file or an image to the next message\n");
+        return;
+    }
+    for(int i = 0; i < attach_num_pending; i++) {
+        printf("[%d] %s (%s, ", i + 1, attach_pending[i].path, attach_pending[i].mime ? attach_pending[i].mime : "text");
+        attach_print_size(attach_pending[i].size);
+        printf(")\n");
+    }
+}
+
+__attribute__((unused)) static void attach_clear(void) {
+    attach_num_pending = 0;
+}
+
+// The references for the pending files as content blocks, each followed by
+// a comma, for add_message_parts; NULL when nothing is attached. Empties the
+// list. *tokens gets an estimate of what the files will cost.
+__attribute__((unused)) static char *attach_take(size_t *len, int *tokens) {
+    *len = 0;
+    *tokens = 0;
+    if(attach_num_pending == 0) return NULL;
+    size_t cap = (size_t)attach_num_pending * (PATH_MAX + 80);
+    char *parts = malloc(cap);
+    if(!parts) return NULL;
+    for(int i = 0; i < attach_num_pending; i++) {
+        const struct attach_file *a = &attach_pending[i];
+        *len += snprintf(parts + *len, cap - *len, "%c%c%s%c%lld%c%lld%c%s%c,", ATTACH_MARK, a->mime ? 'i' : 't',
+                         a->mime ? a->mime : "", ATTACH_FIELD, a->size, ATTACH_FIELD, a->mtime, ATTACH_FIELD,
+                         a->path, ATTACH_MARK);
+        *tokens += a->mime ? ATTACH_IMAGE_TOKENS : (int)(a->size / 4);
+    }
+    attach_num_pending = 0;
+    return parts;
+}
+
+static struct attach_piece *attach_piece_add(struct attach_stream *s, int encode, const char *data, size_t len) {
+    if(s->num_pieces == s->cap_pieces) {
+        int cap = s->cap_pieces ? s->cap_pieces * 2 : 16;
+        struct attach_piece *pieces = realloc(s->pieces, cap * sizeof(*pieces));
+        if(!pieces) return NULL;
+        s->pieces = pieces;
+        s->cap_pieces = cap;
+    }
+    struct attach_piece *p = &s->pieces[s->num_pieces++];
+    memset(p, 0, sizeof(*p));
+    p->encode = encode;
+    p->data = data;
+    p->len = len;
+    p->fd = -1;
+    s->total += (curl_off_t)len;
+    return p;
+}
+
+static int attach_piece_owned(struct attach_stream *s, const char *text) {
+    char *copy = strdup(text);
+    struct attach_piece *p = copy ? attach_piece_add(s, ATTACH_COPY, copy, strlen(copy)) : NULL;
+    if(!p) {
+        free(copy);
+        return 0;
+    }
+    p->owned = copy;
+    return 1;
+}
+
+// The content block for one reference: prefix, file, suffix.
+static int attach_expand(struct attach_stream *s, const char *ref, size_t ref_len, int anthropic) {
+    char kind = ref[0];
+    char mime[32] = "", path[PATH_MAX] = "";
+    const char *f1 = memchr(ref, ATTACH_FIELD, ref_len), *f3 = ref + ref_len;
+    while(f3 > ref && f3[-1] != ATTACH_FIELD) f3--;
+    f3--;
+    if(!f1 || f3 <= f1) return 0;
+    snprintf(mime, sizeof(mime), "%.*s", (int)(f1 - ref - 1), ref + 1);
+    snprintf(path, sizeof(path), "%.*s", (int)(ref + ref_len - f3 - 1), f3 + 1);
+
+    // the path goes into the JSON too, escaped like the contents: it may
+    // hold anything
+    size_t path_len = strlen(path), used = 0;
+    char *head = malloc(6 * path_len + 160), spill[8];
+    int spill_len = 0;
+    if(!head) return 0;
+    size_t at = (size_t)sprintf(head, "{\"type\":\"text\",\"text\":\"");
+    at += attach_escape((const unsigned char *)path, path_len, &used, head + at, 6 * path_len, spill, &spill_len);
+
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    unsigned char *map = NULL;
+    if(fd >= 0 && fstat(fd, &st) == 0 && st.st_size > 0) {
+        map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if(map == MAP_FAILED) map = NULL;
+    }
+    if(!map) {
+        if(fd >= 0) close(fd);
+        fprintf(stderr, "(attachment %s is gone or empty, sending a note instead)\n", path);
+        strcpy(head + at, " is no longer available\"}");
+        int ok = attach_piece_owned(s, head);
+        free(head);
+        return ok;
+    }
+    size_t size = (size_t)st.st_size;
+    madvise(map, size, MADV_SEQUENTIAL);
+    struct attach_piece *p = NULL;
+    if(kind == 'i') {
+        if(anthropic) {
+            sprintf(head, "{\"type\":\"image\",\"source\":{\"type\":\"base64\",\"media_type\":\"%s\",\"data\":\"", mime);
+        } else {
+            sprintf(head, "{\"type\":\"image_url\",\"image_url\":{\"url\":\"data:%s;base64,", mime);
+        }
+        if(attach_piece_owned(s, head)) p = attach_piece_add(s, ATTACH_BASE64, (const char *)map, size);
+        if(p) s->total += (curl_off_t)((size + 2) / 3 * 4) - (curl_off_t)size;
+    } else {
+        // the name first, so the model can refer to it
+        strcpy(head + at, ":\\n```\\n");
+        if(attach_piece_owned(s, head)) p = attach_piece_add(s, ATTACH_ESCAPE, (const char *)map, size);
+        if(p) s->total += (curl_off_t)attach_escaped_len(map, size) - (curl_off_t)size;
+    }
+    free(head);
+    if(!p) {
+        munmap(map, size);
+        close(fd);
+        return 0;
+    }
+    p->fd = fd;
+    p->map = map;
+    const char *tail = kind == 'i' ? "\"}}" : "\\n```\"}";
+    return attach_piece_add(s, ATTACH_COPY, tail, strlen(tail)) != NULL;
+}
+
+static void attach_stream_free(struct attach_stream *s) {
+    if(!s) return;
+    for(int i = 0; i < s->num_pieces; i++) {
+        struct attach_piece *p = &s->pieces[i];
+        free(p->owned);
+        if(p->map) munmap(p->map, p->len);
+        if(p->fd >= 0) close(p->fd);
+    }
+    free(s->pieces);
+    free(s);
+}
+
+// NULL if body has no references (it is then posted as it is), otherwise
+// the pieces of the body with the files in place.
+static struct attach_stream *attach_stream_open(const char *body, size_t len, int anthropic) {
+    const char *mark = memchr(body, ATTACH_MARK, len);
+    if(!mark) return NULL;
+    struct attach_stream *s = calloc(1, sizeof(*s));
+    if(!s) return NULL;
+    attach_b64_init();
+    const char *at = body, *end = body + len;
+    while(mark) {
+        const char *close = memchr(mark + 1, ATTACH_MARK, end - mark - 1);
+        if(!close) break;
+        if(!attach_piece_add(s, ATTACH_COPY, at, mark - at) ||
+           !attach_expand(s, mark + 1, close - mark - 1, anthropic)) {
+            attach_stream_free(s);
+            return NULL;
+        }
+        at = close + 1;
+        mark = memchr(at, ATTACH_MARK, end - at);
+    }
+    if(!attach_piece_add(s, ATTACH_COPY, at, end - at)) {
+        attach_stream_free(s);
+        return NULL;
+    }
+    return s;
+}
+
+// CURLOPT_READFUNCTION
+static size_t attach_read(char *buffer, size_t size, size_t nitems, void *userp) {
+    struct attach_stream *s = (struct attach_stream *)userp;
+    size_t room = size * nitems, o = 0;
+    while(o < room) {
+        if(s->pending_at < s->pending_len) {
+            size_t n = (size_t)(s->pending_len - s->pending_at);
+            if(n > room - o) n = room - o;
+            memcpy(buffer + o, s->pending + s->pending_at, n);
+            o += n;
+            s->pending_at += (int)n;
+            continue;
+        }
+        s->pending_len = s->pending_at = 0;
+        if(s->piece >= s->num_pieces) break;
+        struct attach_piece *p = &s->pieces[s->piece];
+        if(s->at >= p->len) {
+            s->piece++;
+            s->at = 0;
+            continue;
+        }
+        if(p->encode == ATTACH_COPY) {
+            size_t n = p->len - s->at < room - o ? p->len - s->at : room - o;
+            memcpy(buffer + o, p->data + s->at, n);
+            s->at += n;
+            o += n;
+        } else if(p->encode == ATTACH_ESCAPE) {
+            o += attach_escape(p->map, p->len, &s->at, buffer + o, room - o, s->pending, &s->pending_len);
+        } else {
+            o += attach_b64(p->map, p->len, &s->at, buffer + o, room - o, s->pending, &s->pending_len);
+        }
+    }
+    return o;
+}
+
+// CURLOPT_SEEKFUNCTION: curl rewinds when it resends on a new connection
+static int attach_seek(void *userp, curl_off_t offset, int origin) {
+    struct attach_stream *s = (struct attach_stream *)userp;
+    if(origin != SEEK_SET || offset != 0) return CURL_SEEKFUNC_CANTSEEK;
+    s->piece = 0;
+    s->at = 0;
+    s->pending_len = s->pending_at = 0;
+    return CURL_SEEKFUNC_OK;
+}
+
+#endif
@@ -0,0 +1,528 @@
+#ifndef BATCH_H
+#define BATCH_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <curl/curl.h>
+#include "transport.h"
+#include "jsonscan.h"
+#include "history.h"
+#include "respcache.h"
+#include "metrics.h"
+#include "ratelimit.h"
+
+// Batch mode: every line of a JSONL file is one independent prompt. Up to
+// `jobs` requests are in flight at once on one multi handle, over the
+// shared connection pool, and each result is appended to the output JSONL
+// as soon as it completes:
+//
+//   {"line":12,"id":"a7","model":"...","latency":1.52,"tokens":87,"content":"..."}
+//   {"line":13,"model":"...","latency":0.31,"error":"..."}
+//
+// "line" is the 1-based input line. Re-running with the same output file
+// skips every line that already has a successful record, so an interrupted
+// job resumes where it stopped and failed lines are retried; when a line
+// shows up twice the later record wins.
+//
+// Input lines are objects with the prompt in "prompt" (or the member named
+// by --field) and optionally "id", copied to the output, and "model", which
+// overrides the default model for that line.
+//
+// Every request is also filed with metrics.h, so LLM_METRICS gets one
+// timing line per request of the run.
+//
+// With LLM_CACHE=1 lines whose exact request is in the response cache are
+// answered from it without a request and marked "cached":true.
+//
+// Requests are paced by ratelimit.h: a job whose model is over its limit
+// waits (start_at) while the others go on, and one that is turned away is
+// sent again after a backoff instead of being recorded as failed.
+
+#define BATCH_MAX_JOBS 64
+
+// Where and how to send a request for one model. Filled in by the program.
+struct batch_target {
+    const char *url;
+    struct curl_slist *headers;   // owned by the program, lives for the run
+    const char *before, *after;   // extra body members, as for history_request_body
+    const char **paths;           // reply text, error message, output tokens
+};
+typedef int (*batch_target_fn)(const char *model, struct batch_target *target);
+
+struct batch_options {
+    const char *input;
+    const char *output;
+    const char *model;
+    const char *field;
+    int jobs;
+};
+
+struct batch_job {
+    CURL *curl;
+    long line;
+    const char *url;
+    int cached;               // answered from the response cache
+    char model[128];
+    struct jsonbuf id;        // serialized "id" member, empty if none
+    struct jsonbuf body;
+    struct json_scanner scan;
+    struct jsonbuf text;
+    char *error;
+    long tokens;
+    long prompt_tokens;       // estimate charged to the rate limit
+    int replied;
+    struct ratelimit_bucket *limit;
+    struct ratelimit_info limits;
+    int retries;
+    double start_at;          // waiting for the rate limit until then; 0: sent
+};
+
+// Fields of an input line
+struct batch_line {
+    struct jsonbuf prompt;
+    struct jsonbuf id;
+    char model[128];
+    int has_prompt;
+};
+
+// Lines that already have a successful record in the output
+static unsigned char *batch_done = NULL;
+static long batch_done_cap = 0;
+
+static int batch_is_done(long line) {
+    return line < batch_done_cap * 8 && (batch_done[line / 8] & (1 << (line % 8)));
+}
+
+static void batch_mark_done(long line) {
+    if(line >= batch_done_cap * 8) {
+        long cap = batch_done_cap ? batch_done_cap * 2 : 1024;
+        while(line >= cap * 8) cap *= 2;
+        unsigned char *done = realloc(batch_done, cap);
+        if(!done) return;
+        memset(done + batch_done_cap, 0, cap - batch_done_cap);
+        batch_done = done;
+        batch_done_cap = cap;
+    }
+    batch_done[line / 8] |= 1 << (line % 8);
+}
+
+struct batch_record {
+    long line;
+    int has_error;
+};
+
+static void batch_record_value(int path, int type, const char *value, size_t len, void *userp) {
+    struct batch_record *rec = (struct batch_record *)userp;
+    if(path == 0 && type == JSON_NUMBER) rec->line = strtol(value, NULL, 10);
+    else if(path == 1) rec->has_error = 1;
+}
+
+// Collect the finished lines of an earlier run and cut off a record that
+// was only half written when it stopped. Returns how many were found.
+static long batch_resume(const char *path) {
+    FILE *f = fopen(path, "r");
+    if(!f) return 0;
+    static const char *paths[] = { "line", "error" };
+    struct batch_record rec;
+    struct json_scanner scan;
+    json_scan_init(&scan, paths, 2, batch_record_value, &rec);
+    char *line = NULL;
+    size_t cap = 0;
+    ssize_t n;
+    long found = 0;
+    off_t good = 0;
+    while((n = getline(&line, &cap, f)) > 0) {
+        if(line[n - 1] != '\n') break;
+        good += n;
+        rec.line = 0;
+        rec.has_error = 0;
+        json_scan_reset(&scan);
+        json_scan_feed(&scan, line, (size_t)n);
+        if(json_scan_finish(&scan) && rec.line > 0 && !rec.has_error) {
+            batch_mark_done(rec.line);
+            found++;
+        }
+    }
+    free(line);
+    json_scan_free(&scan);
+    fclose(f);
+    if(truncate(path, good) != 0) perror(path);
+    return found;
+}
+
+static void batch_line_value(int path, int type, const char *value, size_t len, void *userp) {
+    struct batch_line *in = (struct batch_line *)userp;
+    if(path == 0 && type == JSON_STRING) {
+        in->prompt.len = 0;
+        jsonbuf_append(&in->prompt, value, len);
+        in->has_prompt = 1;
+    } else if(path == 1 && type < JSON_OBJECT) {
+        in->id.len = 0;
+        jsonbuf_puts(&in->id, ",\"id\":");
+        if(type == JSON_STRING) jsonbuf_string(&in->id, value);
+        else jsonbuf_append(&in->id, value, len);
+    } else if(path == 2 && type == JSON_STRING) {
+        snprintf(in->model, sizeof(in->model), "%s", value);
+    }
+}
+
+static void batch_reply_value(int path, int type, const char *value, size_t len, void *userp) {
+    struct batch_job *job = (struct batch_job *)userp;
+    if(path == 0 && type == JSON_STRING && !job->replied) {
+        jsonbuf_append(&job->text, value, len);
+        job->replied = 1;
+    } else if(path == 1 && type == JSON_STRING && !job->error) {
+        job->error = strdup(value);
+    } else if(path == 2 && type == JSON_NUMBER) {
+        job->tokens = strtol(value, NULL, 10);
+    }
+}
+
+static size_t batch_write(void *contents, size_t size, size_t nmemb, void *userp) {
+    size_t realsize = size * nmemb;
+    struct batch_job *job = (struct batch_job *)userp;
+    json_scan_feed(&job->scan, contents, realsize);
+    return realsize;
+}
+
+static double batch_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Hand job to the multi handle now, or set start_at if its rate limit says
+// to wait. Returns 0 if the handle could not be added.
+static int batch_send(CURLM *multi, struct batch_job *job) {
+    double wait = ratelimit_delay(job->limit, job->prompt_tokens);
+    if(wait > 0) {
+        if(job->start_at == 0) job->limit->paced++;
+        job->start_at = batch_now() + wait;
+        return 1;
+    }
+    job->start_at = 0;
+    ratelimit_sent(job->limit, job->prompt_tokens);
+    ratelimit_info_reset(&job->limits);
+    return curl_multi_add_handle(multi, job->curl) == CURLM_OK;
+}
+
+// Set up job for one input line and hand it to the multi handle. Returns
+// 2 when the response cache already has the answer and no request is needed.
+static int batch_start(CURLM *multi, struct batch_job *job, long line, struct batch_line *in,
+                       const struct batch_options *opt, batch_target_fn target_for) {
+    struct batch_target target = {0};
+    snprintf(job->model, sizeof(job->model), "%s", in->model[0] ? in->model : opt->model);
+    if(!target_for(job->model, &target)) return 0;
+    job->line = line;
+    job->id.len = 0;
+    if(in->id.len) jsonbuf_append(&job->id, in->id.data, in->id.len);
+    job->body.len = 0;
+    jsonbuf_puts(&job->body, "{\"model\":");
+    jsonbuf_string(&job->body, job->model);
+    if(target.before) jsonbuf_puts(&job->body, target.before);
+    jsonbuf_puts(&job->body, history_options);
+    jsonbuf_puts(&job->body, ",\"messages\":[{\"role\":\"user\",\"content\":");
+    jsonbuf_string(&job->body, in->prompt.data);
+    jsonbuf_puts(&job->body, "}]");
+    if(target.after) jsonbuf_puts(&job->body, target.after);
+    jsonbuf_puts(&job->body, "}");
+    if(!job->body.data) return 0;
+    // counted the way the history counts a message
+    job->prompt_tokens = count_tokens(in->prompt.data) + MESSAGE_TOKEN_OVERHEAD;
+    job->text.len = 0;
+    free(job->error);
+    job->error = NULL;
+    job->tokens = 0;
+    job->replied = 0;
+    job->retries = 0;
+    job->start_at = 0;
+    job->url = target.url;
+    char *hit = rcache_get(target.url, job->body.data, job->body.len);
+    job->cached = hit != NULL;
+    if(hit) {
+        jsonbuf_puts(&job->text, hit);
+        free(hit);
+        job->replied = 1;
+        return 2;
+    }
+    json_scan_init(&job->scan, target.paths, 3, batch_reply_value, job);
+
+    if(!job->curl) job->curl = curl_easy_init();
+    else curl_easy_reset(job->curl);
+    if(!job->curl) return 0;
+    transport_setup(job->curl);
+    // open connections in parallel instead of waiting to see whether the
+    // first one can multiplex; HTTP/2 ones in the pool are still shared
+    curl_easy_setopt(job->curl, CURLOPT_PIPEWAIT, 0L);
+    curl_easy_setopt(job->curl, CURLOPT_URL, target.url);
+    curl_easy_setopt(job->curl, CURLOPT_HTTPHEADER, target.headers);
+    curl_easy_setopt(job->curl, CURLOPT_POSTFIELDS, job->body.data);
+    curl_easy_setopt(job->curl, CURLOPT_POSTFIELDSIZE, (long)job->body.len);
+    curl_easy_setopt(job->curl, CURLOPT_WRITEFUNCTION, batch_write);
+    curl_easy_setopt(job->curl, CURLOPT_WRITEDATA, (void *)job);
+    curl_easy_setopt(job->curl, CURLOPT_HEADERFUNCTION, ratelimit_header);
+    curl_easy_setopt(job->curl, CURLOPT_HEADERDATA, (void *)&job->limits);
+    curl_easy_setopt(job->curl, CURLOPT_PRIVATE, (void *)job);
+    job->limit = ratelimit_find(target.url, job->model);
+    return batch_send(multi, job);
+}
+
+// The job's request is over. Returns 1 if it was turned away and is to be
+// sent again (start_at) instead of recorded.
+static int batch_retry(struct batch_job *job, CURLcode res) {
+    ratelimit_update(job->limit, &job->limits);
+    if(job->replied || !ratelimit_retry(job->limit, &job->limits, res, job->retries, NULL)) return 0;
+    job->retries++;
+    json_scan_reset(&job->scan);
+    job->text.len = 0;
+    free(job->error);
+    job->error = NULL;
+    job->tokens = 0;
+    job->start_at = batch_now() + ratelimit_delay(job->limit, job->prompt_tokens);
+    return 1;
+}
+
+// Append the record for a finished job. Returns 1 if it succeeded.
+static int batch_finish(FILE *out, struct batch_job *job, CURLcode res) {
+    double seconds = 0;
+    long status = 0;
+    if(!job->cached) {
+        curl_easy_getinfo(job->curl, CURLINFO_TOTAL_TIME, &seconds);
+        curl_easy_getinfo(job->curl, CURLINFO_RESPONSE_CODE, &status);
+    }
+    int ok = job->cached || (res == CURLE_OK && json_scan_finish(&job->scan) && job->replied);
+    if(!job->cached) {
+        struct metrics_sample metrics;
+        metrics_begin(&metrics, job->model);
+        if(job->tokens > 0) metrics.completion_tokens = job->tokens;
+        metrics.text = job->text.data;
+        metrics_finish(&metrics, job->curl, ok);
+        if(metrics.completion_tokens > 0) job->tokens = metrics.completion_tokens;
+    }
+    if(ok && !job->cached) rcache_put(job->url, job->body.data, job->body.len, job->text.data);
+    struct jsonbuf rec = {0};
+    char num[64];
+    snprintf(num, sizeof(num), "{\"line\":%ld", job->line);
+    jsonbuf_puts(&rec, num);
+    if(job->id.len) jsonbuf_append(&rec, job->id.data, job->id.len);
+    jsonbuf_puts(&rec, ",\"model\":");
+    jsonbuf_string(&rec, job->model);
+    snprintf(num, sizeof(num), ",\"latency\":%.3f", seconds);
+    jsonbuf_puts(&rec, num);
+    if(ok) {
+        if(job->tokens == 0) job->tokens = count_tokens(job->text.data);
+        snprintf(num, sizeof(num), ",\"tokens\":%ld", job->tokens);
+        jsonbuf_puts(&rec, num);
+        if(job->cached) jsonbuf_puts(&rec, ",\"cached\":true");
+        jsonbuf_puts(&rec, ",\"content\":");
+        jsonbuf_string(&rec, job->text.data);
+    } else {
+        char reason[128];
+        const char *error = job->error;
+        if(!error) {
+            if(res != CURLE_OK) snprintf(reason, sizeof(reason), "%s", curl_easy_strerror(res));
+            else snprintf(reason, sizeof(reason), "unexpected response (HTTP %ld)", status);
+            error = reason;
+        }
+        jsonbuf_puts(&rec, ",\"error\":");
+        jsonbuf_string(&rec, error);
+    }
+    jsonbuf_puts(&rec, "}\n");
+    if(rec.data) {
+        fwrite(rec.data, 1, rec.len, out);
+        fflush(out);
+    }
+    free(rec.data);
+    json_scan_free(&job->scan);
+    return ok;
+}
+
+// --batch FILE [-o FILE] [-j JOBS] [-m MODEL] [--field NAME]. Returns 1 for
+// a batch run, 0 for the interactive program, -1 after a usage error.
+static int batch_parse_args(int argc, char **argv, struct batch_options *opt) {
+    static char output[1024];
+    int batch = 0;
+    for(int i = 1; i < argc; i++) {
+        const char *arg = argv[i];
+        const char *value = i + 1 < argc ? argv[i + 1] : NULL;
+        if(strcmp(arg, "--batch") == 0 && value) {
+            opt->input = value;
+            batch = 1;
+        } else if((strcmp(arg, "-o") == 0 || strcmp(arg, "--output") == 0) && value) {
+            opt->output = value;
+        } else if((strcmp(arg, "-j") == 0 || strcmp(arg, "--jobs") == 0) && value) {
+            opt->jobs = atoi(value);
+        } else if((strcmp(arg, "-m") == 0 || strcmp(arg, "--model") == 0) && value) {
+            opt->model = value;
+        } else if(strcmp(arg, "--field") == 0 && value) {
+            opt->field = value;
+        } else {
+            fprintf(stderr, "Usage: %s [--resume SESSION] [--batch FILE|- [-o OUTPUT] [-j JOBS] [-m MODEL] [--field NAME]]\n", argv[0]);
+            return -1;
+        }
+        i++;
+    }
+    if(!batch) return 0;
+    if(!opt->output) {
+        if(strcmp(opt->input, "-") == 0) {
+            fprintf(stderr, "Reading prompts from stdin needs -o OUTPUT\n");
+            return -1;
+        }
+        snprintf(output, sizeof(output), "%s.results", opt->input);
+        opt->output = output;
+    }
+    if(opt->jobs <= 0) opt->jobs = 8;
+    return 1;
+}
+
+static int batch_run(const struct batch_options *opt, batch_target_fn target_for) {
+    FILE *in = strcmp(opt->input, "-") == 0 ? stdin : fopen(opt->input, "r");
+    if(!in) {
+        perror(opt->input);
+        return 1;
+    }
+    long skipped = batch_resume(opt->output);
+    FILE *out = fopen(opt->output, "a");
+    if(!out) {
+        perror(opt->output);
+        if(in != stdin) fclose(in);
+        return 1;
+    }
+    CURLM *multi = curl_multi_init();
+    int jobs = opt->jobs < 1 ? 1 : opt->jobs > BATCH_MAX_JOBS ? BATCH_MAX_JOBS : opt->jobs;
+    struct batch_job *pool = calloc(jobs, sizeof(*pool));
+    struct batch_job **idle = calloc(jobs, sizeof(*idle));
+    if(!multi || !pool || !idle) {
+        fprintf(stderr, "Out of memory\n");
+        return 1;
+    }
+    int num_idle = jobs;
+    for(int i = 0; i < jobs; i++) idle[i] = &pool[i];
+    if(skipped > 0) fprintf(stderr, "Resuming: %ld lines already done\n", skipped);
+
+    const char *field = opt->field ? opt->field : "prompt";
+    const char *paths[] = { field, "id", "model" };
+    struct batch_line fields = {0};
+    struct json_scanner scan;
+    json_scan_init(&scan, paths, 3, batch_line_value, &fields);
+    char *line = NULL;
+    size_t cap = 0;
+    long line_no = 0, done = 0, failed = 0, cached = 0, retried = 0;
+    int eof = 0, running = 0;
+    double start = batch_now(), last_report = 0;
+
+    while(!eof || running > 0) {
+        // keep every idle job busy while there is input
+        while(!eof && num_idle > 0) {
+            ssize_t n = getline(&line, &cap, in);
+            if(n < 0) {
+                eof = 1;
+                break;
+            }
+            line_no++;
+            if(batch_is_done(line_no)) continue;
+            if(strspn(line, " \t\r\n") == (size_t)n) continue;
+            fields.prompt.len = fields.id.len = 0;
+            fields.model[0] = 0;
+            fields.has_prompt = 0;
+            json_scan_reset(&scan);
+            json_scan_feed(&scan, line, (size_t)n);
+            if(!json_scan_finish(&scan) || !fields.has_prompt) {
+                fprintf(stderr, "line %ld: no \"%s\" string, skipped\n", line_no, field);
+                continue;
+            }
+            struct batch_job *job = idle[num_idle - 1];
+            int started = batch_start(multi, job, line_no, &fields, opt, target_for);
+            if(started == 2) {
+                batch_finish(out, job, CURLE_OK);
+                done++;
+                cached++;
+                continue;
+            }
+            if(!started) {
+                fprintf(stderr, "line %ld: could not start request\n", line_no);
+                failed++;
+                continue;
+            }
+            num_idle--;
+            running++;
+        }
+        if(running == 0) continue;
+        int still;
+        if(curl_multi_perform(multi, &still) != CURLM_OK) break;
+        CURLMsg *msg;
+        int left;
+        while((msg = curl_multi_info_read(multi, &left))) {
+            if(msg->msg != CURLMSG_DONE) continue;
+            struct batch_job *job = NULL;
+            CURL *easy = msg->easy_handle;
+            CURLcode res = msg->data.result;
+            curl_easy_getinfo(easy, CURLINFO_PRIVATE, (char **)&job);
+            curl_multi_remove_handle(multi, easy);
+            if(batch_retry(job, res)) {
+                retried++;
+                continue;
+            }
+            if(batch_finish(out, job, res)) done++;
+            else failed++;
+            idle[num_idle++] = job;
+            running--;
+        }
+        double now = batch_now(), wake = now + 1;
+        for(int i = 0; i < jobs; i++) {
+            struct batch_job *job = &pool[i];
+            if(job->start_at == 0) continue;
+            if(now >= job->start_at && !batch_send(multi, job)) {
+                // recorded as failed like any other request
+                job->start_at = 0;
+                if(batch_finish(out, job, CURLE_FAILED_INIT)) done++;
+                else failed++;
+                idle[num_idle++] = job;
+                running--;
+            } else if(job->start_at > 0 && job->start_at < wake) {
+                wake = job->start_at;
+            }
+        }
+        if(isatty(fileno(stderr)) && now - last_report >= 0.5) {
+            fprintf(stderr, "\r%ld done, %ld failed, %d in flight, %.1f req/s ", done, failed, running,
+                    (done + failed) / (now - start));
+            last_report = now;
+        }
+        if(running > 0 && (num_idle == 0 || eof)) {
+            int timeout = wake > now ? (int)((wake - now) * 1000) + 1 : 1;
+            curl_multi_poll(multi, NULL, 0, timeout < 1000 ? timeout : 1000, NULL);
+        }
+    }
+    double elapsed = batch_now() - start;
+    fprintf(stderr, "%s%ld done, %ld failed in %.1f s (%.1f req/s, %d in flight max)\n",
+            isatty(fileno(stderr)) ? "\r" : "", done, failed, elapsed,
+            elapsed > 0 ? (done + failed) / elapsed : 0.0, jobs);
+    if(cached > 0) fprintf(stderr, "%ld answered from the response cache\n", cached);
+    if(retried > 0) fprintf(stderr, "%ld requests sent again after being turned away\n", retried);
+
+    for(int i = 0; i < jobs; i++) {
+        if(pool[i].curl) curl_easy_cleanup(pool[i].curl);
+        free(pool[i].id.data);
+        free(pool[i].body.data);
+        free(pool[i].text.data);
+        free(pool[i].error);
+    }
+    free(pool);
+    free(idle);
+    free(line);
+    free(fields.prompt.data);
+    free(fields.id.data);
+    json_scan_free(&scan);
+    curl_multi_cleanup(multi);
+    fclose(out);
+    if(in != stdin) fclose(in);
+    free(batch_done);
+    batch_done = NULL;
+    batch_done_cap = 0;
+    return failed > 0 ? 2 : 0;
+}
+
+#endif
@@ -0,0 +1,310 @@
+// End-to-end benchmark: runs a real client against mockserver.c and reports
+// what a turn costs on the client side at different history lengths.
+//
+//   gcc mockserver.c -o mockserver -lz
+//   gcc bench.c -o bench -lz
+//   ./bench --client ./openrouter --history 0,25,50,100 --turns 50 -- --chunk-bytes 8
+//
+// For each history length a session journal holding that many messages is
+// written with history.h, the same code the client uses, and the client is
+// started on it with --resume and fed --turns prompts on stdin. A second
+// run on the same session that only quits is the baseline: its time and
+// CPU are taken off, so start-up and loading the session don't count as
+// turns. CPU and peak RSS come from wait4(), so only the client is
+// measured, not the mock. Everything after "--" is passed to mockserver.
+
+#define _GNU_SOURCE   // nftw, wait4
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <time.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include "history.h"
+
+#define BENCH_MAX_LENGTHS 32
+#define BENCH_MAX_PROMPT 8000   // the clients read a line into a 10 kB buffer
+
+struct bench_options {
+    const char *client;
+    const char *mock;
+    const char *model;
+    int port;
+    int turns;
+    int message_bytes;
+    int lengths[BENCH_MAX_LENGTHS];
+    int num_lengths;
+    char **mock_args;
+    int num_mock_args;
+};
+
+struct bench_run {
+    double wall;          // seconds
+    double cpu;           // user + system seconds
+    long max_rss_kb;
+    int errors;           // lines the client wrote to stderr
+};
+
+static double bench_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void bench_text(char *out, int len, int seed) {
+    static const char words[] = "the quick brown fox jumps over the lazy dog while benchmarks run ";
+    for(int i = 0; i < len; i++) out[i] = words[(i + seed * 7) % (int)(sizeof(words) - 1)];
+    out[len] = 0;
+}
+
+static pid_t bench_start_mock(const struct bench_options *opt) {
+    char port[16];
+    snprintf(port, sizeof(port), "%d", opt->port);
+    pid_t pid = fork();
+    if(pid != 0) return pid;
+    char **argv = calloc(opt->num_mock_args + 6, sizeof(char *));
+    int n = 0;
+    argv[n++] = (char *)opt->mock;
+    argv[n++] = "--port";
+    argv[n++] = port;
+    argv[n++] = "--quiet";
+    for(int i = 0; i < opt->num_mock_args; i++) argv[n++] = opt->mock_args[i];
+    argv[n] = NULL;
+    execv(opt->mock, argv);
+    perror(opt->mock);
+    _exit(127);
+}
+
+static int bench_wait_port(int port) {
+    for(int tries = 0; tries < 100; tries++) {
+        int fd = socket(AF_INET, SOCK_STREAM, 0);
+        struct sockaddr_in addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons((uint16_t)port);
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        int ok = connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0;
+        close(fd);
+        if(ok) return 1;
+        usleep(20000);
+    }
+    return 0;
+}
+
+// A session with `messages` alternating user and assistant messages, in
+// the state directory. Returns 0 on failure.
+static int bench_write_session(const struct bench_options *opt, int messages, char *session, size_t size) {
+    char *text = malloc(opt->message_bytes + 1);
+    if(!text) return 0;
+    journal_enabled = 1;
+    if(opt->model) history_set_model(opt->model);
+    for(int i = 0; i < messages; i++) {
+        bench_text(text, opt->message_bytes, i);
+        add_message(i % 2 ? "assistant" : "user", text);
+    }
+    free(text);
+    // an empty session has no file yet
+    if(journal_fd < 0) {
+        const char *parts[] = { "" };
+        size_t lens[] = { 0 };
+        journal_append(HISTORY_RECORD_UNPIN, 0, parts, lens, 1);
+    }
+    if(journal_fd < 0) return 0;
+    journal_sync();
+    close(journal_fd);
+    journal_fd = -1;
+    snprintf(session, size, "%s", journal_name);
+    history_free();
+    return 1;
+}
+
+static int bench_write_prompts(const char *path, const struct bench_options *opt, int turns) {
+    FILE *f = fopen(path, "w");
+    if(!f) return 0;
+    int len = opt->message_bytes < BENCH_MAX_PROMPT ? opt->message_bytes : BENCH_MAX_PROMPT;
+    char *text = malloc(len + 1);
+    if(!text) {
+        fclose(f);
+        return 0;
+    }
+    for(int i = 0; i < turns; i++) {
+        bench_text(text, len, i);
+        fprintf(f, "turn %d %s\n", i, text);
+    }
+    fprintf(f, "/quit\n");
+    free(text);
+    return fclose(f) == 0;
+}
+
+static int bench_count_lines(const char *path) {
+    FILE *f = fopen(path, "r");
+    if(!f) return 0;
+    int lines = 0, c;
+    while((c = fgetc(f)) != EOF) lines += c == '\n';
+    fclose(f);
+    return lines;
+}
+
+static int bench_run_client(const struct bench_options *opt, const char *session, const char *prompts,
+                            const char *log, struct bench_run *run) {
+    double start = bench_now();
+    pid_t pid = fork();
+    if(pid < 0) return 0;
+    if(pid == 0) {
+        int in = open(prompts, O_RDONLY);
+        int out = open("/dev/null", O_WRONLY);
+        int err = open(log, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+        if(in < 0 || out < 0 || err < 0) _exit(127);
+        dup2(in, 0);
+        dup2(out, 1);
+        dup2(err, 2);
+        execl(opt->client, opt->client, "--resume", session, (char *)NULL);
+        _exit(127);
+    }
+    int status;
+    struct rusage ru;
+    if(wait4(pid, &status, 0, &ru) != pid) return 0;
+    run->wall = bench_now() - start;
+    run->cpu = ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6 + ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+    run->max_rss_kb = ru.ru_maxrss;
+    run->errors = bench_count_lines(log);
+    if(!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        fprintf(stderr, "%s exited with status %d, see %s\n", opt->client,
+                WIFEXITED(status) ? WEXITSTATUS(status) : -1, log);
+        return 0;
+    }
+    return 1;
+}
+
+static int bench_remove(const char *path, const struct stat *st, int flag, struct FTW *ftw) {
+    return remove(path);
+}
+
+static void bench_environment(const struct bench_options *opt, const char *dir) {
+    char url[128];
+    snprintf(url, sizeof(url), "http://127.0.0.1:%d/api/v1", opt->port);
+    setenv("LLM_OPENROUTER_URL", url, 1);
+    snprintf(url, sizeof(url), "http://127.0.0.1:%d/v1", opt->port);
+    setenv("LLM_OPENAI_URL", url, 1);
+    setenv("LLM_ANTHROPIC_URL", url, 1);
+    setenv("OPENROUTER_API_KEY", "bench", 1);
+    setenv("OPENAI_API_KEY", "bench", 1);
+    setenv("ANTHROPIC_API_KEY", "bench", 1);
+    setenv("XDG_STATE_HOME", dir, 1);
+    setenv("XDG_CACHE_HOME", dir, 1);
+    setenv("LLM_HEDGE", "0", 1);
+    setenv("NO_COLOR", "1", 1);
+    unsetenv("LLM_CACHE");
+}
+
+static int bench_parse_lengths(const char *list, struct bench_options *opt) {
+    opt->num_lengths = 0;
+    while(*list && opt->num_lengths < BENCH_MAX_LENGTHS) {
+        char *end;
+        long n = strtol(list, &end, 10);
+        if(end == list || n < 0) return 0;
+        opt->lengths[opt->num_lengths++] = (int)n;
+        list = *end == ',' ? end + 1 : end;
+    }
+    return opt->num_lengths > 0;
+}
+
+static void bench_usage(const char *prog) {
+    fprintf(stderr,
+            "Usage: %s [--client PATH] [--mock PATH] [--port N] [--turns N] [--history N,N,...]\n"
+            "          [--message-bytes N] [-m MODEL] [-- mockserver options]\n", prog);
+}
+
+int main(int argc, char **argv) {
+    struct bench_options opt = {
+        .client = "./openrouter", .mock = "./mockserver", .port = 18765, .turns = 20, .message_bytes = 1000,
+    };
+    bench_parse_lengths("0,10,50,100", &opt);
+    for(int i = 1; i < argc; i++) {
+        const char *arg = argv[i];
+        const char *value = i + 1 < argc ? argv[i + 1] : NULL;
+        if(strcmp(arg, "--") == 0) {
+            opt.mock_args = argv + i + 1;
+            opt.num_mock_args = argc - i - 1;
+            break;
+        }
+        if(!value) {
+            bench_usage(argv[0]);
+            return 1;
+        }
+        if(strcmp(arg, "--client") == 0) opt.client = value;
+        else if(strcmp(arg, "--mock") == 0) opt.mock = value;
+        else if(strcmp(arg, "--port") == 0) opt.port = atoi(value);
+        else if(strcmp(arg, "--turns") == 0) opt.turns = atoi(value);
+        else if(strcmp(arg, "--message-bytes") == 0) opt.message_bytes = atoi(value);
+        else if(strcmp(arg, "-m") == 0 || strcmp(arg, "--model") == 0) opt.model = value;
+        else if(strcmp(arg, "--history") == 0 && bench_parse_lengths(value, &opt)) {}
+        else {
+            bench_usage(argv[0]);
+            return 1;
+        }
+        i++;
+    }
+    if(opt.turns < 1 || opt.message_bytes < 1) {
+        bench_usage(argv[0]);
+        return 1;
+    }
+
+    char dir[] = "/tmp/llmbench.XXXXXX";
+    if(!mkdtemp(dir)) {
+        perror("mkdtemp");
+        return 1;
+    }
+    bench_environment(&opt, dir);
+    pid_t mock = bench_start_mock(&opt);
+    if(mock < 0 || !bench_wait_port(opt.port)) {
+        fprintf(stderr, "mockserver did not come up on port %d\n", opt.port);
+        if(mock > 0) kill(mock, SIGTERM);
+        return 1;
+    }
+
+    char prompts[64], quit[64], log[64];
+    snprintf(prompts, sizeof(prompts), "%s/prompts", dir);
+    snprintf(quit, sizeof(quit), "%s/quit", dir);
+    snprintf(log, sizeof(log), "%s/stderr", dir);
+    int status = 0;
+    if(!bench_write_prompts(prompts, &opt, opt.turns) || !bench_write_prompts(quit, &opt, 0)) {
+        perror(dir);
+        status = 1;
+    }
+    printf("%s, %d turns, %d-byte messages\n", opt.client, opt.turns, opt.message_bytes);
+    printf("%8s %9s %10s %10s %10s %9s %7s\n", "history", "turns/s", "ms/turn", "cpu/turn", "peak rss", "start rss", "errors");
+    for(int k = 0; k < opt.num_lengths && status == 0; k++) {
+        char session[128];
+        struct bench_run base, run;
+        if(!bench_write_session(&opt, opt.lengths[k], session, sizeof(session)) ||
+           !bench_run_client(&opt, session, quit, log, &base) ||
+           !bench_run_client(&opt, session, prompts, log, &run)) {
+            status = 1;
+            break;
+        }
+        double wall = run.wall - base.wall, cpu = run.cpu - base.cpu;
+        if(wall <= 0) wall = run.wall;
+        if(cpu < 0) cpu = 0;
+        printf("%8d %9.1f %8.2fms %8.3fms %8.1fMB %7.1fMB %7d\n", opt.lengths[k], opt.turns / wall,
+               1000 * wall / opt.turns, 1000 * cpu / opt.turns, run.max_rss_kb / 1024.0, base.max_rss_kb / 1024.0,
+               run.errors);
+        fflush(stdout);
+    }
+    kill(mock, SIGTERM);
+    waitpid(mock, NULL, 0);
+    if(status == 0) {
+        // the sessions and logs are only kept when something went wrong
+        nftw(dir, bench_remove, 8, FTW_DEPTH | FTW_PHYS);
+    }
+    return status;
+}
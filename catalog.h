@@ -0,0 +1,510 @@
+#ifndef CATALOG_H
+#define CATALOG_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <errno.h>
+#include <stdint.h>
+#include <sys/stat.h>
+#include <curl/curl.h>
+#include "transport.h"
+#include "jsonscan.h"
+#include "repl.h"
+
+// Model catalog: the parsed /models list of one provider, persisted to a
+// compact text file under ~/.cache/llminference. Within the TTL the cached
+// copy is used as is; after it the list is revalidated with ETag /
+// If-Modified-Since so an unchanged list costs one 304. Stale catalogs of
+// several providers are refreshed concurrently through one multi handle.
+// The list is scanned as it downloads; no copy of the body is kept.
+//
+// Entries are a struct of arrays: the ids back to back in one string
+// arena and one array per field (context length, prices, modalities), so
+// a catalog of a few hundred models is a handful of allocations and a
+// search walks contiguous memory.
+//
+// Cache file layout:
+//   llmcat 2
+//   url <models url>
+//   fetched <unix time>
+//   etag <value>
+//   modified <value>
+//   <id>\t<context length>\t<prompt price>\t<completion price>\t<modalities>
+//   ...
+
+#define CATALOG_TTL (6 * 3600)
+
+// modalities
+#define CATALOG_IN_TEXT 0x01
+#define CATALOG_IN_IMAGE 0x02
+#define CATALOG_IN_AUDIO 0x04
+#define CATALOG_IN_FILE 0x08
+#define CATALOG_IN_VIDEO 0x10
+#define CATALOG_OUT_IMAGE 0x20
+#define CATALOG_OUT_AUDIO 0x40
+
+struct catalog {
+    char name[32];
+    char url[512];                // as long as the programs' URL buffers
+    struct curl_slist *headers;   // auth headers for the provider
+    char *names;                  // the ids, NUL-terminated, in entry order
+    size_t names_len, names_cap;
+    uint32_t *name_at;            // where each id starts in names
+    uint32_t *context_length;     // 0 when the provider does not say
+    float *prompt_price;          // USD per million tokens, -1 when not listed
+    float *completion_price;
+    uint8_t *modalities;          // CATALOG_IN_* and CATALOG_OUT_* bits, 0 when not listed
+    int count, cap;
+    unsigned version;             // changes whenever the entries do
+    char etag[256];
+    char modified[128];
+    time_t fetched;
+    // state of a refresh in flight: new entries are appended after the
+    // current ones and replace them only once the whole list has arrived
+    struct json_scanner scan;
+    int parse_base;
+    int saw_data;
+    char entry_id[256];
+    long entry_context_length;
+    float entry_prompt_price, entry_completion_price;
+    int entry_modalities;
+    char new_etag[256];
+    char new_modified[128];
+};
+
+static void catalog_init(struct catalog *c, const char *name, const char *url) {
+    memset(c, 0, sizeof(*c));
+    snprintf(c->name, sizeof(c->name), "%s", name);
+    snprintf(c->url, sizeof(c->url), "%s", url);
+}
+
+// only tui's providers need more than the URL
+__attribute__((unused)) static void catalog_add_header(struct catalog *c, const char *header) {
+    c->headers = curl_slist_append(c->headers, header);
+}
+
+static const char *catalog_id(const struct catalog *c, int i) {
+    return c->names + c->name_at[i];
+}
+
+static void catalog_truncate(struct catalog *c, int count) {
+    if(count >= c->count) return;
+    c->names_len = c->name_at[count];
+    c->count = count;
+    c->version++;
+}
+
+static void catalog_clear(struct catalog *c) {
+    catalog_truncate(c, 0);
+}
+
+static void catalog_free(struct catalog *c) {
+    free(c->names);
+    free(c->name_at);
+    free(c->context_length);
+    free(c->prompt_price);
+    free(c->completion_price);
+    free(c->modalities);
+    json_scan_free(&c->scan);
+    curl_slist_free_all(c->headers);
+    c->names = NULL;
+    c->name_at = NULL;
+    c->context_length = NULL;
+    c->prompt_price = c->completion_price = NULL;
+    c->modalities = NULL;
+    c->headers = NULL;
+    c->names_len = c->names_cap = 0;
+    c->count = c->cap = 0;
+}
+
+static int catalog_grow(void **array, int cap, size_t size) {
+    void *grown = realloc(*array, cap * size);
+    if(!grown) return 0;
+    *array = grown;
+    return 1;
+}
+
+static int catalog_add(struct catalog *c, const char *id, long context_length, float prompt_price,
+                       float completion_price, int modalities) {
+    if(c->count == c->cap) {
+        int cap = c->cap ? c->cap * 2 : 64;
+        if(!catalog_grow((void **)&c->name_at, cap, sizeof(*c->name_at)) ||
+           !catalog_grow((void **)&c->context_length, cap, sizeof(*c->context_length)) ||
+           !catalog_grow((void **)&c->prompt_price, cap, sizeof(*c->prompt_price)) ||
+           !catalog_grow((void **)&c->completion_price, cap, sizeof(*c->completion_price)) ||
+           !catalog_grow((void **)&c->modalities, cap, sizeof(*c->modalities))) return 0;
+        c->cap = cap;
+    }
+    size_t len = strlen(id) + 1;
+    if(c->names_len + len > c->names_cap) {
+        size_t cap = c->names_cap ? c->names_cap : 4096;
+        while(cap < c->names_len + len) cap *= 2;
+        char *names = realloc(c->names, cap);
+        if(!names) return 0;
+        c->names = names;
+        c->names_cap = cap;
+    }
+    memcpy(c->names + c->names_len, id, len);
+    c->name_at[c->count] = (uint32_t)c->names_len;
+    c->names_len += len;
+    c->context_length[c->count] = context_length > 0 ? (uint32_t)context_length : 0;
+    c->prompt_price[c->count] = prompt_price;
+    c->completion_price[c->count] = completion_price;
+    c->modalities[c->count] = (uint8_t)modalities;
+    c->count++;
+    c->version++;
+    return 1;
+}
+
+static int catalog_find(const struct catalog *c, const char *id) {
+    for(int i = 0; i < c->count; i++) {
+        if(strcmp(catalog_id(c, i), id) == 0) return i;
+    }
+    return -1;
+}
+
+// tui's providers don't list context lengths, see guess_context_length
+__attribute__((unused)) static long catalog_context_length(const struct catalog *c, const char *id) {
+    int i = catalog_find(c, id);
+    return i < 0 ? 0 : c->context_length[i];
+}
+
+// "text+image->text" (OpenRouter's architecture.modality) as CATALOG_* bits
+static int catalog_parse_modality(const char *value) {
+    static const struct { const char *name; int in, out; } kinds[] = {
+        { "text", CATALOG_IN_TEXT, 0 }, { "image", CATALOG_IN_IMAGE, CATALOG_OUT_IMAGE },
+        { "audio", CATALOG_IN_AUDIO, CATALOG_OUT_AUDIO }, { "file", CATALOG_IN_FILE, 0 },
+        { "video", CATALOG_IN_VIDEO, 0 },
+    };
+    const char *arrow = strstr(value, "->");
+    int bits = 0;
+    for(size_t k = 0; k < sizeof(kinds) / sizeof(kinds[0]); k++) {
+        const char *p = strstr(value, kinds[k].name);
+        if(!p) continue;
+        if(!arrow || p < arrow) bits |= kinds[k].in;
+        if(arrow && strstr(arrow, kinds[k].name)) bits |= kinds[k].out;
+    }
+    return bits;
+}
+
+// Path of a file in ~/.cache/llminference (or $XDG_CACHE_HOME/llminference),
+// creating the directory on first use. Shared by everything cached on disk.
+static int cache_file_path(const char *file, char *path, size_t size) {
+    const char *base = getenv("XDG_CACHE_HOME");
+    char dir[512];
+    if(base && base[0]) {
+        mkdir(base, 0700);
+        snprintf(dir, sizeof(dir), "%s/llminference", base);
+    } else {
+        const char *home = getenv("HOME");
+        if(!home) return 0;
+        snprintf(dir, sizeof(dir), "%s/.cache", home);
+        mkdir(dir, 0700);
+        snprintf(dir, sizeof(dir), "%s/.cache/llminference", home);
+    }
+    if(mkdir(dir, 0700) != 0 && errno != EEXIST) return 0;
+    snprintf(path, size, "%s/%s", dir, file);
+    return 1;
+}
+
+static int catalog_path(const struct catalog *c, char *path, size_t size) {
+    char file[64];
+    snprintf(file, sizeof(file), "%s.models", c->name);
+    return cache_file_path(file, path, size);
+}
+
+static void catalog_chomp(char *s) {
+    s[strcspn(s, "\r\n")] = 0;
+}
+
+static int catalog_load(struct catalog *c) {
+    char path[640];
+    if(!catalog_path(c, path, sizeof(path))) return 0;
+    FILE *f = fopen(path, "r");
+    if(!f) return 0;
+    char line[1024];
+    // an older layout is simply fetched again
+    if(!fgets(line, sizeof(line), f) || strncmp(line, "llmcat 2", 8) != 0) {
+        fclose(f);
+        return 0;
+    }
+    catalog_clear(c);
+    c->etag[0] = c->modified[0] = 0;
+    c->fetched = 0;
+    while(fgets(line, sizeof(line), f)) {
+        catalog_chomp(line);
+        if(strncmp(line, "fetched ", 8) == 0) {
+            c->fetched = (time_t)strtoll(line + 8, NULL, 10);
+        } else if(strncmp(line, "etag ", 5) == 0) {
+            if(snprintf(c->etag, sizeof(c->etag), "%s", line + 5) >= (int)sizeof(c->etag)) c->etag[0] = 0;
+        } else if(strncmp(line, "modified ", 9) == 0) {
+            if(snprintf(c->modified, sizeof(c->modified), "%s", line + 9) >= (int)sizeof(c->modified)) c->modified[0] = 0;
+        } else if(strncmp(line, "url ", 4) == 0) {
+            // listed by another endpoint, e.g. before a base URL was changed
+            if(strcmp(line + 4, c->url) != 0) {
+                catalog_clear(c);
+                c->etag[0] = c->modified[0] = 0;
+                c->fetched = 0;
+                fclose(f);
+                return 0;
+            }
+        } else if(line[0]) {
+            char *field = strchr(line, '\t');
+            long ctx = 0;
+            float prompt = -1, completion = -1;
+            int modalities = 0;
+            if(field) {
+                *field++ = 0;
+                sscanf(field, "%ld\t%f\t%f\t%d", &ctx, &prompt, &completion, &modalities);
+            }
+            catalog_add(c, line, ctx, prompt, completion, modalities);
+        }
+    }
+    fclose(f);
+    return 1;
+}
+
+// Written to a temp file and renamed so a crash never leaves half a catalog.
+static int catalog_save(const struct catalog *c) {
+    char path[640], tmp[660];
+    if(!catalog_path(c, path, sizeof(path))) return 0;
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    FILE *f = fopen(tmp, "w");
+    if(!f) return 0;
+    fprintf(f, "llmcat 2\nurl %s\nfetched %lld\n", c->url, (long long)c->fetched);
+    if(c->etag[0]) fprintf(f, "etag %s\n", c->etag);
+    if(c->modified[0]) fprintf(f, "modified %s\n", c->modified);
+    for(int i = 0; i < c->count; i++) {
+        fprintf(f, "%s\t%u\t%g\t%g\t%d\n", catalog_id(c, i), c->context_length[i], c->prompt_price[i],
+                c->completion_price[i], c->modalities[i]);
+    }
+    if(fclose(f) != 0) {
+        remove(tmp);
+        return 0;
+    }
+    return rename(tmp, path) == 0;
+}
+
+static int catalog_fresh(const struct catalog *c) {
+    return c->fetched > 0 && time(NULL) - c->fetched < CATALOG_TTL;
+}
+
+static const char *catalog_paths[] = { "data", "data[]", "data[].id", "data[].context_length",
+                                       "data[].pricing.prompt", "data[].pricing.completion",
+                                       "data[].architecture.modality" };
+
+// Prices are listed as strings of USD per token
+static float catalog_price(int type, const char *value) {
+    if(type != JSON_STRING && type != JSON_NUMBER) return -1;
+    double per_token = strtod(value, NULL);
+    return per_token < 0 ? -1 : (float)(per_token * 1e6);
+}
+
+static void catalog_value(int path, int type, const char *value, size_t len, void *userp) {
+    struct catalog *c = (struct catalog *)userp;
+    switch(path) {
+    case 0:
+        if(type == JSON_ARRAY) c->saw_data = 1;
+        break;
+    case 1:
+        if(type == JSON_OBJECT) {
+            c->entry_id[0] = 0;
+            c->entry_context_length = 0;
+            c->entry_prompt_price = c->entry_completion_price = -1;
+            c->entry_modalities = 0;
+        } else if(type == JSON_END && c->entry_id[0]) {
+            catalog_add(c, c->entry_id, c->entry_context_length, c->entry_prompt_price, c->entry_completion_price,
+                        c->entry_modalities);
+        }
+        break;
+    case 2:
+        if(type == JSON_STRING && len < sizeof(c->entry_id)) memcpy(c->entry_id, value, len + 1);
+        break;
+    case 3:
+        if(type == JSON_NUMBER) c->entry_context_length = (long)strtod(value, NULL);
+        break;
+    case 4:
+        c->entry_prompt_price = catalog_price(type, value);
+        break;
+    case 5:
+        c->entry_completion_price = catalog_price(type, value);
+        break;
+    case 6:
+        if(type == JSON_STRING) c->entry_modalities = catalog_parse_modality(value);
+        break;
+    }
+}
+
+static void catalog_scan_start(struct catalog *c) {
+    catalog_truncate(c, c->parse_base);
+    json_scan_reset(&c->scan);
+    c->saw_data = 0;
+}
+
+static size_t catalog_write(void *contents, size_t size, size_t nmemb, void *userp) {
+    size_t realsize = size * nmemb;
+    struct catalog *c = (struct catalog *)userp;
+    json_scan_feed(&c->scan, contents, realsize);
+    return realsize;
+}
+
+static void catalog_header_value(char *dst, size_t size, const char *value, size_t len) {
+    while(len > 0 && (*value == ' ' || *value == '\t')) {
+        value++;
+        len--;
+    }
+    while(len > 0 && (value[len - 1] == '\r' || value[len - 1] == '\n' || value[len - 1] == ' ')) len--;
+    // a validator cut short would never match; better to send none
+    if(len >= size) len = 0;
+    memcpy(dst, value, len);
+    dst[len] = 0;
+}
+
+static size_t catalog_header(char *buffer, size_t size, size_t nitems, void *userp) {
+    size_t len = size * nitems;
+    struct catalog *c = (struct catalog *)userp;
+    if(len >= 5 && strncmp(buffer, "HTTP/", 5) == 0) {
+        // a new response (redirect, 100-continue): forget earlier headers
+        c->new_etag[0] = c->new_modified[0] = 0;
+        catalog_scan_start(c);
+    } else if(len > 5 && strncasecmp(buffer, "etag:", 5) == 0) {
+        catalog_header_value(c->new_etag, sizeof(c->new_etag), buffer + 5, len - 5);
+    } else if(len > 14 && strncasecmp(buffer, "last-modified:", 14) == 0) {
+        catalog_header_value(c->new_modified, sizeof(c->new_modified), buffer + 14, len - 14);
+    }
+    return len;
+}
+
+static CURL *catalog_request(struct catalog *c, struct curl_slist **conditional) {
+    CURL *curl = curl_easy_init();
+    if(!curl) return NULL;
+    transport_setup(curl);
+    if(!c->scan.on_value) json_scan_init(&c->scan, catalog_paths, 7, catalog_value, c);
+    c->parse_base = c->count;
+    catalog_scan_start(c);
+    c->new_etag[0] = c->new_modified[0] = 0;
+    struct curl_slist *headers = NULL;
+    for(struct curl_slist *h = c->headers; h; h = h->next) {
+        headers = curl_slist_append(headers, h->data);
+    }
+    // Only revalidate when we actually hold the list the validators refer to
+    if(c->count > 0) {
+        char header[300];
+        if(c->etag[0]) {
+            snprintf(header, sizeof(header), "If-None-Match: %s", c->etag);
+            headers = curl_slist_append(headers, header);
+        }
+        if(c->modified[0]) {
+            snprintf(header, sizeof(header), "If-Modified-Since: %s", c->modified);
+            headers = curl_slist_append(headers, header);
+        }
+    }
+    *conditional = headers;
+    curl_easy_setopt(curl, CURLOPT_URL, c->url);
+    curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
+    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, catalog_write);
+    curl_easy_setopt(curl, CURLOPT_WRITEDATA, (void *)c);
+    curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, catalog_header);
+    curl_easy_setopt(curl, CURLOPT_HEADERDATA, (void *)c);
+    return curl;
+}
+
+// Swap the freshly scanned entries in for the old ones, or drop them if
+// the body was not a complete model list.
+static int catalog_parse(struct catalog *c) {
+    int base = c->parse_base;
+    if(!json_scan_finish(&c->scan) || !c->saw_data) {
+        catalog_truncate(c, base);
+        return 0;
+    }
+    // the new entries go to the front of every array
+    int n = c->count - base;
+    if(base > 0) {
+        size_t skip = c->name_at[base];
+        memmove(c->names, c->names + skip, c->names_len - skip);
+        c->names_len -= skip;
+        for(int i = 0; i < n; i++) c->name_at[i] = c->name_at[base + i] - (uint32_t)skip;
+        memmove(c->context_length, c->context_length + base, n * sizeof(*c->context_length));
+        memmove(c->prompt_price, c->prompt_price + base, n * sizeof(*c->prompt_price));
+        memmove(c->completion_price, c->completion_price + base, n * sizeof(*c->completion_price));
+        memmove(c->modalities, c->modalities + base, n * sizeof(*c->modalities));
+    }
+    c->count = n;
+    c->parse_base = 0;
+    c->version++;
+    return 1;
+}
+
+static void catalog_complete(struct catalog *c, CURL *curl, CURLcode res) {
+    long status = 0;
+    if(res == CURLE_OK) curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &status);
+    // whatever was scanned from a failed or non-200 response is dropped
+    if(status != 200) catalog_truncate(c, c->parse_base);
+    if(res == CURLE_ABORTED_BY_CALLBACK) {
+        fprintf(stderr, "%s models: cancelled%s\n", c->name, c->count > 0 ? " (using cached list)" : "");
+    } else if(res != CURLE_OK) {
+        fprintf(stderr, "%s models: %s%s\n", c->name, curl_easy_strerror(res),
+                c->count > 0 ? " (using cached list)" : "");
+    } else if(status == 304) {
+        c->fetched = time(NULL);
+        catalog_save(c);
+    } else if(status == 200 && catalog_parse(c)) {
+        c->fetched = time(NULL);
+        strcpy(c->etag, c->new_etag);
+        strcpy(c->modified, c->new_modified);
+        catalog_save(c);
+    } else {
+        fprintf(stderr, "%s models: unexpected response (HTTP %ld)%s\n", c->name, status,
+                c->count > 0 ? ", using cached list" : "");
+    }
+    c->parse_base = 0;
+    json_scan_free(&c->scan);
+}
+
+// Load each catalog from disk and revalidate the stale ones, all at once.
+// Ctrl-C gives up on what hasn't arrived and keeps the cached lists.
+static void catalog_refresh(struct catalog **cats, int n) {
+    CURLM *multi = curl_multi_init();
+    if(!multi) return;
+    CURL *handles[8] = {0};
+    struct curl_slist *headers[8] = {0};
+    int pending = 0;
+    for(int i = 0; i < n && i < 8; i++) {
+        if(cats[i]->count == 0) catalog_load(cats[i]);
+        if(catalog_fresh(cats[i])) continue;
+        handles[i] = catalog_request(cats[i], &headers[i]);
+        if(!handles[i]) continue;
+        curl_easy_setopt(handles[i], CURLOPT_PRIVATE, (void *)cats[i]);
+        curl_multi_add_handle(multi, handles[i]);
+        pending++;
+    }
+    if(pending > 0) printf("Refreshing model list...\n");
+    int running = pending, done[8] = {0};
+    repl_take_interrupt();
+    while(running > 0) {
+        if(curl_multi_perform(multi, &running) != CURLM_OK) break;
+        if(running > 0 && repl_poll(multi, 1000)) break;
+    }
+    CURLMsg *msg;
+    int left;
+    while((msg = curl_multi_info_read(multi, &left))) {
+        if(msg->msg != CURLMSG_DONE) continue;
+        struct catalog *c = NULL;
+        curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, (char **)&c);
+        catalog_complete(c, msg->easy_handle, msg->data.result);
+        for(int i = 0; i < n && i < 8; i++) done[i] |= handles[i] == msg->easy_handle;
+    }
+    for(int i = 0; i < n && i < 8; i++) {
+        if(!handles[i]) continue;
+        if(!done[i]) catalog_complete(cats[i], handles[i], CURLE_ABORTED_BY_CALLBACK);
+        curl_multi_remove_handle(multi, handles[i]);
+        curl_easy_cleanup(handles[i]);
+        curl_slist_free_all(headers[i]);
+    }
+    curl_multi_cleanup(multi);
+}
+
+#endif
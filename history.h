@@ -0,0 +1,742 @@
+#ifndef HISTORY_H
+#define HISTORY_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <zlib.h>
+#include "tokenizer.h"
+#include "journal.h"
+
+// Conversation history kept in its serialized form. Each message is escaped
+// into a JSON fragment exactly once, when add_message stores it. Building a
+// request body is then a memcpy per message instead of a cJSON tree walk
+// over the whole conversation, and the output is byte for byte what
+// cJSON_PrintUnformatted used to produce.
+//
+// Messages live in a ring buffer capped by count and by stored bytes. Only
+// the newest HISTORY_HOT messages stay as plain text; older ones are
+// deflated in place and inflated straight into the request body when one
+// is built.
+//
+// Every message is token-counted once when it is stored. A request then
+// carries the newest suffix of history that fits the model's context
+// window (plus any pinned messages), so long sessions never upload a
+// conversation the model would reject.
+//
+// Every change is also recorded in the session journal (journal.h). A
+// message record holds the role, the token count and the serialized
+// fragment, so --resume rebuilds history without escaping, tokenizing or
+// parsing anything.
+//
+// Branches: a message is a reference-counted node that is never changed
+// once stored (compression only changes how it is held), and a branch is a
+// ring of pointers to nodes. /fork copies the current ring's pointers and
+// takes a reference on each node, so branches share their common prefix,
+// fragments included, and a request on either branch is built from the same
+// bytes. Switching branches only changes which ring is current. A node is
+// freed when the last branch holding it drops it (/undo, eviction); the
+// byte cap counts every node once, however many branches share it. Pins
+// belong to the node, so a pinned message is pinned on every branch.
+//
+// bench.c uses this only to write sessions; the commands and request
+// building it has no use for are marked unused.
+
+#define MAX_MESSAGES 100
+#define HISTORY_MAX_BYTES (2 * 1024 * 1024)
+#define HISTORY_HOT 4
+#define HISTORY_MIN_COMPRESS 256   // smaller fragments are not worth deflating
+#define MESSAGE_TOKEN_OVERHEAD 4   // role and framing tokens per message
+#define HISTORY_CACHE_BREAKPOINTS 4  // Anthropic takes at most four cache_control blocks
+#define HISTORY_MAX_BRANCHES 16
+
+// journal record types
+#define HISTORY_RECORD_MESSAGE 'M'  // arg: tokens, payload: role, NUL, fragment
+#define HISTORY_RECORD_DROP 'D'     // history_drop_newest
+#define HISTORY_RECORD_PIN 'P'      // pin the newest message
+#define HISTORY_RECORD_UNPIN 'U'    // unpin all
+#define HISTORY_RECORD_MODEL 'S'    // payload: model selected from here on
+#define HISTORY_RECORD_FORK 'F'     // payload: name of a new branch off the current one
+#define HISTORY_RECORD_SWITCH 'W'   // arg: branch index
+
+struct jsonbuf {
+    char *data;
+    size_t len, cap;
+};
+
+typedef struct {
+    char role[16];     // "user" or "assistant"
+    char *json;        // {"role":"...","content":"..."}, deflated when z_len > 0
+    size_t json_len;   // length of the plain fragment
+    size_t z_len;      // length of the deflated fragment, 0 if stored plain
+    int tokens;
+    int pinned;        // always sent, whatever the token budget
+    int refs;          // branches holding it
+} Message;
+
+struct history_branch {
+    char name[32];
+    Message *ring[MAX_MESSAGES];
+    int head;          // ring index of the oldest message
+    int size;
+};
+
+static struct history_branch history_branches[HISTORY_MAX_BRANCHES] = { { .name = "main" } };
+static int history_num_branches = 1;
+static struct history_branch *history_current = &history_branches[0];
+static int history_nodes = 0;      // messages held, each counted once
+size_t history_bytes = 0;  // bytes actually held by fragments
+long history_token_budget = 0;  // prompt tokens the model accepts, 0 = unknown
+static char history_selected[MAX_MESSAGES];
+static struct jsonbuf request_body;    // reused for every request
+static const char *history_options = "";   // members every request carries, e.g. RCACHE_OPTIONS
+// Token estimate of the last body built, attachments included: the body
+// only holds references to those, so its length says nothing about them.
+static long history_body_tokens = 0;
+
+#define BRANCH_AT(b, i) ((b)->ring[((b)->head + (i)) % MAX_MESSAGES])
+#define HISTORY_AT(i) BRANCH_AT(history_current, i)
+
+static size_t message_stored_bytes(const Message *msg) {
+    return msg->z_len ? msg->z_len : msg->json_len;
+}
+
+static int jsonbuf_reserve(struct jsonbuf *b, size_t extra) {
+    if(b->len + extra + 1 <= b->cap) return 1;
+    size_t cap = b->cap ? b->cap : 1024;
+    while(cap < b->len + extra + 1) cap *= 2;
+    char *ptr = realloc(b->data, cap);
+    if(ptr == NULL) {
+        fprintf(stderr, "realloc() failed\n");
+        return 0;
+    }
+    b->data = ptr;
+    b->cap = cap;
+    return 1;
+}
+
+static int jsonbuf_append(struct jsonbuf *b, const char *s, size_t len) {
+    if(!jsonbuf_reserve(b, len)) return 0;
+    memcpy(b->data + b->len, s, len);
+    b->len += len;
+    b->data[b->len] = 0;
+    return 1;
+}
+
+static int jsonbuf_puts(struct jsonbuf *b, const char *s) {
+    return jsonbuf_append(b, s, strlen(s));
+}
+
+// Same escaping rules as cJSON's print_string_ptr, quotes included.
+static int jsonbuf_string(struct jsonbuf *b, const char *s) {
+    size_t extra = 2;
+    for(const unsigned char *p = (const unsigned char *)s; *p; p++) {
+        if(*p == '"' || *p == '\\' || *p == '\b' || *p == '\f' || *p == '\n' || *p == '\r' || *p == '\t') extra += 2;
+        else if(*p < 32) extra += 6;
+        else extra++;
+    }
+    if(!jsonbuf_reserve(b, extra)) return 0;
+    char *out = b->data + b->len;
+    *out++ = '"';
+    for(const unsigned char *p = (const unsigned char *)s; *p; p++) {
+        switch(*p) {
+            case '"': *out++ = '\\'; *out++ = '"'; break;
+            case '\\': *out++ = '\\'; *out++ = '\\'; break;
+            case '\b': *out++ = '\\'; *out++ = 'b'; break;
+            case '\f': *out++ = '\\'; *out++ = 'f'; break;
+            case '\n': *out++ = '\\'; *out++ = 'n'; break;
+            case '\r': *out++ = '\\'; *out++ = 'r'; break;
+            case '\t': *out++ = '\\'; *out++ = 't'; break;
+            default:
+                if(*p < 32) {
+                    static const char hex[] = "0123456789abcdef";
+                    *out++ = '\\'; *out++ = 'u'; *out++ = '0'; *out++ = '0';
+                    *out++ = hex[*p >> 4];
+                    *out++ = hex[*p & 15];
+                } else {
+                    *out++ = *p;
+                }
+        }
+    }
+    *out++ = '"';
+    b->len = out - b->data;
+    b->data[b->len] = 0;
+    return 1;
+}
+
+static void message_unref(Message *msg) {
+    if(--msg->refs > 0) return;
+    history_bytes -= message_stored_bytes(msg);
+    history_nodes--;
+    free(msg->json);
+    free(msg);
+}
+
+static void branch_evict_oldest(struct history_branch *b) {
+    Message *msg = BRANCH_AT(b, 0);
+    b->head = (b->head + 1) % MAX_MESSAGES;
+    b->size--;
+    message_unref(msg);
+}
+
+static void branch_drop_newest(struct history_branch *b) {
+    b->size--;
+    message_unref(BRANCH_AT(b, b->size));
+}
+
+static void message_compress(Message *msg) {
+    if(msg->z_len || msg->json_len < HISTORY_MIN_COMPRESS) return;
+    uLongf z_len = compressBound(msg->json_len);
+    unsigned char *z = malloc(z_len);
+    if(!z) return;
+    if(compress2(z, &z_len, (const Bytef *)msg->json, msg->json_len, 6) != Z_OK || z_len >= msg->json_len) {
+        free(z);
+        return;
+    }
+    unsigned char *shrunk = realloc(z, z_len);
+    if(shrunk) z = shrunk;
+    history_bytes -= msg->json_len;
+    history_bytes += z_len;
+    free(msg->json);
+    msg->json = (char *)z;
+    msg->z_len = z_len;
+}
+
+// Inflate (or copy) a fragment straight into the end of b.
+static int message_append_json(struct jsonbuf *b, const Message *msg) {
+    if(!msg->z_len) return jsonbuf_append(b, msg->json, msg->json_len);
+    if(!jsonbuf_reserve(b, msg->json_len)) return 0;
+    uLongf out_len = msg->json_len;
+    if(uncompress((Bytef *)b->data + b->len, &out_len, (const Bytef *)msg->json, msg->z_len) != Z_OK || out_len != msg->json_len) {
+        fprintf(stderr, "Corrupt history message\n");
+        return 0;
+    }
+    b->len += out_len;
+    b->data[b->len] = 0;
+    return 1;
+}
+
+// Budget passes over the ring, skipped while a journal is replayed and run
+// once at the end instead.
+static int history_replaying = 0;
+
+// Evict the oldest message of every branch that still has more than one,
+// so shared nodes actually go. Returns 0 when there was nothing to evict.
+static int history_evict_round(void) {
+    int evicted = 0;
+    for(int i = 0; i < history_num_branches; i++) {
+        struct history_branch *b = &history_branches[i];
+        if(b->size > 1) {
+            branch_evict_oldest(b);
+            evicted = 1;
+        }
+    }
+    return evicted;
+}
+
+static void history_enforce_budget(void) {
+    if(history_current->size > HISTORY_HOT) message_compress(HISTORY_AT(history_current->size - 1 - HISTORY_HOT));
+    // Over the byte budget: deflate hot messages too before dropping any,
+    // then evict from the old end. The newest message always stays.
+    for(int i = 0; history_bytes > HISTORY_MAX_BYTES && i < history_current->size - 1; i++) {
+        message_compress(HISTORY_AT(i));
+    }
+    while(history_bytes > HISTORY_MAX_BYTES && history_evict_round()) {}
+}
+
+// Take ownership of an already serialized fragment.
+static void history_store(const char *role, char *json, size_t json_len, int tokens) {
+    Message *msg = calloc(1, sizeof(*msg));
+    if(!msg) {
+        free(json);
+        return;
+    }
+    if(history_current->size >= MAX_MESSAGES) branch_evict_oldest(history_current);
+    snprintf(msg->role, sizeof(msg->role), "%s", role);
+    msg->json = json;
+    msg->json_len = json_len;
+    msg->tokens = tokens;
+    msg->refs = 1;
+    HISTORY_AT(history_current->size) = msg;
+    history_current->size++;
+    history_nodes++;
+    history_bytes += json_len;
+    if(!history_replaying) history_enforce_budget();
+}
+
+// parts: content blocks serialized ahead of the text, each followed by a
+// comma (attach_take), or NULL for a plain string message. extra_tokens is
+// their estimated cost.
+void add_message_parts(const char *role, const char *content, const char *parts, size_t parts_len, int extra_tokens) {
+    struct jsonbuf frag = {0};
+    jsonbuf_puts(&frag, "{\"role\":");
+    jsonbuf_string(&frag, role);
+    if(parts) {
+        jsonbuf_puts(&frag, ",\"content\":[");
+        jsonbuf_append(&frag, parts, parts_len);
+        jsonbuf_puts(&frag, "{\"type\":\"text\",\"text\":");
+        jsonbuf_string(&frag, content);
+        jsonbuf_puts(&frag, "}]}");
+    } else {
+        jsonbuf_puts(&frag, ",\"content\":");
+        jsonbuf_string(&frag, content);
+        jsonbuf_puts(&frag, "}");
+    }
+    if(!frag.data) return;
+
+    int tokens = count_tokens(content) + MESSAGE_TOKEN_OVERHEAD + extra_tokens;
+    const char *parts_out[] = { role, frag.data };
+    size_t lens[] = { strlen(role) + 1, frag.len };
+    journal_append(HISTORY_RECORD_MESSAGE, (uint32_t)tokens, parts_out, lens, 2);
+
+    char *json = realloc(frag.data, frag.len);
+    history_store(role, json ? json : frag.data, frag.len, tokens);
+}
+
+void add_message(const char *role, const char *content) {
+    add_message_parts(role, content, NULL, 0, 0);
+}
+
+// Context window for the current model, keeping reply_tokens free for the answer.
+__attribute__((unused)) static void history_set_context(long context_length, long reply_tokens) {
+    if(context_length <= 0) {
+        history_token_budget = 0;
+    } else {
+        if(reply_tokens > context_length / 4) reply_tokens = context_length / 4;
+        history_token_budget = context_length - reply_tokens;
+    }
+}
+
+// Mark the messages to send: pinned ones, then the newest suffix that fits
+// the budget. Returns the token estimate, or -1 if not even the newest
+// message fits.
+static long history_select(void) {
+    long used = 0;
+    for(int i = 0; i < history_current->size; i++) {
+        history_selected[i] = (history_token_budget <= 0 || HISTORY_AT(i)->pinned);
+        if(history_selected[i]) used += HISTORY_AT(i)->tokens;
+    }
+    if(history_token_budget <= 0 || history_current->size == 0) return used;
+    Message *newest = HISTORY_AT(history_current->size - 1);
+    if(!newest->pinned && used + newest->tokens > history_token_budget) return -1;
+    for(int i = history_current->size - 1; i >= 0; i--) {
+        if(history_selected[i]) continue;
+        if(used + HISTORY_AT(i)->tokens > history_token_budget) break;
+        history_selected[i] = 1;
+        used += HISTORY_AT(i)->tokens;
+    }
+    // the window should open with a user turn
+    for(int i = 0; i < history_current->size; i++) {
+        if(!history_selected[i]) continue;
+        if(HISTORY_AT(i)->pinned || strcmp(HISTORY_AT(i)->role, "assistant") != 0) break;
+        history_selected[i] = 0;
+        used -= HISTORY_AT(i)->tokens;
+    }
+    return used;
+}
+
+// Anthropic prompt caching: pick the messages that get a cache_control
+// breakpoint. The newest user turn writes a cache entry for the whole
+// prompt; the user turn before it is where the previous request wrote one,
+// so marking it guarantees the hit even if a long reply pushed it past the
+// 20 blocks the API looks back from a breakpoint. If the window has
+// dropped messages, the last pinned message before the gap ends a prefix
+// that stays the same while the window slides, so it gets one as well.
+static void history_cache_marks(char *marks) {
+    memset(marks, 0, MAX_MESSAGES);
+    int left = HISTORY_CACHE_BREAKPOINTS, users = 0;
+    for(int i = history_current->size - 1; i >= 0 && users < 2 && left > 0; i--) {
+        if(!history_selected[i] || strcmp(HISTORY_AT(i)->role, "user") != 0) continue;
+        marks[i] = 1;
+        users++;
+        left--;
+    }
+    for(int i = 0; i + 1 < history_current->size && left > 0; i++) {
+        if(history_selected[i] && HISTORY_AT(i)->pinned && !history_selected[i + 1]) {
+            marks[i] = 1;
+            left--;
+        }
+    }
+}
+
+// Rewrite the fragment that starts at start, the last thing in b, into
+// block form with a breakpoint:
+// {"role":"user","content":[{"type":"text","text":"...","cache_control":{"type":"ephemeral"}}]}
+// A message in block form already (attachments) gets it on its last block,
+// which is always the text.
+static int message_mark_cached(struct jsonbuf *b, size_t start) {
+    static const char open[] = "[{\"type\":\"text\",\"text\":";
+    static const char close[] = ",\"cache_control\":{\"type\":\"ephemeral\"}}]}";
+    size_t open_len = sizeof(open) - 1, close_len = sizeof(close) - 1;
+    // the role is a plain word, so the first match is the content member
+    char *member = strstr(b->data + start, ",\"content\":");
+    if(!member) return 0;
+    size_t at = (size_t)(member - b->data) + 11;
+    if(b->data[at] == '[') {
+        // ...,{"type":"text","text":"..."}]}: insert before the last "}]}"
+        if(!jsonbuf_reserve(b, close_len - 3)) return 0;
+        b->len -= 3;
+        return jsonbuf_append(b, close, close_len);
+    }
+    if(!jsonbuf_reserve(b, open_len + close_len)) return 0;
+    size_t str_len = b->len - 1 - at;    // the string, without the closing '}'
+    memmove(b->data + at + open_len, b->data + at, str_len);
+    memcpy(b->data + at, open, open_len);
+    memcpy(b->data + at + open_len + str_len, close, close_len);
+    b->len += open_len + close_len - 1;
+    b->data[b->len] = 0;
+    return 1;
+}
+
+static const char *history_build_body(const char *model, const char *before, const char *after, size_t *len,
+                                      int cache_marks) {
+    long tokens = history_select();
+    history_body_tokens = tokens;
+    if(tokens < 0) {
+        fprintf(stderr, "Message is too long for this model (~%d tokens, context budget %ld)\n",
+                HISTORY_AT(history_current->size - 1)->tokens, history_token_budget);
+        return NULL;
+    }
+    char marks[MAX_MESSAGES];
+    if(cache_marks) history_cache_marks(marks);
+    int sent = 0;
+    request_body.len = 0;
+    jsonbuf_puts(&request_body, "{\"model\":");
+    jsonbuf_string(&request_body, model);
+    if(before) jsonbuf_puts(&request_body, before);
+    jsonbuf_puts(&request_body, history_options);
+    jsonbuf_puts(&request_body, ",\"messages\":[");
+    for(int i = 0; i < history_current->size; i++) {
+        if(!history_selected[i]) continue;
+        if(sent++ > 0) jsonbuf_append(&request_body, ",", 1);
+        size_t start = request_body.len;
+        // a message that can't be inflated would leave the body invalid
+        if(!message_append_json(&request_body, HISTORY_AT(i))) return NULL;
+        if(cache_marks && marks[i]) message_mark_cached(&request_body, start);
+    }
+    jsonbuf_puts(&request_body, "]");
+    if(after) jsonbuf_puts(&request_body, after);
+    jsonbuf_puts(&request_body, "}");
+    if(sent < history_current->size) {
+        printf("(context: sending %d of %d messages, ~%ld tokens)\n", sent, history_current->size, tokens);
+    }
+    if(len) *len = request_body.len;
+    return request_body.data;
+}
+
+// {"model":<model><before>,"messages":[...]<after>}
+// before/after are pre-serialized option members, each starting with ','.
+// Returns NULL when the newest message alone exceeds the context window, or
+// a stored message can't be read back.
+__attribute__((unused)) static const char *history_request_body(const char *model, const char *before, const char *after,
+                                                                size_t *len) {
+    return history_build_body(model, before, after, len, 0);
+}
+
+// The same, with Anthropic cache_control breakpoints on the stable prefix.
+// Only tui talks to Anthropic directly.
+__attribute__((unused)) static const char *history_request_body_cached(const char *model, const char *before,
+                                                                       const char *after, size_t *len) {
+    return history_build_body(model, before, after, len, 1);
+}
+
+// Undo add_message, e.g. for a prompt that could not be sent. Other
+// branches that share the message keep it.
+static void history_drop_newest(void) {
+    if(history_current->size == 0) return;
+    journal_append(HISTORY_RECORD_DROP, 0, NULL, NULL, 0);
+    branch_drop_newest(history_current);
+}
+
+// /undo: take back the last turn, the newest user message and whatever
+// came after it.
+__attribute__((unused)) static void history_undo(void) {
+    int dropped = 0;
+    while(history_current->size > 0) {
+        int user = strcmp(HISTORY_AT(history_current->size - 1)->role, "user") == 0;
+        history_drop_newest();
+        dropped++;
+        if(user) break;
+    }
+    if(dropped == 0) printf("Nothing to undo\n");
+    else printf("Removed %d message%s, %d left on branch %s\n", dropped, dropped == 1 ? "" : "s",
+                history_current->size, history_current->name);
+}
+
+// A new branch holding everything the current one does, made current.
+// Returns its index, or -1 if there are too many.
+static int history_branch_fork(const char *name) {
+    if(history_num_branches >= HISTORY_MAX_BRANCHES) return -1;
+    int index = history_num_branches++;
+    struct history_branch *b = &history_branches[index];
+    if(name && name[0]) snprintf(b->name, sizeof(b->name), "%s", name);
+    else snprintf(b->name, sizeof(b->name), "%d", index + 1);
+    b->head = 0;
+    b->size = history_current->size;
+    for(int i = 0; i < b->size; i++) {
+        b->ring[i] = HISTORY_AT(i);
+        b->ring[i]->refs++;
+    }
+    history_current = b;
+    return index;
+}
+
+// Branch by number (as /branches lists them) or by name, -1 if none.
+static int history_branch_find(const char *which) {
+    char *end;
+    long n = strtol(which, &end, 10);
+    if(end != which && *end == 0 && n >= 1 && n <= history_num_branches) return (int)n - 1;
+    for(int i = 0; i < history_num_branches; i++) {
+        if(strcmp(history_branches[i].name, which) == 0) return i;
+    }
+    return -1;
+}
+
+__attribute__((unused)) static void history_fork(const char *name) {
+    // a cut name could clash with another or never match /switch
+    if(strlen(name) >= sizeof(history_branches[0].name)) {
+        printf("A branch name can have at most %zu characters\n", sizeof(history_branches[0].name) - 1);
+        return;
+    }
+    // /switch reads a number as a place in the list, so "7" could mean two branches
+    if(name[0] && name[strspn(name, "0123456789")] == 0) {
+        printf("A branch name can't be just digits, /switch takes those as a number from /branches\n");
+        return;
+    }
+    if(history_branch_find(name) >= 0) {
+        printf("There is a branch %s already\n", name);
+        return;
+    }
+    int index = history_branch_fork(name);
+    if(index < 0) {
+        printf("No more than %d branches\n", HISTORY_MAX_BRANCHES);
+        return;
+    }
+    const char *parts[] = { history_current->name };
+    size_t lens[] = { strlen(history_current->name) };
+    journal_append(HISTORY_RECORD_FORK, 0, parts, lens, 1);
+    printf("On new branch %s (%d), sharing %d messages\n", history_current->name, index + 1, history_current->size);
+}
+
+__attribute__((unused)) static void history_switch(const char *which) {
+    int index = history_branch_find(which);
+    if(index < 0) {
+        printf("No branch %s, see /branches\n", which);
+        return;
+    }
+    journal_append(HISTORY_RECORD_SWITCH, (uint32_t)index, NULL, NULL, 0);
+    history_current = &history_branches[index];
+    printf("On branch %s, %d messages\n", history_current->name, history_current->size);
+}
+
+// Start of a message's text for listings, control characters and escapes
+// flattened.
+static void message_preview(const Message *msg, char *out, size_t size) {
+    struct jsonbuf plain = {0};
+    out[0] = 0;
+    if(!message_append_json(&plain, msg)) {
+        free(plain.data);
+        return;
+    }
+    // the text is the whole content, or its last block
+    const char *text = NULL;
+    for(const char *p = plain.data; (p = strstr(p, "\"text\":\"")); p++) text = p + 8;
+    if(!text) {
+        text = strstr(plain.data, ",\"content\":\"");
+        if(text) text += 12;
+    }
+    size_t n = 0;
+    for(const char *p = text; p && *p && *p != '"' && n + 1 < size; p++) {
+        char c = *p;
+        if(c == '\\') {
+            p++;
+            if(!*p) break;
+            c = *p == 'u' ? '?' : *p == 'n' || *p == 't' || *p == 'r' ? ' ' : *p;
+            if(*p == 'u') p += strnlen(p + 1, 4);
+        }
+        out[n++] = c;
+    }
+    // don't end in the middle of a UTF-8 sequence
+    if(n + 1 >= size) {
+        while(n > 0 && ((unsigned char)out[n - 1] & 0xC0) == 0x80) n--;
+        if(n > 0 && ((unsigned char)out[n - 1] & 0xC0) == 0xC0) n--;
+    }
+    out[n] = 0;
+    free(plain.data);
+}
+
+__attribute__((unused)) static void history_list_branches(void) {
+    for(int i = 0; i < history_num_branches; i++) {
+        struct history_branch *b = &history_branches[i];
+        // shared messages are a common prefix: count from the oldest on
+        int shared = 0;
+        if(b != history_current) {
+            int at = 0;
+            while(at < history_current->size && HISTORY_AT(at) != BRANCH_AT(b, 0)) at++;
+            while(shared < b->size && at + shared < history_current->size &&
+                  HISTORY_AT(at + shared) == BRANCH_AT(b, shared)) {
+                shared++;
+            }
+        }
+        char last[48] = "";
+        for(int k = b->size - 1; k >= 0 && !last[0]; k--) {
+            if(strcmp(BRANCH_AT(b, k)->role, "user") == 0) message_preview(BRANCH_AT(b, k), last, sizeof(last));
+        }
+        printf("%c %2d %-12s %3d messages", b == history_current ? '*' : ' ', i + 1, b->name, b->size);
+        if(b != history_current) printf(", %3d shared", shared);
+        else printf("            ");
+        if(last[0]) printf("  \"%s\"", last);
+        printf("\n");
+    }
+}
+
+__attribute__((unused)) static void history_pin_last(void) {
+    if(history_current->size == 0) {
+        printf("Nothing to pin\n");
+        return;
+    }
+    journal_append(HISTORY_RECORD_PIN, 0, NULL, NULL, 0);
+    HISTORY_AT(history_current->size - 1)->pinned = 1;
+    printf("Pinned the last message\n");
+}
+
+__attribute__((unused)) static void history_unpin_all(void) {
+    journal_append(HISTORY_RECORD_UNPIN, 0, NULL, NULL, 0);
+    for(int i = 0; i < history_current->size; i++) HISTORY_AT(i)->pinned = 0;
+    printf("Unpinned all messages\n");
+}
+
+// The body buffer holds the whole conversation uncompressed; don't keep a
+// big one around between turns.
+__attribute__((unused)) static void history_release_body(void) {
+    if(request_body.cap > 256 * 1024) {
+        free(request_body.data);
+        memset(&request_body, 0, sizeof(request_body));
+    }
+}
+
+static long process_rss_kb(void) {
+    long pages = 0, resident = 0;
+    FILE *f = fopen("/proc/self/statm", "r");
+    if(!f) return -1;
+    if(fscanf(f, "%ld %ld", &pages, &resident) != 2) resident = -1;
+    fclose(f);
+    return resident < 0 ? -1 : resident * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+__attribute__((unused)) static void history_print_mem(void) {
+    size_t plain = 0, compressed = 0;
+    int cold = 0;
+    long tokens = 0;
+    for(int i = 0; i < history_current->size; i++) {
+        Message *msg = HISTORY_AT(i);
+        plain += msg->json_len;
+        tokens += msg->tokens;
+        if(msg->z_len) {
+            compressed += msg->z_len;
+            cold++;
+        }
+    }
+    printf("History: %d/%d messages, %zu bytes held (limit %d), %zu bytes as JSON\n",
+           history_current->size, MAX_MESSAGES, history_bytes, HISTORY_MAX_BYTES, plain);
+    if(history_num_branches > 1) {
+        printf("Branches: %d, holding %d distinct messages\n", history_num_branches, history_nodes);
+    }
+    printf("Compressed: %d messages in %zu bytes\n", cold, compressed);
+    if(history_token_budget > 0) printf("Tokens: ~%ld (context budget %ld)\n", tokens, history_token_budget);
+    else printf("Tokens: ~%ld\n", tokens);
+    printf("Request buffer: %zu bytes\n", request_body.cap);
+    long rss = process_rss_kb();
+    if(rss >= 0) printf("Process RSS: %ld kB\n", rss);
+}
+
+// Remember the model in the journal so --resume picks it up again.
+static void history_set_model(const char *model) {
+    const char *parts[] = { model };
+    size_t lens[] = { strlen(model) };
+    journal_append(HISTORY_RECORD_MODEL, 0, parts, lens, 1);
+}
+
+struct history_resume_state {
+    char *model;
+    size_t model_size;
+};
+
+static void history_replay(uint32_t type, uint32_t arg, const char *payload, size_t len, void *userp) {
+    struct history_resume_state *state = userp;
+    switch(type) {
+        case HISTORY_RECORD_MESSAGE: {
+            const char *nul = memchr(payload, 0, len);
+            if(!nul) return;
+            size_t json_len = len - (size_t)(nul + 1 - payload);
+            char *json = malloc(json_len ? json_len : 1);
+            if(!json) return;
+            memcpy(json, nul + 1, json_len);
+            history_store(payload, json, json_len, (int)arg);
+            break;
+        }
+        case HISTORY_RECORD_DROP:
+            if(history_current->size > 0) branch_drop_newest(history_current);
+            break;
+        case HISTORY_RECORD_PIN:
+            if(history_current->size > 0) HISTORY_AT(history_current->size - 1)->pinned = 1;
+            break;
+        case HISTORY_RECORD_UNPIN:
+            for(int i = 0; i < history_current->size; i++) HISTORY_AT(i)->pinned = 0;
+            break;
+        case HISTORY_RECORD_FORK: {
+            char name[32];
+            snprintf(name, sizeof(name), "%.*s", (int)len, payload);
+            history_branch_fork(name);
+            break;
+        }
+        case HISTORY_RECORD_SWITCH:
+            if(arg < (uint32_t)history_num_branches) history_current = &history_branches[arg];
+            break;
+        case HISTORY_RECORD_MODEL:
+            if(state->model && state->model_size > 0) {
+                size_t n = len < state->model_size - 1 ? len : state->model_size - 1;
+                memcpy(state->model, payload, n);
+                state->model[n] = 0;
+            }
+            break;
+    }
+}
+
+// Rebuild history from a session journal and keep appending to it. model
+// is updated to the last model used in that session. Returns 0 if the
+// session could not be opened.
+__attribute__((unused)) static int history_resume(const char *session, char *model, size_t model_size) {
+    struct history_resume_state state = { model, model_size };
+    history_replaying = 1;
+    long records = journal_open(session, history_replay, &state);
+    history_replaying = 0;
+    if(records < 0) return 0;
+    // deflate everything but the hot tails, as if it had been added live
+    for(int k = 0; k < history_num_branches; k++) {
+        struct history_branch *b = &history_branches[k];
+        for(int i = 0; i + HISTORY_HOT < b->size; i++) message_compress(BRANCH_AT(b, i));
+    }
+    history_enforce_budget();
+    printf("Resumed session %s: %d messages", session, history_current->size);
+    if(history_num_branches > 1) printf(" on branch %s of %d", history_current->name, history_num_branches);
+    printf("\n");
+    return 1;
+}
+
+static void history_free(void) {
+    journal_close();
+    for(int i = 0; i < history_num_branches; i++) {
+        struct history_branch *b = &history_branches[i];
+        while(b->size > 0) branch_drop_newest(b);
+        b->head = 0;
+    }
+    history_num_branches = 1;
+    history_current = &history_branches[0];
+    history_bytes = 0;
+    free(request_body.data);
+    memset(&request_body, 0, sizeof(request_body));
+}
+
+#endif
@@ -0,0 +1,227 @@
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <zlib.h>
+
+// Append-only session journal. Every change to the conversation is written
+// as one record the moment it happens, so a session survives /quit, a
+// crash or a closed terminal and can be reopened with --resume <session>.
+//
+// Sessions live in $XDG_STATE_HOME/llminference (~/.local/state/llminference)
+// as <session>.journal. The file starts with JOURNAL_MAGIC, then records:
+//
+//   type (4 bytes) | payload length (4) | crc32 of payload (4) | arg (4) | payload
+//
+// Records reach the file with a plain write(), which is enough to survive
+// the process dying. fdatasync is batched (every JOURNAL_SYNC_RECORDS
+// records or JOURNAL_SYNC_SECONDS, and on close), so a power cut may lose
+// the last few seconds but never more. Reopening maps the file and walks
+// the records; a torn or corrupt tail is cut off at the last good record.
+
+#define JOURNAL_MAGIC "llmjrn1\n"
+#define JOURNAL_HEAD 16
+#define JOURNAL_SYNC_RECORDS 16
+#define JOURNAL_SYNC_SECONDS 5
+
+typedef void (*journal_record_fn)(uint32_t type, uint32_t arg, const char *payload, size_t len, void *userp);
+
+static int journal_fd = -1;
+static char journal_name[128];
+static char journal_path[640];
+static int journal_unsynced = 0;
+static time_t journal_synced_at = 0;
+
+static int state_file_path(const char *file, char *path, size_t size) {
+    const char *base = getenv("XDG_STATE_HOME");
+    char dir[512];
+    // a path cut short would be a different file, and --resume would miss it
+    if(base && base[0]) {
+        mkdir(base, 0700);
+        if(snprintf(dir, sizeof(dir), "%s/llminference", base) >= (int)sizeof(dir)) return 0;
+    } else {
+        const char *home = getenv("HOME");
+        if(!home) return 0;
+        if(snprintf(dir, sizeof(dir), "%s/.local/state/llminference", home) >= (int)sizeof(dir)) return 0;
+        snprintf(dir, sizeof(dir), "%s/.local", home);
+        mkdir(dir, 0700);
+        snprintf(dir, sizeof(dir), "%s/.local/state", home);
+        mkdir(dir, 0700);
+        snprintf(dir, sizeof(dir), "%s/.local/state/llminference", home);
+    }
+    if(mkdir(dir, 0700) != 0 && errno != EEXIST) return 0;
+    return snprintf(path, size, "%s/%s", dir, file) < (int)size;
+}
+
+// A session is named by id; anything with a '/' is taken as a path.
+static int journal_locate(const char *session, char *path, size_t size) {
+    if(strchr(session, '/')) return snprintf(path, size, "%s", session) < (int)size;
+    char file[160];
+    if(snprintf(file, sizeof(file), "%s.journal", session) >= (int)sizeof(file)) return 0;
+    return state_file_path(file, path, size);
+}
+
+// Remove --resume SESSION from argv so the remaining options can be parsed
+// as before. Returns the session, or NULL if none was given. (bench.c
+// writes sessions but takes no --resume.)
+__attribute__((unused)) static const char *journal_parse_args(int *argc, char **argv) {
+    const char *session = NULL;
+    int out = 1;
+    for(int i = 1; i < *argc; i++) {
+        if(strcmp(argv[i], "--resume") == 0 && i + 1 < *argc) {
+            session = argv[++i];
+            continue;
+        }
+        argv[out++] = argv[i];
+    }
+    *argc = out;
+    argv[out] = NULL;
+    return session;
+}
+
+static void journal_sync(void) {
+    if(journal_fd < 0 || journal_unsynced == 0) return;
+    fdatasync(journal_fd);
+    journal_unsynced = 0;
+    journal_synced_at = time(NULL);
+}
+
+// Fresh sessions get a file only once there is something to write, so
+// starting the program and quitting leaves nothing behind.
+static int journal_create(void) {
+    char stamp[32];
+    time_t now = time(NULL);
+    strftime(stamp, sizeof(stamp), "%Y%m%d-%H%M%S", localtime(&now));
+    for(int n = 1; n < 100; n++) {
+        if(n == 1) snprintf(journal_name, sizeof(journal_name), "%s", stamp);
+        else snprintf(journal_name, sizeof(journal_name), "%s-%d", stamp, n);
+        if(!journal_locate(journal_name, journal_path, sizeof(journal_path))) return 0;
+        journal_fd = open(journal_path, O_WRONLY | O_CREAT | O_EXCL | O_APPEND, 0600);
+        if(journal_fd >= 0) break;
+        if(errno != EEXIST) return 0;
+    }
+    if(journal_fd < 0) return 0;
+    if(write(journal_fd, JOURNAL_MAGIC, 8) != 8) {
+        close(journal_fd);
+        journal_fd = -1;
+        return 0;
+    }
+    journal_synced_at = now;
+    return 1;
+}
+
+static int journal_enabled = 0;    // set by the interactive programs
+
+// Append one record whose payload is the concatenation of parts.
+static void journal_append(uint32_t type, uint32_t arg, const char *const *parts, const size_t *lens, int nparts) {
+    if(!journal_enabled) return;
+    if(journal_fd < 0 && !journal_create()) {
+        fprintf(stderr, "Could not write the session journal, this session will not be saved\n");
+        journal_enabled = 0;
+        return;
+    }
+    uint32_t head[4] = { type, 0, 0, arg };
+    uLong crc = crc32(0L, Z_NULL, 0);
+    size_t total = 0;
+    for(int i = 0; i < nparts; i++) {
+        crc = crc32(crc, (const Bytef *)parts[i], (uInt)lens[i]);
+        total += lens[i];
+    }
+    head[1] = (uint32_t)total;
+    head[2] = (uint32_t)crc;
+    // one write per record, so a crash leaves at most one partial record
+    char stack[4096];
+    size_t size = JOURNAL_HEAD + total;
+    char *buf = size <= sizeof(stack) ? stack : malloc(size);
+    if(!buf) return;
+    memcpy(buf, head, JOURNAL_HEAD);
+    size_t at = JOURNAL_HEAD;
+    for(int i = 0; i < nparts; i++) {
+        memcpy(buf + at, parts[i], lens[i]);
+        at += lens[i];
+    }
+    ssize_t written = write(journal_fd, buf, size);
+    if(buf != stack) free(buf);
+    if(written != (ssize_t)size) {
+        fprintf(stderr, "Session journal write failed: %s\n", strerror(errno));
+        return;
+    }
+    journal_unsynced++;
+    if(journal_unsynced >= JOURNAL_SYNC_RECORDS || time(NULL) - journal_synced_at >= JOURNAL_SYNC_SECONDS) journal_sync();
+}
+
+// Map an existing session, hand every intact record to fn and cut off a
+// torn tail. Afterwards new records are appended to the same file.
+// Returns the number of records read, or -1 if the session can't be used.
+static long journal_open(const char *session, journal_record_fn fn, void *userp) {
+    if(!journal_locate(session, journal_path, sizeof(journal_path))) {
+        fprintf(stderr, "%s: the session path is too long\n", session);
+        return -1;
+    }
+    int fd = open(journal_path, O_RDWR | O_APPEND);
+    if(fd < 0) {
+        perror(journal_path);
+        return -1;
+    }
+    struct stat st;
+    if(fstat(fd, &st) != 0 || st.st_size < 8) {
+        fprintf(stderr, "%s: not a session journal\n", journal_path);
+        close(fd);
+        return -1;
+    }
+    size_t size = (size_t)st.st_size;
+    const char *map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if(map == MAP_FAILED || memcmp(map, JOURNAL_MAGIC, 8) != 0) {
+        fprintf(stderr, "%s: not a session journal\n", journal_path);
+        if(map != MAP_FAILED) munmap((void *)map, size);
+        close(fd);
+        return -1;
+    }
+    madvise((void *)map, size, MADV_SEQUENTIAL);
+    size_t at = 8;
+    long records = 0;
+    while(size - at >= JOURNAL_HEAD) {
+        uint32_t head[4];
+        memcpy(head, map + at, JOURNAL_HEAD);
+        if(head[1] > size - at - JOURNAL_HEAD) break;
+        const char *payload = map + at + JOURNAL_HEAD;
+        if((uint32_t)crc32(crc32(0L, Z_NULL, 0), (const Bytef *)payload, head[1]) != head[2]) break;
+        fn(head[0], head[3], payload, head[1], userp);
+        at += JOURNAL_HEAD + head[1];
+        records++;
+    }
+    munmap((void *)map, size);
+    if(at < size) {
+        fprintf(stderr, "(session: dropped %zu bytes of an unfinished record)\n", size - at);
+        if(ftruncate(fd, (off_t)at) != 0) {
+            perror(journal_path);
+            close(fd);
+            return -1;
+        }
+        fdatasync(fd);
+    }
+    snprintf(journal_name, sizeof(journal_name), "%s", session);
+    journal_fd = fd;
+    journal_synced_at = time(NULL);
+    journal_enabled = 1;
+    return records;
+}
+
+static void journal_close(void) {
+    if(journal_fd < 0) return;
+    journal_sync();
+    close(journal_fd);
+    journal_fd = -1;
+    printf("Session saved, continue it with --resume %s\n", journal_name);
+}
+
+#endif
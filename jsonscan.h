@@ -0,0 +1,447 @@
+#ifndef JSONSCAN_H
+#define JSONSCAN_H
+
+#include <stdlib.h>
+#include <string.h>
+
+// Incremental JSON scanner. Bytes are fed as they come off the wire, in
+// pieces of any size, and only the values at a few requested paths are
+// handed to a callback; everything else is skipped without being stored.
+// Memory is the container stack plus the value being captured, however
+// large the document is.
+//
+// Paths use dots for keys and brackets for array elements, "[]" meaning
+// any element: "choices[0].message.content", "data[].id", "error.message".
+// Scalars arrive as their decoded text (strings unescaped, numbers and
+// literals verbatim). A path naming an object or array reports
+// JSON_OBJECT/JSON_ARRAY when it opens and JSON_END when it closes, which
+// is how callers group the fields of one array entry.
+
+#define JSON_MAX_DEPTH 32
+#define JSON_MAX_PATHS 8
+#define JSON_KEY_MAX 64
+
+enum {
+    JSON_STRING,
+    JSON_NUMBER,
+    JSON_TRUE,
+    JSON_FALSE,
+    JSON_NULL,
+    JSON_OBJECT,
+    JSON_ARRAY,
+    JSON_END,
+};
+
+typedef void (*json_value_fn)(int path, int type, const char *value, size_t len, void *userp);
+
+enum {
+    JS_VALUE,          // a value must follow
+    JS_VALUE_OR_END,   // just after '['
+    JS_KEY_OR_END,     // just after '{'
+    JS_KEY,            // after ',' in an object
+    JS_COLON,
+    JS_COMMA_OR_END,
+    JS_STRING,
+    JS_LITERAL,
+    JS_DONE,
+    JS_ERROR,
+};
+
+struct json_frame {
+    char type;                 // '{' or '['
+    int index;                 // element index in an array
+    char key[JSON_KEY_MAX];    // last key seen in an object
+    int key_len;               // -1 when the key did not fit
+    unsigned match;            // paths that are a prefix match so far
+    int pos[JSON_MAX_PATHS];   // where each of those continues
+    int end_path;              // path to report JSON_END for, or -1
+};
+
+struct json_scanner {
+    const char *paths[JSON_MAX_PATHS];
+    int num_paths;
+    json_value_fn on_value;
+    void *userp;
+    struct json_frame stack[JSON_MAX_DEPTH];
+    int depth;
+    int state;
+    int in_key;         // the string being read is an object key
+    int capture;        // path of the value being read, -1 to skip it
+    int literal_type;
+    int escape;         // 0, 1 after '\\', 2..5 reading \u digits
+    unsigned unicode;
+    unsigned surrogate; // pending high surrogate
+    char *buf;          // captured value
+    size_t len, cap;
+};
+
+static void json_scan_init(struct json_scanner *s, const char **paths, int num_paths,
+                           json_value_fn on_value, void *userp) {
+    memset(s, 0, sizeof(*s));
+    if(num_paths > JSON_MAX_PATHS) num_paths = JSON_MAX_PATHS;
+    for(int i = 0; i < num_paths; i++) s->paths[i] = paths[i];
+    s->num_paths = num_paths;
+    s->on_value = on_value;
+    s->userp = userp;
+    s->state = JS_VALUE;
+    s->capture = -1;
+}
+
+// Start over on a new document, keeping paths, callback and buffer.
+static void json_scan_reset(struct json_scanner *s) {
+    s->depth = 0;
+    s->state = JS_VALUE;
+    s->in_key = 0;
+    s->capture = -1;
+    s->escape = 0;
+    s->surrogate = 0;
+    s->len = 0;
+}
+
+static void json_scan_free(struct json_scanner *s) {
+    free(s->buf);
+    s->buf = NULL;
+    s->len = s->cap = 0;
+}
+
+static int json_scan_put(struct json_scanner *s, const char *p, size_t n) {
+    if(s->len + n + 1 > s->cap) {
+        size_t cap = s->cap ? s->cap * 2 : 256;
+        while(cap < s->len + n + 1) cap *= 2;
+        char *buf = realloc(s->buf, cap);
+        if(!buf) return 0;
+        s->buf = buf;
+        s->cap = cap;
+    }
+    memcpy(s->buf + s->len, p, n);
+    s->len += n;
+    s->buf[s->len] = 0;
+    return 1;
+}
+
+// Does the path segment at pattern + *pos name this key or index? On a
+// match *pos moves past the segment.
+static int json_segment(const char *pattern, int *pos, const struct json_frame *f) {
+    const char *p = pattern + *pos;
+    if(f->type == '[') {
+        if(*p != '[') return 0;
+        p++;
+        if(*p == ']') {
+            *pos += 2;
+            return 1;
+        }
+        int index = 0;
+        const char *q = p;
+        while(*q >= '0' && *q <= '9') index = index * 10 + (*q++ - '0');
+        if(q == p || *q != ']' || index != f->index) return 0;
+        *pos = (int)(q + 1 - pattern);
+        return 1;
+    }
+    if(*p == '.') p++;
+    else if(*pos != 0) return 0;
+    size_t n = strcspn(p, ".[");
+    if(f->key_len < 0 || (size_t)f->key_len != n || memcmp(p, f->key, n) != 0) return 0;
+    *pos = (int)(p + n - pattern);
+    return 1;
+}
+
+// A value of the given type starts here. Works out which paths it is on
+// and, for containers, pushes the frame they continue in.
+static int json_begin(struct json_scanner *s, int type) {
+    unsigned match = 0;
+    int pos[JSON_MAX_PATHS];
+    int full = -1;
+    if(s->depth == 0) {
+        for(int p = 0; p < s->num_paths; p++) {
+            pos[p] = 0;
+            if(s->paths[p][0] == 0) {
+                if(full < 0) full = p;
+            } else {
+                match |= 1u << p;
+            }
+        }
+    } else {
+        struct json_frame *f = &s->stack[s->depth - 1];
+        for(int p = 0; p < s->num_paths; p++) {
+            if(!(f->match & (1u << p))) continue;
+            pos[p] = f->pos[p];
+            if(!json_segment(s->paths[p], &pos[p], f)) continue;
+            if(s->paths[p][pos[p]] == 0) {
+                if(full < 0) full = p;
+            } else {
+                match |= 1u << p;
+            }
+        }
+    }
+    if(type != JSON_OBJECT && type != JSON_ARRAY) {
+        s->capture = full;
+        s->len = 0;
+        return 1;
+    }
+    if(s->depth == JSON_MAX_DEPTH) return 0;
+    struct json_frame *c = &s->stack[s->depth++];
+    c->type = type == JSON_OBJECT ? '{' : '[';
+    c->index = 0;
+    c->key_len = 0;
+    c->match = match;
+    memcpy(c->pos, pos, sizeof(pos));
+    c->end_path = full;
+    if(full >= 0) s->on_value(full, type, NULL, 0, s->userp);
+    return 1;
+}
+
+// The value just read is complete; decide what may follow it.
+static void json_after_value(struct json_scanner *s) {
+    s->state = s->depth == 0 ? JS_DONE : JS_COMMA_OR_END;
+}
+
+static int json_end(struct json_scanner *s, char close) {
+    struct json_frame *f = &s->stack[s->depth - 1];
+    if((close == '}') != (f->type == '{')) return 0;
+    s->depth--;
+    if(f->end_path >= 0) s->on_value(f->end_path, JSON_END, NULL, 0, s->userp);
+    json_after_value(s);
+    return 1;
+}
+
+static void json_emit(struct json_scanner *s, int type) {
+    if(s->capture >= 0) s->on_value(s->capture, type, s->buf ? s->buf : "", s->len, s->userp);
+    s->capture = -1;
+}
+
+// Append a decoded character to the key or the captured value.
+static void json_string_put(struct json_scanner *s, const char *p, size_t n) {
+    if(s->in_key) {
+        struct json_frame *f = &s->stack[s->depth - 1];
+        if(f->key_len < 0) return;
+        if(f->key_len + n > JSON_KEY_MAX) {
+            f->key_len = -1;
+            return;
+        }
+        memcpy(f->key + f->key_len, p, n);
+        f->key_len += (int)n;
+    } else if(s->capture >= 0) {
+        json_scan_put(s, p, n);
+    }
+}
+
+static void json_put_codepoint(struct json_scanner *s, unsigned c) {
+    char u[4];
+    size_t n;
+    if(c < 0x80) {
+        u[0] = (char)c;
+        n = 1;
+    } else if(c < 0x800) {
+        u[0] = (char)(0xc0 | (c >> 6));
+        u[1] = (char)(0x80 | (c & 0x3f));
+        n = 2;
+    } else if(c < 0x10000) {
+        u[0] = (char)(0xe0 | (c >> 12));
+        u[1] = (char)(0x80 | ((c >> 6) & 0x3f));
+        u[2] = (char)(0x80 | (c & 0x3f));
+        n = 3;
+    } else {
+        u[0] = (char)(0xf0 | (c >> 18));
+        u[1] = (char)(0x80 | ((c >> 12) & 0x3f));
+        u[2] = (char)(0x80 | ((c >> 6) & 0x3f));
+        u[3] = (char)(0x80 | (c & 0x3f));
+        n = 4;
+    }
+    json_string_put(s, u, n);
+}
+
+static void json_unicode(struct json_scanner *s, unsigned c) {
+    if(s->surrogate) {
+        unsigned hi = s->surrogate;
+        s->surrogate = 0;
+        if(c >= 0xdc00 && c <= 0xdfff) {
+            json_put_codepoint(s, 0x10000 + ((hi - 0xd800) << 10) + (c - 0xdc00));
+            return;
+        }
+        json_put_codepoint(s, 0xfffd);
+    }
+    if(c >= 0xd800 && c <= 0xdbff) s->surrogate = c;
+    else if(c >= 0xdc00 && c <= 0xdfff) json_put_codepoint(s, 0xfffd);
+    else json_put_codepoint(s, c);
+}
+
+// Read string bytes from p; returns how many were consumed.
+static size_t json_string(struct json_scanner *s, const char *p, size_t n) {
+    size_t i = 0;
+    while(i < n) {
+        unsigned char c = (unsigned char)p[i];
+        if(s->escape >= 2) {
+            int v;
+            if(c >= '0' && c <= '9') v = c - '0';
+            else if((c | 0x20) >= 'a' && (c | 0x20) <= 'f') v = (c | 0x20) - 'a' + 10;
+            else {
+                s->state = JS_ERROR;
+                return n;
+            }
+            s->unicode = (s->unicode << 4) | (unsigned)v;
+            i++;
+            if(++s->escape == 6) {
+                s->escape = 0;
+                json_unicode(s, s->unicode);
+            }
+            continue;
+        }
+        if(s->escape == 1) {
+            char e;
+            switch(c) {
+            case '"': e = '"'; break;
+            case '\\': e = '\\'; break;
+            case '/': e = '/'; break;
+            case 'b': e = '\b'; break;
+            case 'f': e = '\f'; break;
+            case 'n': e = '\n'; break;
+            case 'r': e = '\r'; break;
+            case 't': e = '\t'; break;
+            case 'u':
+                s->escape = 2;
+                s->unicode = 0;
+                i++;
+                continue;
+            default:
+                s->state = JS_ERROR;
+                return n;
+            }
+            s->escape = 0;
+            if(s->surrogate) json_unicode(s, 0);
+            json_string_put(s, &e, 1);
+            i++;
+            continue;
+        }
+        if(c == '\\') {
+            s->escape = 1;
+            i++;
+            continue;
+        }
+        if(s->surrogate) json_unicode(s, 0);
+        if(c == '"') {
+            i++;
+            if(s->in_key) {
+                s->in_key = 0;
+                s->state = JS_COLON;
+            } else {
+                json_emit(s, JSON_STRING);
+                json_after_value(s);
+            }
+            return i;
+        }
+        // copy the run up to the next quote or backslash in one go
+        size_t run = i;
+        while(run < n && p[run] != '"' && p[run] != '\\') run++;
+        json_string_put(s, p + i, run - i);
+        i = run;
+    }
+    return i;
+}
+
+static int json_literal_char(char c) {
+    return (c >= '0' && c <= '9') || (c >= 'a' && c <= 'z') || c == '-' || c == '+' || c == '.' || c == 'E';
+}
+
+// Feed the next piece of the document. Returns 0 once it is known not to
+// be JSON; the rest of the input is then ignored.
+static int json_scan_feed(struct json_scanner *s, const char *data, size_t len) {
+    size_t i = 0;
+    while(i < len) {
+        if(s->state == JS_ERROR) return 0;
+        if(s->state == JS_STRING) {
+            i += json_string(s, data + i, len - i);
+            continue;
+        }
+        char c = data[i];
+        if(s->state == JS_LITERAL) {
+            if(json_literal_char(c)) {
+                if(s->capture >= 0) json_scan_put(s, &c, 1);
+                i++;
+                continue;
+            }
+            json_emit(s, s->literal_type);
+            json_after_value(s);
+        }
+        if(c == ' ' || c == '\t' || c == '\n' || c == '\r') {
+            i++;
+            continue;
+        }
+        i++;
+        switch(s->state) {
+        case JS_VALUE_OR_END:
+            if(c == ']') {
+                if(!json_end(s, c)) s->state = JS_ERROR;
+                break;
+            }
+            // fall through
+        case JS_VALUE:
+            if(c == '{') {
+                if(!json_begin(s, JSON_OBJECT)) s->state = JS_ERROR;
+                else s->state = JS_KEY_OR_END;
+            } else if(c == '[') {
+                if(!json_begin(s, JSON_ARRAY)) s->state = JS_ERROR;
+                else s->state = JS_VALUE_OR_END;
+            } else if(c == '"') {
+                json_begin(s, JSON_STRING);
+                s->state = JS_STRING;
+            } else if(c == '-' || (c >= '0' && c <= '9') || c == 't' || c == 'f' || c == 'n') {
+                s->literal_type = c == 't' ? JSON_TRUE : c == 'f' ? JSON_FALSE : c == 'n' ? JSON_NULL : JSON_NUMBER;
+                json_begin(s, s->literal_type);
+                if(s->capture >= 0) json_scan_put(s, &c, 1);
+                s->state = JS_LITERAL;
+            } else {
+                s->state = JS_ERROR;
+            }
+            break;
+        case JS_KEY_OR_END:
+            if(c == '}') {
+                if(!json_end(s, c)) s->state = JS_ERROR;
+                break;
+            }
+            // fall through
+        case JS_KEY:
+            if(c == '"') {
+                s->stack[s->depth - 1].key_len = 0;
+                s->in_key = 1;
+                s->state = JS_STRING;
+            } else {
+                s->state = JS_ERROR;
+            }
+            break;
+        case JS_COLON:
+            s->state = c == ':' ? JS_VALUE : JS_ERROR;
+            break;
+        case JS_COMMA_OR_END:
+            if(c == ',') {
+                struct json_frame *f = &s->stack[s->depth - 1];
+                if(f->type == '[') {
+                    f->index++;
+                    s->state = JS_VALUE;
+                } else {
+                    s->state = JS_KEY;
+                }
+            } else if(c == '}' || c == ']') {
+                if(!json_end(s, c)) s->state = JS_ERROR;
+            } else {
+                s->state = JS_ERROR;
+            }
+            break;
+        default:
+            // JS_DONE: nothing but whitespace may follow the document
+            s->state = JS_ERROR;
+            break;
+        }
+    }
+    return s->state != JS_ERROR;
+}
+
+// End of input. Returns 1 if exactly one complete document was read.
+static int json_scan_finish(struct json_scanner *s) {
+    if(s->state == JS_LITERAL && s->depth == 0) {
+        json_emit(s, s->literal_type);
+        s->state = JS_DONE;
+    }
+    return s->state == JS_DONE;
+}
+
+#endif
@@ -0,0 +1,716 @@
+// Local daemon the clients of one machine can share instead of each holding
+// its own upstream connections and model list:
+//
+//   gcc llmproxy.c -o llmproxy -lcurl -lz
+//   OPENROUTER_API_KEY=... ./llmproxy --socket /tmp/llm.sock
+//   LLM_PROXY=/tmp/llm.sock ./openrouter
+//
+// It speaks the OpenAI-style API the clients use, GET /v1/models and POST
+// /v1/chat/completions, streamed or not, and passes every request under /v1/
+// on to LLM_OPENROUTER_URL (default https://openrouter.ai/api/v1). All
+// upstream transfers run on one curl multi handle, so they are multiplexed
+// over a few HTTP/2 connections whose DNS, TCP and TLS setup is paid once
+// for every client. A request identical to one still in flight (same path,
+// key and body) is not sent again: the later client is attached to the
+// transfer already running and gets the same bytes from the start. A model
+// list is answered from memory for --models-ttl seconds, with 304 for
+// clients whose ETag still matches. On a Unix socket, a client without a
+// key of its own ("Authorization: Bearer" with nothing after it) is sent
+// upstream with the daemon's OPENROUTER_API_KEY, so whoever can open the
+// socket can use it: the socket is created 0600, or 0660 for --group. On
+// TCP anyone on the machine can connect, so there every client has to send
+// its own key.
+//
+// One thread: curl_multi_poll waits on the upstream transfers and the
+// client connections together. Clients get HTTP/1.1 with keep-alive and
+// chunked answers, passed on as they arrive.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <strings.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/stat.h>
+#include <grp.h>
+#include "transport.h"
+
+#define PROXY_MAX_CONNS 256
+#define PROXY_MAX_REQUEST (64 * 1024 * 1024)
+#define PROXY_OUT_HIGH (256 * 1024)    // a slow client isn't queued more than this
+
+struct proxy_options {
+    const char *socket_path;
+    const char *group;          // may use the socket, and with it the key
+    int port;
+    long models_ttl;
+    long max_connections;
+    int quiet;
+};
+
+static struct proxy_options opt = { .port = 8765, .models_ttl = 3600, .max_connections = 4 };
+
+struct buf {
+    char *data;
+    size_t len, cap;
+};
+
+// One upstream request and its answer, shared by every client that asked
+// for exactly this.
+struct flight {
+    struct flight *next;
+    uint64_t key;
+    char method[8];
+    char *url;
+    char *auth;                 // the Authorization header sent upstream
+    char *encoding;             // the client's Content-Encoding header
+    struct buf body;            // request
+    CURL *curl;                 // NULL once finished
+    struct curl_slist *headers;
+    long status;                // 0 until the response headers are complete
+    struct buf head;            // response headers passed on to the clients
+    struct buf reply;           // response body so far
+    char etag[256], modified[64];
+    int done, broken;           // broken: cut off after the headers went out
+    int subscribers;            // clients still being sent this
+    int clients;                // clients served, for the log
+    time_t cached_until;        // model lists are kept after they finish
+    double started;
+};
+
+struct conn {
+    int fd;
+    struct buf in, out;
+    size_t out_pos;
+    int close_after;
+    int continued;              // 100 Continue sent for the request being read
+    struct flight *flight;      // the answer being passed on
+    size_t sent;                // bytes of flight->reply passed on
+    int head_sent;
+};
+
+static struct conn conns[PROXY_MAX_CONNS];
+static struct flight *flights = NULL;
+static CURLM *multi = NULL;
+static char upstream_base[512];
+static const char *api_key = NULL;     // lent on the Unix socket only
+
+static double now_s(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int buf_reserve(struct buf *b, size_t extra) {
+    if(b->len + extra + 1 <= b->cap) return 1;
+    size_t cap = b->cap ? b->cap : 4096;
+    while(cap < b->len + extra + 1) cap *= 2;
+    char *data = realloc(b->data, cap);
+    if(!data) return 0;
+    b->data = data;
+    b->cap = cap;
+    return 1;
+}
+
+static void buf_append(struct buf *b, const char *s, size_t len) {
+    if(!buf_reserve(b, len)) return;
+    memcpy(b->data + b->len, s, len);
+    b->len += len;
+    b->data[b->len] = 0;
+}
+
+static void buf_printf(struct buf *b, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+static void buf_printf(struct buf *b, const char *fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    int n = vsnprintf(NULL, 0, fmt, ap);
+    va_end(ap);
+    if(n < 0 || !buf_reserve(b, (size_t)n)) return;
+    va_start(ap, fmt);
+    vsnprintf(b->data + b->len, (size_t)n + 1, fmt, ap);
+    va_end(ap);
+    b->len += (size_t)n;
+}
+
+static uint64_t fnv1a(uint64_t h, const void *data, size_t len) {
+    const unsigned char *p = data;
+    for(size_t i = 0; i < len; i++) {
+        h ^= p[i];
+        h *= 0x100000001b3ULL;
+    }
+    return h;
+}
+
+static const char *header_value(const char *head, size_t head_len, const char *name, size_t *len) {
+    size_t name_len = strlen(name);
+    const char *p = memchr(head, '\n', head_len);
+    while(p && (size_t)(p - head) < head_len) {
+        p++;
+        if((size_t)(head + head_len - p) > name_len && strncasecmp(p, name, name_len) == 0 && p[name_len] == ':') {
+            const char *v = p + name_len + 1;
+            while(*v == ' ') v++;
+            *len = strcspn(v, "\r\n");
+            return v;
+        }
+        p = memchr(p, '\n', head_len - (size_t)(p - head));
+    }
+    return NULL;
+}
+
+static const char *status_reason(long status) {
+    switch(status) {
+    case 200: return "OK";
+    case 304: return "Not Modified";
+    case 400: return "Bad Request";
+    case 401: return "Unauthorized";
+    case 404: return "Not Found";
+    case 429: return "Too Many Requests";
+    case 502: return "Bad Gateway";
+    default: return status < 400 ? "OK" : "Error";
+    }
+}
+
+static void respond_error(struct conn *c, int status, const char *message) {
+    struct buf body = {0};
+    buf_printf(&body, "{\"error\":{\"message\":\"llmproxy: %s\",\"code\":%d}}", message, status);
+    buf_printf(&c->out, "HTTP/1.1 %d %s\r\nContent-Type: application/json\r\nContent-Length: %zu\r\n%s\r\n", status,
+               status_reason(status), body.len, c->close_after ? "Connection: close\r\n" : "");
+    buf_append(&c->out, body.data, body.len);
+    free(body.data);
+}
+
+static void flight_free(struct flight *f) {
+    for(struct flight **p = &flights; *p; p = &(*p)->next) {
+        if(*p == f) {
+            *p = f->next;
+            break;
+        }
+    }
+    if(f->curl) {
+        curl_multi_remove_handle(multi, f->curl);
+        curl_easy_cleanup(f->curl);
+    }
+    curl_slist_free_all(f->headers);
+    free(f->url);
+    free(f->auth);
+    free(f->encoding);
+    free(f->body.data);
+    free(f->head.data);
+    free(f->reply.data);
+    free(f);
+}
+
+// A client is done with f, or gone: nobody left means the transfer is not
+// needed any more, unless it is a model list worth keeping.
+static void flight_release(struct flight *f) {
+    if(--f->subscribers > 0) return;
+    if(f->done && f->cached_until > time(NULL)) return;
+    flight_free(f);
+}
+
+// Response headers: the status comes with the blank line that ends them,
+// and only the ones that mean something to the client are kept.
+static size_t flight_header(char *buffer, size_t size, size_t nitems, void *userp) {
+    struct flight *f = userp;
+    size_t len = size * nitems;
+    if(len >= 5 && strncmp(buffer, "HTTP/", 5) == 0) {
+        // a new response, e.g. after 100 Continue
+        f->head.len = 0;
+        f->etag[0] = f->modified[0] = 0;
+        return len;
+    }
+    if(len <= 2 && (buffer[0] == '\r' || buffer[0] == '\n')) {
+        long status = 0;
+        curl_easy_getinfo(f->curl, CURLINFO_RESPONSE_CODE, &status);
+        if(status >= 200) f->status = status;
+        return len;
+    }
+    static const char *const passed[] = { "content-type:", "etag:", "last-modified:", "retry-after:", "x-ratelimit-" };
+    for(size_t i = 0; i < sizeof(passed) / sizeof(passed[0]); i++) {
+        size_t n = strlen(passed[i]);
+        if(len <= n || strncasecmp(buffer, passed[i], n) != 0) continue;
+        size_t end = len;
+        while(end > 0 && (buffer[end - 1] == '\r' || buffer[end - 1] == '\n')) end--;
+        buf_append(&f->head, buffer, end);
+        buf_append(&f->head, "\r\n", 2);
+        const char *v = strchr(buffer, ':') + 1;
+        while(*v == ' ') v++;
+        int vlen = (int)(buffer + end - v);
+        if(i == 1) snprintf(f->etag, sizeof(f->etag), "%.*s", vlen, v);
+        if(i == 2) snprintf(f->modified, sizeof(f->modified), "%.*s", vlen, v);
+    }
+    return len;
+}
+
+static size_t flight_write(void *contents, size_t size, size_t nmemb, void *userp) {
+    struct flight *f = userp;
+    size_t len = size * nmemb;
+    if(!buf_reserve(&f->reply, len)) return 0;
+    buf_append(&f->reply, contents, len);
+    return len;
+}
+
+static struct flight *flight_start(const char *method, const char *url, const char *auth, const char *type,
+                                   const char *encoding, const char *accept, const char *body, size_t body_len,
+                                   uint64_t key) {
+    struct flight *f = calloc(1, sizeof(*f));
+    if(!f) return NULL;
+    f->key = key;
+    snprintf(f->method, sizeof(f->method), "%s", method);
+    f->url = strdup(url);
+    f->auth = strdup(auth);
+    f->encoding = strdup(encoding);
+    buf_append(&f->body, body, body_len);
+    f->curl = curl_easy_init();
+    if(!f->url || !f->auth || !f->encoding || (body_len && !f->body.data) || !f->curl) {
+        flight_free(f);
+        return NULL;
+    }
+    char header[1024];
+    if(auth[0]) f->headers = curl_slist_append(f->headers, auth);
+    if(type[0]) {
+        snprintf(header, sizeof(header), "Content-Type: %s", type);
+        f->headers = curl_slist_append(f->headers, header);
+    }
+    if(encoding[0]) {
+        snprintf(header, sizeof(header), "Content-Encoding: %s", encoding);
+        f->headers = curl_slist_append(f->headers, header);
+    }
+    if(accept[0]) {
+        snprintf(header, sizeof(header), "Accept: %s", accept);
+        f->headers = curl_slist_append(f->headers, header);
+    }
+    f->headers = curl_slist_append(f->headers, "Expect:");
+    transport_setup_options(f->curl);
+    // the upstream link is the slow one; clients get it decoded
+    curl_easy_setopt(f->curl, CURLOPT_ACCEPT_ENCODING, "");
+    curl_easy_setopt(f->curl, CURLOPT_URL, f->url);
+    curl_easy_setopt(f->curl, CURLOPT_HTTPHEADER, f->headers);
+    if(strcmp(method, "POST") == 0) {
+        curl_easy_setopt(f->curl, CURLOPT_POSTFIELDS, f->body.data ? f->body.data : "");
+        curl_easy_setopt(f->curl, CURLOPT_POSTFIELDSIZE_LARGE, (curl_off_t)f->body.len);
+    }
+    curl_easy_setopt(f->curl, CURLOPT_WRITEFUNCTION, flight_write);
+    curl_easy_setopt(f->curl, CURLOPT_WRITEDATA, (void *)f);
+    curl_easy_setopt(f->curl, CURLOPT_HEADERFUNCTION, flight_header);
+    curl_easy_setopt(f->curl, CURLOPT_HEADERDATA, (void *)f);
+    curl_easy_setopt(f->curl, CURLOPT_PRIVATE, (void *)f);
+    if(curl_multi_add_handle(multi, f->curl) != CURLM_OK) {
+        flight_free(f);
+        return NULL;
+    }
+    f->started = now_s();
+    f->next = flights;
+    flights = f;
+    return f;
+}
+
+// A transfer that is still running, or a model list that is still fresh,
+// for exactly this request.
+static struct flight *flight_find(uint64_t key, const char *method, const char *url, const char *auth,
+                                  const char *encoding, const char *body, size_t body_len) {
+    time_t now = time(NULL);
+    struct flight *next;
+    for(struct flight *f = flights; f; f = next) {
+        next = f->next;
+        // a model list nobody is reading any more that went stale
+        if(f->done && f->subscribers == 0 && f->cached_until <= now) {
+            flight_free(f);
+            continue;
+        }
+        if(f->key != key || strcmp(f->method, method) != 0 || strcmp(f->url, url) != 0 || strcmp(f->auth, auth) != 0 ||
+           strcmp(f->encoding, encoding) != 0 || f->body.len != body_len ||
+           (body_len && memcmp(f->body.data, body, body_len) != 0)) {
+            continue;
+        }
+        if(!f->done) return f;
+        if(f->cached_until > now) return f;
+    }
+    return NULL;
+}
+
+static void flight_finished(struct flight *f, CURLcode res) {
+    curl_multi_remove_handle(multi, f->curl);
+    curl_easy_cleanup(f->curl);
+    f->curl = NULL;
+    f->done = 1;
+    if(res != CURLE_OK) {
+        if(f->status == 0) {
+            // nothing went out yet, so the clients can be told properly
+            f->status = 502;
+            f->head.len = 0;
+            buf_printf(&f->head, "Content-Type: application/json\r\n");
+            f->reply.len = 0;
+            buf_printf(&f->reply, "{\"error\":{\"message\":\"llmproxy: %s\",\"code\":502}}", curl_easy_strerror(res));
+        } else {
+            f->broken = 1;
+        }
+    }
+    size_t len = strlen(f->url);
+    if(!f->broken && f->status == 200 && strcmp(f->method, "GET") == 0 && len >= 7 &&
+       strcmp(f->url + len - 7, "/models") == 0) {
+        f->cached_until = time(NULL) + opt.models_ttl;
+    }
+    if(!opt.quiet) {
+        fprintf(stderr, "%s %s: %ld, %zu bytes in %.2f s, %d client%s%s\n", f->method, f->url + strlen(upstream_base),
+                f->status, f->reply.len, now_s() - f->started, f->clients, f->clients == 1 ? "" : "s",
+                f->broken ? ", cut off" : "");
+    }
+    if(f->subscribers == 0 && f->cached_until <= time(NULL)) flight_free(f);
+}
+
+static void conn_detach(struct conn *c) {
+    struct flight *f = c->flight;
+    c->flight = NULL;
+    if(f) flight_release(f);
+}
+
+// A whole request is in c->in: answer it, or attach the connection to the
+// transfer that will answer it. Returns the bytes it took up.
+static size_t handle_request(struct conn *c, size_t head_len, size_t body_len) {
+    const char *head = c->in.data;
+    const char *body = head + head_len;
+    char method[8] = "", path[256] = "";
+    sscanf(head, "%7s %255s", method, path);
+    size_t len;
+    const char *conn_hdr = header_value(head, head_len, "Connection", &len);
+    c->close_after = conn_hdr && len >= 5 && strncasecmp(conn_hdr, "close", 5) == 0;
+
+    // clients warm their connection with HEAD; ours is warm already
+    if(strcmp(method, "HEAD") == 0) {
+        buf_printf(&c->out, "HTTP/1.1 200 OK\r\nContent-Length: 0\r\n%s\r\n", c->close_after ? "Connection: close\r\n" : "");
+        return head_len + body_len;
+    }
+    const char *rest = strncmp(path, "/api/v1/", 8) == 0 ? path + 7 : strncmp(path, "/v1/", 4) == 0 ? path + 3 : NULL;
+    if(!rest || (strcmp(method, "GET") != 0 && strcmp(method, "POST") != 0)) {
+        respond_error(c, 404, "no such endpoint");
+        return head_len + body_len;
+    }
+    char url[1024];
+    snprintf(url, sizeof(url), "%s%s", upstream_base, rest);
+
+    char auth[512] = "", type[128] = "", encoding[64] = "", accept[128] = "";
+    const char *v = header_value(head, head_len, "Authorization", &len);
+    if(v && len > 6 && strncasecmp(v, "Bearer", 6) == 0 && v[6 + strspn(v + 6, " ")] != '\r') {
+        snprintf(auth, sizeof(auth), "Authorization: %.*s", (int)len, v);
+    } else if(api_key) {
+        snprintf(auth, sizeof(auth), "Authorization: Bearer %s", api_key);
+    }
+    if((v = header_value(head, head_len, "Content-Type", &len))) snprintf(type, sizeof(type), "%.*s", (int)len, v);
+    if((v = header_value(head, head_len, "Content-Encoding", &len))) snprintf(encoding, sizeof(encoding), "%.*s", (int)len, v);
+    if((v = header_value(head, head_len, "Accept", &len))) snprintf(accept, sizeof(accept), "%.*s", (int)len, v);
+
+    uint64_t key = 0xcbf29ce484222325ULL;
+    key = fnv1a(key, method, strlen(method) + 1);
+    key = fnv1a(key, url, strlen(url) + 1);
+    key = fnv1a(key, auth, strlen(auth) + 1);
+    key = fnv1a(key, encoding, strlen(encoding) + 1);
+    key = fnv1a(key, body, body_len);
+    struct flight *f = flight_find(key, method, url, auth, encoding, body, body_len);
+    if(f && f->done) {
+        const char *etag = header_value(head, head_len, "If-None-Match", &len);
+        int same = etag && f->etag[0] && strlen(f->etag) == len && strncmp(etag, f->etag, len) == 0;
+        const char *since = header_value(head, head_len, "If-Modified-Since", &len);
+        if(!etag && since && f->modified[0] && strlen(f->modified) == len && strncmp(since, f->modified, len) == 0) same = 1;
+        if(same) {
+            buf_printf(&c->out, "HTTP/1.1 304 Not Modified\r\n%s%s%s%s\r\n", f->etag[0] ? "ETag: " : "", f->etag,
+                       f->etag[0] ? "\r\n" : "", c->close_after ? "Connection: close\r\n" : "");
+            return head_len + body_len;
+        }
+    } else if(!f) {
+        f = flight_start(method, url, auth, type, encoding, accept, body, body_len, key);
+        if(!f) {
+            respond_error(c, 502, "cannot start the upstream request");
+            return head_len + body_len;
+        }
+    }
+    f->subscribers++;
+    f->clients++;
+    c->flight = f;
+    c->sent = 0;
+    c->head_sent = 0;
+    return head_len + body_len;
+}
+
+// Parse as many complete requests as have arrived, one at a time: the next
+// one waits until the answer to this one is out.
+static int conn_process(struct conn *c) {
+    while(!c->flight && c->in.len > 0) {
+        char *end = c->in.data ? strstr(c->in.data, "\r\n\r\n") : NULL;
+        if(!end) return c->in.len < 65536;
+        size_t head_len = (size_t)(end - c->in.data) + 4, len;
+        const char *cl = header_value(c->in.data, head_len, "Content-Length", &len);
+        size_t body_len = cl ? strtoul(cl, NULL, 10) : 0;
+        if(body_len > PROXY_MAX_REQUEST) return 0;
+        if(c->in.len < head_len + body_len) {
+            const char *expect = header_value(c->in.data, head_len, "Expect", &len);
+            if(!c->continued && expect && len >= 12 && strncasecmp(expect, "100-continue", 12) == 0) {
+                buf_printf(&c->out, "HTTP/1.1 100 Continue\r\n\r\n");
+                c->continued = 1;
+            }
+            return 1;
+        }
+        c->continued = 0;
+        size_t used = handle_request(c, head_len, body_len);
+        memmove(c->in.data, c->in.data + used, c->in.len - used);
+        c->in.len -= used;
+        c->in.data[c->in.len] = 0;
+    }
+    return 1;
+}
+
+// Pass on what arrived for the connection's flight since the last call.
+static void conn_pump(struct conn *c) {
+    struct flight *f = c->flight;
+    if(!f || f->status == 0) return;
+    if(!c->head_sent) {
+        buf_printf(&c->out, "HTTP/1.1 %ld %s\r\n", f->status, status_reason(f->status));
+        buf_append(&c->out, f->head.data ? f->head.data : "", f->head.len);
+        buf_printf(&c->out, "Transfer-Encoding: chunked\r\n%s\r\n", c->close_after ? "Connection: close\r\n" : "");
+        c->head_sent = 1;
+    }
+    if(f->reply.len > c->sent && c->out.len - c->out_pos < PROXY_OUT_HIGH) {
+        size_t n = f->reply.len - c->sent;
+        if(n > PROXY_OUT_HIGH) n = PROXY_OUT_HIGH;
+        buf_printf(&c->out, "%zx\r\n", n);
+        buf_append(&c->out, f->reply.data + c->sent, n);
+        buf_append(&c->out, "\r\n", 2);
+        c->sent += n;
+    }
+    if(f->done && c->sent == f->reply.len) {
+        // without the last chunk the client sees the answer was cut off
+        if(f->broken) c->close_after = 1;
+        else buf_append(&c->out, "0\r\n\r\n", 5);
+        conn_detach(c);
+    }
+}
+
+// Reply bytes that have arrived for c but aren't in its output yet.
+static int conn_unqueued(const struct conn *c) {
+    return c->flight && c->flight->status != 0 && c->sent < c->flight->reply.len;
+}
+
+static void conn_close(struct conn *c) {
+    conn_detach(c);
+    close(c->fd);
+    free(c->in.data);
+    free(c->out.data);
+    memset(c, 0, sizeof(*c));
+    c->fd = -1;
+}
+
+static int listen_tcp(int port) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if(fd < 0) return -1;
+    int one = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons((uint16_t)port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if(bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(fd, 128) != 0) {
+        close(fd);
+        return -1;
+    }
+    fcntl(fd, F_SETFL, O_NONBLOCK);
+    return fd;
+}
+
+static int listen_unix(const char *path, const char *group) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if(strlen(path) >= sizeof(addr.sun_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(fd < 0) return -1;
+    // a socket left behind by a daemon that was killed
+    unlink(path);
+    // created owner-only, so there's no moment anyone else can connect
+    mode_t mask = umask(0177);
+    int bound = bind(fd, (struct sockaddr *)&addr, sizeof(addr));
+    umask(mask);
+    if(bound != 0 || listen(fd, 128) != 0) {
+        close(fd);
+        return -1;
+    }
+    if(group) {
+        struct group *g = getgrnam(group);
+        if(!g) {
+            fprintf(stderr, "%s: no such group\n", group);
+            errno = EINVAL;
+        }
+        if(!g || chown(path, (uid_t)-1, g->gr_gid) != 0 || chmod(path, 0660) != 0) {
+            close(fd);
+            unlink(path);
+            return -1;
+        }
+    }
+    fcntl(fd, F_SETFL, O_NONBLOCK);
+    return fd;
+}
+
+static void on_signal(int sig) {
+    (void)sig;
+    if(opt.socket_path) unlink(opt.socket_path);
+    _exit(0);
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+            "Usage: %s [--socket PATH [--group NAME] | --port N] [--models-ttl SECONDS] [--max-connections N] "
+            "[--quiet]\n",
+            prog);
+}
+
+static int parse_args(int argc, char **argv) {
+    for(int i = 1; i < argc; i++) {
+        const char *arg = argv[i];
+        const char *value = i + 1 < argc ? argv[i + 1] : NULL;
+        if(strcmp(arg, "--quiet") == 0) opt.quiet = 1;
+        else if(!value) return 0;
+        else {
+            if(strcmp(arg, "--socket") == 0) opt.socket_path = value;
+            else if(strcmp(arg, "--group") == 0) opt.group = value;
+            else if(strcmp(arg, "--port") == 0) opt.port = atoi(value);
+            else if(strcmp(arg, "--models-ttl") == 0) opt.models_ttl = atol(value);
+            else if(strcmp(arg, "--max-connections") == 0) opt.max_connections = atol(value);
+            else return 0;
+            i++;
+        }
+    }
+    if(opt.max_connections < 1) opt.max_connections = 1;
+    return !opt.group || opt.socket_path;
+}
+
+int main(int argc, char **argv) {
+    if(!parse_args(argc, argv)) {
+        usage(argv[0]);
+        return 1;
+    }
+    // on TCP there is no telling who connected
+    if(opt.socket_path) api_key = getenv("OPENROUTER_API_KEY");
+    transport_url(upstream_base, sizeof(upstream_base), "LLM_OPENROUTER_URL", "https://openrouter.ai/api/v1", "");
+    signal(SIGPIPE, SIG_IGN);
+    int lfd = opt.socket_path ? listen_unix(opt.socket_path, opt.group) : listen_tcp(opt.port);
+    if(lfd < 0) {
+        perror(opt.socket_path ? opt.socket_path : "listen");
+        return 1;
+    }
+    signal(SIGINT, on_signal);
+    signal(SIGTERM, on_signal);
+    curl_global_init(CURL_GLOBAL_DEFAULT);
+    multi = curl_multi_init();
+    if(!multi) return 1;
+    curl_multi_setopt(multi, CURLMOPT_PIPELINING, CURLPIPE_MULTIPLEX);
+    curl_multi_setopt(multi, CURLMOPT_MAX_HOST_CONNECTIONS, opt.max_connections);
+    for(int i = 0; i < PROXY_MAX_CONNS; i++) conns[i].fd = -1;
+    if(opt.socket_path) fprintf(stderr, "llmproxy listening on %s, forwarding to %s\n", opt.socket_path, upstream_base);
+    else fprintf(stderr, "llmproxy listening on 127.0.0.1:%d, forwarding to %s\n", opt.port, upstream_base);
+    if(!opt.socket_path) fprintf(stderr, "On TCP the daemon's key isn't lent, clients have to send their own\n");
+    else if(!api_key) fprintf(stderr, "OPENROUTER_API_KEY is not set, clients have to send their own\n");
+
+    struct curl_waitfd fds[PROXY_MAX_CONNS + 1];
+    int slot_of[PROXY_MAX_CONNS + 1];
+    for(;;) {
+        int nfds = 0;
+        fds[nfds++] = (struct curl_waitfd){ .fd = lfd, .events = CURL_WAIT_POLLIN };
+        for(int i = 0; i < PROXY_MAX_CONNS; i++) {
+            struct conn *c = &conns[i];
+            if(c->fd < 0) continue;
+            short events = CURL_WAIT_POLLIN;
+            // also when the reply is all there (a cached model list) and
+            // nothing upstream would wake the poll to queue the rest
+            if(c->out_pos < c->out.len || conn_unqueued(c)) events |= CURL_WAIT_POLLOUT;
+            slot_of[nfds] = i;
+            fds[nfds++] = (struct curl_waitfd){ .fd = c->fd, .events = events };
+        }
+        if(curl_multi_poll(multi, fds, (unsigned)nfds, 1000, NULL) != CURLM_OK) {
+            fprintf(stderr, "curl_multi_poll failed\n");
+            return 1;
+        }
+        int running;
+        curl_multi_perform(multi, &running);
+        CURLMsg *msg;
+        int left;
+        while((msg = curl_multi_info_read(multi, &left))) {
+            if(msg->msg != CURLMSG_DONE) continue;
+            struct flight *f = NULL;
+            curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, (char **)&f);
+            if(f) flight_finished(f, msg->data.result);
+        }
+
+        if(fds[0].revents & CURL_WAIT_POLLIN) {
+            int fd;
+            while((fd = accept(lfd, NULL, NULL)) >= 0) {
+                int slot = -1;
+                for(int i = 0; i < PROXY_MAX_CONNS && slot < 0; i++) {
+                    if(conns[i].fd < 0) slot = i;
+                }
+                if(slot < 0) {
+                    close(fd);
+                    continue;
+                }
+                int one = 1;
+                if(!opt.socket_path) setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+                fcntl(fd, F_SETFL, O_NONBLOCK);
+                memset(&conns[slot], 0, sizeof(conns[slot]));
+                conns[slot].fd = fd;
+            }
+        }
+        for(int k = 1; k < nfds; k++) {
+            struct conn *c = &conns[slot_of[k]];
+            if(c->fd != fds[k].fd || !(fds[k].revents & CURL_WAIT_POLLIN)) continue;
+            int dead = !buf_reserve(&c->in, 65536);
+            ssize_t n = dead ? 0 : read(c->fd, c->in.data + c->in.len, 65536);
+            if(n > 0) {
+                c->in.len += (size_t)n;
+                c->in.data[c->in.len] = 0;
+            } else if(n == 0 || (errno != EAGAIN && errno != EINTR)) {
+                dead = 1;
+            }
+            if(dead) conn_close(c);
+        }
+        // every connection, since upstream data arrives without client I/O
+        for(int i = 0; i < PROXY_MAX_CONNS; i++) {
+            struct conn *c = &conns[i];
+            if(c->fd < 0) continue;
+            // queue and write PROXY_OUT_HIGH at a time until the socket is
+            // full or nothing more has arrived
+            int dead = 0, blocked = 0;
+            do {
+                dead = !conn_process(c);
+                if(!dead) {
+                    conn_pump(c);
+                    dead = !conn_process(c);
+                }
+                if(!dead && c->out_pos < c->out.len) {
+                    ssize_t n = write(c->fd, c->out.data + c->out_pos, c->out.len - c->out_pos);
+                    if(n > 0) c->out_pos += (size_t)n;
+                    else if(n < 0 && errno != EAGAIN && errno != EINTR) dead = 1;
+                    blocked = c->out_pos < c->out.len;
+                }
+                if(c->out_pos == c->out.len) {
+                    c->out.len = c->out_pos = 0;
+                    if(c->close_after && !c->flight) dead = 1;
+                }
+            } while(!dead && !blocked && conn_unqueued(c));
+            if(dead) conn_close(c);
+        }
+    }
+    return 0;
+}
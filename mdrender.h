@@ -0,0 +1,913 @@
+#ifndef MDRENDER_H
+#define MDRENDER_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <unistd.h>
+
+// Streaming markdown + LaTeX renderer for ANSI terminals. Text can be fed
+// in arbitrary pieces as it arrives; each byte is rendered as soon as the
+// markup around it is unambiguous, so only a short held-back tail (an
+// unclosed "$...$", a run of '*', a table row) waits for more input. All
+// state lives in struct md_renderer: no allocations, no files, no
+// processes.
+//
+// Handles headings, emphasis, inline code, links, bullet and numbered
+// lists, block quotes, rules, fenced code with simple highlighting, pipe
+// tables, and inline/display LaTeX ($..$, $$..$$, \(..\), \[..\]) mapped
+// to Unicode.
+
+#define MD_LINE_MAX 4096   // held-back bytes of the current line
+#define MD_HOLD 512        // how far to look ahead for a closing delimiter
+#define MD_MAX_COLS 16
+
+enum {
+    MD_UNKNOWN,      // start of line, block type not known yet
+    MD_TEXT,         // paragraph, heading, list item or quote: streamed inline
+    MD_LINE,         // fence, math, table, rule: rendered once the line is complete
+};
+
+struct md_renderer {
+    FILE *out;
+    int color;
+    char buf[MD_LINE_MAX];
+    size_t len;
+    int kind;
+    int heading;         // level of the heading being rendered
+    int quote;
+    int in_fence;
+    char fence_lang[16];
+    int in_math;         // inside a $$ or \[ display block
+    char math_close[3];  // "$$" or "\\]"
+    int table_row;       // rows of the current table rendered so far
+    int table_cols;
+    int table_width[MD_MAX_COLS];
+    int bold, italic, code, strike, link;
+    int prev;            // previous source character, for intraword '_'
+};
+
+#define MD_RESET "\x1b[0m"
+
+static void md_init(struct md_renderer *r, FILE *out) {
+    memset(r, 0, sizeof(*r));
+    r->out = out;
+    r->color = isatty(fileno(out)) && !getenv("NO_COLOR");
+}
+
+static void md_puts(struct md_renderer *r, const char *s) {
+    fputs(s, r->out);
+}
+
+static void md_write(struct md_renderer *r, const char *s, size_t n) {
+    fwrite(s, 1, n, r->out);
+}
+
+// strspn for a buffer that is not NUL-terminated
+static size_t md_span(const char *s, size_t n, const char *set) {
+    size_t i = 0;
+    while(i < n && s[i] && strchr(set, s[i])) i++;
+    return i;
+}
+
+static int md_name_is(const char *name, size_t len, const char *word) {
+    return strlen(word) == len && memcmp(name, word, len) == 0;
+}
+
+static void md_ansi(struct md_renderer *r, const char *code) {
+    if(r->color) fputs(code, r->out);
+}
+
+// Re-emit the SGR state for the current block and inline flags.
+static void md_style(struct md_renderer *r) {
+    if(!r->color) return;
+    fputs(MD_RESET, r->out);
+    if(r->heading == 1) fputs("\x1b[1;4;35m", r->out);
+    else if(r->heading == 2) fputs("\x1b[1;36m", r->out);
+    else if(r->heading >= 3) fputs("\x1b[1;34m", r->out);
+    if(r->quote) fputs("\x1b[2m", r->out);
+    if(r->bold) fputs("\x1b[1m", r->out);
+    if(r->italic) fputs("\x1b[3m", r->out);
+    if(r->strike) fputs("\x1b[9m", r->out);
+    if(r->link) fputs("\x1b[4;34m", r->out);
+    if(r->code) fputs("\x1b[33m", r->out);
+}
+
+// ---- LaTeX to Unicode ----
+
+struct md_symbol {
+    const char *name;
+    const char *text;
+};
+
+static const struct md_symbol md_symbols[] = {
+    {"alpha", "α"}, {"beta", "β"}, {"gamma", "γ"}, {"delta", "δ"}, {"epsilon", "ε"},
+    {"varepsilon", "ε"}, {"zeta", "ζ"}, {"eta", "η"}, {"theta", "θ"}, {"vartheta", "ϑ"},
+    {"iota", "ι"}, {"kappa", "κ"}, {"lambda", "λ"}, {"mu", "μ"}, {"nu", "ν"}, {"xi", "ξ"},
+    {"pi", "π"}, {"rho", "ρ"}, {"sigma", "σ"}, {"tau", "τ"}, {"upsilon", "υ"}, {"phi", "φ"},
+    {"varphi", "φ"}, {"chi", "χ"}, {"psi", "ψ"}, {"omega", "ω"},
+    {"Gamma", "Γ"}, {"Delta", "Δ"}, {"Theta", "Θ"}, {"Lambda", "Λ"}, {"Xi", "Ξ"}, {"Pi", "Π"},
+    {"Sigma", "Σ"}, {"Upsilon", "Υ"}, {"Phi", "Φ"}, {"Psi", "Ψ"}, {"Omega", "Ω"},
+    {"infty", "∞"}, {"partial", "∂"}, {"nabla", "∇"}, {"sum", "∑"}, {"prod", "∏"},
+    {"int", "∫"}, {"iint", "∬"}, {"oint", "∮"}, {"sqrt", "√"}, {"cdot", "·"}, {"cdots", "⋯"},
+    {"ldots", "…"}, {"dots", "…"}, {"times", "×"}, {"div", "÷"}, {"pm", "±"}, {"mp", "∓"},
+    {"leq", "≤"}, {"le", "≤"}, {"geq", "≥"}, {"ge", "≥"}, {"neq", "≠"}, {"ne", "≠"},
+    {"approx", "≈"}, {"equiv", "≡"}, {"sim", "∼"}, {"simeq", "≃"}, {"propto", "∝"},
+    {"ll", "≪"}, {"gg", "≫"}, {"to", "→"}, {"rightarrow", "→"}, {"leftarrow", "←"},
+    {"leftrightarrow", "↔"}, {"Rightarrow", "⇒"}, {"Leftarrow", "⇐"}, {"Leftrightarrow", "⇔"},
+    {"implies", "⇒"}, {"iff", "⇔"}, {"mapsto", "↦"}, {"in", "∈"}, {"notin", "∉"},
+    {"ni", "∋"}, {"subset", "⊂"}, {"subseteq", "⊆"}, {"supset", "⊃"}, {"supseteq", "⊇"},
+    {"cup", "∪"}, {"cap", "∩"}, {"setminus", "∖"}, {"emptyset", "∅"}, {"varnothing", "∅"},
+    {"forall", "∀"}, {"exists", "∃"}, {"neg", "¬"}, {"lnot", "¬"}, {"land", "∧"}, {"wedge", "∧"},
+    {"lor", "∨"}, {"vee", "∨"}, {"oplus", "⊕"}, {"otimes", "⊗"}, {"circ", "∘"}, {"bullet", "•"},
+    {"star", "⋆"}, {"angle", "∠"}, {"perp", "⊥"}, {"parallel", "∥"}, {"mid", "∣"},
+    {"langle", "⟨"}, {"rangle", "⟩"}, {"lfloor", "⌊"}, {"rfloor", "⌋"}, {"lceil", "⌈"},
+    {"rceil", "⌉"}, {"hbar", "ℏ"}, {"ell", "ℓ"}, {"Re", "ℜ"}, {"Im", "ℑ"}, {"aleph", "ℵ"},
+    {"degree", "°"}, {"prime", "′"}, {"{", "{"}, {"}", "}"}, {"%", "%"}, {"$", "$"}, {"&", "&"},
+    {"#", "#"}, {"_", "_"}, {"|", "‖"}, {"quad", "  "}, {"qquad", "    "}, {",", " "},
+    {";", " "}, {":", " "}, {" ", " "}, {"!", ""}, {"\\", "; "}, {"left", ""}, {"right", ""},
+    {"big", ""}, {"Big", ""}, {"bigg", ""}, {"Bigg", ""}, {"displaystyle", ""},
+    {"limits", ""}, {"nolimits", ""}, {"lim", "lim"}, {"max", "max"}, {"min", "min"},
+    {"sup", "sup"}, {"inf", "inf"}, {"log", "log"}, {"ln", "ln"}, {"exp", "exp"},
+    {"sin", "sin"}, {"cos", "cos"}, {"tan", "tan"}, {"det", "det"}, {"dim", "dim"},
+    {NULL, NULL}
+};
+
+static const char *md_sup_digits[] = {"⁰", "¹", "²", "³", "⁴", "⁵", "⁶", "⁷", "⁸", "⁹"};
+static const char *md_sub_digits[] = {"₀", "₁", "₂", "₃", "₄", "₅", "₆", "₇", "₈", "₉"};
+
+static const char *md_script_char(char c, int sup) {
+    if(c >= '0' && c <= '9') return sup ? md_sup_digits[c - '0'] : md_sub_digits[c - '0'];
+    switch(c) {
+        case '+': return sup ? "⁺" : "₊";
+        case '-': return sup ? "⁻" : "₋";
+        case '=': return sup ? "⁼" : "₌";
+        case '(': return sup ? "⁽" : "₍";
+        case ')': return sup ? "⁾" : "₎";
+        case 'i': return sup ? "ⁱ" : "ᵢ";
+        case 'n': return sup ? "ⁿ" : "ₙ";
+        case 'a': return sup ? "ᵃ" : "ₐ";
+        case 'e': return sup ? "ᵉ" : "ₑ";
+        case 'o': return sup ? "ᵒ" : "ₒ";
+        case 'x': return sup ? "ˣ" : "ₓ";
+        case 'k': return sup ? "ᵏ" : "ₖ";
+        case 'm': return sup ? "ᵐ" : "ₘ";
+        case 't': return sup ? "ᵗ" : "ₜ";
+        case 'j': return sup ? "ʲ" : "ⱼ";
+        case 'T': return sup ? "ᵀ" : NULL;
+        case 'r': return sup ? "ʳ" : "ᵣ";
+        case 's': return sup ? "ˢ" : "ₛ";
+        case 'p': return sup ? "ᵖ" : "ₚ";
+        case 'h': return sup ? "ʰ" : "ₕ";
+        case 'l': return sup ? "ˡ" : "ₗ";
+        case 'u': return sup ? "ᵘ" : "ᵤ";
+        case 'v': return sup ? "ᵛ" : "ᵥ";
+        case '*': return sup ? "*" : NULL;
+        case '\'': return sup ? "′" : NULL;
+        default: return NULL;
+    }
+}
+
+static const char *md_blackboard(char c) {
+    switch(c) {
+        case 'R': return "ℝ";
+        case 'N': return "ℕ";
+        case 'Z': return "ℤ";
+        case 'Q': return "ℚ";
+        case 'C': return "ℂ";
+        case 'P': return "ℙ";
+        case 'E': return "𝔼";
+        default: return NULL;
+    }
+}
+
+// One argument: {group}, \command or a single character. Returns its end.
+static size_t md_latex_arg(const char *s, size_t n, size_t i, size_t *start, size_t *end) {
+    while(i < n && s[i] == ' ') i++;
+    if(i >= n) {
+        *start = *end = n;
+        return n;
+    }
+    if(s[i] == '{') {
+        int depth = 0;
+        size_t j = i;
+        for(; j < n; j++) {
+            if(s[j] == '\\' && j + 1 < n) {
+                j++;
+                continue;
+            }
+            if(s[j] == '{') depth++;
+            else if(s[j] == '}' && --depth == 0) break;
+        }
+        *start = i + 1;
+        *end = j < n ? j : n;
+        return j < n ? j + 1 : n;
+    }
+    if(s[i] == '\\') {
+        size_t j = i + 1;
+        while(j < n && isalpha((unsigned char)s[j])) j++;
+        if(j == i + 1 && j < n) j++;
+        *start = i;
+        *end = j;
+        return j;
+    }
+    size_t len = 1;
+    while(i + len < n && ((unsigned char)s[i + len] & 0xC0) == 0x80) len++;
+    *start = i;
+    *end = i + len;
+    return i + len;
+}
+
+static int md_latex_simple(const char *s, size_t n) {
+    size_t chars = 0;
+    for(size_t i = 0; i < n; i++) {
+        if(s[i] == '\\') {
+            while(i + 1 < n && isalpha((unsigned char)s[i + 1])) i++;
+            chars++;
+        } else if(((unsigned char)s[i] & 0xC0) != 0x80 && s[i] != '{' && s[i] != '}') {
+            if(!isalnum((unsigned char)s[i]) && s[i] != '.') return 0;
+            chars++;
+        }
+    }
+    return chars <= 1 || (n > 0 && md_span(s, n, "0123456789.") == n);
+}
+
+static void md_latex(struct md_renderer *r, const char *s, size_t n);
+
+static void md_latex_script(struct md_renderer *r, const char *s, size_t n, int sup) {
+    int mappable = n > 0;
+    for(size_t i = 0; i < n && mappable; i++) {
+        if(s[i] == ' ') continue;
+        if(!md_script_char(s[i], sup)) mappable = 0;
+    }
+    if(mappable) {
+        for(size_t i = 0; i < n; i++) {
+            if(s[i] != ' ') md_puts(r, md_script_char(s[i], sup));
+        }
+        return;
+    }
+    md_puts(r, sup ? "^" : "_");
+    int simple = md_latex_simple(s, n);
+    if(!simple) md_puts(r, "(");
+    md_latex(r, s, n);
+    if(!simple) md_puts(r, ")");
+}
+
+static void md_latex(struct md_renderer *r, const char *s, size_t n) {
+    size_t i = 0;
+    while(i < n) {
+        char c = s[i];
+        if(c == '\\') {
+            size_t j = i + 1;
+            while(j < n && isalpha((unsigned char)s[j])) j++;
+            if(j == i + 1 && j < n) j++;
+            size_t name_len = j - i - 1;
+            const char *name = s + i + 1;
+            size_t a0, a1, b0, b1;
+            if(md_name_is(name, name_len, "frac") || md_name_is(name, name_len, "dfrac") || md_name_is(name, name_len, "tfrac")) {
+                j = md_latex_arg(s, n, j, &a0, &a1);
+                j = md_latex_arg(s, n, j, &b0, &b1);
+                int sa = md_latex_simple(s + a0, a1 - a0), sb = md_latex_simple(s + b0, b1 - b0);
+                if(!sa) md_puts(r, "(");
+                md_latex(r, s + a0, a1 - a0);
+                md_puts(r, sa ? "/" : ")/");
+                if(!sb) md_puts(r, "(");
+                md_latex(r, s + b0, b1 - b0);
+                if(!sb) md_puts(r, ")");
+            } else if(md_name_is(name, name_len, "sqrt")) {
+                if(j < n && s[j] == '[') {
+                    size_t k = j + 1;
+                    while(k < n && s[k] != ']') k++;
+                    md_latex_script(r, s + j + 1, k - j - 1, 1);
+                    j = k < n ? k + 1 : n;
+                }
+                j = md_latex_arg(s, n, j, &a0, &a1);
+                int sa = md_latex_simple(s + a0, a1 - a0);
+                md_puts(r, sa ? "√" : "√(");
+                md_latex(r, s + a0, a1 - a0);
+                if(!sa) md_puts(r, ")");
+            } else if(md_name_is(name, name_len, "mathbb")) {
+                j = md_latex_arg(s, n, j, &a0, &a1);
+                for(size_t k = a0; k < a1; k++) {
+                    const char *bb = md_blackboard(s[k]);
+                    if(bb) md_puts(r, bb);
+                    else md_write(r, s + k, 1);
+                }
+            } else if(md_name_is(name, name_len, "text") || md_name_is(name, name_len, "textrm") ||
+                      md_name_is(name, name_len, "textbf") || md_name_is(name, name_len, "textit")) {
+                j = md_latex_arg(s, n, j, &a0, &a1);
+                md_write(r, s + a0, a1 - a0);
+            } else if(md_name_is(name, name_len, "mathrm") || md_name_is(name, name_len, "mathbf") ||
+                      md_name_is(name, name_len, "mathit") || md_name_is(name, name_len, "mathsf") ||
+                      md_name_is(name, name_len, "mathtt") || md_name_is(name, name_len, "mathcal") ||
+                      md_name_is(name, name_len, "operatorname") || md_name_is(name, name_len, "boldsymbol")) {
+                j = md_latex_arg(s, n, j, &a0, &a1);
+                md_latex(r, s + a0, a1 - a0);
+            } else if(md_name_is(name, name_len, "hat") || md_name_is(name, name_len, "bar") ||
+                      md_name_is(name, name_len, "overline") || md_name_is(name, name_len, "tilde") ||
+                      md_name_is(name, name_len, "dot") || md_name_is(name, name_len, "vec")) {
+                j = md_latex_arg(s, n, j, &a0, &a1);
+                md_latex(r, s + a0, a1 - a0);
+                if(name[0] == 'h') md_puts(r, "\xCC\x82");        // combining circumflex
+                else if(name[0] == 't') md_puts(r, "\xCC\x83");   // combining tilde
+                else if(name[0] == 'd') md_puts(r, "\xCC\x87");   // combining dot
+                else if(name[0] == 'v') md_puts(r, "\xE2\x83\x97"); // combining arrow
+                else md_puts(r, "\xCC\x84");                     // combining macron
+            } else if(md_name_is(name, name_len, "begin") || md_name_is(name, name_len, "end")) {
+                j = md_latex_arg(s, n, j, &a0, &a1);   // environment name: dropped
+            } else {
+                const struct md_symbol *sym = md_symbols;
+                while(sym->name && !(strlen(sym->name) == name_len && memcmp(sym->name, name, name_len) == 0)) sym++;
+                if(sym->name) md_puts(r, sym->text);
+                else md_write(r, name, name_len);
+            }
+            i = j;
+        } else if(c == '^' || c == '_') {
+            size_t a0, a1;
+            i = md_latex_arg(s, n, i + 1, &a0, &a1);
+            md_latex_script(r, s + a0, a1 - a0, c == '^');
+        } else if(c == '{' || c == '}') {
+            i++;
+        } else if(c == '~') {
+            md_puts(r, " ");
+            i++;
+        } else if(c == '&') {
+            md_puts(r, "  ");
+            i++;
+        } else {
+            md_write(r, s + i, 1);
+            i++;
+        }
+    }
+}
+
+static void md_math(struct md_renderer *r, const char *s, size_t n) {
+    md_ansi(r, "\x1b[36m");
+    md_latex(r, s, n);
+    md_style(r);
+}
+
+// ---- inline spans ----
+
+static int md_is_word(int c) {
+    return isalnum(c) || c >= 0x80;
+}
+
+// Find `delim` in s[from..n), skipping backslash escapes.
+static size_t md_find(const char *s, size_t n, size_t from, const char *delim) {
+    size_t dl = strlen(delim);
+    for(size_t i = from; i + dl <= n; i++) {
+        if(s[i] == '\\' && delim[0] != '\\') {
+            i++;
+            continue;
+        }
+        if(memcmp(s + i, delim, dl) == 0) return i;
+    }
+    return (size_t)-1;
+}
+
+// Render as much of s[0..n) as is unambiguous. With `complete` the line is
+// known to end at n and everything is rendered. Returns bytes consumed.
+static size_t md_inline(struct md_renderer *r, const char *s, size_t n, int complete) {
+    size_t i = 0;
+    while(i < n) {
+        unsigned char c = (unsigned char)s[i];
+        if(r->code && c != '`') {
+            md_write(r, s + i, 1);
+            r->prev = c;
+            i++;
+            continue;
+        }
+        if(c == '\\') {
+            if(i + 1 >= n) {
+                if(!complete) return i;
+                md_write(r, s + i, 1);
+                i++;
+                continue;
+            }
+            char d = s[i + 1];
+            if(d == '(' || d == '[') {
+                size_t close = md_find(s, n, i + 2, d == '(' ? "\\)" : "\\]");
+                if(close != (size_t)-1) {
+                    md_math(r, s + i + 2, close - i - 2);
+                    i = close + 2;
+                    continue;
+                }
+                if(!complete && n - i < MD_HOLD) return i;
+            }
+            if(ispunct((unsigned char)d)) {
+                md_write(r, s + i + 1, 1);
+                r->prev = d;
+                i += 2;
+            } else {
+                md_write(r, s + i, 1);
+                i++;
+            }
+            continue;
+        }
+        if(c == '`' || c == '*' || c == '_' || c == '~') {
+            size_t run = 1;
+            while(i + run < n && s[i + run] == (char)c) run++;
+            if(i + run >= n && !complete) return i;   // need the next character
+            int next = i + run < n ? (unsigned char)s[i + run] : ' ';
+            int handled = 1;
+            if(c == '`') {
+                r->code = !r->code;
+            } else if(c == '~') {
+                if(run >= 2) r->strike = !r->strike;
+                else handled = 0;
+            } else if(c == '_' && md_is_word(r->prev) && md_is_word(next)) {
+                handled = 0;   // snake_case
+            } else if(isspace(r->prev) && isspace(next)) {
+                handled = 0;   // "a * b"
+            } else if(r->prev == 0 && isspace(next) && c == '*') {
+                handled = 0;
+            } else if(run == 1) {
+                r->italic = !r->italic;
+            } else if(run == 2) {
+                r->bold = !r->bold;
+            } else {
+                r->bold = !r->bold;
+                r->italic = !r->italic;
+            }
+            if(handled) md_style(r);
+            else md_write(r, s + i, run);
+            r->prev = c;
+            i += run;
+            continue;
+        }
+        if(c == '$') {
+            int display = (i + 1 < n && s[i + 1] == '$');
+            size_t open = display ? 2 : 1;
+            if(i + open >= n && !complete) return i;
+            size_t close = md_find(s, n, i + open, display ? "$$" : "$");
+            int ok = close != (size_t)-1 && close > i + open &&
+                     (display || (!isspace((unsigned char)s[i + 1]) && !isspace((unsigned char)s[close - 1])));
+            if(ok) {
+                md_math(r, s + i + open, close - i - open);
+                i = close + open;
+                r->prev = '$';
+                continue;
+            }
+            if(close == (size_t)-1 && !complete && n - i < MD_HOLD) return i;
+            md_write(r, s + i, 1);
+            r->prev = c;
+            i++;
+            continue;
+        }
+        if(c == '[') {
+            size_t mid = md_find(s, n, i + 1, "](");
+            size_t end = mid != (size_t)-1 ? md_find(s, n, mid + 2, ")") : (size_t)-1;
+            if(end != (size_t)-1 && memchr(s + i + 1, '\n', mid - i - 1) == NULL) {
+                r->link = 1;
+                md_style(r);
+                md_inline(r, s + i + 1, mid - i - 1, 1);
+                r->link = 0;
+                md_style(r);
+                md_ansi(r, "\x1b[2m");
+                md_puts(r, " (");
+                md_write(r, s + mid + 2, end - mid - 2);
+                md_puts(r, ")");
+                md_style(r);
+                i = end + 1;
+                r->prev = ')';
+                continue;
+            }
+            if(!complete && n - i < MD_HOLD && (mid == (size_t)-1 || end == (size_t)-1)) return i;
+        }
+        md_write(r, s + i, 1);
+        r->prev = c;
+        i++;
+    }
+    return i;
+}
+
+// ---- code ----
+
+static const char *md_keywords[] = {
+    "if", "else", "for", "while", "do", "return", "break", "continue", "switch", "case",
+    "default", "struct", "typedef", "enum", "union", "static", "const", "void", "int", "char",
+    "long", "short", "unsigned", "signed", "float", "double", "bool", "sizeof", "goto", "extern",
+    "include", "define", "def", "class", "import", "from", "as", "in", "is", "not", "and", "or",
+    "None", "True", "False", "lambda", "yield", "with", "try", "except", "finally", "raise",
+    "pass", "elif", "function", "var", "let", "new", "this", "null", "true", "false", "async",
+    "await", "fn", "pub", "impl", "use", "mut", "match", "func", "package", "public", "private",
+    "then", "fi", "done", "esac", "echo", "export", "local", "select", "where", "SELECT",
+    "FROM", "WHERE", NULL
+};
+
+static int md_is_keyword(const char *s, size_t n) {
+    for(int k = 0; md_keywords[k]; k++) {
+        if(strlen(md_keywords[k]) == n && memcmp(md_keywords[k], s, n) == 0) return 1;
+    }
+    return 0;
+}
+
+static int md_hash_comments(const char *lang) {
+    const char *langs[] = {"python", "py", "sh", "bash", "shell", "zsh", "ruby", "rb", "perl",
+                           "yaml", "yml", "toml", "r", "make", "makefile", "dockerfile", "conf", NULL};
+    for(int k = 0; langs[k]; k++) {
+        if(strcasecmp(lang, langs[k]) == 0) return 1;
+    }
+    return 0;
+}
+
+static void md_code_line(struct md_renderer *r, const char *s, size_t n) {
+    md_ansi(r, MD_RESET);
+    md_ansi(r, "\x1b[2m");
+    md_puts(r, "  │ ");
+    md_ansi(r, MD_RESET);
+    if(!r->color) {
+        md_write(r, s, n);
+        return;
+    }
+    int hash = md_hash_comments(r->fence_lang);
+    size_t i = 0;
+    while(i < n) {
+        char c = s[i];
+        if((c == '/' && i + 1 < n && s[i + 1] == '/') || (c == '#' && hash) || (c == '-' && i + 1 < n && s[i + 1] == '-' && strcasecmp(r->fence_lang, "sql") == 0)) {
+            md_ansi(r, "\x1b[2;3m");
+            md_write(r, s + i, n - i);
+            md_ansi(r, MD_RESET);
+            return;
+        }
+        if(c == '"' || c == '\'') {
+            size_t j = i + 1;
+            while(j < n && s[j] != c) j += (s[j] == '\\') ? 2 : 1;
+            if(j > n) j = n;
+            else if(j < n) j++;
+            md_ansi(r, "\x1b[32m");
+            md_write(r, s + i, j - i);
+            md_ansi(r, MD_RESET);
+            i = j;
+            continue;
+        }
+        if(isdigit((unsigned char)c) && (i == 0 || !md_is_word((unsigned char)s[i - 1]))) {
+            size_t j = i;
+            while(j < n && (isalnum((unsigned char)s[j]) || s[j] == '.')) j++;
+            md_ansi(r, "\x1b[36m");
+            md_write(r, s + i, j - i);
+            md_ansi(r, MD_RESET);
+            i = j;
+            continue;
+        }
+        if(isalpha((unsigned char)c) || c == '_') {
+            size_t j = i;
+            while(j < n && (isalnum((unsigned char)s[j]) || s[j] == '_')) j++;
+            int kw = md_is_keyword(s + i, j - i);
+            if(kw) md_ansi(r, "\x1b[1;35m");
+            md_write(r, s + i, j - i);
+            if(kw) md_ansi(r, MD_RESET);
+            i = j;
+            continue;
+        }
+        md_write(r, s + i, 1);
+        i++;
+    }
+}
+
+// ---- tables ----
+
+static int md_display_width(const char *s, size_t n) {
+    int w = 0;
+    for(size_t i = 0; i < n; i++) {
+        unsigned char c = (unsigned char)s[i];
+        if((c & 0xC0) == 0x80) continue;
+        if(c == '*' || c == '`') continue;
+        w++;
+    }
+    return w;
+}
+
+static void md_trim(const char **s, size_t *n) {
+    while(*n > 0 && isspace((unsigned char)**s)) {
+        (*s)++;
+        (*n)--;
+    }
+    while(*n > 0 && isspace((unsigned char)(*s)[*n - 1])) (*n)--;
+}
+
+static void md_table_row(struct md_renderer *r, const char *s, size_t n) {
+    md_trim(&s, &n);
+    if(n > 0 && s[0] == '|') {
+        s++;
+        n--;
+    }
+    if(n > 0 && s[n - 1] == '|' && (n < 2 || s[n - 2] != '\\')) n--;
+    int separator = n > 0 && md_span(s, n, "|:- \t") >= n;
+    int col = 0;
+    size_t start = 0;
+    md_ansi(r, "\x1b[2m");
+    md_puts(r, separator ? "├" : "│");
+    md_style(r);
+    for(size_t i = 0; i <= n && col < MD_MAX_COLS; i++) {
+        if(i < n && !(s[i] == '|' && (i == 0 || s[i - 1] != '\\'))) continue;
+        const char *cell = s + start;
+        size_t len = i - start;
+        md_trim(&cell, &len);
+        int width = md_display_width(cell, len);
+        if(r->table_row == 0) {
+            r->table_width[col] = width < 3 ? 3 : width;
+        }
+        int target = col < r->table_cols || r->table_row == 0 ? r->table_width[col] : width;
+        if(separator) {
+            md_ansi(r, "\x1b[2m");
+            for(int k = 0; k < target + 2; k++) md_puts(r, "─");
+            md_puts(r, i < n ? "┼" : "┤");
+        } else {
+            md_puts(r, " ");
+            if(r->table_row == 0) r->bold = 1;
+            md_style(r);
+            md_inline(r, cell, len, 1);
+            r->bold = r->italic = r->code = r->strike = 0;
+            md_style(r);
+            for(int k = width; k < target; k++) md_puts(r, " ");
+            md_ansi(r, "\x1b[2m");
+            md_puts(r, " │");
+        }
+        md_style(r);
+        col++;
+        start = i + 1;
+    }
+    if(r->table_row == 0) r->table_cols = col;
+    r->table_row++;
+    md_puts(r, "\n");
+}
+
+// ---- blocks ----
+
+static int md_only(const char *s, size_t n, char c) {
+    int count = 0;
+    for(size_t i = 0; i < n; i++) {
+        if(s[i] == c) count++;
+        else if(s[i] != ' ' && s[i] != '\t') return 0;
+    }
+    return count;
+}
+
+// Render one complete line of a line-at-a-time block.
+static void md_line(struct md_renderer *r, const char *s, size_t n) {
+    const char *t = s;
+    size_t tn = n;
+    md_trim(&t, &tn);
+    if(r->in_fence) {
+        if(tn >= 3 && memcmp(t, "```", 3) == 0 && md_only(t, tn, '`') >= 3) {
+            r->in_fence = 0;
+            md_ansi(r, MD_RESET);
+            return;
+        }
+        md_code_line(r, s, n);
+        md_puts(r, "\n");
+        return;
+    }
+    if(r->in_math) {
+        size_t cl = strlen(r->math_close);
+        size_t close = md_find(s, n, 0, r->math_close);
+        if(close != (size_t)-1) {
+            r->in_math = 0;
+            if(close > 0) {
+                md_puts(r, "    ");
+                md_math(r, s, close);
+                md_puts(r, "\n");
+            }
+            size_t rest = close + cl;
+            if(rest < n) {
+                md_inline(r, s + rest, n - rest, 1);
+                md_puts(r, "\n");
+            }
+            return;
+        }
+        md_puts(r, "    ");
+        md_math(r, s, n);
+        md_puts(r, "\n");
+        return;
+    }
+    if(tn >= 3 && memcmp(t, "```", 3) == 0) {
+        r->in_fence = 1;
+        const char *lang = t + 3;
+        size_t ln = tn - 3;
+        md_trim(&lang, &ln);
+        if(ln >= sizeof(r->fence_lang)) ln = sizeof(r->fence_lang) - 1;
+        memcpy(r->fence_lang, lang, ln);
+        r->fence_lang[ln] = 0;
+        if(ln > 0) {
+            md_ansi(r, "\x1b[2m");
+            md_puts(r, "  ");
+            md_puts(r, r->fence_lang);
+            md_ansi(r, MD_RESET);
+            md_puts(r, "\n");
+        }
+        return;
+    }
+    if(tn >= 2 && (memcmp(t, "$$", 2) == 0 || memcmp(t, "\\[", 2) == 0)) {
+        const char *close = t[0] == '$' ? "$$" : "\\]";
+        size_t end = md_find(t, tn, 2, close);
+        if(end != (size_t)-1) {
+            md_puts(r, "    ");
+            md_math(r, t + 2, end - 2);
+            md_puts(r, "\n");
+            return;
+        }
+        r->in_math = 1;
+        strcpy(r->math_close, close);
+        if(tn > 2) {
+            md_puts(r, "    ");
+            md_math(r, t + 2, tn - 2);
+            md_puts(r, "\n");
+        }
+        return;
+    }
+    if(tn > 0 && t[0] == '|') {
+        md_table_row(r, t, tn);
+        return;
+    }
+    if(md_only(t, tn, '-') >= 3 || md_only(t, tn, '*') >= 3 || md_only(t, tn, '_') >= 3) {
+        md_ansi(r, "\x1b[2m");
+        for(int k = 0; k < 40; k++) md_puts(r, "─");
+        md_ansi(r, MD_RESET);
+        md_puts(r, "\n");
+        return;
+    }
+    // A line we held back that turned out to be ordinary text
+    md_inline(r, s, n, 1);
+    md_puts(r, "\n");
+}
+
+// Decide what the line in buf is, emitting any list/quote/heading prefix.
+// Returns 0 if more input is needed to tell.
+static int md_classify(struct md_renderer *r, int complete) {
+    const char *s = r->buf;
+    size_t n = r->len;
+    const char *nl = memchr(s, '\n', n);
+    size_t line_len = nl ? (size_t)(nl - s) : n;
+    int whole = nl != NULL || complete;
+    if(r->in_fence || r->in_math) {
+        r->kind = MD_LINE;
+        return 1;
+    }
+    size_t indent = md_span(s, line_len, " \t");
+    if(r->table_row > 0 && (indent == line_len || s[indent] != '|') && (nl || indent < line_len)) {
+        r->table_row = 0;   // a table ends at the first non-row line
+        r->table_cols = 0;
+    }
+    size_t i = 0;
+    while(i < line_len && (s[i] == ' ' || s[i] == '\t')) i++;
+    if(i == line_len) {
+        if(!whole) return 0;
+        r->kind = MD_LINE;
+        return 1;
+    }
+    char c = s[i];
+    size_t rest = line_len - i;
+    if(c == '`' || c == '$' || c == '|' || c == '\\') {
+        if(c == '|' || (rest >= 3 && memcmp(s + i, "```", 3) == 0) || (rest >= 2 && (memcmp(s + i, "$$", 2) == 0 || memcmp(s + i, "\\[", 2) == 0))) {
+            r->kind = MD_LINE;
+            return 1;
+        }
+        char run[2] = {c, 0};
+        if(rest < 3 && !whole && md_span(s + i, rest, run) == rest) return 0;
+        r->kind = MD_TEXT;
+        return 1;
+    }
+    if(c == '-' || c == '*' || c == '_' || c == '+') {
+        // could still be a rule ("---") until something else shows up
+        if(md_only(s + i, rest, c)) {
+            if(!whole) return 0;
+            if(md_only(s + i, rest, c) >= 3) {
+                r->kind = MD_LINE;
+                return 1;
+            }
+        }
+        if(c != '_' && rest >= 2 && s[i + 1] == ' ') {
+            md_write(r, s, i);
+            md_ansi(r, "\x1b[33m");
+            md_puts(r, "•");
+            md_ansi(r, MD_RESET);
+            md_puts(r, " ");
+            r->prev = ' ';
+            memmove(r->buf, r->buf + i + 2, r->len - i - 2);
+            r->len -= i + 2;
+        }
+        r->kind = MD_TEXT;
+        return 1;
+    }
+    if(c == '#') {
+        size_t h = 0;
+        while(h < rest && s[i + h] == '#') h++;
+        if(h == rest && !whole) return 0;
+        if(h <= 6 && h < rest && s[i + h] == ' ') {
+            r->heading = (int)h;
+            md_style(r);
+            memmove(r->buf, r->buf + i + h + 1, r->len - i - h - 1);
+            r->len -= i + h + 1;
+            r->prev = ' ';
+        }
+        r->kind = MD_TEXT;
+        return 1;
+    }
+    if(c == '>') {
+        if(rest == 1 && !whole) return 0;
+        r->quote = 1;
+        md_write(r, s, i);
+        md_ansi(r, "\x1b[2m");
+        md_puts(r, "│ ");
+        size_t skip = i + 1 + (rest > 1 && s[i + 1] == ' ');
+        memmove(r->buf, r->buf + skip, r->len - skip);
+        r->len -= skip;
+        md_style(r);
+        r->prev = ' ';
+        r->kind = MD_TEXT;
+        return 1;
+    }
+    if(isdigit((unsigned char)c)) {
+        size_t d = 0;
+        while(d < rest && isdigit((unsigned char)s[i + d])) d++;
+        if(d == rest && !whole) return 0;
+        if(d < rest && (s[i + d] == '.' || s[i + d] == ')')) {
+            if(d + 1 == rest && !whole) return 0;
+            if(d + 1 < rest && s[i + d + 1] == ' ') {
+                md_write(r, s, i);
+                md_ansi(r, "\x1b[33m");
+                md_write(r, s + i, d + 1);
+                md_ansi(r, MD_RESET);
+                md_puts(r, " ");
+                r->prev = ' ';
+                memmove(r->buf, r->buf + i + d + 2, r->len - i - d - 2);
+                r->len -= i + d + 2;
+            }
+        }
+    }
+    r->kind = MD_TEXT;
+    return 1;
+}
+
+static void md_end_line(struct md_renderer *r) {
+    r->bold = r->italic = r->code = r->strike = r->link = 0;
+    r->heading = r->quote = 0;
+    r->prev = 0;
+    r->kind = MD_UNKNOWN;
+    md_ansi(r, MD_RESET);
+}
+
+static void md_pump(struct md_renderer *r, int complete) {
+    while(r->len > 0) {
+        if(r->kind == MD_UNKNOWN && !md_classify(r, complete)) return;
+        char *nl = memchr(r->buf, '\n', r->len);
+        size_t line_len = nl ? (size_t)(nl - r->buf) : r->len;
+        int whole = nl != NULL || complete;
+        size_t used;
+        if(r->kind == MD_LINE) {
+            if(!whole) return;
+            md_line(r, r->buf, line_len);
+            used = line_len;
+        } else {
+            used = md_inline(r, r->buf, line_len, whole);
+            if(used < line_len || !whole) {
+                memmove(r->buf, r->buf + used, r->len - used);
+                r->len -= used;
+                return;
+            }
+            md_puts(r, "\n");
+        }
+        md_end_line(r);
+        size_t consumed = used + (nl ? 1 : 0);
+        memmove(r->buf, r->buf + consumed, r->len - consumed);
+        r->len -= consumed;
+    }
+}
+
+static void md_feed(struct md_renderer *r, const char *text, size_t len) {
+    while(len > 0) {
+        size_t room = MD_LINE_MAX - r->len;
+        size_t n = len < room ? len : room;
+        memcpy(r->buf + r->len, text, n);
+        r->len += n;
+        text += n;
+        len -= n;
+        md_pump(r, 0);
+        if(r->len == MD_LINE_MAX) {
+            // a line longer than the buffer: render what we hold as is
+            if(r->kind == MD_TEXT) {
+                md_inline(r, r->buf, r->len, 1);
+                r->len = 0;
+            } else {
+                md_pump(r, 1);
+            }
+        }
+    }
+    fflush(r->out);
+}
+
+// End of the reply: render whatever is still held back.
+static void md_finish(struct md_renderer *r) {
+    md_pump(r, 1);
+    if(r->kind != MD_UNKNOWN) md_puts(r, "\n");
+    md_end_line(r);
+    r->in_fence = r->in_math = 0;
+    r->table_row = r->table_cols = 0;
+    fflush(r->out);
+}
+
+#endif
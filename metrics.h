@@ -0,0 +1,267 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <curl/curl.h>
+#include "tokenizer.h"
+
+// Where the time of a request goes. Each request fills a metrics_sample:
+// the network phases come from curl_easy_getinfo, building the body,
+// parsing the reply and printing it are timed by the caller with
+// metrics_now_us. Finished samples go into per-model histograms shown by
+// /stats and, if LLM_METRICS names a file, are appended to it as one JSON
+// line each.
+//
+// The histograms are HDR-style: values in microseconds, 8 linear
+// sub-buckets per power of two, so any percentile is within about 6% of
+// the true value while a histogram is a fixed 2 kB.
+
+#define METRICS_MAX_MODELS 16
+#define METRICS_SUB_BITS 4
+#define METRICS_SUB (1 << METRICS_SUB_BITS)
+#define METRICS_BUCKETS ((64 - METRICS_SUB_BITS) * (METRICS_SUB / 2) + METRICS_SUB)
+
+enum {
+    METRIC_DNS, METRIC_CONNECT, METRIC_TLS, METRIC_TTFB, METRIC_TRANSFER, METRIC_TOTAL,
+    METRIC_BUILD, METRIC_PARSE, METRIC_RENDER, METRIC_TOKENS_PER_S, METRIC_COUNT
+};
+
+static const char *metric_names[METRIC_COUNT] = {
+    "dns", "connect", "tls", "first byte", "transfer", "total", "json build", "parse", "render", "tokens/s"
+};
+
+struct metrics_hist {
+    uint32_t counts[METRICS_BUCKETS];
+    uint64_t n;
+    uint64_t max;
+};
+
+struct metrics_model {
+    char model[128];
+    long requests, failures;
+    long prompt_tokens, completion_tokens;
+    struct metrics_hist hist[METRIC_COUNT];
+};
+
+// One request. Phase times are filled in by metrics_finish.
+struct metrics_sample {
+    char model[128];
+    int64_t build_us, parse_us, render_us;
+    long prompt_tokens, completion_tokens;   // -1: not reported by the API
+    const char *text;                        // reply, to estimate tokens from
+    int streamed;                            // the reply arrived as it was generated
+};
+
+static struct metrics_model *metrics_models = NULL;
+static int metrics_num_models = 0;
+static FILE *metrics_file = NULL;
+static int metrics_file_state = 0;           // 0 not opened yet
+
+static int64_t metrics_now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static int metrics_bucket(uint64_t v) {
+    if(v < METRICS_SUB) return (int)v;
+    int msb = 63 - __builtin_clzll(v);
+    int shift = msb - (METRICS_SUB_BITS - 1);
+    return (shift + 1) * (METRICS_SUB / 2) + (int)(v >> shift) - METRICS_SUB / 2;
+}
+
+// Middle of the range a bucket covers
+static uint64_t metrics_bucket_value(int i) {
+    if(i < METRICS_SUB) return (uint64_t)i;
+    int shift = i / (METRICS_SUB / 2) - 1;
+    uint64_t low = (uint64_t)(i % (METRICS_SUB / 2) + METRICS_SUB / 2) << shift;
+    return low + ((uint64_t)1 << shift) / 2;
+}
+
+static void metrics_hist_add(struct metrics_hist *h, int64_t v) {
+    if(v < 0) return;
+    h->counts[metrics_bucket((uint64_t)v)]++;
+    h->n++;
+    if((uint64_t)v > h->max) h->max = (uint64_t)v;
+}
+
+static uint64_t metrics_hist_percentile(const struct metrics_hist *h, double p) {
+    if(h->n == 0) return 0;
+    // nearest rank: the smallest value with at least p of the samples at or below it
+    uint64_t rank = (uint64_t)(p * h->n + 0.999999), seen = 0;
+    if(rank == 0) rank = 1;
+    for(int i = 0; i < METRICS_BUCKETS; i++) {
+        seen += h->counts[i];
+        if(seen >= rank) {
+            uint64_t v = metrics_bucket_value(i);
+            return v > h->max ? h->max : v;
+        }
+    }
+    return h->max;
+}
+
+static struct metrics_model *metrics_model_for(const char *model) {
+    for(int i = 0; i < metrics_num_models; i++) {
+        if(strcmp(metrics_models[i].model, model) == 0) return &metrics_models[i];
+    }
+    if(!metrics_models) {
+        metrics_models = calloc(METRICS_MAX_MODELS, sizeof(*metrics_models));
+        if(!metrics_models) return NULL;
+    }
+    if(metrics_num_models == METRICS_MAX_MODELS) return NULL;
+    struct metrics_model *m = &metrics_models[metrics_num_models++];
+    snprintf(m->model, sizeof(m->model), "%s", model);
+    return m;
+}
+
+static void metrics_begin(struct metrics_sample *s, const char *model) {
+    memset(s, 0, sizeof(*s));
+    // longer ids are cut, the same way every time, so they still group
+    size_t len = strlen(model);
+    if(len >= sizeof(s->model)) len = sizeof(s->model) - 1;
+    memcpy(s->model, model, len);
+    s->prompt_tokens = s->completion_tokens = -1;
+}
+
+static FILE *metrics_output(void) {
+    if(metrics_file_state == 0) {
+        metrics_file_state = -1;
+        const char *path = getenv("LLM_METRICS");
+        if(path && path[0]) {
+            metrics_file = fopen(path, "a");
+            if(metrics_file) metrics_file_state = 1;
+            else perror(path);
+        }
+    }
+    return metrics_file;
+}
+
+static void metrics_write_string(FILE *f, const char *s) {
+    fputc('"', f);
+    for(; *s; s++) {
+        if(*s == '"' || *s == '\\') fputc('\\', f);
+        if((unsigned char)*s >= 32) fputc(*s, f);
+    }
+    fputc('"', f);
+}
+
+// The transfer on curl is over: take its timings, file the sample and
+// write its metrics line. ok: a reply was received.
+static void metrics_finish(struct metrics_sample *s, CURL *curl, int ok) {
+    curl_off_t namelookup = 0, connect = 0, appconnect = 0, pretransfer = 0, starttransfer = 0, total = 0;
+    curl_off_t up = 0, down = 0;
+    long status = 0, connects = 0;
+    if(curl) {
+        curl_easy_getinfo(curl, CURLINFO_NAMELOOKUP_TIME_T, &namelookup);
+        curl_easy_getinfo(curl, CURLINFO_CONNECT_TIME_T, &connect);
+        curl_easy_getinfo(curl, CURLINFO_APPCONNECT_TIME_T, &appconnect);
+        curl_easy_getinfo(curl, CURLINFO_PRETRANSFER_TIME_T, &pretransfer);
+        curl_easy_getinfo(curl, CURLINFO_STARTTRANSFER_TIME_T, &starttransfer);
+        curl_easy_getinfo(curl, CURLINFO_TOTAL_TIME_T, &total);
+        curl_easy_getinfo(curl, CURLINFO_SIZE_UPLOAD_T, &up);
+        curl_easy_getinfo(curl, CURLINFO_SIZE_DOWNLOAD_T, &down);
+        curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &status);
+        curl_easy_getinfo(curl, CURLINFO_NUM_CONNECTS, &connects);
+    }
+    // the curl times are cumulative from the start; a reused connection has
+    // no connect or TLS phase
+    int64_t phase[METRIC_COUNT];
+    phase[METRIC_DNS] = namelookup;
+    phase[METRIC_CONNECT] = connect > namelookup ? connect - namelookup : 0;
+    phase[METRIC_TLS] = appconnect > connect ? appconnect - connect : 0;
+    phase[METRIC_TTFB] = starttransfer > pretransfer ? starttransfer - pretransfer : 0;
+    phase[METRIC_TRANSFER] = total > starttransfer ? total - starttransfer : 0;
+    phase[METRIC_TOTAL] = total;
+    phase[METRIC_BUILD] = s->build_us;
+    phase[METRIC_PARSE] = s->parse_us;
+    phase[METRIC_RENDER] = s->render_us;
+    int estimated = 0;
+    if(ok && s->completion_tokens < 0 && s->text) {
+        s->completion_tokens = count_tokens(s->text);
+        estimated = 1;
+    }
+    // generation speed: a streamed answer is generated while it downloads,
+    // a plain one before its first byte
+    double tokens_per_s = 0;
+    int64_t generating = phase[METRIC_TRANSFER] + (s->streamed ? 0 : phase[METRIC_TTFB]);
+    if(ok && s->completion_tokens > 0 && generating > 0) {
+        tokens_per_s = s->completion_tokens / (generating / 1e6);
+    }
+    phase[METRIC_TOKENS_PER_S] = (int64_t)(tokens_per_s * 1000);   // stored in milli-tokens/s
+
+    struct metrics_model *m = metrics_model_for(s->model);
+    if(m) {
+        m->requests++;
+        if(!ok) m->failures++;
+        if(s->prompt_tokens > 0) m->prompt_tokens += s->prompt_tokens;
+        if(ok && s->completion_tokens > 0) m->completion_tokens += s->completion_tokens;
+        for(int i = 0; i < METRIC_COUNT; i++) {
+            if(i == METRIC_TOKENS_PER_S && tokens_per_s <= 0) continue;
+            if(!ok && i >= METRIC_TRANSFER) continue;
+            metrics_hist_add(&m->hist[i], phase[i]);
+        }
+    }
+
+    FILE *f = metrics_output();
+    if(!f) return;
+    fprintf(f, "{\"time\":%ld,\"model\":", (long)time(NULL));
+    metrics_write_string(f, s->model);
+    fprintf(f, ",\"ok\":%s,\"status\":%ld,\"new_connections\":%ld", ok ? "true" : "false", status, connects);
+    fprintf(f, ",\"dns_ms\":%.3f,\"connect_ms\":%.3f,\"tls_ms\":%.3f,\"ttfb_ms\":%.3f,\"transfer_ms\":%.3f,\"total_ms\":%.3f",
+            phase[METRIC_DNS] / 1e3, phase[METRIC_CONNECT] / 1e3, phase[METRIC_TLS] / 1e3,
+            phase[METRIC_TTFB] / 1e3, phase[METRIC_TRANSFER] / 1e3, phase[METRIC_TOTAL] / 1e3);
+    fprintf(f, ",\"build_ms\":%.3f,\"parse_ms\":%.3f,\"render_ms\":%.3f",
+            phase[METRIC_BUILD] / 1e3, phase[METRIC_PARSE] / 1e3, phase[METRIC_RENDER] / 1e3);
+    fprintf(f, ",\"bytes_up\":%ld,\"bytes_down\":%ld", (long)up, (long)down);
+    if(s->prompt_tokens >= 0) fprintf(f, ",\"prompt_tokens\":%ld", s->prompt_tokens);
+    if(s->completion_tokens >= 0) fprintf(f, ",\"completion_tokens\":%ld", s->completion_tokens);
+    if(estimated) fprintf(f, ",\"tokens_estimated\":true");
+    if(tokens_per_s > 0) fprintf(f, ",\"tokens_per_s\":%.1f", tokens_per_s);
+    fprintf(f, "}\n");
+    fflush(f);
+}
+
+static void metrics_print_value(int metric, uint64_t v) {
+    if(metric == METRIC_TOKENS_PER_S) printf(" %9.1f", v / 1000.0);
+    else printf(" %7.1fms", v / 1000.0);
+}
+
+static void metrics_print(void) {
+    if(metrics_num_models == 0) {
+        printf("No requests yet\n");
+        return;
+    }
+    for(int i = 0; i < metrics_num_models; i++) {
+        struct metrics_model *m = &metrics_models[i];
+        printf("%s: %ld requests, %ld failed", m->model, m->requests, m->failures);
+        if(m->prompt_tokens > 0) printf(", %ld prompt tokens", m->prompt_tokens);
+        printf(", %ld completion tokens\n", m->completion_tokens);
+        printf("  %-12s %9s %9s %9s %9s\n", "", "p50", "p90", "p99", "max");
+        for(int k = 0; k < METRIC_COUNT; k++) {
+            struct metrics_hist *h = &m->hist[k];
+            if(h->n == 0) continue;
+            printf("  %-12s", metric_names[k]);
+            metrics_print_value(k, metrics_hist_percentile(h, 0.5));
+            metrics_print_value(k, metrics_hist_percentile(h, 0.9));
+            metrics_print_value(k, metrics_hist_percentile(h, 0.99));
+            metrics_print_value(k, h->max);
+            printf("\n");
+        }
+    }
+    if(metrics_file) printf("Metrics are also written to %s\n", getenv("LLM_METRICS"));
+}
+
+static void metrics_close(void) {
+    if(metrics_file) fclose(metrics_file);
+    metrics_file = NULL;
+    metrics_file_state = 0;
+    free(metrics_models);
+    metrics_models = NULL;
+    metrics_num_models = 0;
+}
+
+#endif
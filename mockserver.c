@@ -0,0 +1,589 @@
+// Local stand-in for the provider APIs, for measuring the clients offline:
+//
+//   gcc mockserver.c -o mockserver -lz
+//   ./mockserver --port 8080 --latency 200 --chunk-bytes 16 --chunk-delay 5
+//   LLM_OPENROUTER_URL=http://127.0.0.1:8080/api/v1 ./openrouter
+//   LLM_OPENAI_URL=http://127.0.0.1:8080/v1 LLM_ANTHROPIC_URL=http://127.0.0.1:8080/v1 ./tui
+//
+// It speaks enough of each wire format for the clients: GET .../models,
+// POST .../chat/completions (OpenRouter and OpenAI, plain JSON or SSE with
+// "stream":true) and POST .../messages (Anthropic, plain or SSE). Every
+// answer is reply-bytes of filler text, sent after latency ms; a stream is
+// cut into chunk-bytes deltas chunk-delay ms apart and ends with a usage
+// chunk. Token counts are bytes / 4. A gzipped request body is inflated,
+// or refused with 415 under --refuse-gzip. --rate-limit N allows N chat
+// requests per --rate-window seconds (default 60) and answers the rest with
+// 429 and Retry-After; every chat answer carries x-ratelimit-* headers like
+// OpenAI's.
+//
+// One thread, poll(), HTTP/1.1 with keep-alive; streams use chunked
+// transfer encoding so connections are reused like the real thing.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <strings.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <zlib.h>
+
+#define MOCK_MAX_CONNS 256
+#define MOCK_MAX_REQUEST (64 * 1024 * 1024)
+
+struct mock_options {
+    int port;
+    long latency_ms;
+    long jitter_ms;
+    long reply_bytes;
+    long chunk_bytes;
+    long chunk_delay_ms;
+    int models;
+    double error_rate;
+    long rate_limit;        // chat requests per rate_window, 0: unlimited
+    double rate_window;     // seconds
+    int refuse_gzip;
+    int quiet;
+};
+
+static struct mock_options opt = {
+    .port = 8080, .latency_ms = 0, .reply_bytes = 400, .chunk_bytes = 16, .chunk_delay_ms = 0, .models = 50,
+    .rate_window = 60,
+};
+
+struct buf {
+    char *data;
+    size_t len, cap;
+};
+
+enum { CONN_READ, CONN_WAIT, CONN_STREAM };
+enum { API_OPENAI, API_ANTHROPIC };
+
+struct conn {
+    int fd;
+    int state;
+    struct buf in, out;
+    size_t out_pos;
+    int64_t wake_at;        // ms, for CONN_WAIT and CONN_STREAM
+    int close_after;
+    int head_only;        // HEAD: the headers of the answer, no body
+    int continued;          // 100 Continue sent for the request being read
+    // the request being answered
+    int api, stream;
+    char model[128];
+    long prompt_tokens;
+    long sent;              // reply bytes streamed so far
+    int phase;              // stream: 0 start, 1 deltas, 2 done
+    char limit_headers[256];    // x-ratelimit-* for the answer, under --rate-limit
+};
+
+static struct conn conns[MOCK_MAX_CONNS];
+static int64_t window_start = 0;     // --rate-limit: the current fixed window
+static long window_used = 0;
+
+static int64_t now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static int buf_reserve(struct buf *b, size_t extra) {
+    if(b->len + extra + 1 <= b->cap) return 1;
+    size_t cap = b->cap ? b->cap : 4096;
+    while(cap < b->len + extra + 1) cap *= 2;
+    char *data = realloc(b->data, cap);
+    if(!data) return 0;
+    b->data = data;
+    b->cap = cap;
+    return 1;
+}
+
+static void buf_append(struct buf *b, const char *s, size_t len) {
+    if(!buf_reserve(b, len)) return;
+    memcpy(b->data + b->len, s, len);
+    b->len += len;
+    b->data[b->len] = 0;
+}
+
+static void buf_printf(struct buf *b, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+static void buf_printf(struct buf *b, const char *fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    int n = vsnprintf(NULL, 0, fmt, ap);
+    va_end(ap);
+    if(n < 0 || !buf_reserve(b, (size_t)n)) return;
+    va_start(ap, fmt);
+    vsnprintf(b->data + b->len, (size_t)n + 1, fmt, ap);
+    va_end(ap);
+    b->len += (size_t)n;
+}
+
+// Filler text: bytes [from, from + len) of an endless run of words, so
+// deltas joined together give the same text as a plain answer.
+static void filler(struct buf *b, long from, long len) {
+    static const char words[] = "lorem ipsum dolor sit amet consectetur adipiscing elit sed do eiusmod tempor ";
+    for(long i = from; i < from + len; i++) {
+        char c = words[i % (long)(sizeof(words) - 1)];
+        buf_append(b, &c, 1);
+    }
+}
+
+// Chunked transfer encoding for streams
+static void out_chunk(struct conn *c, const char *data, size_t len) {
+    buf_printf(&c->out, "%zx\r\n", len);
+    buf_append(&c->out, data, len);
+    buf_append(&c->out, "\r\n", 2);
+}
+
+static void respond(struct conn *c, int status, const char *reason, const char *type, const char *body, size_t len) {
+    buf_printf(&c->out, "HTTP/1.1 %d %s\r\nContent-Type: %s\r\nContent-Length: %zu\r\n%s%s\r\n", status, reason, type,
+               len, c->limit_headers, c->close_after ? "Connection: close\r\n" : "");
+    if(!c->head_only) buf_append(&c->out, body, len);
+}
+
+static void respond_error(struct conn *c, int status, const char *reason, const char *message) {
+    struct buf body = {0};
+    if(c->api == API_ANTHROPIC) {
+        buf_printf(&body, "{\"type\":\"error\",\"error\":{\"type\":\"mock_error\",\"message\":\"%s\"}}", message);
+    } else {
+        buf_printf(&body, "{\"error\":{\"message\":\"%s\",\"code\":%d}}", message, status);
+    }
+    respond(c, status, reason, "application/json", body.data, body.len);
+    free(body.data);
+}
+
+static void respond_models(struct conn *c, const char *path) {
+    struct buf body = {0};
+    int openrouter = strstr(path, "/api/") != NULL;
+    buf_printf(&body, "{\"data\":[");
+    for(int i = 0; i < opt.models; i++) {
+        if(i) buf_append(&body, ",", 1);
+        if(openrouter) {
+            static const char *kinds[] = { "openai/gpt-mock-%d", "anthropic/claude-mock-%d", "mock/model-%d:free",
+                                           "mock/paid-%d" };
+            char id[64];
+            snprintf(id, sizeof(id), kinds[i % 4], i);
+            // prices per token as OpenRouter sends them, the :free ones at zero
+            double price = i % 4 == 2 ? 0 : (i % 7 + 1) * 1e-7;
+            buf_printf(&body, "{\"id\":\"%s\",\"name\":\"Mock %d\",\"context_length\":%d,"
+                              "\"pricing\":{\"prompt\":\"%.7f\",\"completion\":\"%.7f\"},"
+                              "\"architecture\":{\"modality\":\"%s\"}}",
+                       id, i, 8192 << (i % 6), price, price * 4, i % 3 ? "text->text" : "text+image->text");
+        } else {
+            buf_printf(&body, "{\"id\":\"%s-mock-%d\",\"object\":\"model\",\"created\":1700000000}",
+                       i % 2 ? "claude" : "gpt", i);
+        }
+    }
+    buf_printf(&body, "],\"has_more\":false}");
+    respond(c, 200, "OK", "application/json", body.data, body.len);
+    free(body.data);
+}
+
+static void respond_complete(struct conn *c) {
+    struct buf body = {0};
+    long completion = opt.reply_bytes / 4;
+    if(c->api == API_ANTHROPIC) {
+        buf_printf(&body, "{\"id\":\"msg_mock\",\"type\":\"message\",\"role\":\"assistant\",\"model\":\"%s\","
+                          "\"content\":[{\"type\":\"text\",\"text\":\"", c->model);
+        filler(&body, 0, opt.reply_bytes);
+        buf_printf(&body, "\"}],\"stop_reason\":\"end_turn\",\"usage\":{\"input_tokens\":%ld,\"output_tokens\":%ld,"
+                          "\"cache_creation_input_tokens\":0,\"cache_read_input_tokens\":0}}", c->prompt_tokens, completion);
+    } else {
+        buf_printf(&body, "{\"id\":\"chatcmpl-mock\",\"object\":\"chat.completion\",\"model\":\"%s\",\"choices\":[{"
+                          "\"index\":0,\"message\":{\"role\":\"assistant\",\"content\":\"", c->model);
+        filler(&body, 0, opt.reply_bytes);
+        buf_printf(&body, "\"},\"finish_reason\":\"stop\"}],\"usage\":{\"prompt_tokens\":%ld,\"completion_tokens\":%ld,"
+                          "\"total_tokens\":%ld}}", c->prompt_tokens, completion, c->prompt_tokens + completion);
+    }
+    respond(c, 200, "OK", "application/json", body.data, body.len);
+    free(body.data);
+}
+
+// One step of a stream: the headers and opening events, then one delta per
+// call, then the closing events.
+static void stream_step(struct conn *c) {
+    struct buf ev = {0};
+    long completion = opt.reply_bytes / 4;
+    if(c->phase == 0) {
+        buf_printf(&c->out, "HTTP/1.1 200 OK\r\nContent-Type: text/event-stream\r\nCache-Control: no-cache\r\n"
+                            "Transfer-Encoding: chunked\r\n%s%s\r\n", c->limit_headers,
+                   c->close_after ? "Connection: close\r\n" : "");
+        if(c->api == API_ANTHROPIC) {
+            buf_printf(&ev, "event: message_start\ndata: {\"type\":\"message_start\",\"message\":{\"id\":\"msg_mock\","
+                            "\"type\":\"message\",\"role\":\"assistant\",\"model\":\"%s\",\"content\":[],\"usage\":"
+                            "{\"input_tokens\":%ld,\"output_tokens\":1}}}\n\n", c->model, c->prompt_tokens);
+            buf_printf(&ev, "event: content_block_start\ndata: {\"type\":\"content_block_start\",\"index\":0,"
+                            "\"content_block\":{\"type\":\"text\",\"text\":\"\"}}\n\n");
+        } else {
+            // OpenRouter sends comments while the model warms up
+            buf_printf(&ev, ": MOCK PROCESSING\n\n");
+        }
+        c->phase = 1;
+    } else if(c->phase == 1 && c->sent < opt.reply_bytes) {
+        long n = opt.reply_bytes - c->sent < opt.chunk_bytes ? opt.reply_bytes - c->sent : opt.chunk_bytes;
+        if(c->api == API_ANTHROPIC) {
+            buf_printf(&ev, "event: content_block_delta\ndata: {\"type\":\"content_block_delta\",\"index\":0,"
+                            "\"delta\":{\"type\":\"text_delta\",\"text\":\"");
+            filler(&ev, c->sent, n);
+            buf_printf(&ev, "\"}}\n\n");
+        } else {
+            buf_printf(&ev, "data: {\"id\":\"chatcmpl-mock\",\"object\":\"chat.completion.chunk\",\"model\":\"%s\","
+                            "\"choices\":[{\"index\":0,\"delta\":{\"content\":\"", c->model);
+            filler(&ev, c->sent, n);
+            buf_printf(&ev, "\"},\"finish_reason\":null}]}\n\n");
+        }
+        c->sent += n;
+    } else {
+        if(c->api == API_ANTHROPIC) {
+            buf_printf(&ev, "event: content_block_stop\ndata: {\"type\":\"content_block_stop\",\"index\":0}\n\n");
+            buf_printf(&ev, "event: message_delta\ndata: {\"type\":\"message_delta\",\"delta\":{\"stop_reason\":"
+                            "\"end_turn\"},\"usage\":{\"output_tokens\":%ld}}\n\n", completion);
+            buf_printf(&ev, "event: message_stop\ndata: {\"type\":\"message_stop\"}\n\n");
+        } else {
+            buf_printf(&ev, "data: {\"id\":\"chatcmpl-mock\",\"object\":\"chat.completion.chunk\",\"model\":\"%s\","
+                            "\"choices\":[{\"index\":0,\"delta\":{},\"finish_reason\":\"stop\"}],\"usage\":"
+                            "{\"prompt_tokens\":%ld,\"completion_tokens\":%ld,\"total_tokens\":%ld}}\n\ndata: [DONE]\n\n",
+                        c->model, c->prompt_tokens, completion, c->prompt_tokens + completion);
+        }
+        c->phase = 2;
+    }
+    if(ev.len) out_chunk(c, ev.data, ev.len);
+    if(c->phase == 2) buf_append(&c->out, "0\r\n\r\n", 5);
+    free(ev.data);
+}
+
+static const char *header_value(const char *head, size_t head_len, const char *name, size_t *len) {
+    size_t name_len = strlen(name);
+    const char *p = memchr(head, '\n', head_len);
+    while(p && (size_t)(p - head) < head_len) {
+        p++;
+        if((size_t)(head + head_len - p) > name_len && strncasecmp(p, name, name_len) == 0 && p[name_len] == ':') {
+            const char *v = p + name_len + 1;
+            while(*v == ' ') v++;
+            *len = strcspn(v, "\r\n");
+            return v;
+        }
+        p = memchr(p, '\n', head_len - (size_t)(p - head));
+    }
+    return NULL;
+}
+
+static int gunzip(const char *data, size_t len, struct buf *out) {
+    z_stream zs;
+    memset(&zs, 0, sizeof(zs));
+    if(inflateInit2(&zs, 15 + 16) != Z_OK) return 0;
+    zs.next_in = (Bytef *)data;
+    zs.avail_in = (uInt)len;
+    int ret;
+    do {
+        if(!buf_reserve(out, 65536)) break;
+        zs.next_out = (Bytef *)out->data + out->len;
+        zs.avail_out = 65536;
+        ret = inflate(&zs, Z_NO_FLUSH);
+        out->len += 65536 - zs.avail_out;
+        out->data[out->len] = 0;
+    } while(ret == Z_OK);
+    inflateEnd(&zs);
+    return ret == Z_STREAM_END;
+}
+
+// Pull the model name out of the request; only the characters a model id
+// has, so it can be echoed into JSON as it is.
+static void request_model(const char *body, char *model, size_t size) {
+    snprintf(model, size, "mock");
+    const char *p = strstr(body, "\"model\":\"");
+    if(!p) return;
+    p += 9;
+    size_t n = 0;
+    while(n + 1 < size && p[n] && p[n] != '"' && p[n] != '\\') n++;
+    memcpy(model, p, n);
+    model[n] = 0;
+}
+
+// A whole request is in c->in: answer it, or schedule the answer.
+// Returns the bytes it took up.
+// --rate-limit: count the request against the window. Returns 0 if it is
+// over the limit.
+static int rate_take(struct conn *c) {
+    if(opt.rate_limit <= 0) return 1;
+    int64_t now = now_ms(), window = (int64_t)(opt.rate_window * 1000);
+    if(now - window_start >= window) {
+        window_start = now;
+        window_used = 0;
+    }
+    int ok = window_used < opt.rate_limit;
+    if(ok) window_used++;
+    double reset = (window_start + window - now) / 1000.0;
+    int n = snprintf(c->limit_headers, sizeof(c->limit_headers),
+                     "x-ratelimit-limit-requests: %ld\r\nx-ratelimit-remaining-requests: %ld\r\n"
+                     "x-ratelimit-reset-requests: %.3fs\r\n", opt.rate_limit, opt.rate_limit - window_used, reset);
+    if(!ok) snprintf(c->limit_headers + n, sizeof(c->limit_headers) - n, "Retry-After: %ld\r\n", (long)reset + 1);
+    return ok;
+}
+
+static size_t handle_request(struct conn *c, size_t head_len, size_t body_len) {
+    const char *head = c->in.data;
+    char method[8] = "", path[256] = "";
+    sscanf(head, "%7s %255s", method, path);
+    size_t len;
+    const char *conn_hdr = header_value(head, head_len, "Connection", &len);
+    c->close_after = conn_hdr && len >= 5 && strncasecmp(conn_hdr, "close", 5) == 0;
+    c->api = strstr(path, "/messages") ? API_ANTHROPIC : API_OPENAI;
+    c->head_only = strcmp(method, "HEAD") == 0;
+    c->limit_headers[0] = 0;
+    if(!opt.quiet) fprintf(stderr, "%s %s (%zu bytes)\n", method, path, body_len);
+
+    if(strcmp(method, "GET") == 0 && strstr(path, "/models")) {
+        respond_models(c, path);
+        return head_len + body_len;
+    }
+    if(strcmp(method, "POST") != 0 || (!strstr(path, "/chat/completions") && c->api != API_ANTHROPIC)) {
+        respond_error(c, 404, "Not Found", "no such endpoint");
+        return head_len + body_len;
+    }
+    struct buf plain = {0};
+    const char *body = head + head_len;
+    const char *encoding = header_value(head, head_len, "Content-Encoding", &len);
+    if(encoding && len >= 4 && strncasecmp(encoding, "gzip", 4) == 0) {
+        if(opt.refuse_gzip) {
+            respond_error(c, 415, "Unsupported Media Type", "compressed request bodies are not supported");
+            return head_len + body_len;
+        }
+        if(!gunzip(body, body_len, &plain)) {
+            free(plain.data);
+            respond_error(c, 400, "Bad Request", "corrupt gzip body");
+            return head_len + body_len;
+        }
+    } else {
+        buf_append(&plain, body, body_len);
+    }
+    const char *json = plain.data ? plain.data : "";
+    request_model(json, c->model, sizeof(c->model));
+    c->stream = strstr(json, "\"stream\":true") != NULL;
+    c->prompt_tokens = (long)(plain.len / 4);
+    free(plain.data);
+    if(!rate_take(c)) {
+        respond_error(c, 429, "Too Many Requests", "rate limit exceeded");
+        return head_len + body_len;
+    }
+    if(opt.error_rate > 0 && rand() < opt.error_rate * RAND_MAX) {
+        if(c->api == API_ANTHROPIC) respond_error(c, 529, "Overloaded", "Overloaded");
+        else respond_error(c, 503, "Service Unavailable", "upstream is overloaded");
+        return head_len + body_len;
+    }
+    long delay = opt.latency_ms;
+    if(opt.jitter_ms > 0) delay += rand() % (opt.jitter_ms + 1);
+    c->state = CONN_WAIT;
+    c->wake_at = now_ms() + delay;
+    c->sent = 0;
+    c->phase = 0;
+    return head_len + body_len;
+}
+
+// Parse as many complete requests as have arrived, until one has to wait.
+static int conn_process(struct conn *c) {
+    while(c->state == CONN_READ && c->in.len > 0) {
+        char *end = c->in.data ? strstr(c->in.data, "\r\n\r\n") : NULL;
+        if(!end) return c->in.len < 65536;
+        size_t head_len = (size_t)(end - c->in.data) + 4, len;
+        const char *cl = header_value(c->in.data, head_len, "Content-Length", &len);
+        size_t body_len = cl ? strtoul(cl, NULL, 10) : 0;
+        if(body_len > MOCK_MAX_REQUEST) return 0;
+        if(c->in.len < head_len + body_len) {
+            const char *expect = header_value(c->in.data, head_len, "Expect", &len);
+            if(!c->continued && expect && len >= 12 && strncasecmp(expect, "100-continue", 12) == 0) {
+                buf_printf(&c->out, "HTTP/1.1 100 Continue\r\n\r\n");
+                c->continued = 1;
+            }
+            return 1;
+        }
+        c->continued = 0;
+        // NUL-terminate the body for the string searches
+        char saved = c->in.data[head_len + body_len];
+        c->in.data[head_len + body_len] = 0;
+        size_t used = handle_request(c, head_len, body_len);
+        c->in.data[head_len + body_len] = saved;
+        memmove(c->in.data, c->in.data + used, c->in.len - used);
+        c->in.len -= used;
+        c->in.data[c->in.len] = 0;
+    }
+    return 1;
+}
+
+static void conn_close(struct conn *c) {
+    close(c->fd);
+    free(c->in.data);
+    free(c->out.data);
+    memset(c, 0, sizeof(*c));
+    c->fd = -1;
+}
+
+// Timers: a delayed answer is due, or the next delta of a stream.
+static void conn_tick(struct conn *c, int64_t now) {
+    if(c->state == CONN_READ || now < c->wake_at) return;
+    if(c->state == CONN_WAIT && !c->stream) {
+        respond_complete(c);
+        c->state = CONN_READ;
+        return;
+    }
+    c->state = CONN_STREAM;
+    // without a delay the whole stream goes out in one go
+    do stream_step(c);
+    while(c->phase != 2 && opt.chunk_delay_ms == 0);
+    if(c->phase == 2) c->state = CONN_READ;
+    else c->wake_at = now + opt.chunk_delay_ms;
+}
+
+static int listen_on(int port) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if(fd < 0) return -1;
+    int one = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons((uint16_t)port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if(bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(fd, 128) != 0) {
+        close(fd);
+        return -1;
+    }
+    fcntl(fd, F_SETFL, O_NONBLOCK);
+    return fd;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+            "Usage: %s [--port N] [--latency MS] [--jitter MS] [--reply-bytes N] [--chunk-bytes N]\n"
+            "          [--chunk-delay MS] [--models N] [--error-rate P] [--rate-limit N]\n"
+            "          [--rate-window S] [--refuse-gzip] [--quiet]\n", prog);
+}
+
+static int parse_args(int argc, char **argv) {
+    for(int i = 1; i < argc; i++) {
+        const char *arg = argv[i];
+        const char *value = i + 1 < argc ? argv[i + 1] : NULL;
+        if(strcmp(arg, "--refuse-gzip") == 0) opt.refuse_gzip = 1;
+        else if(strcmp(arg, "--quiet") == 0) opt.quiet = 1;
+        else if(!value) return 0;
+        else {
+            if(strcmp(arg, "--port") == 0) opt.port = atoi(value);
+            else if(strcmp(arg, "--latency") == 0) opt.latency_ms = atol(value);
+            else if(strcmp(arg, "--jitter") == 0) opt.jitter_ms = atol(value);
+            else if(strcmp(arg, "--reply-bytes") == 0) opt.reply_bytes = atol(value);
+            else if(strcmp(arg, "--chunk-bytes") == 0) opt.chunk_bytes = atol(value);
+            else if(strcmp(arg, "--chunk-delay") == 0) opt.chunk_delay_ms = atol(value);
+            else if(strcmp(arg, "--models") == 0) opt.models = atoi(value);
+            else if(strcmp(arg, "--error-rate") == 0) opt.error_rate = atof(value);
+            else if(strcmp(arg, "--rate-limit") == 0) opt.rate_limit = atol(value);
+            else if(strcmp(arg, "--rate-window") == 0) opt.rate_window = atof(value);
+            else return 0;
+            i++;
+        }
+    }
+    if(opt.chunk_bytes < 1) opt.chunk_bytes = 1;
+    if(opt.reply_bytes < 0) opt.reply_bytes = 0;
+    if(opt.rate_window <= 0) opt.rate_window = 60;
+    return 1;
+}
+
+int main(int argc, char **argv) {
+    if(!parse_args(argc, argv)) {
+        usage(argv[0]);
+        return 1;
+    }
+    signal(SIGPIPE, SIG_IGN);
+    int lfd = listen_on(opt.port);
+    if(lfd < 0) {
+        perror("listen");
+        return 1;
+    }
+    for(int i = 0; i < MOCK_MAX_CONNS; i++) conns[i].fd = -1;
+    fprintf(stderr, "mockserver listening on 127.0.0.1:%d\n", opt.port);
+
+    struct pollfd fds[MOCK_MAX_CONNS + 1];
+    int slot_of[MOCK_MAX_CONNS + 1];
+    for(;;) {
+        int64_t now = now_ms(), next = -1;
+        int nfds = 0;
+        fds[nfds++] = (struct pollfd){ .fd = lfd, .events = POLLIN };
+        for(int i = 0; i < MOCK_MAX_CONNS; i++) {
+            struct conn *c = &conns[i];
+            if(c->fd < 0) continue;
+            short events = POLLIN;
+            if(c->out_pos < c->out.len) events |= POLLOUT;
+            if(c->state != CONN_READ && (next < 0 || c->wake_at < next)) next = c->wake_at;
+            slot_of[nfds] = i;
+            fds[nfds++] = (struct pollfd){ .fd = c->fd, .events = events };
+        }
+        int timeout = next < 0 ? -1 : next <= now ? 0 : (int)(next - now);
+        if(poll(fds, nfds, timeout) < 0 && errno != EINTR) {
+            perror("poll");
+            return 1;
+        }
+        if(fds[0].revents & POLLIN) {
+            int fd;
+            while((fd = accept(lfd, NULL, NULL)) >= 0) {
+                int slot = -1;
+                for(int i = 0; i < MOCK_MAX_CONNS && slot < 0; i++) {
+                    if(conns[i].fd < 0) slot = i;
+                }
+                if(slot < 0) {
+                    close(fd);
+                    continue;
+                }
+                int one = 1;
+                setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+                fcntl(fd, F_SETFL, O_NONBLOCK);
+                memset(&conns[slot], 0, sizeof(conns[slot]));
+                conns[slot].fd = fd;
+            }
+        }
+        for(int k = 1; k < nfds; k++) {
+            struct conn *c = &conns[slot_of[k]];
+            if(c->fd != fds[k].fd) continue;
+            int dead = 0;
+            if(fds[k].revents & (POLLIN | POLLHUP | POLLERR)) {
+                if(!buf_reserve(&c->in, 65536)) dead = 1;
+                ssize_t n = dead ? 0 : read(c->fd, c->in.data + c->in.len, 65536);
+                if(n > 0) {
+                    c->in.len += (size_t)n;
+                    c->in.data[c->in.len] = 0;
+                } else if(n == 0 || (errno != EAGAIN && errno != EINTR)) {
+                    dead = 1;
+                }
+            }
+            if(!dead && !conn_process(c)) dead = 1;
+            if(!dead) conn_tick(c, now_ms());
+            if(!dead && c->state == CONN_READ) dead = !conn_process(c);
+            if(!dead && c->out_pos < c->out.len) {
+                ssize_t n = write(c->fd, c->out.data + c->out_pos, c->out.len - c->out_pos);
+                if(n > 0) c->out_pos += (size_t)n;
+                else if(n < 0 && errno != EAGAIN && errno != EINTR) dead = 1;
+            }
+            if(c->out_pos == c->out.len) {
+                c->out.len = c->out_pos = 0;
+                if(c->close_after && c->state == CONN_READ) dead = 1;
+            }
+            if(dead) conn_close(c);
+        }
+        // timers of connections that had no I/O this round
+        now = now_ms();
+        for(int i = 0; i < MOCK_MAX_CONNS; i++) {
+            struct conn *c = &conns[i];
+            if(c->fd < 0 || c->state == CONN_READ || now < c->wake_at) continue;
+            conn_tick(c, now);
+            if(c->state == CONN_READ && !conn_process(c)) conn_close(c);
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,423 @@
+#ifndef MODELSEARCH_H
+#define MODELSEARCH_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <ctype.h>
+#include "catalog.h"
+
+// /model <query>: search the model catalogs instead of printing all of them.
+// A query is any mix of words and filters:
+//
+//   gpt mini               ids matching every word, by prefix, substring, or
+//                          fuzzily by shared trigrams, so typos still match
+//   ctx>=128k              context length (also >, <, <=, =; k and m suffixes)
+//   price<0.5  out<2       prompt / completion price, USD per million tokens
+//   free                   both prices zero
+//   in:image  out:image    takes / produces images (or audio, file, video)
+//   sort:price  sort:-ctx  order by ctx, price, out or name; '-' reverses
+//   all                    list every match instead of the first page
+//
+// Without words the catalog order is kept; with words the best matches come
+// first. Only one page is printed unless asked, which matters on a slow
+// terminal more than the search itself.
+//
+// Each catalog gets an index the first time it is searched, rebuilt when its
+// entries change: the lowercased ids, every id trigram as a sorted
+// (trigram, entry) array, and the ids and their part after the last '/'
+// sorted for prefix lookups by binary search.
+
+#define MODEL_SEARCH_PAGE 20
+#define MODEL_SEARCH_MAX_WORDS 8
+#define MODEL_SEARCH_MAX_CATALOGS 4
+#define MODEL_SEARCH_FUZZY 60   // percent of a word's trigrams an id must share
+
+struct model_prefix_key {
+    uint32_t at;       // offset of the key in lower
+    uint32_t entry;
+};
+
+struct model_index {
+    const struct catalog *catalog;
+    unsigned version;                 // the catalog's version when built
+    int count;
+    char *lower;                      // lowercased copy of the catalog's names
+    uint64_t *trigrams;               // trigram << 32 | entry, sorted and unique
+    size_t num_trigrams;
+    struct model_prefix_key *prefixes;   // whole ids and their tails, sorted
+    int num_prefixes;
+    uint16_t *hits;                   // per entry, scratch for one word
+    int *score;                       // per entry, scratch for one query; -1 excluded
+};
+
+static struct model_index model_indexes[MODEL_SEARCH_MAX_CATALOGS];
+
+struct model_query {
+    char words[MODEL_SEARCH_MAX_WORDS][64];
+    int num_words;
+    long min_ctx, max_ctx;            // inclusive, -1 unbounded
+    float max_price, min_price;       // prompt, -1 unbounded
+    float max_out, min_out;           // completion
+    int free_only;
+    int in_modalities, out_modalities;
+    char sort[8];                     // "", "ctx", "price", "out", "name"
+    int descending;
+    int all;
+};
+
+struct model_match {
+    const struct catalog *catalog;
+    int entry;
+    int score;
+};
+
+static void model_index_free(struct model_index *x) {
+    free(x->lower);
+    free(x->trigrams);
+    free(x->prefixes);
+    free(x->hits);
+    free(x->score);
+    memset(x, 0, sizeof(*x));
+}
+
+static uint32_t model_trigram(const char *p) {
+    return (uint32_t)(unsigned char)p[0] << 16 | (uint32_t)(unsigned char)p[1] << 8 | (unsigned char)p[2];
+}
+
+static int model_compare_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+static const char *model_sort_lower;   // for the qsort comparators below
+
+static int model_compare_prefix(const void *a, const void *b) {
+    const struct model_prefix_key *x = a, *y = b;
+    return strcmp(model_sort_lower + x->at, model_sort_lower + y->at);
+}
+
+static int model_index_build(struct model_index *x, const struct catalog *c) {
+    model_index_free(x);
+    x->catalog = c;
+    x->version = c->version;
+    x->count = c->count;
+    if(c->count == 0) return 1;
+    x->lower = malloc(c->names_len);
+    x->hits = calloc(c->count, sizeof(*x->hits));
+    x->score = calloc(c->count, sizeof(*x->score));
+    x->prefixes = malloc(2 * c->count * sizeof(*x->prefixes));
+    size_t max_trigrams = c->names_len;
+    x->trigrams = malloc(max_trigrams * sizeof(*x->trigrams));
+    if(!x->lower || !x->hits || !x->score || !x->prefixes || !x->trigrams) {
+        model_index_free(x);
+        return 0;
+    }
+    for(size_t i = 0; i < c->names_len; i++) x->lower[i] = (char)tolower((unsigned char)c->names[i]);
+    for(int e = 0; e < c->count; e++) {
+        const char *id = x->lower + c->name_at[e];
+        size_t len = strlen(id);
+        for(size_t i = 0; i + 3 <= len; i++) {
+            x->trigrams[x->num_trigrams++] = (uint64_t)model_trigram(id + i) << 32 | (uint32_t)e;
+        }
+        x->prefixes[x->num_prefixes++] = (struct model_prefix_key){ c->name_at[e], (uint32_t)e };
+        const char *slash = strrchr(id, '/');
+        if(slash && slash[1]) {
+            x->prefixes[x->num_prefixes++] = (struct model_prefix_key){ (uint32_t)(slash + 1 - x->lower), (uint32_t)e };
+        }
+    }
+    qsort(x->trigrams, x->num_trigrams, sizeof(*x->trigrams), model_compare_u64);
+    size_t unique = 0;
+    for(size_t i = 0; i < x->num_trigrams; i++) {
+        if(unique == 0 || x->trigrams[i] != x->trigrams[unique - 1]) x->trigrams[unique++] = x->trigrams[i];
+    }
+    x->num_trigrams = unique;
+    model_sort_lower = x->lower;
+    qsort(x->prefixes, x->num_prefixes, sizeof(*x->prefixes), model_compare_prefix);
+    return 1;
+}
+
+static struct model_index *model_index_for(const struct catalog *c) {
+    struct model_index *free_slot = NULL;
+    for(int i = 0; i < MODEL_SEARCH_MAX_CATALOGS; i++) {
+        struct model_index *x = &model_indexes[i];
+        if(x->catalog == c) {
+            if(x->version != c->version && !model_index_build(x, c)) return NULL;
+            return x;
+        }
+        if(!x->catalog && !free_slot) free_slot = x;
+    }
+    if(!free_slot || !model_index_build(free_slot, c)) return NULL;
+    return free_slot;
+}
+
+static void model_index_cleanup(void) {
+    for(int i = 0; i < MODEL_SEARCH_MAX_CATALOGS; i++) model_index_free(&model_indexes[i]);
+}
+
+// First posting of trigram t
+static size_t model_trigram_lower_bound(const struct model_index *x, uint32_t t) {
+    uint64_t key = (uint64_t)t << 32;
+    size_t lo = 0, hi = x->num_trigrams;
+    while(lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        if(x->trigrams[mid] < key) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+static int model_prefix_lower_bound(const struct model_index *x, const char *word) {
+    int lo = 0, hi = x->num_prefixes;
+    while(lo < hi) {
+        int mid = (lo + hi) / 2;
+        if(strcmp(x->lower + x->prefixes[mid].at, word) < 0) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+// Add one word's score to every entry still in the running, and rule out
+// the ones it does not match at all.
+static void model_index_match_word(struct model_index *x, const char *word) {
+    const struct catalog *c = x->catalog;
+    size_t len = strlen(word);
+    memset(x->hits, 0, x->count * sizeof(*x->hits));
+    // prefix of the id or of its part after the '/': hits of 0xffff
+    for(int k = model_prefix_lower_bound(x, word); k < x->num_prefixes; k++) {
+        if(strncmp(x->lower + x->prefixes[k].at, word, len) != 0) break;
+        x->hits[x->prefixes[k].entry] = 0xffff;
+    }
+    int distinct = 0;
+    if(len >= 3) {
+        uint32_t seen[62];
+        for(size_t i = 0; i + 3 <= len && distinct < 62; i++) {
+            uint32_t t = model_trigram(word + i);
+            int dup = 0;
+            for(int k = 0; k < distinct && !dup; k++) dup = seen[k] == t;
+            if(dup) continue;
+            seen[distinct++] = t;
+            for(size_t p = model_trigram_lower_bound(x, t); p < x->num_trigrams && x->trigrams[p] >> 32 == t; p++) {
+                uint32_t e = (uint32_t)x->trigrams[p];
+                if(x->hits[e] != 0xffff) x->hits[e]++;
+            }
+        }
+    }
+    for(int e = 0; e < x->count; e++) {
+        if(x->score[e] < 0) continue;
+        int score = 0;
+        if(x->hits[e] == 0xffff) {
+            score = 300;
+        } else if(len < 3 || x->hits[e] == distinct) {
+            // every trigram is there, or the word is too short to have any
+            if(strstr(x->lower + c->name_at[e], word)) score = 200;
+        }
+        if(score == 0 && distinct > 0 && x->hits[e] * 100 >= distinct * MODEL_SEARCH_FUZZY) {
+            score = 100 * x->hits[e] / distinct;
+        }
+        x->score[e] = score > 0 ? x->score[e] + score : -1;
+    }
+}
+
+static int model_passes_filters(const struct catalog *c, int e, const struct model_query *q) {
+    long ctx = c->context_length[e];
+    float price = c->prompt_price[e], out = c->completion_price[e];
+    int mod = c->modalities[e];
+    if(q->min_ctx >= 0 && ctx < q->min_ctx) return 0;
+    if(q->max_ctx >= 0 && (ctx == 0 || ctx > q->max_ctx)) return 0;
+    if(q->max_price >= 0 && (price < 0 || price > q->max_price)) return 0;
+    if(q->min_price >= 0 && price < q->min_price) return 0;
+    if(q->max_out >= 0 && (out < 0 || out > q->max_out)) return 0;
+    if(q->min_out >= 0 && out < q->min_out) return 0;
+    if(q->free_only && !(price == 0 && out == 0)) return 0;
+    if((mod & q->in_modalities) != q->in_modalities) return 0;
+    if((mod & q->out_modalities) != q->out_modalities) return 0;
+    return 1;
+}
+
+// 128k, 1m, 200000, 0.5
+static int model_parse_number(const char *s, double *value) {
+    char *end;
+    *value = strtod(s, &end);
+    if(end == s) return 0;
+    if(*end == 'k' || *end == 'K') *value *= 1000, end++;
+    else if(*end == 'm' || *end == 'M') *value *= 1000000, end++;
+    return *end == 0;
+}
+
+static int model_parse_modality(const char *name, int out) {
+    if(strcmp(name, "image") == 0) return out ? CATALOG_OUT_IMAGE : CATALOG_IN_IMAGE;
+    if(strcmp(name, "audio") == 0) return out ? CATALOG_OUT_AUDIO : CATALOG_IN_AUDIO;
+    if(!out && strcmp(name, "file") == 0) return CATALOG_IN_FILE;
+    if(!out && strcmp(name, "video") == 0) return CATALOG_IN_VIDEO;
+    if(!out && strcmp(name, "text") == 0) return CATALOG_IN_TEXT;
+    return 0;
+}
+
+// field<op>value with op one of < <= > >= =
+static int model_parse_comparison(const char *token, struct model_query *q) {
+    size_t name_len = strcspn(token, "<>=");
+    if(name_len == 0 || token[name_len] == 0) return 0;
+    const char *op = token + name_len;
+    int less = *op == '<', greater = *op == '>';
+    const char *value_text = op + 1;
+    int inclusive = 1;
+    if((less || greater) && *value_text == '=') value_text++;
+    else if(less || greater) inclusive = 0;
+    double value;
+    if(!model_parse_number(value_text, &value)) return 0;
+    long *min_l = NULL, *max_l = NULL;
+    float *min_f = NULL, *max_f = NULL;
+    if(strncmp(token, "ctx", name_len) == 0 && name_len == 3) min_l = &q->min_ctx, max_l = &q->max_ctx;
+    else if(strncmp(token, "price", name_len) == 0 && name_len == 5) min_f = &q->min_price, max_f = &q->max_price;
+    else if(strncmp(token, "out", name_len) == 0 && name_len == 3) min_f = &q->min_out, max_f = &q->max_out;
+    else return 0;
+    if(min_l) {
+        long v = (long)value;
+        if(less || !greater) *max_l = inclusive || !less ? v : v - 1;
+        if(greater || !less) *min_l = inclusive || !greater ? v : v + 1;
+    } else {
+        // prices are floats; a strict bound is close enough as inclusive
+        if(less || !greater) *max_f = (float)value;
+        if(greater || !less) *min_f = (float)value;
+    }
+    return 1;
+}
+
+// Returns 0 and names the token it could not make sense of.
+static int model_parse_query(const char *text, struct model_query *q, char *bad, size_t bad_size) {
+    memset(q, 0, sizeof(*q));
+    q->min_ctx = q->max_ctx = -1;
+    q->min_price = q->max_price = q->min_out = q->max_out = -1;
+    char token[64];
+    while(*text) {
+        text += strspn(text, " \t");
+        size_t len = strcspn(text, " \t");
+        if(len == 0) break;
+        if(len >= sizeof(token)) len = sizeof(token) - 1;
+        for(size_t i = 0; i < len; i++) token[i] = (char)tolower((unsigned char)text[i]);
+        token[len] = 0;
+        text += strcspn(text, " \t");
+        int ok = 1;
+        if(strcmp(token, "free") == 0) q->free_only = 1;
+        else if(strcmp(token, "all") == 0) q->all = 1;
+        else if(strncmp(token, "in:", 3) == 0) ok = (q->in_modalities |= model_parse_modality(token + 3, 0)) != 0;
+        else if(strncmp(token, "out:", 4) == 0) ok = (q->out_modalities |= model_parse_modality(token + 4, 1)) != 0;
+        else if(strncmp(token, "sort:", 5) == 0) {
+            const char *field = token + 5;
+            q->descending = *field == '-';
+            if(*field == '-' || *field == '+') field++;
+            ok = (strcmp(field, "ctx") == 0 || strcmp(field, "price") == 0 || strcmp(field, "out") == 0 ||
+                  strcmp(field, "name") == 0) &&
+                 snprintf(q->sort, sizeof(q->sort), "%s", field) < (int)sizeof(q->sort);
+        } else if(strpbrk(token, "<>=")) ok = model_parse_comparison(token, q);
+        else if(q->num_words < MODEL_SEARCH_MAX_WORDS) snprintf(q->words[q->num_words++], sizeof(q->words[0]), "%s", token);
+        if(!ok) {
+            snprintf(bad, bad_size, "%s", token);
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static const struct model_query *model_sort_query;
+
+static double model_sort_value(const struct model_match *m) {
+    const char *field = model_sort_query->sort;
+    if(strcmp(field, "ctx") == 0) return m->catalog->context_length[m->entry];
+    if(strcmp(field, "price") == 0) return m->catalog->prompt_price[m->entry];
+    return m->catalog->completion_price[m->entry];
+}
+
+static int model_compare_matches(const void *a, const void *b) {
+    const struct model_match *x = a, *y = b;
+    const struct model_query *q = model_sort_query;
+    int order = 0;
+    if(strcmp(q->sort, "name") == 0) {
+        order = strcmp(catalog_id(x->catalog, x->entry), catalog_id(y->catalog, y->entry));
+    } else if(q->sort[0]) {
+        double vx = model_sort_value(x), vy = model_sort_value(y);
+        // unknown values (0 context, -1 price) go last either way
+        int ux = strcmp(q->sort, "ctx") == 0 ? vx <= 0 : vx < 0, uy = strcmp(q->sort, "ctx") == 0 ? vy <= 0 : vy < 0;
+        if(ux != uy) return ux - uy;
+        order = vx < vy ? -1 : vx > vy;
+    }
+    if(order) return q->descending ? -order : order;
+    if(x->score != y->score) return y->score - x->score;
+    if(x->catalog != y->catalog) return x->catalog < y->catalog ? -1 : 1;
+    return x->entry - y->entry;
+}
+
+static void model_print_match(int number, const struct model_match *m, int width) {
+    const struct catalog *c = m->catalog;
+    int e = m->entry;
+    char ctx[16] = "", price[40] = "", mod[48] = "";
+    uint32_t n = c->context_length[e];
+    if(n >= 1000000) snprintf(ctx, sizeof(ctx), "%.3gM", n / 1e6);
+    else if(n > 0) snprintf(ctx, sizeof(ctx), "%uk", (n + 500) / 1000);
+    float in = c->prompt_price[e], out = c->completion_price[e];
+    if(in == 0 && out == 0) snprintf(price, sizeof(price), "free");
+    else if(in >= 0 && out >= 0) snprintf(price, sizeof(price), "$%.2f/$%.2f", in, out);
+    int bits = c->modalities[e];
+    if(bits & CATALOG_IN_IMAGE) strcat(mod, " +image");
+    if(bits & CATALOG_IN_AUDIO) strcat(mod, " +audio");
+    if(bits & CATALOG_IN_FILE) strcat(mod, " +file");
+    if(bits & CATALOG_IN_VIDEO) strcat(mod, " +video");
+    if(bits & CATALOG_OUT_IMAGE) strcat(mod, " ->image");
+    if(bits & CATALOG_OUT_AUDIO) strcat(mod, " ->audio");
+    if(!ctx[0] && !price[0] && !mod[0]) {
+        printf("[%d] %s\n", number, catalog_id(c, e));
+        return;
+    }
+    printf("[%d] %-*s %6s %14s%s\n", number, width, catalog_id(c, e), ctx, price, mod);
+}
+
+// Search cats for query and print the results, numbered from 1. The ids
+// listed are strdup'ed into selected (at most max of them). Returns how many
+// were listed, or -1 if the query did not parse.
+static int model_search(struct catalog **cats, int n, const char *query, char **selected, int max) {
+    struct model_query q;
+    char bad[64];
+    if(!model_parse_query(query, &q, bad, sizeof(bad))) {
+        printf("Don't know what to do with '%s'. Try words, ctx>=128k, price<1, out<5, free, in:image, "
+               "out:image, sort:price, sort:-ctx, all\n", bad);
+        return -1;
+    }
+    int total = 0;
+    for(int i = 0; i < n; i++) total += cats[i]->count;
+    struct model_match *matches = malloc((total ? total : 1) * sizeof(*matches));
+    if(!matches) return 0;
+    int found = 0;
+    for(int i = 0; i < n && i < MODEL_SEARCH_MAX_CATALOGS; i++) {
+        struct model_index *x = model_index_for(cats[i]);
+        if(!x) continue;
+        for(int e = 0; e < x->count; e++) x->score[e] = model_passes_filters(cats[i], e, &q) ? 0 : -1;
+        for(int w = 0; w < q.num_words; w++) model_index_match_word(x, q.words[w]);
+        for(int e = 0; e < x->count; e++) {
+            if(x->score[e] >= 0) matches[found++] = (struct model_match){ cats[i], e, x->score[e] };
+        }
+    }
+    model_sort_query = &q;
+    qsort(matches, found, sizeof(*matches), model_compare_matches);
+
+    int shown = q.all ? found : found < MODEL_SEARCH_PAGE ? found : MODEL_SEARCH_PAGE;
+    if(shown > max) shown = max;
+    int width = 0;
+    for(int i = 0; i < shown; i++) {
+        int len = (int)strlen(catalog_id(matches[i].catalog, matches[i].entry));
+        if(len > width) width = len;
+    }
+    if(width > 48) width = 48;
+    for(int i = 0; i < shown; i++) {
+        model_print_match(i + 1, &matches[i], width);
+        selected[i] = strdup(catalog_id(matches[i].catalog, matches[i].entry));
+    }
+    if(found == 0) printf("No model matches '%s' among %d\n", query, total);
+    else if(shown < found) printf("%d of %d matches, narrow it down or add 'all'\n", shown, found);
+    if(!query[0]) printf("Search with /model <words> [ctx>=128k] [price<1] [free] [in:image] [sort:price]\n");
+    free(matches);
+    return shown;
+}
+
+#endif
@@ -1,260 +1,669 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdbool.h>
 #include <curl/curl.h>
 #include <cjson/cJSON.h>
+#include "sse.h"
+#include "jsonscan.h"
+#include "mdrender.h"
+#include "transport.h"
+#include "catalog.h"
+#include "modelsearch.h"
+#include "history.h"
+#include "repl.h"
+#include "respcache.h"
+#include "metrics.h"
+#include "arena.h"
+#include "ratelimit.h"
 
 #define BUFFER_SIZE 10240
-#define MAX_MESSAGES 100
 #define MAX_SELECTABLE_MODELS 500
 
 struct memory {
     char *response;
-    size_t size;
+    size_t size, cap;
+    int kept;             // the reply_buffer: its growth is what /mem reports
+};
+struct stream {
+    CURL *curl;
+    struct sse_parser sse;
+    struct md_renderer md;
+    struct memory text;   // assistant reply assembled from deltas
+    struct json_scanner scan;   // non-SSE body, e.g. a JSON error document
+    char *error;
+    int is_sse;           // -1 until the Content-Type has been seen
+    int done;
+    int finished;         // the stream ended with [DONE]
+    struct metrics_sample metrics;
 };
-typedef struct {
-    char role[16];     // "user" or "assistant"
-    char *content;
-} Message;
 
-Message history[MAX_MESSAGES];
-int history_size = 0;
 const char *openrouter_api_key = NULL;
+char openrouter_chat_url[512];      // LLM_OPENROUTER_URL overrides the base
+char openrouter_models_url[512];
 char* selectable_models[MAX_SELECTABLE_MODELS];
 int num_selectable_models = 0;
-static size_t write_callback(void *contents, size_t size, size_t nmemb, void *userp) {
-    size_t realsize = size * nmemb;
-    struct memory *mem = (struct memory *)userp;
-
-    char *ptr = realloc(mem->response, mem->size + realsize + 1);
-    if(ptr == NULL) {
-        fprintf(stderr, "realloc() failed\n");
-        return 0;
-    }
-    mem->response = ptr;
-    memcpy(&(mem->response[mem->size]), contents, realsize);
-    mem->size += realsize;
+struct catalog openrouter_catalog;
+// The reply of a normal turn goes into one buffer that is kept from turn to
+// turn (reply_buffer), so after the first few it no longer grows at all.
+static struct memory reply_buffer = { .kept = 1 };
+static unsigned long reply_buffer_grows = 0;
+// Same for the request headers, which don't change during a session
+static struct curl_slist *chat_headers = NULL;
+static int append_text(struct memory *mem, const char *text, size_t len) {
+    if(mem->size + len + 1 > mem->cap) {
+        size_t cap = mem->cap ? mem->cap : 4096;
+        while(cap < mem->size + len + 1) cap *= 2;
+        char *ptr = realloc(mem->response, cap);
+        if(ptr == NULL) {
+            fprintf(stderr, "realloc() failed\n");
+            return 0;
+        }
+        mem->response = ptr;
+        mem->cap = cap;
+        if(mem->kept) reply_buffer_grows++;
+    }
+    memcpy(&(mem->response[mem->size]), text, len);
+    mem->size += len;
     mem->response[mem->size] = 0;
-    return realsize;
+    return 1;
+}
+static void print_api_error(cJSON *json) {
+    cJSON *error = cJSON_GetObjectItem(json, "error");
+    if (error) {
+        cJSON *error_message = cJSON_GetObjectItem(error, "message");
+        if (cJSON_IsString(error_message)) {
+            fprintf(stderr, "API Error: %s\n", error_message->valuestring);
+        }
+    } else {
+        fprintf(stderr, "Unexpected API response format.\n");
+    }
+}
+// One SSE event: either "[DONE]" or a chunk whose delta is rendered as it arrives
+static void stream_event(const char *data, size_t len, void *userp) {
+    struct stream *st = (struct stream *)userp;
+    if(st->done) return;
+    if(strcmp(data, "[DONE]") == 0) {
+        st->done = 1;
+        st->finished = 1;
+        return;
+    }
+    cJSON *json = cJSON_Parse(data);
+    if(!json) {
+        // a failed parse can leave nodes in the arena too
+        arena_reset(&scratch_arena);
+        return;
+    }
+    // the last chunk carries the token counts, where the provider reports them
+    cJSON *usage = cJSON_GetObjectItem(json, "usage");
+    if(cJSON_IsObject(usage)) {
+        cJSON *prompt = cJSON_GetObjectItem(usage, "prompt_tokens");
+        cJSON *completion = cJSON_GetObjectItem(usage, "completion_tokens");
+        if(cJSON_IsNumber(prompt)) st->metrics.prompt_tokens = (long)prompt->valuedouble;
+        if(cJSON_IsNumber(completion)) st->metrics.completion_tokens = (long)completion->valuedouble;
+    }
+    cJSON *choices = cJSON_GetObjectItem(json, "choices");
+    if(cJSON_IsArray(choices) && cJSON_GetArraySize(choices) > 0) {
+        cJSON *delta = cJSON_GetObjectItem(cJSON_GetArrayItem(choices, 0), "delta");
+        cJSON *content = cJSON_GetObjectItem(delta, "content");
+        if(cJSON_IsString(content) && content->valuestring[0]) {
+            size_t n = strlen(content->valuestring);
+            int64_t start = metrics_now_us();
+            md_feed(&st->md, content->valuestring, n);
+            st->metrics.render_us += metrics_now_us() - start;
+            append_text(&st->text, content->valuestring, n);
+        }
+    } else if(cJSON_GetObjectItem(json, "error")) {
+        md_finish(&st->md);
+        print_api_error(json);
+        st->done = 1;
+    }
+    // the tree lives in the scratch arena and nothing of it is kept
+    cJSON_Delete(json);
+    arena_reset(&scratch_arena);
 }
-void add_message(const char *role, const char *content) {
-    if(history_size >= MAX_MESSAGES) {
-        free(history[0].content);
-        memmove(&history[0], &history[1], (MAX_MESSAGES - 1) * sizeof(Message));
-        history_size--;
-    }
-    strcpy(history[history_size].role, role);
-    history[history_size].content = strdup(content);
-    history_size++;
+// Plain JSON answer instead of an event stream: pick out the reply or the error
+static const char *reply_paths[] = { "choices[0].message.content", "error.message", "usage.prompt_tokens",
+                                      "usage.completion_tokens" };
+static void reply_value(int path, int type, const char *value, size_t len, void *userp) {
+    struct stream *st = (struct stream *)userp;
+    if(type == JSON_NUMBER) {
+        if(path == 2) st->metrics.prompt_tokens = strtol(value, NULL, 10);
+        else if(path == 3) st->metrics.completion_tokens = strtol(value, NULL, 10);
+        return;
+    }
+    if(type != JSON_STRING) return;
+    if(path == 0 && !st->done) {
+        append_text(&st->text, value, len);
+        st->done = 1;
+    } else if(path == 1 && !st->error) {
+        st->error = strdup(value);
+    }
 }
-cJSON *build_messages_json() {
-    cJSON *messages = cJSON_CreateArray();
-    for(int i = 0; i < history_size; i++) {
-        cJSON *msg = cJSON_CreateObject();
-        cJSON_AddStringToObject(msg, "role", history[i].role);
-        cJSON_AddStringToObject(msg, "content", history[i].content);
-        cJSON_AddItemToArray(messages, msg);
-    }
-    return messages;
+static size_t stream_callback(void *contents, size_t size, size_t nmemb, void *userp) {
+    size_t realsize = size * nmemb;
+    struct stream *st = (struct stream *)userp;
+    if(st->is_sse < 0) {
+        char *ct = NULL;
+        curl_easy_getinfo(st->curl, CURLINFO_CONTENT_TYPE, &ct);
+        st->is_sse = (ct && strncmp(ct, "text/event-stream", 17) == 0);
+    }
+    // parsing is what this takes apart from printing the deltas
+    int64_t start = metrics_now_us(), rendered = st->metrics.render_us;
+    size_t taken = realsize;
+    if(!st->is_sse) json_scan_feed(&st->scan, contents, realsize);
+    else taken = sse_feed(&st->sse, contents, realsize);
+    st->metrics.parse_us += metrics_now_us() - start - (st->metrics.render_us - rendered);
+    return taken;
 }
 
-// Fetch free models along with openai and anthropic
-void list_available_models() {
+// The prompt, with whatever was /attach'ed to it
+static void add_user_message(const char *text) {
+    size_t parts_len;
+    int tokens;
+    char *parts = attach_take(&parts_len, &tokens);
+    add_message_parts("user", text, parts, parts_len, tokens);
+    free(parts);
+}
+
+// Prompt budget for the selected model, from the catalog's context_length
+void update_context_budget(const char *model) {
+    history_set_context(catalog_context_length(&openrouter_catalog, model), 4096);
+}
+
+// Search the cached catalog and list one page of matches, see modelsearch.h
+void list_available_models(const char *query) {
     for(int i = 0; i < num_selectable_models; i++) {
         free(selectable_models[i]);
         selectable_models[i] = NULL;
     }
     num_selectable_models = 0;
 
-    CURL *curl = curl_easy_init();
-    if(!curl) return;
-
-    struct memory chunk = { .response = malloc(1), .size = 0 };
+    struct catalog *cats[] = { &openrouter_catalog };
+    catalog_refresh(cats, 1);
+    if(openrouter_catalog.count == 0) {
+        fprintf(stderr, "Failed to fetch the model list.\n");
+        return;
+    }
+    int listed = model_search(cats, 1, query, selectable_models, MAX_SELECTABLE_MODELS);
+    num_selectable_models = listed > 0 ? listed : 0;
+}
 
-    curl_easy_setopt(curl, CURLOPT_URL, "https://openrouter.ai/api/v1/models");
-    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, write_callback);
-    curl_easy_setopt(curl, CURLOPT_WRITEDATA, (void *)&chunk);
+// Switch to the model and size the prompt budget for it
+void select_model(char *model, size_t size, const char *id) {
+    snprintf(model, size, "%s", id);
+    printf("Model set to: %s\n", model);
+    update_context_budget(model);
+    history_set_model(model);
+}
 
-    printf("Fetching OpenRouter models...\n");
-    CURLcode res = curl_easy_perform(curl);
+void chat_with_openrouter(const char *model, const char *message) {
+    if (!openrouter_api_key) {
+        fprintf(stderr, "Where is your API key\n");
+        return;
+    }
+    struct metrics_sample metrics;
+    metrics_begin(&metrics, model);
+    int64_t build_start = metrics_now_us();
+    size_t postdata_len;
+    const char *postdata = history_request_body(model, NULL, ",\"reasoning\":{\"exclude\":true},\"stream\":true", &postdata_len);
+    metrics.build_us = metrics_now_us() - build_start;
+    if(!postdata) {
+        history_drop_newest();
+        return;
+    }
+    char *cached = rcache_get(openrouter_chat_url, postdata, postdata_len);
+    if(cached) {
+        struct md_renderer md;
+        md_init(&md, stdout);
+        md_feed(&md, cached, strlen(cached));
+        md_finish(&md);
+        add_message("assistant", cached);
+        free(cached);
+        history_release_body();
+        return;
+    }
+    CURL *curl = transport_handle(openrouter_chat_url);
+    if(!curl) {
+        fprintf(stderr, "Could not start the request\n");
+        history_drop_newest();
+        history_release_body();
+        return;
+    }
+    struct stream st = { .curl = curl, .is_sse = -1, .metrics = metrics, .text = reply_buffer };
+    st.text.size = 0;
+    sse_init(&st.sse, stream_event, &st);
+    json_scan_init(&st.scan, reply_paths, 4, reply_value, &st);
+    md_init(&st.md, stdout);
+    if(!chat_headers) {
+        char auth_header[256];
+        snprintf(auth_header, sizeof(auth_header), "Authorization: Bearer %s", openrouter_api_key);
+        chat_headers = curl_slist_append(chat_headers, auth_header);
+        chat_headers = curl_slist_append(chat_headers, "Content-Type: application/json");
+        chat_headers = curl_slist_append(chat_headers, "Accept: text/event-stream");
+    }
+    curl_easy_setopt(curl, CURLOPT_URL, openrouter_chat_url);
+    curl_easy_setopt(curl, CURLOPT_HTTPHEADER, chat_headers);
+    struct transport_body upload;
+    transport_post(&upload, curl, openrouter_chat_url, &chat_headers, postdata, postdata_len, stream_callback, &st, 1);
+    // pace to the provider's limits, and retry rejected or dropped requests
+    // as long as nothing of the answer has been shown
+    struct ratelimit_bucket *limit = ratelimit_find(openrouter_chat_url, model);
+    struct ratelimit_info limits;
+    ratelimit_info_reset(&limits);
+    curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, ratelimit_header);
+    curl_easy_setopt(curl, CURLOPT_HEADERDATA, (void *)&limits);
+    long tokens = history_body_tokens;
+    CURLcode res;
+    for(int attempt = 0;; attempt++) {
+        if(ratelimit_wait(limit, tokens, attempt)) {
+            res = CURLE_ABORTED_BY_CALLBACK;
+            break;
+        }
+        res = repl_perform(curl);
+        if(transport_retry(&upload, &chat_headers, res)) res = repl_perform(curl);
+        ratelimit_update(limit, &limits);
+        if(st.text.size > 0 || !ratelimit_retry(limit, &limits, res, attempt, model)) break;
+        sse_free(&st.sse);
+        sse_init(&st.sse, stream_event, &st);
+        json_scan_reset(&st.scan);
+        free(st.error);
+        st.error = NULL;
+        st.is_sse = -1;
+        st.done = st.finished = 0;
+        transport_rewind(&upload);
+    }
+    int complete = 0;     // a whole answer, worth caching
+    if(st.is_sse > 0) sse_finish(&st.sse);
+    md_finish(&st.md);
+    if(res == CURLE_ABORTED_BY_CALLBACK) {
+        // keep the part of the answer that already arrived
+        printf("(cancelled)\n");
+    } else if(res != CURLE_OK) {
+        fprintf(stderr, "curl_easy_perform() failed: %s\n", curl_easy_strerror(res));
+    } else if(st.is_sse > 0) {
+        if(st.text.size == 0 && !st.done) fprintf(stderr, "Unexpected API response format.\n");
+        complete = st.finished && st.text.size > 0;
+    } else if(!json_scan_finish(&st.scan)) {
+        // Not an event stream, and not a JSON document either
+        fprintf(stderr, "Failed to parse API response JSON.\n");
+    } else if(st.done) {
+        int64_t start = metrics_now_us();
+        md_feed(&st.md, st.text.response, st.text.size);
+        md_finish(&st.md);
+        st.metrics.render_us += metrics_now_us() - start;
+        complete = 1;
+    } else if(st.error) {
+        fprintf(stderr, "API Error: %s\n", st.error);
+    } else {
+        fprintf(stderr, "Unexpected API response format.\n");
+    }
+    st.metrics.text = st.text.response;
+    st.metrics.streamed = st.is_sse > 0;
+    metrics_finish(&st.metrics, curl, res == CURLE_OK && st.text.size > 0);
+    transport_body_done(&upload, 1);
+    // Keep whatever arrived, even if the stream was cut short
+    if(st.text.size > 0) add_message("assistant", st.text.response);
+    if(complete) rcache_put(openrouter_chat_url, postdata, postdata_len, st.text.response);
 
-    if(res == CURLE_OK) {
-        cJSON *json = cJSON_Parse(chunk.response);
-        if(json) {
-            cJSON *data = cJSON_GetObjectItem(json, "data");
-            if(cJSON_IsArray(data)) {
-                printf("--- Available Models (Free, OpenAI, Anthropic) ---\n");
-                cJSON *model;
-                cJSON_ArrayForEach(model, data) {
-                    cJSON *id = cJSON_GetObjectItem(model, "id");
-                    if(cJSON_IsString(id)) {
-                        const char *model_id = id->valuestring;
-                        size_t id_len = strlen(model_id);
+    reply_buffer = st.text;
+    free(st.error);
+    json_scan_free(&st.scan);
+    sse_free(&st.sse);
+    history_release_body();
+}
 
-                        const char* suffix = ":free";
-                        size_t suffix_len = strlen(suffix);
-                        int ends_with_free = (id_len >= suffix_len && strcmp(model_id + id_len - suffix_len, suffix) == 0);
+// /compare: one prompt, several models, all requests in flight at once
+#define MAX_COMPARE 8
 
-                        const char* openai_prefix = "openai/";
-                        int starts_with_openai = (strncmp(model_id, openai_prefix, strlen(openai_prefix)) == 0);
+struct compare_slot {
+    char model[128];
+    CURL *curl;
+    char *body;
+    size_t body_len;
+    struct curl_slist *headers;
+    struct transport_body upload;
+    struct json_scanner scan;
+    struct memory text;
+    char *error;
+    int replied;
+    int finished;         // answer complete and shown
+    long tokens;          // usage.completion_tokens, 0 if not reported
+    struct metrics_sample metrics;
+};
 
-                        const char* anthropic_prefix = "anthropic/";
-                        int starts_with_anthropic = (strncmp(model_id, anthropic_prefix, strlen(anthropic_prefix)) == 0);
+static const char *compare_paths[] = { "choices[0].message.content", "error.message", "usage.completion_tokens" };
+static void compare_value(int path, int type, const char *value, size_t len, void *userp) {
+    struct compare_slot *slot = (struct compare_slot *)userp;
+    if(path == 0 && type == JSON_STRING && !slot->replied) {
+        append_text(&slot->text, value, len);
+        slot->replied = 1;
+    } else if(path == 1 && type == JSON_STRING && !slot->error) {
+        slot->error = strdup(value);
+    } else if(path == 2 && type == JSON_NUMBER) {
+        slot->tokens = strtol(value, NULL, 10);
+    }
+}
+static size_t compare_write(void *contents, size_t size, size_t nmemb, void *userp) {
+    size_t realsize = size * nmemb;
+    struct compare_slot *slot = (struct compare_slot *)userp;
+    int64_t start = metrics_now_us();
+    json_scan_feed(&slot->scan, contents, realsize);
+    slot->metrics.parse_us += metrics_now_us() - start;
+    return realsize;
+}
 
-                        if (ends_with_free || starts_with_openai || starts_with_anthropic) {
-                             if (num_selectable_models < MAX_SELECTABLE_MODELS) {
-                                printf("[%d] %s\n", num_selectable_models + 1, model_id);
-                                selectable_models[num_selectable_models] = strdup(model_id);
-                                num_selectable_models++;
-                            }
-                        }
-                    }
-                }
-            }
-            cJSON_Delete(json);
+// Entries are model ids or numbers from the last /model listing
+static int compare_parse(const char *list, struct compare_slot *slots) {
+    int n = 0;
+    while(*list && n < MAX_COMPARE) {
+        list += strspn(list, " ,");
+        size_t len = strcspn(list, ",");
+        while(len > 0 && list[len - 1] == ' ') len--;
+        if(len == 0) break;
+        char name[128];
+        snprintf(name, sizeof(name), "%.*s", (int)len, list);
+        char *endptr;
+        long choice = strtol(name, &endptr, 10);
+        if(*endptr == 0 && choice > 0 && choice <= num_selectable_models) {
+            snprintf(slots[n].model, sizeof(slots[n].model), "%s", selectable_models[choice - 1]);
         } else {
-            fprintf(stderr, "Failed to parse JSON for model list.\n");
+            snprintf(slots[n].model, sizeof(slots[n].model), "%s", name);
         }
-    } else {
-        fprintf(stderr, "curl_easy_perform() failed: %s\n", curl_easy_strerror(res));
+        n++;
+        list += strcspn(list, ",");
     }
+    return n;
+}
 
-    free(chunk.response);
-    curl_easy_cleanup(curl);
+static double compare_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
 }
 
-void chat_with_openrouter(const char *model, const char *message) {
+static void compare_show(struct compare_slot *slot, int index, CURLcode res) {
+    double seconds = 0;
+    curl_easy_getinfo(slot->curl, CURLINFO_TOTAL_TIME, &seconds);
+    if(res != CURLE_OK) {
+        printf("[%d] %s failed after %.2f s: %s\n", index + 1, slot->model, seconds, curl_easy_strerror(res));
+    } else if(!slot->replied) {
+        printf("[%d] %s failed after %.2f s: %s\n", index + 1, slot->model, seconds,
+               slot->error ? slot->error : "unexpected response");
+    } else {
+        // estimate when the provider did not report usage
+        int estimated = slot->tokens == 0;
+        if(estimated) slot->tokens = count_tokens(slot->text.response);
+        printf("[%d] %s (%.2f s, %s%ld tokens)\n", index + 1, slot->model, seconds,
+               estimated ? "~" : "", slot->tokens);
+        struct md_renderer md;
+        md_init(&md, stdout);
+        md_feed(&md, slot->text.response, slot->text.size);
+        md_finish(&md);
+        printf("\n");
+    }
+    fflush(stdout);
+}
+
+void compare_models(const char *current_model, const char *list) {
     if (!openrouter_api_key) {
         fprintf(stderr, "Where is your API key\n");
         return;
     }
-    CURL *curl = curl_easy_init();
-    if(!curl) return;
-    struct memory chunk = { .response = malloc(1), .size = 0 };
-    struct curl_slist *headers = NULL;
+    struct compare_slot slots[MAX_COMPARE];
+    memset(slots, 0, sizeof(slots));
+    int n = compare_parse(list, slots);
+    if(n < 1) {
+        printf("Usage: /compare model1,model2,... (ids or numbers from /model)\n");
+        return;
+    }
+    char prompt[2048];
+    printf("Prompt: ");
+    if(!repl_gets(prompt, sizeof(prompt))) return;
+    prompt[strcspn(prompt, "\n")] = 0;
+    if(strlen(prompt) == 0) return;
+    add_user_message(prompt);
+
+    CURLM *multi = curl_multi_init();
+    if(!multi) {
+        history_drop_newest();
+        return;
+    }
     char auth_header[256];
     snprintf(auth_header, sizeof(auth_header), "Authorization: Bearer %s", openrouter_api_key);
-    headers = curl_slist_append(headers, auth_header);
-    headers = curl_slist_append(headers, "Content-Type: application/json");
-    cJSON *root = cJSON_CreateObject();
-    cJSON_AddStringToObject(root, "model", model);
-    cJSON_AddItemToObject(root, "messages", build_messages_json());
-    cJSON *reasoning = cJSON_CreateObject();
-    cJSON_AddBoolToObject(reasoning, "exclude", true);
-    cJSON_AddItemToObject(root, "reasoning", reasoning);
-    char *postdata = cJSON_PrintUnformatted(root);
-    curl_easy_setopt(curl, CURLOPT_URL, "https://openrouter.ai/api/v1/chat/completions");
-    curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
-    curl_easy_setopt(curl, CURLOPT_POSTFIELDS, postdata);
-    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, write_callback);
-    curl_easy_setopt(curl, CURLOPT_WRITEDATA, (void *)&chunk);
-    CURLcode res = curl_easy_perform(curl);
-    if(res != CURLE_OK) {
-        fprintf(stderr, "curl_easy_perform() failed: %s\n", curl_easy_strerror(res));
-    } else {
-        cJSON *json = cJSON_Parse(chunk.response);
-        if(json) {
-            cJSON *choices = cJSON_GetObjectItem(json, "choices");
-            if(cJSON_IsArray(choices) && cJSON_GetArraySize(choices) > 0) {
-                cJSON *message_obj = cJSON_GetObjectItem(cJSON_GetArrayItem(choices, 0), "message");
-                if(message_obj) {
-                    cJSON *content = cJSON_GetObjectItem(message_obj, "content");
-                    if(cJSON_IsString(content)) {
-                        // Render assistant message as Markdown using txc + glow
-			const char *ai_output = content->valuestring;
-			add_message("assistant", ai_output);
-
-			// Write markdown to temporary file
-			FILE *mdfile = fopen("markdown.md", "w");
-			if (mdfile) {
-    				fputs(ai_output, mdfile);
-    				fclose(mdfile);
-
-    				// Render markdown using txc and glow
-    				int render_status = system("txc -f markdown.md -c | glow");
-    				if (render_status != 0) {
-        				fprintf(stderr, "Failed to render markdown (txc/glow issue?). Showing raw text:\n%s\n", ai_output);
-   				 }
-				} else {
-    					fprintf(stderr, "Failed to open markdown.md for writing. Showing raw text:\n%s\n", ai_output);
-				}
+    int running = 0;
+    for(int i = 0; i < n; i++) {
+        struct compare_slot *slot = &slots[i];
+        // each model gets the history that fits its own context window
+        update_context_budget(slot->model);
+        metrics_begin(&slot->metrics, slot->model);
+        int64_t build_start = metrics_now_us();
+        size_t len;
+        const char *body = history_request_body(slot->model, NULL, ",\"reasoning\":{\"exclude\":true}", &len);
+        slot->metrics.build_us = metrics_now_us() - build_start;
+        if(!body) continue;
+        slot->body = malloc(len);
+        slot->curl = curl_easy_init();
+        if(!slot->body || !slot->curl) continue;
+        memcpy(slot->body, body, len);
+        slot->body_len = len;
+        transport_setup(slot->curl);
+        // an idle HTTP/2 connection from the pool is still multiplexed; not
+        // waiting keeps HTTP/1.1 servers from serializing the models
+        curl_easy_setopt(slot->curl, CURLOPT_PIPEWAIT, 0L);
+        json_scan_init(&slot->scan, compare_paths, 3, compare_value, slot);
+        slot->headers = curl_slist_append(slot->headers, auth_header);
+        slot->headers = curl_slist_append(slot->headers, "Content-Type: application/json");
+        curl_easy_setopt(slot->curl, CURLOPT_URL, openrouter_chat_url);
+        curl_easy_setopt(slot->curl, CURLOPT_HTTPHEADER, slot->headers);
+        // gzipped only where a chat request already showed the host takes it
+        transport_post(&slot->upload, slot->curl, openrouter_chat_url, &slot->headers,
+                       slot->body, slot->body_len, compare_write, slot, 0);
+        curl_easy_setopt(slot->curl, CURLOPT_PRIVATE, (void *)slot);
+        curl_multi_add_handle(multi, slot->curl);
+        running++;
+    }
+    history_release_body();
+    update_context_budget(current_model);
 
+    double start = compare_now(), total = 0;
+    int answers = 0;
+    printf("Asking %d models...\n\n", running);
+    while(running > 0) {
+        if(curl_multi_perform(multi, &running) != CURLM_OK) break;
+        CURLMsg *msg;
+        int left;
+        while((msg = curl_multi_info_read(multi, &left))) {
+            if(msg->msg != CURLMSG_DONE) continue;
+            struct compare_slot *slot = NULL;
+            curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, (char **)&slot);
+            if(msg->data.result == CURLE_OK && !json_scan_finish(&slot->scan)) slot->replied = 0;
+            if(slot->tokens > 0) slot->metrics.completion_tokens = slot->tokens;
+            slot->metrics.text = slot->text.response;
+            metrics_finish(&slot->metrics, slot->curl, slot->replied);
+            compare_show(slot, (int)(slot - slots), msg->data.result);
+            transport_body_done(&slot->upload, 0);
+            double seconds = 0;
+            curl_easy_getinfo(slot->curl, CURLINFO_TOTAL_TIME, &seconds);
+            total += seconds;
+            slot->finished = slot->replied;
+            if(slot->replied) answers++;
+        }
+        if(running > 0 && repl_poll(multi, 1000)) {
+            printf("(cancelled, %d still running)\n", running);
+            break;
+        }
+    }
+    printf("Wall clock %.2f s (%.2f s if asked one by one)\n", compare_now() - start, total);
 
-                    }
-                }
-            } else {
-                 cJSON *error = cJSON_GetObjectItem(json, "error");
-                 if (error) {
-                     cJSON *error_message = cJSON_GetObjectItem(error, "message");
-                     if (cJSON_IsString(error_message)) {
-                         fprintf(stderr, "API Error: %s\n", error_message->valuestring);
-                     }
-                 } else {
-                    fprintf(stderr, "Unexpected API response format.\n");
-                 }
+    int keep = 0;
+    if(answers > 0) {
+        printf("Keep which answer in the history? (number, Enter for none): ");
+        char choice_input[16];
+        if(repl_gets(choice_input, sizeof(choice_input))) {
+            long choice = strtol(choice_input, NULL, 10);
+            if(choice > 0 && choice <= n && slots[choice - 1].finished) {
+                add_message("assistant", slots[choice - 1].text.response);
+                keep = 1;
             }
-            cJSON_Delete(json);
-        } else {
-            fprintf(stderr, "Failed to parse API response JSON.\n");
         }
     }
+    // an unanswered prompt would leave two user turns in a row
+    if(!keep) history_drop_newest();
 
-    free(postdata);
-    free(chunk.response);
-    curl_slist_free_all(headers);
-    curl_easy_cleanup(curl);
-    cJSON_Delete(root);
+    for(int i = 0; i < n; i++) {
+        struct compare_slot *slot = &slots[i];
+        if(slot->curl) {
+            curl_multi_remove_handle(multi, slot->curl);
+            curl_easy_cleanup(slot->curl);
+        }
+        curl_slist_free_all(slot->headers);
+        json_scan_free(&slot->scan);
+        free(slot->body);
+        free(slot->upload.z);
+        free(slot->text.response);
+        free(slot->error);
+    }
+    curl_multi_cleanup(multi);
 }
-int main() {
+int main(int argc, char **argv) {
+    const char *resume = journal_parse_args(&argc, argv);
+    if(argc > 1) {
+        fprintf(stderr, "Usage: %s [--resume SESSION]\n", argv[0]);
+        return 1;
+    }
     openrouter_api_key = getenv("OPENROUTER_API_KEY");
+    // behind llmproxy a client without a key of its own uses the daemon's
+    const char *proxy = getenv("LLM_PROXY");
+    if(!openrouter_api_key && proxy && proxy[0]) openrouter_api_key = "";
     if(!openrouter_api_key) {
         fprintf(stderr, "Where the fuck is your API key?\n");
         return 1;
     }
+    char model[128] = "openai/gpt-oss-20b:free";
+    journal_enabled = 1;
+    if(resume && !history_resume(resume, model, sizeof(model))) return 1;
+    transport_init();
+    // cached answers have to be reproducible, see respcache.h
+    if(rcache_wanted()) history_options = RCACHE_OPTIONS;
+    if(!transport_proxy_url(openrouter_chat_url, sizeof(openrouter_chat_url), "/chat/completions") ||
+       !transport_proxy_url(openrouter_models_url, sizeof(openrouter_models_url), "/models")) {
+        transport_url(openrouter_chat_url, sizeof(openrouter_chat_url), "LLM_OPENROUTER_URL", "https://openrouter.ai/api/v1", "/chat/completions");
+        transport_url(openrouter_models_url, sizeof(openrouter_models_url), "LLM_OPENROUTER_URL", "https://openrouter.ai/api/v1", "/models");
+    }
+    catalog_init(&openrouter_catalog, "openrouter", openrouter_models_url);
+    catalog_load(&openrouter_catalog);
+    // the only cJSON trees are the streamed events, see stream_event
+    cJSON_InitHooks(&(cJSON_Hooks){ arena_cjson_malloc, arena_cjson_free });
 
+    repl_init();
+    // connect while the first prompt is being typed
+    transport_warm(openrouter_chat_url);
+    repl_idle = transport_warm_tick;
     char input[2048];
-    char model[128] = "openai/gpt-oss-20b:free";
-    printf("Commands: /model to change model, /quit to exit\n");
+    printf("Commands: /model [words ctx>=128k price<1 free in:image sort:price] to find and change model, /attach <file> to send a text file or image with the next message (/detach drops them), /compare m1,m2 to ask several models at once, /pin to always send the last message, /unpin, /fork [name] to branch the conversation here, /undo to take back the last turn, /branches to list them, /switch <branch>, /mem for memory use, /cache for response cache stats, /stats for request timings, /quit to exit (Ctrl-C stops an answer)\n");
     printf("Current Model: %s\n", model);
+    update_context_budget(model);
 
     while(1) {
         printf("> ");
-        if(!fgets(input, sizeof(input), stdin)) break;
+        if(!repl_gets(input, sizeof(input))) break;
         input[strcspn(input, "\n")] = 0; 
 
         if(strlen(input) == 0) continue;
         if(strcmp(input, "/quit") == 0) break;
+        if(strcmp(input, "/mem") == 0) {
+            history_print_mem();
+            printf("Reply buffer: %zu bytes, grown %lu times\n", reply_buffer.cap, reply_buffer_grows);
+            arena_print_stats(&scratch_arena, "Scratch arena");
+            continue;
+        }
+        if(strcmp(input, "/stats") == 0) {
+            metrics_print();
+            ratelimit_print();
+            continue;
+        }
+        if(strcmp(input, "/cache") == 0) {
+            rcache_print_stats();
+            continue;
+        }
+        if(strncmp(input, "/attach", 7) == 0 && (input[7] == ' ' || input[7] == 0)) {
+            const char *path = input + 7 + strspn(input + 7, " ");
+            if(path[0]) attach_add(path);
+            else attach_list();
+            continue;
+        }
+        if(strcmp(input, "/detach") == 0) {
+            attach_clear();
+            continue;
+        }
+        if(strcmp(input, "/pin") == 0) {
+            history_pin_last();
+            continue;
+        }
+        if(strcmp(input, "/unpin") == 0) {
+            history_unpin_all();
+            continue;
+        }
+        if(strcmp(input, "/undo") == 0) {
+            history_undo();
+            continue;
+        }
+        if(strcmp(input, "/branches") == 0) {
+            history_list_branches();
+            continue;
+        }
+        if(strncmp(input, "/fork", 5) == 0 && (input[5] == ' ' || input[5] == 0)) {
+            history_fork(input + 5 + strspn(input + 5, " "));
+            continue;
+        }
+        if(strncmp(input, "/switch", 7) == 0 && (input[7] == ' ' || input[7] == 0)) {
+            const char *which = input + 7 + strspn(input + 7, " ");
+            if(which[0]) history_switch(which);
+            else history_list_branches();
+            continue;
+        }
 
-        if(strcmp(input, "/model") == 0) {
-            list_available_models();
-            if (num_selectable_models > 0) {
+        if(strncmp(input, "/compare", 8) == 0 && (input[8] == ' ' || input[8] == 0)) {
+            compare_models(model, input + 8);
+            continue;
+        }
+        if(strncmp(input, "/model", 6) == 0 && (input[6] == ' ' || input[6] == 0)) {
+            const char *query = input + 6 + strspn(input + 6, " ");
+            list_available_models(query);
+            if(query[0] && (num_selectable_models == 1 || (num_selectable_models > 1 && strcmp(selectable_models[0], query) == 0))) {
+                select_model(model, sizeof(model), selectable_models[0]);
+            } else if(num_selectable_models > 0) {
                 printf("Enter model number to use: ");
                 char choice_input[16];
-                if(fgets(choice_input, sizeof(choice_input), stdin)) {
+                if(repl_gets(choice_input, sizeof(choice_input))) {
                     char *endptr;
                     long choice = strtol(choice_input, &endptr, 10);
                     if (endptr != choice_input && (*endptr == '\n' || *endptr == '\0') && choice > 0 && choice <= num_selectable_models) {
-                        strncpy(model, selectable_models[choice - 1], sizeof(model) - 1);
-                        model[sizeof(model) - 1] = '\0'; 
-                        printf("Model set to: %s\n", model);
+                        select_model(model, sizeof(model), selectable_models[choice - 1]);
                     } else {
                         fprintf(stderr, "What the hell? Keeping model: %s\n", model);
                     }
                 }
-            } else {
-                 printf("Ok, someone fuck up and we don't know who\n");
             }
             continue;
         }
         
-        add_message("user", input);
+        add_user_message(input);
         chat_with_openrouter(model, input);
     }
-    for(int i = 0; i < history_size; i++) {
-        if(history[i].content) free(history[i].content);
-    }
+    history_free();
     for(int i = 0; i < num_selectable_models; i++) {
         free(selectable_models[i]);
     }
+    model_index_cleanup();
+    catalog_free(&openrouter_catalog);
+    rcache_close();
+    metrics_close();
+    repl_cleanup();
+    transport_cleanup();
+    curl_slist_free_all(chat_headers);
+    free(reply_buffer.response);
+    arena_free(&scratch_arena);
     return 0;
 }
@@ -0,0 +1,338 @@
+#ifndef RATELIMIT_H
+#define RATELIMIT_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <curl/curl.h>
+#include "transport.h"
+#include "repl.h"
+
+// Rate-limit governor: requests are paced to what the provider says it
+// will take, and the ones it turns away anyway are retried instead of
+// losing the turn.
+//
+// Every response's headers pass through ratelimit_header, which picks out
+// Retry-After and the limits the providers report: OpenAI's
+// x-ratelimit-{limit,remaining,reset}-{requests,tokens}, OpenRouter's
+// X-RateLimit-{Limit,Remaining,Reset} and Anthropic's
+// anthropic-ratelimit-{requests,tokens}-*. Each host and model has a pair
+// of token buckets, for requests and for tokens, sized from the last limit
+// seen and refilled at the rate that brings the remaining count back to the
+// limit by the reset time. Before a request goes out the bucket is asked
+// how long to wait; a bucket nothing was learned about yet never holds
+// anything back.
+//
+// A 429, a 5xx or a dropped connection before any of the answer arrived
+// is retried up to LLM_RETRIES times (default 4), after the Retry-After
+// the server asked for or else an exponential backoff (1, 2, 4... seconds,
+// each somewhere between half and all of that). The wait is put on the
+// bucket, so every other request for the same model holds back as well
+// instead of being rejected too. A wait longer than LLM_RETRY_MAX_WAIT
+// seconds (default 60) is not taken; the request fails with the reason.
+
+#define RATELIMIT_MAX 32
+#define RATELIMIT_BACKOFF_BASE 1.0   // seconds before the first retry
+
+// What one response said; -1 where it didn't say
+struct ratelimit_info {
+    long status;
+    double retry_after;            // seconds
+    double limit[2], remaining[2], reset[2];   // [0] requests, [1] tokens; reset in seconds from now
+};
+
+struct ratelimit_dim {
+    double capacity;     // 0: unknown, no pacing
+    double available;
+    double rate;         // per second
+};
+
+struct ratelimit_bucket {
+    char key[200];       // host and model
+    struct ratelimit_dim dim[2];
+    double last;         // when the dims were last refilled
+    double blocked_until;
+    long requests, paced, rejected, retried, gave_up;
+    double waited;       // seconds spent holding requests back
+};
+
+static struct ratelimit_bucket ratelimit_buckets[RATELIMIT_MAX];
+static int ratelimit_num_buckets = 0;
+static int ratelimit_retries = -1;       // LLM_RETRIES, read on first use
+static double ratelimit_max_wait = 60;
+
+static double ratelimit_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void ratelimit_info_reset(struct ratelimit_info *info) {
+    info->status = 0;
+    info->retry_after = -1;
+    for(int d = 0; d < 2; d++) info->limit[d] = info->remaining[d] = info->reset[d] = -1;
+}
+
+// "1s", "6m0s", "20ms", "1h2m3.5s"
+static double ratelimit_duration(const char *v) {
+    double total = 0;
+    while(*v && *v != '\r' && *v != '\n') {
+        char *end;
+        double n = strtod(v, &end);
+        if(end == v) return -1;
+        if(strncmp(end, "ms", 2) == 0) total += n / 1000, end += 2;
+        else if(*end == 'h') total += n * 3600, end++;
+        else if(*end == 'm') total += n * 60, end++;
+        else if(*end == 's') total += n, end++;
+        else return total + n;
+        v = end;
+    }
+    return total;
+}
+
+// A reset as seconds from now: a duration, an RFC 3339 time (Anthropic),
+// epoch seconds or milliseconds (OpenRouter), or plain seconds.
+static double ratelimit_reset_value(const char *v) {
+    int year, month, day, hour, min;
+    double sec;
+    if(sscanf(v, "%4d-%2d-%2dT%2d:%2d:%lf", &year, &month, &day, &hour, &min, &sec) == 6) {
+        struct tm tm = { .tm_year = year - 1900, .tm_mon = month - 1, .tm_mday = day, .tm_hour = hour, .tm_min = min };
+        return (double)(timegm(&tm) - time(NULL)) + sec;
+    }
+    char *end;
+    double n = strtod(v, &end);
+    if(end == v) return -1;
+    if(*end && *end != '\r' && *end != '\n' && *end != ' ') return ratelimit_duration(v);
+    if(n > 1e12) return n / 1000 - (double)time(NULL);
+    if(n > 1e9) return n - (double)time(NULL);
+    return n;
+}
+
+// CURLOPT_HEADERFUNCTION; userp is a struct ratelimit_info
+static size_t ratelimit_header(char *buffer, size_t size, size_t nitems, void *userp) {
+    struct ratelimit_info *info = userp;
+    size_t len = size * nitems;
+    char line[256];
+    size_t n = len < sizeof(line) - 1 ? len : sizeof(line) - 1;
+    memcpy(line, buffer, n);
+    line[n] = 0;
+    if(strncmp(line, "HTTP/", 5) == 0) {
+        // every response starts over, e.g. after 100 Continue
+        ratelimit_info_reset(info);
+        const char *code = strchr(line, ' ');
+        if(code) info->status = strtol(code + 1, NULL, 10);
+        return len;
+    }
+    char *colon = strchr(line, ':');
+    if(!colon) return len;
+    *colon = 0;
+    for(char *c = line; *c; c++) if(*c >= 'A' && *c <= 'Z') *c += 'a' - 'A';
+    const char *v = colon + 1;
+    while(*v == ' ') v++;
+    if(strcmp(line, "retry-after-ms") == 0) {
+        info->retry_after = strtod(v, NULL) / 1000;
+    } else if(strcmp(line, "retry-after") == 0 && info->retry_after < 0) {
+        char *end;
+        double s = strtod(v, &end);
+        if(end == v) {
+            time_t when = curl_getdate(v, NULL);
+            s = when > 0 ? (double)(when - time(NULL)) : -1;
+        }
+        info->retry_after = s;
+    } else if(strncmp(line, "x-ratelimit-", 12) == 0 || strncmp(line, "anthropic-ratelimit-", 20) == 0) {
+        // "limit-requests", "requests-limit", or OpenRouter's plain "limit",
+        // which counts requests. Anthropic also reports input and output
+        // tokens separately; the total will do.
+        const char *name = line[0] == 'a' ? line + 20 : line + 12;
+        int d = strstr(name, "token") ? 1 : 0;
+        double *field = strstr(name, "limit") ? info->limit : strstr(name, "remaining") ? info->remaining :
+                        strstr(name, "reset") ? info->reset : NULL;
+        if(field && !strstr(name, "input") && !strstr(name, "output")) {
+            field[d] = field == info->reset ? ratelimit_reset_value(v) : strtod(v, NULL);
+        }
+    }
+    return len;
+}
+
+static struct ratelimit_bucket *ratelimit_find(const char *url, const char *model) {
+    if(ratelimit_retries < 0) {
+        const char *retries = getenv("LLM_RETRIES");
+        const char *wait = getenv("LLM_RETRY_MAX_WAIT");
+        ratelimit_retries = retries && retries[0] ? atoi(retries) : 4;
+        if(ratelimit_retries < 0) ratelimit_retries = 0;
+        if(wait && wait[0]) ratelimit_max_wait = atof(wait);
+        srand((unsigned)time(NULL) ^ (unsigned)getpid());
+    }
+    char key[200];
+    transport_host(url, key, 128);
+    snprintf(key + strlen(key), sizeof(key) - strlen(key), " %s", model);
+    for(int i = 0; i < ratelimit_num_buckets; i++) {
+        if(strcmp(ratelimit_buckets[i].key, key) == 0) return &ratelimit_buckets[i];
+    }
+    // full: the least used one is forgotten, in place, since requests in
+    // flight hold pointers to the others
+    struct ratelimit_bucket *b = &ratelimit_buckets[0];
+    if(ratelimit_num_buckets < RATELIMIT_MAX) {
+        b = &ratelimit_buckets[ratelimit_num_buckets++];
+    } else {
+        for(int i = 1; i < ratelimit_num_buckets; i++) {
+            if(ratelimit_buckets[i].requests < b->requests) b = &ratelimit_buckets[i];
+        }
+    }
+    memset(b, 0, sizeof(*b));
+    snprintf(b->key, sizeof(b->key), "%s", key);
+    b->last = ratelimit_now();
+    return b;
+}
+
+static void ratelimit_refill(struct ratelimit_bucket *b, double now) {
+    for(int d = 0; d < 2; d++) {
+        struct ratelimit_dim *dim = &b->dim[d];
+        if(dim->capacity <= 0) continue;
+        dim->available += dim->rate * (now - b->last);
+        if(dim->available > dim->capacity) dim->available = dim->capacity;
+    }
+    b->last = now;
+}
+
+// Seconds until a request of about tokens may go out, 0 for right away.
+static double ratelimit_delay(struct ratelimit_bucket *b, long tokens) {
+    double now = ratelimit_now();
+    ratelimit_refill(b, now);
+    double wait = b->blocked_until > now ? b->blocked_until - now : 0;
+    double need[2] = { 1, (double)tokens };
+    for(int d = 0; d < 2; d++) {
+        struct ratelimit_dim *dim = &b->dim[d];
+        if(dim->capacity <= 0 || need[d] <= 0 || dim->rate <= 0) continue;
+        // a request bigger than the whole bucket only has to wait for a full one
+        double want = need[d] < dim->capacity ? need[d] : dim->capacity;
+        if(dim->available < want && (want - dim->available) / dim->rate > wait) {
+            wait = (want - dim->available) / dim->rate;
+        }
+    }
+    return wait;
+}
+
+// A request is going out now
+static void ratelimit_sent(struct ratelimit_bucket *b, long tokens) {
+    ratelimit_refill(b, ratelimit_now());
+    b->requests++;
+    if(b->dim[0].capacity > 0) b->dim[0].available -= 1;
+    if(b->dim[1].capacity > 0) b->dim[1].available -= (double)tokens;
+}
+
+// Learn from a response's headers
+static void ratelimit_update(struct ratelimit_bucket *b, const struct ratelimit_info *info) {
+    double now = ratelimit_now();
+    ratelimit_refill(b, now);
+    for(int d = 0; d < 2; d++) {
+        struct ratelimit_dim *dim = &b->dim[d];
+        if(info->limit[d] <= 0 || info->remaining[d] < 0) continue;
+        dim->capacity = info->limit[d];
+        dim->available = info->remaining[d];
+        double reset = info->reset[d];
+        if(reset > 0 && info->remaining[d] < info->limit[d]) dim->rate = (info->limit[d] - info->remaining[d]) / reset;
+        // unknown or implausibly slow: assume the usual per-minute window
+        if(dim->rate < info->limit[d] / 3600) dim->rate = info->limit[d] / 60;
+        // a fixed window that is used up stays shut until it resets
+        if(info->remaining[d] < 1 && reset > 0 && now + reset > b->blocked_until) b->blocked_until = now + reset;
+    }
+    if(info->retry_after > 0 && now + info->retry_after > b->blocked_until) b->blocked_until = now + info->retry_after;
+}
+
+static int ratelimit_transient(CURLcode res, long status) {
+    switch(res) {
+        case CURLE_OK:
+            return status == 408 || status == 425 || status == 429 || (status >= 500 && status != 501 && status != 505);
+        case CURLE_COULDNT_CONNECT:
+        case CURLE_OPERATION_TIMEDOUT:
+        case CURLE_SEND_ERROR:
+        case CURLE_RECV_ERROR:
+        case CURLE_GOT_NOTHING:
+        case CURLE_PARTIAL_FILE:
+        case CURLE_SSL_CONNECT_ERROR:
+        case CURLE_HTTP2:
+        case CURLE_HTTP2_STREAM:
+            return 1;
+        default:
+            return 0;
+    }
+}
+
+// After a failed attempt (the attempt-th, from 0) that returned nothing
+// usable: decide whether to try again. If so, the wait is put on the bucket
+// for ratelimit_delay to hand out, and 1 is returned. name says what waits,
+// for the message; NULL keeps quiet.
+static int ratelimit_retry(struct ratelimit_bucket *b, const struct ratelimit_info *info, CURLcode res,
+                           int attempt, const char *name) {
+    long status = info->status;
+    if(res == CURLE_ABORTED_BY_CALLBACK || !ratelimit_transient(res, status)) return 0;
+    if(status == 429) b->rejected++;
+    double now = ratelimit_now();
+    double wait = info->retry_after;
+    if(wait < 0) {
+        double cap = RATELIMIT_BACKOFF_BASE * (double)(1L << (attempt < 16 ? attempt : 16));
+        wait = cap / 2 + (cap / 2) * rand() / RAND_MAX;
+    } else {
+        // a little spread, so everyone told the same time doesn't come back at once
+        wait += wait * 0.1 * rand() / RAND_MAX;
+    }
+    if(b->blocked_until - now > wait) wait = b->blocked_until - now;
+    char reason[64];
+    if(res != CURLE_OK) snprintf(reason, sizeof(reason), "%s", curl_easy_strerror(res));
+    else snprintf(reason, sizeof(reason), "HTTP %ld", status);
+    if(attempt >= ratelimit_retries || wait > ratelimit_max_wait) {
+        b->gave_up++;
+        if(name && ratelimit_retries > 0) {
+            if(attempt >= ratelimit_retries) fprintf(stderr, "(%s: %s, gave up after %d attempts)\n", name, reason, attempt + 1);
+            else fprintf(stderr, "(%s: %s, asked to wait %.0f s, not waiting that long)\n", name, reason, wait);
+        }
+        return 0;
+    }
+    b->retried++;
+    b->blocked_until = now + wait;
+    if(name) {
+        printf("(%s: %s, trying again in %.1f s)\n", name, reason, wait);
+        fflush(stdout);
+    }
+    return 1;
+}
+
+// Interactive programs: hold the attempt-th try of a request back as long
+// as its bucket says, Ctrl-C cutting the wait short. Returns 1 if it was
+// cut short.
+static int ratelimit_wait(struct ratelimit_bucket *b, long tokens, int attempt) {
+    double wait = ratelimit_delay(b, tokens);
+    if(wait > 0) {
+        // a retry's wait was announced and counted by ratelimit_retry
+        if(attempt == 0) b->paced++;
+        if(wait >= 1 && attempt == 0) {
+            printf("(waiting %.1f s for the rate limit)\n", wait);
+            fflush(stdout);
+        }
+        double start = ratelimit_now();
+        int interrupted = repl_sleep(wait);
+        if(attempt == 0) b->waited += ratelimit_now() - start;
+        if(interrupted) return 1;
+    }
+    ratelimit_sent(b, tokens);
+    return 0;
+}
+
+static void ratelimit_print(void) {
+    int shown = 0;
+    for(int i = 0; i < ratelimit_num_buckets; i++) {
+        struct ratelimit_bucket *b = &ratelimit_buckets[i];
+        if(!b->paced && !b->rejected && !b->retried && !b->dim[0].capacity && !b->dim[1].capacity) continue;
+        if(!shown++) printf("Rate limits:\n");
+        printf("  %s: %ld requests, %ld held back (%.1f s), %ld rejected, %ld retried, %ld given up", b->key, b->requests,
+               b->paced, b->waited, b->rejected, b->retried, b->gave_up);
+        if(b->dim[0].capacity > 0) printf("; %.0f/%.0f requests left", b->dim[0].available, b->dim[0].capacity);
+        if(b->dim[1].capacity > 0) printf("; %.0f/%.0f tokens left", b->dim[1].available, b->dim[1].capacity);
+        printf("\n");
+    }
+}
+
+#endif
@@ -0,0 +1,227 @@
+#ifndef REPL_H
+#define REPL_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <curl/curl.h>
+
+// Event loop for the interactive programs. Requests run on a multi handle
+// while the same poll also watches stdin and a self-pipe written by the
+// SIGINT handler, so:
+//   - Ctrl-C during a request aborts just that request (the caller keeps
+//     whatever part of the answer arrived); at the prompt it quits;
+//   - lines typed while an answer is coming in are queued and become the
+//     next prompts, with no dead time between turns.
+// All reading of stdin goes through repl_gets so queued lines are never
+// skipped.
+
+static volatile sig_atomic_t repl_interrupted = 0;
+static int repl_signal_pipe[2] = { -1, -1 };
+static CURLM *repl_multi = NULL;
+static char *repl_queue = NULL;     // bytes read from stdin, not yet returned
+static size_t repl_queue_len = 0, repl_queue_cap = 0;
+static size_t repl_ahead = 0;       // how many of them were typed during a request
+static int repl_eof = 0;
+static int repl_type_ahead = 0;     // stdin is a terminal, read it during requests
+// Background work while waiting for a line (transport_warm_tick): called on
+// every wakeup, returns a multi handle to drive alongside stdin or NULL, and
+// the longest wait before it wants to be called again (-1: none).
+static CURLM *(*repl_idle)(int *timeout_ms) = NULL;
+
+static void repl_on_sigint(int sig) {
+    (void)sig;
+    int saved = errno;
+    repl_interrupted = 1;
+    if(write(repl_signal_pipe[1], "", 1) < 0) {
+        // pipe full: a wakeup is already pending
+    }
+    errno = saved;
+}
+
+static void repl_init(void) {
+    if(pipe(repl_signal_pipe) == 0) {
+        fcntl(repl_signal_pipe[0], F_SETFL, O_NONBLOCK);
+        fcntl(repl_signal_pipe[1], F_SETFL, O_NONBLOCK);
+        struct sigaction sa;
+        memset(&sa, 0, sizeof(sa));
+        sa.sa_handler = repl_on_sigint;
+        sigemptyset(&sa.sa_mask);
+        sigaction(SIGINT, &sa, NULL);
+    }
+    repl_multi = curl_multi_init();
+    repl_type_ahead = isatty(STDIN_FILENO);
+}
+
+static void repl_cleanup(void) {
+    if(repl_multi) curl_multi_cleanup(repl_multi);
+    repl_multi = NULL;
+    free(repl_queue);
+    repl_queue = NULL;
+    repl_queue_len = repl_queue_cap = 0;
+}
+
+// Consume a pending Ctrl-C. Returns 1 if there was one.
+static int repl_take_interrupt(void) {
+    char drain[64];
+    while(repl_signal_pipe[0] >= 0 && read(repl_signal_pipe[0], drain, sizeof(drain)) > 0) {}
+    int was = repl_interrupted;
+    repl_interrupted = 0;
+    return was;
+}
+
+// One read() of whatever stdin has. Returns 0 on EOF or error.
+static int repl_read_stdin(int ahead) {
+    if(repl_queue_len + 4096 > repl_queue_cap) {
+        size_t cap = repl_queue_cap ? repl_queue_cap * 2 : 8192;
+        char *queue = realloc(repl_queue, cap);
+        if(!queue) return 0;
+        repl_queue = queue;
+        repl_queue_cap = cap;
+    }
+    ssize_t n = read(STDIN_FILENO, repl_queue + repl_queue_len, repl_queue_cap - repl_queue_len);
+    if(n < 0 && errno == EINTR) return 1;
+    if(n <= 0) {
+        repl_eof = 1;
+        return 0;
+    }
+    repl_queue_len += n;
+    if(ahead) repl_ahead = repl_queue_len;
+    return 1;
+}
+
+// fgets for stdin. Returns NULL on EOF, or on Ctrl-C while waiting for a
+// line.
+static char *repl_gets(char *buf, int size) {
+    fflush(stdout);
+    for(;;) {
+        char *nl = repl_queue_len ? memchr(repl_queue, '\n', repl_queue_len) : NULL;
+        if(nl || (repl_eof && repl_queue_len > 0)) {
+            size_t line = nl ? (size_t)(nl - repl_queue) + 1 : repl_queue_len;
+            size_t n = line < (size_t)size - 1 ? line : (size_t)size - 1;
+            memcpy(buf, repl_queue, n);
+            buf[n] = 0;
+            // typed while an answer was printing: show what is being sent now
+            if(repl_ahead > 0) {
+                fwrite(buf, 1, n, stdout);
+                if(buf[n - 1] != '\n') fputc('\n', stdout);
+            }
+            // the rest of a line that doesn't fit would become the next
+            // prompt; drop it instead and say so
+            if(n < line) fprintf(stderr, "(line cut to %zu of %zu bytes, /attach a file to send long text)\n", n, line);
+            memmove(repl_queue, repl_queue + line, repl_queue_len - line);
+            repl_queue_len -= line;
+            repl_ahead = repl_ahead > line ? repl_ahead - line : 0;
+            return buf;
+        }
+        if(repl_eof) return NULL;
+        int timeout = -1;
+        CURLM *background = repl_idle ? repl_idle(&timeout) : NULL;
+        if(background) {
+            struct curl_waitfd fds[2] = {
+                { .fd = STDIN_FILENO, .events = CURL_WAIT_POLLIN },
+                { .fd = repl_signal_pipe[0], .events = CURL_WAIT_POLLIN },
+            };
+            curl_multi_poll(background, fds, repl_signal_pipe[0] >= 0 ? 2 : 1, timeout, NULL);
+            if(repl_take_interrupt()) {
+                printf("\n");
+                return NULL;
+            }
+            // curl doesn't report POLLHUP, and a closed pipe only has that
+            struct pollfd in = { .fd = STDIN_FILENO, .events = POLLIN };
+            if(poll(&in, 1, 0) > 0 && (in.revents & (POLLIN | POLLHUP | POLLERR))) repl_read_stdin(0);
+            continue;
+        }
+        struct pollfd fds[2] = {
+            { .fd = STDIN_FILENO, .events = POLLIN },
+            { .fd = repl_signal_pipe[0], .events = POLLIN },
+        };
+        int r = poll(fds, repl_signal_pipe[0] >= 0 ? 2 : 1, timeout);
+        if(r < 0 && errno != EINTR) return NULL;
+        if(repl_take_interrupt()) {
+            printf("\n");
+            return NULL;
+        }
+        if(r > 0 && (fds[0].revents & (POLLIN | POLLHUP | POLLERR))) repl_read_stdin(0);
+    }
+}
+
+// Wait on the multi handle, stdin and the signal pipe at once. Returns 1
+// if Ctrl-C was pressed.
+static int repl_poll(CURLM *multi, int timeout_ms) {
+    struct curl_waitfd extra[2];
+    unsigned n = 0;
+    int watch_stdin = repl_type_ahead && !repl_eof;
+    if(watch_stdin) {
+        extra[n].fd = STDIN_FILENO;
+        extra[n].events = CURL_WAIT_POLLIN;
+        extra[n].revents = 0;
+        n++;
+    }
+    if(repl_signal_pipe[0] >= 0) {
+        extra[n].fd = repl_signal_pipe[0];
+        extra[n].events = CURL_WAIT_POLLIN;
+        extra[n].revents = 0;
+        n++;
+    }
+    curl_multi_poll(multi, extra, n, timeout_ms, NULL);
+    if(watch_stdin && (extra[0].revents & CURL_WAIT_POLLIN)) repl_read_stdin(1);
+    return repl_take_interrupt();
+}
+
+// Wait seconds the same way, e.g. before retrying a request. Returns 1 if
+// Ctrl-C cut it short.
+static int repl_sleep(double seconds) {
+    struct timespec start, now;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    repl_take_interrupt();
+    for(;;) {
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        double left = seconds - (now.tv_sec - start.tv_sec) - (now.tv_nsec - start.tv_nsec) / 1e9;
+        if(left <= 0) return 0;
+        int ms = (int)(left * 1000) + 1;
+        if(repl_multi) {
+            if(repl_poll(repl_multi, ms)) return 1;
+        } else {
+            struct timespec ts = { ms / 1000, (ms % 1000) * 1000000L };
+            nanosleep(&ts, NULL);
+            if(repl_take_interrupt()) return 1;
+        }
+    }
+}
+
+// curl_easy_perform that stays responsive: queues type-ahead and returns
+// CURLE_ABORTED_BY_CALLBACK when the user presses Ctrl-C. (tui drives its
+// requests on repl_multi itself.)
+__attribute__((unused)) static CURLcode repl_perform(CURL *curl) {
+    if(!repl_multi) return curl_easy_perform(curl);
+    CURLcode result = CURLE_OK;
+    if(curl_multi_add_handle(repl_multi, curl) != CURLM_OK) return CURLE_FAILED_INIT;
+    repl_take_interrupt();
+    int running = 1;
+    while(running) {
+        if(curl_multi_perform(repl_multi, &running) != CURLM_OK) {
+            result = CURLE_FAILED_INIT;
+            break;
+        }
+        CURLMsg *msg;
+        int left;
+        while((msg = curl_multi_info_read(repl_multi, &left))) {
+            if(msg->msg == CURLMSG_DONE && msg->easy_handle == curl) result = msg->data.result;
+        }
+        if(running && repl_poll(repl_multi, 1000)) {
+            result = CURLE_ABORTED_BY_CALLBACK;
+            break;
+        }
+    }
+    curl_multi_remove_handle(repl_multi, curl);
+    return result;
+}
+
+#endif
@@ -0,0 +1,353 @@
+#ifndef RESPCACHE_H
+#define RESPCACHE_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <zlib.h>
+#include "catalog.h"
+#include "jsonscan.h"
+
+// Opt-in response cache (LLM_CACHE=1). A reply is stored under a hash of
+// the endpoint and the exact request body, so replaying a conversation
+// byte for byte returns the earlier answer without a request.
+//
+// responses.idx is a memory-mapped open-addressing table of fixed size;
+// responses.dat is an append-only file of records. Entries expire after
+// LLM_CACHE_TTL seconds (default a week) and the least recently used ones
+// are dropped once the live records exceed LLM_CACHE_MB (default 64). The
+// data file is compacted when most of it is dead. Several processes can
+// share the cache: every operation holds an flock on the index.
+//
+// Only requests that ask for greedy decoding ("temperature":0, and no
+// top_p below 1) are cached: without a temperature the provider samples at
+// its default, and the same body would not get the same answer. With the
+// cache on, the programs add RCACHE_OPTIONS to every request for that.
+
+#define RCACHE_SLOTS 8192
+#define RCACHE_MAGIC "llmrc1"
+#define RCACHE_OPTIONS ",\"temperature\":0"
+
+struct rcache_header {
+    char magic[8];
+    uint64_t data_end;      // where the next record goes
+    uint64_t live_bytes;    // bytes of indexed records
+    uint64_t tick;          // LRU clock
+    uint64_t hits, misses;  // over the lifetime of the cache
+    uint64_t generation;    // bumped when the data file is rewritten
+    uint32_t entries;
+    uint32_t slots;
+};
+
+struct rcache_slot {
+    uint64_t h1, h2;        // both 0: empty
+    uint64_t offset;
+    uint32_t length;        // reply bytes
+    uint32_t pad;
+    int64_t created;
+    uint64_t used;          // tick of the last hit
+};
+
+// Record in the data file: h1, h2, length, then the reply text
+#define RCACHE_RECORD_HEAD 20
+
+static int rcache_state = 0;          // 0 not opened yet, 1 open, -1 off
+static int rcache_idx_fd = -1, rcache_dat_fd = -1;
+static struct rcache_header *rcache_hdr = NULL;
+static struct rcache_slot *rcache_slots = NULL;
+static size_t rcache_map_size = 0;
+static uint64_t rcache_generation = 0;
+static uint64_t rcache_max_bytes = 64ull << 20;
+static long rcache_ttl = 7 * 24 * 3600;
+static long rcache_session_hits = 0, rcache_session_misses = 0, rcache_session_bypass = 0;
+
+static int rcache_open_data(void) {
+    char path[640];
+    if(!cache_file_path("responses.dat", path, sizeof(path))) return 0;
+    if(rcache_dat_fd >= 0) close(rcache_dat_fd);
+    rcache_dat_fd = open(path, O_RDWR | O_CREAT, 0600);
+    rcache_generation = rcache_hdr->generation;
+    return rcache_dat_fd >= 0;
+}
+
+// LLM_CACHE is set, whether or not the cache could be opened
+static int rcache_wanted(void) {
+    const char *on = getenv("LLM_CACHE");
+    return on && on[0] && strcmp(on, "0") != 0;
+}
+
+static int rcache_open(void) {
+    if(rcache_state) return rcache_state > 0;
+    rcache_state = -1;
+    if(!rcache_wanted()) return 0;
+    const char *mb = getenv("LLM_CACHE_MB");
+    if(mb && atol(mb) > 0) rcache_max_bytes = (uint64_t)atol(mb) << 20;
+    const char *ttl = getenv("LLM_CACHE_TTL");
+    if(ttl && atol(ttl) > 0) rcache_ttl = atol(ttl);
+
+    char path[640];
+    if(!cache_file_path("responses.idx", path, sizeof(path))) return 0;
+    rcache_idx_fd = open(path, O_RDWR | O_CREAT, 0600);
+    if(rcache_idx_fd < 0) return 0;
+    rcache_map_size = sizeof(struct rcache_header) + RCACHE_SLOTS * sizeof(struct rcache_slot);
+    flock(rcache_idx_fd, LOCK_EX);
+    struct stat st;
+    if(fstat(rcache_idx_fd, &st) != 0 || ((size_t)st.st_size < rcache_map_size && ftruncate(rcache_idx_fd, rcache_map_size) != 0)) {
+        flock(rcache_idx_fd, LOCK_UN);
+        close(rcache_idx_fd);
+        return 0;
+    }
+    void *map = mmap(NULL, rcache_map_size, PROT_READ | PROT_WRITE, MAP_SHARED, rcache_idx_fd, 0);
+    if(map == MAP_FAILED) {
+        flock(rcache_idx_fd, LOCK_UN);
+        close(rcache_idx_fd);
+        return 0;
+    }
+    rcache_hdr = (struct rcache_header *)map;
+    rcache_slots = (struct rcache_slot *)(rcache_hdr + 1);
+    if(memcmp(rcache_hdr->magic, RCACHE_MAGIC, sizeof(RCACHE_MAGIC)) != 0 || rcache_hdr->slots != RCACHE_SLOTS) {
+        memset(map, 0, rcache_map_size);
+        memcpy(rcache_hdr->magic, RCACHE_MAGIC, sizeof(RCACHE_MAGIC));
+        rcache_hdr->slots = RCACHE_SLOTS;
+        char dat[640];
+        if(cache_file_path("responses.dat", dat, sizeof(dat))) truncate(dat, 0);
+    }
+    int ok = rcache_open_data();
+    flock(rcache_idx_fd, LOCK_UN);
+    if(!ok) return 0;
+    rcache_state = 1;
+    return 1;
+}
+
+static void rcache_close(void) {
+    if(rcache_hdr) munmap(rcache_hdr, rcache_map_size);
+    if(rcache_idx_fd >= 0) close(rcache_idx_fd);
+    if(rcache_dat_fd >= 0) close(rcache_dat_fd);
+    rcache_hdr = NULL;
+    rcache_slots = NULL;
+    rcache_idx_fd = rcache_dat_fd = -1;
+    rcache_state = 0;
+}
+
+// FNV-1a and CRC-32 of url, '\n', body; the total length is mixed into h2.
+static void rcache_key(const char *url, const char *body, size_t len, uint64_t *h1, uint64_t *h2) {
+    uint64_t h = 1469598103934665603ULL;
+    const unsigned char *parts[2] = { (const unsigned char *)url, (const unsigned char *)body };
+    size_t lens[2] = { strlen(url) + 1, len };   // the url's NUL stands in for the separator
+    uLong crc = crc32(0L, Z_NULL, 0);
+    for(int p = 0; p < 2; p++) {
+        for(size_t i = 0; i < lens[p]; i++) {
+            h ^= parts[p][i];
+            h *= 1099511628211ULL;
+        }
+        crc = crc32(crc, parts[p], (uInt)lens[p]);
+    }
+    *h1 = h ? h : 1;
+    *h2 = ((uint64_t)crc << 32) | (uint32_t)(lens[0] + lens[1]);
+}
+
+static int rcache_greedy, rcache_sampling;
+
+static void rcache_option(int path, int type, const char *value, size_t len, void *userp) {
+    double v = type == JSON_NUMBER ? strtod(value, NULL) : 0;
+    if(path == 0) {
+        if(type == JSON_NUMBER && v == 0) rcache_greedy = 1;
+        else rcache_sampling = 1;
+    } else if(type == JSON_NUMBER && v < 1) {
+        rcache_sampling = 1;
+    }
+}
+
+// Would the same body get the same answer? Only when it asks for
+// temperature 0; a body that doesn't say is sampled at the default.
+static int rcache_cacheable(const char *body, size_t len) {
+    static const char *paths[] = { "temperature", "top_p" };
+    struct json_scanner scan;
+    json_scan_init(&scan, paths, 2, rcache_option, NULL);
+    rcache_greedy = rcache_sampling = 0;
+    json_scan_feed(&scan, body, len);
+    json_scan_free(&scan);
+    return rcache_greedy && !rcache_sampling;
+}
+
+static struct rcache_slot *rcache_find(uint64_t h1, uint64_t h2) {
+    for(uint32_t i = (uint32_t)h1 & (RCACHE_SLOTS - 1);; i = (i + 1) & (RCACHE_SLOTS - 1)) {
+        struct rcache_slot *s = &rcache_slots[i];
+        if(s->h1 == 0 && s->h2 == 0) return s;
+        if(s->h1 == h1 && s->h2 == h2) return s;
+    }
+}
+
+// Backward-shift deletion keeps linear probing chains intact without tombstones.
+static void rcache_remove(struct rcache_slot *s) {
+    rcache_hdr->live_bytes -= RCACHE_RECORD_HEAD + s->length;
+    rcache_hdr->entries--;
+    uint32_t hole = (uint32_t)(s - rcache_slots);
+    uint32_t i = hole;
+    for(;;) {
+        i = (i + 1) & (RCACHE_SLOTS - 1);
+        struct rcache_slot *n = &rcache_slots[i];
+        if(n->h1 == 0 && n->h2 == 0) break;
+        uint32_t home = (uint32_t)n->h1 & (RCACHE_SLOTS - 1);
+        // move n into the hole unless its home lies cyclically in (hole, i]
+        int stays = hole <= i ? (home > hole && home <= i) : (home > hole || home <= i);
+        if(stays) continue;
+        rcache_slots[hole] = *n;
+        hole = i;
+    }
+    memset(&rcache_slots[hole], 0, sizeof(rcache_slots[hole]));
+}
+
+static void rcache_evict_lru(void) {
+    struct rcache_slot *oldest = NULL;
+    for(uint32_t i = 0; i < RCACHE_SLOTS; i++) {
+        struct rcache_slot *s = &rcache_slots[i];
+        if(s->h1 == 0 && s->h2 == 0) continue;
+        if(!oldest || s->used < oldest->used) oldest = s;
+    }
+    if(oldest) rcache_remove(oldest);
+}
+
+// Copy the live records into a fresh data file and point the index at it.
+static void rcache_compact(void) {
+    char path[640], tmp[660];
+    if(!cache_file_path("responses.dat", path, sizeof(path))) return;
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    int fd = open(tmp, O_RDWR | O_CREAT | O_TRUNC, 0600);
+    if(fd < 0) return;
+    uint64_t end = 0;
+    char *buf = NULL;
+    size_t cap = 0;
+    for(uint32_t i = 0; i < RCACHE_SLOTS; i++) {
+        struct rcache_slot *s = &rcache_slots[i];
+        if(s->h1 == 0 && s->h2 == 0) continue;
+        size_t n = RCACHE_RECORD_HEAD + s->length;
+        if(n > cap) {
+            char *p = realloc(buf, n);
+            if(!p) break;
+            buf = p;
+            cap = n;
+        }
+        if(pread(rcache_dat_fd, buf, n, (off_t)s->offset) != (ssize_t)n || pwrite(fd, buf, n, (off_t)end) != (ssize_t)n) {
+            free(buf);
+            close(fd);
+            remove(tmp);
+            return;
+        }
+        s->offset = end;
+        end += n;
+    }
+    free(buf);
+    close(fd);
+    if(rename(tmp, path) != 0) return;
+    rcache_hdr->data_end = end;
+    rcache_hdr->generation++;
+    rcache_open_data();
+}
+
+static void rcache_lock(void) {
+    flock(rcache_idx_fd, LOCK_EX);
+    // another process rewrote the data file since we opened it
+    if(rcache_hdr->generation != rcache_generation) rcache_open_data();
+}
+
+static void rcache_unlock(void) {
+    flock(rcache_idx_fd, LOCK_UN);
+}
+
+// The cached reply for this request as a malloc'd string, or NULL.
+static char *rcache_get(const char *url, const char *body, size_t len) {
+    if(!rcache_open()) return NULL;
+    if(!rcache_cacheable(body, len)) {
+        rcache_session_bypass++;
+        return NULL;
+    }
+    uint64_t h1, h2;
+    rcache_key(url, body, len, &h1, &h2);
+    char *reply = NULL;
+    rcache_lock();
+    struct rcache_slot *s = rcache_find(h1, h2);
+    if(s->h1 == h1 && s->h2 == h2) {
+        if(time(NULL) - s->created > rcache_ttl) {
+            rcache_remove(s);
+        } else if((reply = malloc(s->length + 1))) {
+            unsigned char head[RCACHE_RECORD_HEAD];
+            uint64_t r1, r2;
+            if(pread(rcache_dat_fd, head, sizeof(head), (off_t)s->offset) == (ssize_t)sizeof(head) &&
+               (memcpy(&r1, head, 8), memcpy(&r2, head + 8, 8), r1 == h1 && r2 == h2) &&
+               pread(rcache_dat_fd, reply, s->length, (off_t)s->offset + RCACHE_RECORD_HEAD) == (ssize_t)s->length) {
+                reply[s->length] = 0;
+                s->used = ++rcache_hdr->tick;
+            } else {
+                // record lost (e.g. data file removed by hand)
+                free(reply);
+                reply = NULL;
+                rcache_remove(s);
+            }
+        }
+    }
+    if(reply) rcache_hdr->hits++;
+    else rcache_hdr->misses++;
+    rcache_unlock();
+    if(reply) rcache_session_hits++;
+    else rcache_session_misses++;
+    return reply;
+}
+
+static void rcache_put(const char *url, const char *body, size_t len, const char *reply) {
+    if(!rcache_open() || !rcache_cacheable(body, len)) return;
+    size_t n = strlen(reply);
+    if(RCACHE_RECORD_HEAD + n > rcache_max_bytes) return;
+    uint64_t h1, h2;
+    rcache_key(url, body, len, &h1, &h2);
+    unsigned char head[RCACHE_RECORD_HEAD];
+    uint32_t n32 = (uint32_t)n;
+    memcpy(head, &h1, 8);
+    memcpy(head + 8, &h2, 8);
+    memcpy(head + 16, &n32, 4);
+    rcache_lock();
+    struct rcache_slot *s = rcache_find(h1, h2);
+    if(s->h1 == h1 && s->h2 == h2) rcache_remove(s);
+    while(rcache_hdr->entries > 0 && (rcache_hdr->live_bytes + RCACHE_RECORD_HEAD + n > rcache_max_bytes ||
+                                      rcache_hdr->entries >= RCACHE_SLOTS * 3 / 4)) {
+        rcache_evict_lru();
+    }
+    if(rcache_hdr->data_end > 2 * rcache_max_bytes && rcache_hdr->data_end > 2 * rcache_hdr->live_bytes) rcache_compact();
+    uint64_t off = rcache_hdr->data_end;
+    if(pwrite(rcache_dat_fd, head, sizeof(head), (off_t)off) == (ssize_t)sizeof(head) &&
+       pwrite(rcache_dat_fd, reply, n, (off_t)off + sizeof(head)) == (ssize_t)n) {
+        s = rcache_find(h1, h2);
+        s->h1 = h1;
+        s->h2 = h2;
+        s->offset = off;
+        s->length = n32;
+        s->created = time(NULL);
+        s->used = ++rcache_hdr->tick;
+        rcache_hdr->data_end = off + sizeof(head) + n;
+        rcache_hdr->live_bytes += sizeof(head) + n;
+        rcache_hdr->entries++;
+    }
+    rcache_unlock();
+}
+
+static void rcache_print_stats(void) {
+    if(!rcache_open()) {
+        printf("Response cache is off (set LLM_CACHE=1 to enable)\n");
+        return;
+    }
+    printf("Response cache: %u entries, %llu KB live of %llu KB file (limit %llu KB), TTL %ld s\n",
+           rcache_hdr->entries, (unsigned long long)(rcache_hdr->live_bytes >> 10),
+           (unsigned long long)(rcache_hdr->data_end >> 10), (unsigned long long)(rcache_max_bytes >> 10), rcache_ttl);
+    printf("This session: %ld hits, %ld misses, %ld bypassed; all time: %llu hits, %llu misses\n",
+           rcache_session_hits, rcache_session_misses, rcache_session_bypass,
+           (unsigned long long)rcache_hdr->hits, (unsigned long long)rcache_hdr->misses);
+}
+
+#endif
@@ -0,0 +1,234 @@
+#ifndef ROUTE_H
+#define ROUTE_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "catalog.h"
+
+// Per-model latency and error statistics, used to decide when a turn is
+// slow enough to be worth a hedged request to a fallback model.
+//
+// There is no hedging without a fallback: LLM_HEDGE_MODEL names one model
+// for all, or maps models to theirs ("gpt-4o=claude-sonnet-4,..."). A model
+// is never hedged with itself, which would only pay twice for the same
+// upstream.
+//
+// Every finished request adds its latency to an EWMA and to a window of
+// recent samples, and a success or failure to an error-rate EWMA. The
+// hedge delay for a model is the LLM_HEDGE_PERCENTILE (default 95th)
+// latency of its window; until a model has ROUTE_MIN_SAMPLES it is three
+// times the EWMA, or LLM_HEDGE_DELAY seconds (default 10) for a model never
+// seen. A request that was cancelled because its hedge won still counts
+// with the time it had run, so a stalled upstream pushes its own numbers
+// up. The statistics are kept in the cache directory between runs.
+
+#define ROUTE_MAX 32
+#define ROUTE_WINDOW 64
+#define ROUTE_MIN_SAMPLES 8
+#define ROUTE_ALPHA 0.2
+#define ROUTE_MIN_DELAY 0.5
+
+struct route {
+    char model[128];
+    double ewma;            // seconds
+    double errors;          // failure rate, 0..1
+    long requests, failures;
+    long hedged, hedge_wins;    // second requests sent, and answered first
+    float window[ROUTE_WINDOW];
+    int window_len, window_pos;
+};
+
+static struct route routes[ROUTE_MAX];
+static int num_routes = 0;
+static int route_hedging = 1;         // LLM_HEDGE=0 turns it off even with a fallback
+static double route_percentile = 0.95;
+static double route_default_delay = 10;
+static const char *route_hedge_model = NULL;   // LLM_HEDGE_MODEL, NULL: no hedging
+
+static struct route *route_lookup(const char *model) {
+    for(int i = 0; i < num_routes; i++) {
+        if(strcmp(routes[i].model, model) == 0) return &routes[i];
+    }
+    return NULL;
+}
+
+static struct route *route_find(const char *model) {
+    struct route *r = route_lookup(model);
+    if(r) return r;
+    if(num_routes < ROUTE_MAX) {
+        r = &routes[num_routes++];
+    } else {
+        // forget the least used model, in place so no other entry moves
+        r = &routes[0];
+        for(int i = 1; i < num_routes; i++) {
+            if(routes[i].requests < r->requests) r = &routes[i];
+        }
+    }
+    memset(r, 0, sizeof(*r));
+    snprintf(r->model, sizeof(r->model), "%s", model);
+    return r;
+}
+
+static void route_sample(struct route *r, double seconds) {
+    r->ewma = r->window_len == 0 ? seconds : ROUTE_ALPHA * seconds + (1 - ROUTE_ALPHA) * r->ewma;
+    r->window[r->window_pos] = (float)seconds;
+    r->window_pos = (r->window_pos + 1) % ROUTE_WINDOW;
+    if(r->window_len < ROUTE_WINDOW) r->window_len++;
+}
+
+// A request that finished, successfully or not.
+static void route_record(const char *model, double seconds, int ok) {
+    struct route *r = route_find(model);
+    r->requests++;
+    if(!ok) r->failures++;
+    r->errors = ROUTE_ALPHA * (ok ? 0 : 1) + (1 - ROUTE_ALPHA) * r->errors;
+    // failures often come back fast and would make the model look quick
+    if(ok) route_sample(r, seconds);
+}
+
+// A request given up after seconds because another one answered first.
+static void route_record_cancelled(const char *model, double seconds) {
+    route_sample(route_find(model), seconds);
+}
+
+static int route_compare_float(const void *a, const void *b) {
+    float x = *(const float *)a, y = *(const float *)b;
+    return x < y ? -1 : x > y;
+}
+
+static double route_window_percentile(const struct route *r, double p) {
+    float sorted[ROUTE_WINDOW];
+    memcpy(sorted, r->window, r->window_len * sizeof(float));
+    qsort(sorted, r->window_len, sizeof(float), route_compare_float);
+    int i = (int)(p * (r->window_len - 1) + 0.5);
+    return sorted[i];
+}
+
+// Seconds to wait for model before sending a hedge.
+static double route_hedge_delay(const char *model) {
+    struct route *r = route_find(model);
+    double delay;
+    if(r->window_len >= ROUTE_MIN_SAMPLES) delay = route_window_percentile(r, route_percentile);
+    else if(r->window_len > 0) delay = 3 * r->ewma;
+    else delay = route_default_delay;
+    return delay < ROUTE_MIN_DELAY ? ROUTE_MIN_DELAY : delay;
+}
+
+// Which of the two models goes first: the chosen one, unless it has been
+// failing while the fallback has not.
+static int route_prefer_fallback(const char *model, const char *fallback) {
+    if(strcmp(model, fallback) == 0) return 0;
+    // looked up without adding, so neither lookup can evict the other
+    struct route *r = route_lookup(model), *f = route_lookup(fallback);
+    if(!r) return 0;
+    return r->requests >= 3 && r->errors > 0.5 && (f ? f->errors : 0) < r->errors;
+}
+
+// The model to hedge model with (into buf), or NULL for none.
+static const char *route_fallback(const char *model, char *buf, size_t size) {
+    if(!route_hedging || !route_hedge_model) return NULL;
+    const char *spec = route_hedge_model;
+    if(!strchr(spec, '=')) {
+        snprintf(buf, size, "%s", spec);
+    } else {
+        buf[0] = 0;
+        while(*spec) {
+            size_t len = strcspn(spec, ","), eq = strcspn(spec, "=");
+            if(eq < len && eq == strlen(model) && strncmp(spec, model, eq) == 0) {
+                snprintf(buf, size, "%.*s", (int)(len - eq - 1), spec + eq + 1);
+                break;
+            }
+            spec += len;
+            if(*spec == ',') spec++;
+        }
+    }
+    return buf[0] && strcmp(buf, model) != 0 ? buf : NULL;
+}
+
+static void route_configure(void) {
+    const char *value = getenv("LLM_HEDGE");
+    if(value && strcmp(value, "0") == 0) route_hedging = 0;
+    value = getenv("LLM_HEDGE_MODEL");
+    if(value && value[0]) route_hedge_model = value;
+    value = getenv("LLM_HEDGE_PERCENTILE");
+    if(value) {
+        double p = strtod(value, NULL);
+        if(p > 0 && p < 100) route_percentile = p / 100;
+    }
+    value = getenv("LLM_HEDGE_DELAY");
+    if(value) {
+        double d = strtod(value, NULL);
+        if(d > 0) route_default_delay = d;
+    }
+}
+
+// routes file: "llmroute 1", then per model
+// <model> <ewma> <errors> <requests> <failures> <hedged> <hedge_wins> <n> <n samples, oldest first>
+static void route_load(void) {
+    char path[640];
+    if(!cache_file_path("routes", path, sizeof(path))) return;
+    FILE *f = fopen(path, "r");
+    if(!f) return;
+    char model[128];
+    if(fscanf(f, "llmroute %127s", model) != 1 || strcmp(model, "1") != 0) {
+        fclose(f);
+        return;
+    }
+    struct route r;
+    while(num_routes < ROUTE_MAX && fscanf(f, " %127s %lf %lf %ld %ld %ld %ld %d", model, &r.ewma, &r.errors,
+                                           &r.requests, &r.failures, &r.hedged, &r.hedge_wins, &r.window_len) == 8) {
+        if(r.window_len < 0 || r.window_len > ROUTE_WINDOW) break;
+        int ok = 1;
+        for(int i = 0; i < r.window_len && ok; i++) ok = fscanf(f, "%f", &r.window[i]) == 1;
+        if(!ok) break;
+        r.window_pos = r.window_len % ROUTE_WINDOW;
+        snprintf(r.model, sizeof(r.model), "%s", model);
+        routes[num_routes++] = r;
+    }
+    fclose(f);
+}
+
+static void route_save(void) {
+    char path[640], tmp[660];
+    if(num_routes == 0 || !cache_file_path("routes", path, sizeof(path))) return;
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    FILE *f = fopen(tmp, "w");
+    if(!f) return;
+    fprintf(f, "llmroute 1\n");
+    for(int i = 0; i < num_routes; i++) {
+        struct route *r = &routes[i];
+        fprintf(f, "%s %.4f %.4f %ld %ld %ld %ld %d", r->model, r->ewma, r->errors, r->requests, r->failures,
+                r->hedged, r->hedge_wins, r->window_len);
+        int start = r->window_len < ROUTE_WINDOW ? 0 : r->window_pos;
+        for(int j = 0; j < r->window_len; j++) fprintf(f, " %.3f", r->window[(start + j) % ROUTE_WINDOW]);
+        fprintf(f, "\n");
+    }
+    if(fclose(f) == 0) rename(tmp, path);
+    else remove(tmp);
+}
+
+static void route_print(void) {
+    if(num_routes == 0) {
+        printf("No requests yet\n");
+        return;
+    }
+    printf("%-32s %8s %8s %8s %6s %8s %6s\n", "model", "requests", "ewma", "p50", "errors", "hedge at", "hedges");
+    for(int i = 0; i < num_routes; i++) {
+        struct route *r = &routes[i];
+        char p50[16] = "-";
+        if(r->window_len > 0) snprintf(p50, sizeof(p50), "%.2fs", route_window_percentile(r, 0.5));
+        printf("%-32s %8ld %7.2fs %8s %5.0f%% %7.2fs %3ld/%-3ld\n", r->model, r->requests, r->ewma, p50,
+               100 * r->errors, route_hedge_delay(r->model), r->hedge_wins, r->hedged);
+    }
+    if(!route_hedging || !route_hedge_model) {
+        printf("Hedging off%s\n", route_hedging ? " (LLM_HEDGE_MODEL names a fallback model to hedge with)" : "");
+        return;
+    }
+    long hedged = 0;
+    for(int i = 0; i < num_routes; i++) hedged += routes[i].hedged;
+    printf("Hedging with %s after the p%.0f latency. Each hedge is a second billed request: %ld so far.\n",
+           route_hedge_model, route_percentile * 100, hedged);
+}
+
+#endif
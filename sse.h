@@ -0,0 +1,125 @@
+#ifndef SSE_H
+#define SSE_H
+
+#include <stdlib.h>
+#include <string.h>
+
+// Incremental server-sent-events parser. Feed it whatever curl hands the
+// write callback; it calls on_event once per complete event with the joined
+// "data:" payload. Lines and events may be split anywhere across chunks.
+
+typedef void (*sse_event_fn)(const char *data, size_t len, void *userp);
+
+struct sse_parser {
+    char *line;          // partial line carried over from the previous chunk
+    size_t line_len, line_cap;
+    char *data;          // data: fields of the event being assembled
+    size_t data_len, data_cap;
+    int has_data;
+    int skip_lf;         // previous chunk ended in '\r', drop a leading '\n'
+    sse_event_fn on_event;
+    void *userp;
+};
+
+static int sse_reserve(char **buf, size_t *cap, size_t need) {
+    if(need <= *cap) return 1;
+    size_t n = *cap ? *cap : 256;
+    while(n < need) n *= 2;
+    char *ptr = realloc(*buf, n);
+    if(!ptr) return 0;
+    *buf = ptr;
+    *cap = n;
+    return 1;
+}
+
+static void sse_init(struct sse_parser *p, sse_event_fn on_event, void *userp) {
+    memset(p, 0, sizeof(*p));
+    p->on_event = on_event;
+    p->userp = userp;
+}
+
+static void sse_free(struct sse_parser *p) {
+    free(p->line);
+    free(p->data);
+    p->line = p->data = NULL;
+    p->line_len = p->line_cap = p->data_len = p->data_cap = 0;
+}
+
+static void sse_dispatch(struct sse_parser *p) {
+    if(p->has_data) {
+        if(!sse_reserve(&p->data, &p->data_cap, p->data_len + 1)) return;
+        p->data[p->data_len] = 0;
+        p->on_event(p->data, p->data_len, p->userp);
+    }
+    p->data_len = 0;
+    p->has_data = 0;
+}
+
+static void sse_line(struct sse_parser *p, const char *line, size_t len) {
+    if(len == 0) {
+        sse_dispatch(p);
+        return;
+    }
+    if(line[0] == ':') return; // comment / keep-alive
+    if(len < 5 || memcmp(line, "data:", 5) != 0) return; // event:, id:, retry: are not used
+    line += 5;
+    len -= 5;
+    if(len > 0 && line[0] == ' ') {
+        line++;
+        len--;
+    }
+    size_t need = p->data_len + len + 2;
+    if(!sse_reserve(&p->data, &p->data_cap, need)) return;
+    if(p->has_data) p->data[p->data_len++] = '\n';
+    memcpy(p->data + p->data_len, line, len);
+    p->data_len += len;
+    p->has_data = 1;
+}
+
+// Returns len, or 0 on allocation failure so curl aborts the transfer.
+static size_t sse_feed(struct sse_parser *p, const char *buf, size_t len) {
+    size_t i = 0;
+    if(p->skip_lf && len > 0) {
+        if(buf[0] == '\n') i = 1;
+        p->skip_lf = 0;
+    }
+    size_t start = i;
+    for(; i < len; i++) {
+        char c = buf[i];
+        if(c != '\n' && c != '\r') continue;
+        if(p->line_len > 0) {
+            if(!sse_reserve(&p->line, &p->line_cap, p->line_len + (i - start))) return 0;
+            memcpy(p->line + p->line_len, buf + start, i - start);
+            p->line_len += i - start;
+            sse_line(p, p->line, p->line_len);
+            p->line_len = 0;
+        } else {
+            sse_line(p, buf + start, i - start);
+        }
+        if(c == '\r') {
+            if(i + 1 < len) {
+                if(buf[i + 1] == '\n') i++;
+            } else {
+                p->skip_lf = 1;
+            }
+        }
+        start = i + 1;
+    }
+    if(start < len) {
+        if(!sse_reserve(&p->line, &p->line_cap, p->line_len + (len - start))) return 0;
+        memcpy(p->line + p->line_len, buf + start, len - start);
+        p->line_len += len - start;
+    }
+    return len;
+}
+
+// Flush a trailing event when the stream closes without a blank line.
+static void sse_finish(struct sse_parser *p) {
+    if(p->line_len > 0) {
+        sse_line(p, p->line, p->line_len);
+        p->line_len = 0;
+    }
+    sse_dispatch(p);
+}
+
+#endif
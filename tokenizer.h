@@ -0,0 +1,257 @@
+#ifndef TOKENIZER_H
+#define TOKENIZER_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+// Fast in-process token counter. Text is split into GPT-style pre-tokens
+// (words with their leading space, digit groups, punctuation runs,
+// whitespace) and each pre-token is run through byte-level BPE using the
+// rank table of a tiktoken file (e.g. cl100k_base.tiktoken) named by
+// $LLM_TOKENIZER. Without that file a per-pre-token estimate is used, which
+// is close enough for budgeting. Counts per pre-token are memoized, so
+// repeated words cost a hash lookup.
+
+#define TOKEN_CACHE_SIZE 8192       // memoized pre-token counts, power of 2
+#define TOKEN_MAX_PIECE 128         // longer pre-tokens are counted in slices
+
+struct bpe_entry {
+    uint32_t hash;
+    uint32_t rank;
+    uint32_t off;     // into bpe_pool
+    uint32_t len;
+};
+
+struct token_cache_entry {
+    uint64_t hash;
+    uint32_t len;
+    uint32_t count;
+};
+
+static struct bpe_entry *bpe_table = NULL;   // open addressing, size bpe_mask + 1
+static uint32_t bpe_mask = 0;
+static unsigned char *bpe_pool = NULL;
+static size_t bpe_pool_len = 0, bpe_pool_cap = 0;
+static size_t bpe_count = 0;
+static struct token_cache_entry token_cache[TOKEN_CACHE_SIZE];
+static int tokenizer_loaded = 0;
+
+static uint64_t token_hash64(const unsigned char *s, size_t len) {
+    uint64_t h = 1469598103934665603ULL;
+    for(size_t i = 0; i < len; i++) {
+        h ^= s[i];
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+static int bpe_lookup(const unsigned char *s, size_t len, uint32_t *rank) {
+    if(!bpe_table) return 0;
+    uint32_t h = (uint32_t)token_hash64(s, len);
+    for(uint32_t i = h & bpe_mask;; i = (i + 1) & bpe_mask) {
+        struct bpe_entry *e = &bpe_table[i];
+        if(e->len == 0) return 0;
+        if(e->hash == h && e->len == len && memcmp(bpe_pool + e->off, s, len) == 0) {
+            *rank = e->rank;
+            return 1;
+        }
+    }
+}
+
+static int bpe_insert(const unsigned char *s, size_t len, uint32_t rank) {
+    if(len == 0) return 1;
+    if(bpe_pool_len + len > bpe_pool_cap) {
+        size_t cap = bpe_pool_cap ? bpe_pool_cap * 2 : 1 << 20;
+        while(cap < bpe_pool_len + len) cap *= 2;
+        unsigned char *pool = realloc(bpe_pool, cap);
+        if(!pool) return 0;
+        bpe_pool = pool;
+        bpe_pool_cap = cap;
+    }
+    memcpy(bpe_pool + bpe_pool_len, s, len);
+    uint32_t h = (uint32_t)token_hash64(s, len);
+    uint32_t i = h & bpe_mask;
+    while(bpe_table[i].len != 0) i = (i + 1) & bpe_mask;
+    bpe_table[i].hash = h;
+    bpe_table[i].rank = rank;
+    bpe_table[i].off = (uint32_t)bpe_pool_len;
+    bpe_table[i].len = (uint32_t)len;
+    bpe_pool_len += len;
+    bpe_count++;
+    return 1;
+}
+
+static size_t base64_decode(const char *in, size_t len, unsigned char *out) {
+    static signed char map[256];
+    static int ready = 0;
+    if(!ready) {
+        const char *alphabet = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+        memset(map, -1, sizeof(map));
+        for(int i = 0; i < 64; i++) map[(unsigned char)alphabet[i]] = (signed char)i;
+        ready = 1;
+    }
+    uint32_t acc = 0;
+    int bits = 0;
+    size_t n = 0;
+    for(size_t i = 0; i < len; i++) {
+        signed char v = map[(unsigned char)in[i]];
+        if(v < 0) continue;
+        acc = (acc << 6) | (uint32_t)v;
+        bits += 6;
+        if(bits >= 8) {
+            bits -= 8;
+            out[n++] = (unsigned char)(acc >> bits);
+        }
+    }
+    return n;
+}
+
+// Load "<base64 token> <rank>" lines. Returns the number of ranks loaded.
+static size_t tokenizer_load(const char *path) {
+    FILE *f = fopen(path, "r");
+    if(!f) return 0;
+    size_t lines = 0;
+    char line[512];
+    while(fgets(line, sizeof(line), f)) lines++;
+    rewind(f);
+    uint32_t size = 1;
+    while(size < lines * 2) size <<= 1;
+    bpe_table = calloc(size, sizeof(*bpe_table));
+    if(!bpe_table) {
+        fclose(f);
+        return 0;
+    }
+    bpe_mask = size - 1;
+    unsigned char tok[512];
+    while(fgets(line, sizeof(line), f)) {
+        char *space = strchr(line, ' ');
+        if(!space) continue;
+        size_t n = base64_decode(line, space - line, tok);
+        bpe_insert(tok, n, (uint32_t)strtoul(space + 1, NULL, 10));
+    }
+    fclose(f);
+    return bpe_count;
+}
+
+static void tokenizer_init(void) {
+    if(tokenizer_loaded) return;
+    tokenizer_loaded = 1;
+    const char *path = getenv("LLM_TOKENIZER");
+    if(path && path[0] && tokenizer_load(path) == 0) {
+        fprintf(stderr, "Could not load tokenizer ranks from %s, estimating token counts\n", path);
+    }
+}
+
+// Byte-level BPE: merge the adjacent pair with the lowest rank until none
+// of the pairs is a known token.
+static uint32_t bpe_count_piece(const unsigned char *s, size_t len) {
+    uint32_t rank;
+    if(bpe_lookup(s, len, &rank)) return 1;
+    size_t starts[TOKEN_MAX_PIECE + 1];
+    size_t parts = len;
+    for(size_t i = 0; i <= len; i++) starts[i] = i;
+    while(parts > 1) {
+        uint32_t best = UINT32_MAX;
+        size_t best_i = 0;
+        for(size_t i = 0; i + 1 < parts; i++) {
+            if(bpe_lookup(s + starts[i], starts[i + 2] - starts[i], &rank) && rank < best) {
+                best = rank;
+                best_i = i;
+            }
+        }
+        if(best == UINT32_MAX) break;
+        memmove(&starts[best_i + 1], &starts[best_i + 2], (parts - best_i - 1) * sizeof(size_t));
+        parts--;
+    }
+    return (uint32_t)parts;
+}
+
+static int token_is_letter(unsigned char c) {
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c >= 0x80;
+}
+
+static int token_is_digit(unsigned char c) {
+    return c >= '0' && c <= '9';
+}
+
+static int token_is_space(unsigned char c) {
+    return c == ' ' || c == '\t' || c == '\n' || c == '\r' || c == '\f' || c == '\v';
+}
+
+// Rough count for one pre-token when no rank table is loaded.
+static uint32_t estimate_piece(const unsigned char *s, size_t len) {
+    size_t i = (s[0] == ' ' && len > 1) ? 1 : 0;
+    unsigned char c = s[i];
+    if(token_is_letter(c)) {
+        if(c >= 0x80) return (uint32_t)((len - i + 1) / 2);
+        return (uint32_t)(1 + (len - i - 1) / 6);
+    }
+    if(token_is_digit(c)) return 1;
+    if(token_is_space(c)) return 1;
+    return (uint32_t)((len - i + 1) / 2);
+}
+
+static uint32_t count_piece(const unsigned char *s, size_t len) {
+    uint64_t h = token_hash64(s, len);
+    struct token_cache_entry *e = &token_cache[h & (TOKEN_CACHE_SIZE - 1)];
+    if(e->hash == h && e->len == len && e->count) return e->count;
+    uint32_t count = 0;
+    for(size_t off = 0; off < len; off += TOKEN_MAX_PIECE) {
+        size_t n = len - off < TOKEN_MAX_PIECE ? len - off : TOKEN_MAX_PIECE;
+        count += bpe_table ? bpe_count_piece(s + off, n) : estimate_piece(s + off, n);
+    }
+    e->hash = h;
+    e->len = (uint32_t)len;
+    e->count = count;
+    return count;
+}
+
+// Length of the pre-token starting at s (roughly the cl100k split pattern).
+static size_t pretoken_len(const unsigned char *s, size_t len) {
+    size_t i = 0;
+    if(s[0] == '\'' && len >= 2) {
+        unsigned char c = s[1] | 0x20;
+        if(c == 's' || c == 't' || c == 'm' || c == 'd') return 2;
+        if(len >= 3) {
+            unsigned char d = s[2] | 0x20;
+            if((c == 'r' && d == 'e') || (c == 'v' && d == 'e') || (c == 'l' && d == 'l')) return 3;
+        }
+    }
+    if(token_is_digit(s[0])) {
+        while(i < len && i < 3 && token_is_digit(s[i])) i++;
+        return i;
+    }
+    if(token_is_space(s[0])) {
+        while(i < len && token_is_space(s[i])) i++;
+        // leave the last space to attach to the following word
+        if(i < len && i > 1 && s[i - 1] == ' ') i--;
+        else if(i == 1 && i < len && s[0] == ' ') i = 0;
+        else return i;
+        if(i > 0) return i;
+    }
+    if(s[i] == ' ') i++;
+    if(i < len && token_is_letter(s[i])) {
+        while(i < len && token_is_letter(s[i])) i++;
+        return i;
+    }
+    while(i < len && !token_is_letter(s[i]) && !token_is_digit(s[i]) && !token_is_space(s[i])) i++;
+    return i > 0 ? i : 1;
+}
+
+static int count_tokens(const char *text) {
+    tokenizer_init();
+    const unsigned char *s = (const unsigned char *)text;
+    size_t len = strlen(text);
+    uint32_t total = 0;
+    while(len > 0) {
+        size_t n = pretoken_len(s, len);
+        total += count_piece(s, n);
+        s += n;
+        len -= n;
+    }
+    return (int)total;
+}
+
+#endif
@@ -0,0 +1,524 @@
+#ifndef TRANSPORT_H
+#define TRANSPORT_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <curl/curl.h>
+#include <zlib.h>
+#include "attach.h"
+
+// Long-lived transport: one easy handle per provider host, all of them
+// attached to a CURLSH that shares the DNS cache, TLS sessions and the
+// connection pool. Connection setup is paid once per session instead of
+// once per message.
+//
+// Low-bandwidth mode (LLM_LOW_BANDWIDTH=1) is for slow links: responses are
+// negotiated compressed (whatever encodings curl was built with) and request
+// bodies, which repeat the whole conversation every turn, are gzipped. Not
+// every API takes a gzipped body, so the first compressed upload to a host
+// is a probe: if the server refuses it with 400 or 415, the same request is
+// sent again uncompressed and that host only gets plain bodies from then on.
+// Each turn reports the bytes that crossed the wire against the JSON sizes.
+//
+// Warm-up: while the first prompt is being typed, a HEAD request to each
+// provider host resolves it and sets up TCP and TLS on a multi handle of its
+// own, driven from the prompt wait (repl_idle), so the connection is in the
+// shared pool when Enter is pressed. Hosts are warmed again at the prompt
+// after LLM_WARM_IDLE seconds without traffic (default 90, servers drop idle
+// connections), but not once nothing was asked for TRANSPORT_WARM_GIVE_UP.
+// Failures are ignored, and a real request cancels whatever warm-up has not
+// finished yet, so offline it costs nothing. LLM_WARM=0 turns it off.
+//
+// Daemon: with LLM_PROXY set, a client that asks transport_proxy_url for its
+// endpoints talks to llmproxy.c instead of the provider, over the Unix
+// socket LLM_PROXY names (a path) or at host:port.
+//
+// llmproxy.c includes this for transport_url and transport_setup only; the
+// client entry points are marked unused for it (and transport_proxy_url for
+// tui, which has no daemon).
+
+#define TRANSPORT_MAX_HOSTS 8
+#define TRANSPORT_WARM_GIVE_UP 1800   // seconds without a request
+
+struct transport_conn {
+    char host[128];
+    CURL *curl;
+    int gzip_upload;    // 1 accepted, -1 refused, 0 not tried yet
+};
+
+// One request body on its way out, possibly gzipped
+struct transport_body {
+    CURL *curl;
+    struct transport_conn *conn;
+    const char *data;                 // the plain JSON
+    size_t len;
+    unsigned char *z;                 // gzipped copy, if sent that way
+    size_t z_len;
+    struct curl_slist **headers;      // the caller's list
+    struct curl_slist *added;         // our node at its end (Content-Encoding or Expect)
+    size_t (*write)(void *, size_t, size_t, void *);
+    void *userp;
+    int probe;                        // retry plain if the host refuses gzip
+    int refused;
+    int resent_plain;                 // refused, then sent again without gzip
+    curl_off_t received;              // response bytes after decoding
+    curl_off_t wire_up, wire_down;    // bytes of earlier attempts
+    struct attach_stream *stream;     // the body has files in it, see attach.h
+};
+
+static CURLSH *transport_share = NULL;
+static struct transport_conn transport_conns[TRANSPORT_MAX_HOSTS];
+static int transport_num_conns = 0;
+static int transport_low_bandwidth = -1;
+static curl_off_t transport_wire_sent = 0, transport_json_sent = 0;
+static curl_off_t transport_wire_received = 0, transport_json_received = 0;
+
+struct transport_warm {
+    char url[512];
+    CURL *curl;          // warm-up in flight, NULL otherwise
+    time_t last_used;    // last warm-up or request
+};
+
+static CURLM *transport_warm_multi = NULL;
+static struct transport_warm transport_warms[TRANSPORT_MAX_HOSTS];
+static int transport_num_warms = 0;
+static int transport_warm_idle = 90;      // seconds, 0: off
+static time_t transport_last_request = 0;
+static char transport_unix_socket[108];   // sun_path, see transport_proxy_url
+
+static int transport_low_bandwidth_mode(void) {
+    if(transport_low_bandwidth < 0) {
+        const char *on = getenv("LLM_LOW_BANDWIDTH");
+        transport_low_bandwidth = on && on[0] && strcmp(on, "0") != 0;
+    }
+    return transport_low_bandwidth;
+}
+
+__attribute__((unused)) static void transport_init(void) {
+    curl_global_init(CURL_GLOBAL_DEFAULT);
+    transport_share = curl_share_init();
+    if(!transport_share) return;
+    curl_share_setopt(transport_share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+    curl_share_setopt(transport_share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+    curl_share_setopt(transport_share, CURLSHOPT_SHARE, CURL_LOCK_DATA_CONNECT);
+}
+
+static void transport_setup_options(CURL *curl) {
+    if(transport_share) curl_easy_setopt(curl, CURLOPT_SHARE, transport_share);
+    curl_easy_setopt(curl, CURLOPT_HTTP_VERSION, (long)CURL_HTTP_VERSION_2TLS);
+    curl_easy_setopt(curl, CURLOPT_PIPEWAIT, 1L);
+    curl_easy_setopt(curl, CURLOPT_TCP_KEEPALIVE, 1L);
+    curl_easy_setopt(curl, CURLOPT_TCP_KEEPIDLE, 30L);
+    curl_easy_setopt(curl, CURLOPT_TCP_KEEPINTVL, 15L);
+    curl_easy_setopt(curl, CURLOPT_DNS_CACHE_TIMEOUT, 600L);
+    curl_easy_setopt(curl, CURLOPT_MAXAGE_CONN, 600L);
+    if(transport_low_bandwidth_mode()) curl_easy_setopt(curl, CURLOPT_ACCEPT_ENCODING, "");
+    if(transport_unix_socket[0]) curl_easy_setopt(curl, CURLOPT_UNIX_SOCKET_PATH, transport_unix_socket);
+}
+
+// A transfer is about to start, so the user is done typing: unfinished
+// warm-ups would only hold connections the transfer could wait on.
+static void transport_warm_cancel(void) {
+    transport_last_request = time(NULL);
+    for(int i = 0; i < transport_num_warms; i++) {
+        struct transport_warm *w = &transport_warms[i];
+        if(!w->curl) continue;
+        curl_multi_remove_handle(transport_warm_multi, w->curl);
+        curl_easy_cleanup(w->curl);
+        w->curl = NULL;
+    }
+}
+
+// Options every pooled handle gets; also used for extra handles that
+// should ride on the same connections (e.g. concurrent transfers).
+static void transport_setup(CURL *curl) {
+    transport_warm_cancel();
+    transport_setup_options(curl);
+}
+
+// Endpoint for a provider: base is replaced by the environment variable env
+// when it is set (e.g. LLM_OPENAI_URL=http://127.0.0.1:8080/v1 for a local
+// mock or proxy), then path is appended.
+static void transport_url(char *url, size_t size, const char *env, const char *base, const char *path) {
+    const char *custom = getenv(env);
+    if(custom && custom[0]) base = custom;
+    size_t n = strlen(base);
+    while(n > 0 && base[n - 1] == '/') n--;
+    snprintf(url, size, "%.*s%s", (int)n, base, path);
+}
+
+// With LLM_PROXY set, url becomes path under the daemon's /v1 and 1 is
+// returned; every handle set up from then on goes through its socket.
+// Returns 0 without it, for the caller to fall back to transport_url.
+__attribute__((unused)) static int transport_proxy_url(char *url, size_t size, const char *path) {
+    const char *proxy = getenv("LLM_PROXY");
+    if(!proxy || !proxy[0]) return 0;
+    if(proxy[0] == '/') {
+        snprintf(transport_unix_socket, sizeof(transport_unix_socket), "%s", proxy);
+        snprintf(url, size, "http://localhost/v1%s", path);
+    } else {
+        snprintf(url, size, "http://%s/v1%s", proxy, path);
+    }
+    return 1;
+}
+
+static void transport_host(const char *url, char *host, size_t size) {
+    const char *p = strstr(url, "://");
+    p = p ? p + 3 : url;
+    size_t n = strcspn(p, "/?#");
+    if(n >= size) n = size - 1;
+    memcpy(host, p, n);
+    host[n] = 0;
+}
+
+// Returns the pooled handle for url's host, reset to a clean state but with
+// its connections, DNS entries and TLS sessions intact. Do not clean it up.
+__attribute__((unused)) static CURL *transport_handle(const char *url) {
+    char host[128];
+    transport_host(url, host, sizeof(host));
+    for(int i = 0; i < transport_num_conns; i++) {
+        if(strcmp(transport_conns[i].host, host) == 0) {
+            CURL *curl = transport_conns[i].curl;
+            curl_easy_reset(curl);
+            transport_setup(curl);
+            return curl;
+        }
+    }
+    if(transport_num_conns >= TRANSPORT_MAX_HOSTS) {
+        fprintf(stderr, "Too many provider hosts\n");
+        return NULL;
+    }
+    CURL *curl = curl_easy_init();
+    if(!curl) return NULL;
+    transport_setup(curl);
+    strcpy(transport_conns[transport_num_conns].host, host);
+    transport_conns[transport_num_conns].curl = curl;
+    transport_conns[transport_num_conns].gzip_upload = 0;
+    transport_num_conns++;
+    return curl;
+}
+
+static struct transport_conn *transport_conn_for(const char *url) {
+    char host[128];
+    transport_host(url, host, sizeof(host));
+    for(int i = 0; i < transport_num_conns; i++) {
+        if(strcmp(transport_conns[i].host, host) == 0) return &transport_conns[i];
+    }
+    return NULL;
+}
+
+static int transport_gzip(struct transport_body *b) {
+    z_stream zs;
+    memset(&zs, 0, sizeof(zs));
+    if(deflateInit2(&zs, 6, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) return 0;
+    size_t bound = deflateBound(&zs, b->len);
+    b->z = malloc(bound);
+    if(!b->z) {
+        deflateEnd(&zs);
+        return 0;
+    }
+    zs.next_in = (Bytef *)b->data;
+    zs.avail_in = (uInt)b->len;
+    zs.next_out = b->z;
+    zs.avail_out = (uInt)bound;
+    int ok = deflate(&zs, Z_FINISH) == Z_STREAM_END;
+    b->z_len = zs.total_out;
+    deflateEnd(&zs);
+    if(!ok || b->z_len >= b->len) {
+        free(b->z);
+        b->z = NULL;
+        return 0;
+    }
+    return 1;
+}
+
+// Does the error body say anything about the encoding? Case-insensitive.
+static int transport_mentions_encoding(const char *data, size_t len) {
+    static const char *words[] = { "encoding", "gzip", "compress" };
+    for(int w = 0; w < 3; w++) {
+        size_t n = strlen(words[w]);
+        for(size_t i = 0; i + n <= len; i++) {
+            if(strncasecmp(data + i, words[w], n) == 0) return 1;
+        }
+    }
+    return 0;
+}
+
+static size_t transport_write(void *contents, size_t size, size_t nmemb, void *userp) {
+    struct transport_body *b = (struct transport_body *)userp;
+    size_t realsize = size * nmemb;
+    // 415 is the refusal; a 400 only when it is about the encoding, any
+    // other (a bad model id...) goes to the caller like always
+    if(b->z && b->probe && !b->refused && b->received == 0) {
+        long status = 0;
+        curl_easy_getinfo(b->curl, CURLINFO_RESPONSE_CODE, &status);
+        if(status == 415 || (status == 400 && transport_mentions_encoding(contents, realsize))) b->refused = 1;
+    }
+    // the answer to a refused probe is not the caller's business
+    if(b->refused) return realsize;
+    b->received += realsize;
+    return b->write(contents, size, nmemb, b->userp);
+}
+
+// Attach body to curl, gzipped in low-bandwidth mode unless url's host is
+// known not to take it. headers must already be set on the handle; a
+// Content-Encoding header is appended to it when needed, and taken off
+// again by transport_body_done, so the caller may keep one list for every
+// request. probe: the caller runs transport_retry after the transfer, so a
+// host may be tried.
+__attribute__((unused)) static void transport_post(struct transport_body *b, CURL *curl, const char *url,
+                                                   struct curl_slist **headers, const char *data, size_t len,
+                                                   size_t (*write)(void *, size_t, size_t, void *), void *userp,
+                                                   int probe) {
+    memset(b, 0, sizeof(*b));
+    b->curl = curl;
+    b->conn = transport_conn_for(url);
+    b->data = data;
+    b->len = len;
+    b->write = write;
+    b->userp = userp;
+    b->probe = probe;
+    b->headers = headers;
+    // files are read into the upload as it goes, and not gzipped: images
+    // are compressed already and the point is not to hold a copy
+    b->stream = attach_stream_open(data, len, strstr(url, "/messages") != NULL);
+    if(b->stream) {
+        b->len = (size_t)b->stream->total;
+        *headers = curl_slist_append(*headers, "Expect:");
+        for(b->added = *headers; b->added->next; b->added = b->added->next) {}
+        curl_easy_setopt(curl, CURLOPT_HTTPHEADER, *headers);
+        curl_easy_setopt(curl, CURLOPT_POSTFIELDS, NULL);
+        curl_easy_setopt(curl, CURLOPT_POST, 1L);
+        curl_easy_setopt(curl, CURLOPT_READFUNCTION, attach_read);
+        curl_easy_setopt(curl, CURLOPT_READDATA, (void *)b->stream);
+        curl_easy_setopt(curl, CURLOPT_SEEKFUNCTION, attach_seek);
+        curl_easy_setopt(curl, CURLOPT_SEEKDATA, (void *)b->stream);
+        curl_easy_setopt(curl, CURLOPT_POSTFIELDSIZE_LARGE, b->stream->total);
+        curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, transport_write);
+        curl_easy_setopt(curl, CURLOPT_WRITEDATA, (void *)b);
+        return;
+    }
+    int state = b->conn ? b->conn->gzip_upload : 0;
+    if(transport_low_bandwidth_mode() && (state > 0 || (state == 0 && probe)) && transport_gzip(b)) {
+        *headers = curl_slist_append(*headers, "Content-Encoding: gzip");
+        for(b->added = *headers; b->added->next; b->added = b->added->next) {}
+        curl_easy_setopt(curl, CURLOPT_HTTPHEADER, *headers);
+        curl_easy_setopt(curl, CURLOPT_POSTFIELDS, (const char *)b->z);
+        curl_easy_setopt(curl, CURLOPT_POSTFIELDSIZE, (long)b->z_len);
+    } else {
+        curl_easy_setopt(curl, CURLOPT_POSTFIELDS, data);
+        curl_easy_setopt(curl, CURLOPT_POSTFIELDSIZE, (long)len);
+    }
+    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, transport_write);
+    curl_easy_setopt(curl, CURLOPT_WRITEDATA, (void *)b);
+}
+
+// Take our node off the end of the caller's header list
+static void transport_unlink_header(struct transport_body *b) {
+    if(!b->added) return;
+    if(*b->headers == b->added) {
+        *b->headers = NULL;
+    } else {
+        struct curl_slist *h = *b->headers;
+        while(h->next != b->added) h = h->next;
+        h->next = NULL;
+    }
+    curl_slist_free_all(b->added);
+    b->added = NULL;
+}
+
+// Body bytes as they crossed the wire, i.e. before decoding. Headers are
+// left out so the numbers compare like for like with the JSON sizes.
+static void transport_wire_bytes(CURL *curl, curl_off_t *up, curl_off_t *down) {
+    *up = *down = 0;
+    curl_easy_getinfo(curl, CURLINFO_SIZE_UPLOAD_T, up);
+    curl_easy_getinfo(curl, CURLINFO_SIZE_DOWNLOAD_T, down);
+}
+
+// After the transfer: returns 1 if the host refused the gzipped body and
+// the handle is now set up to send it again plain.
+__attribute__((unused)) static int transport_retry(struct transport_body *b, struct curl_slist **headers, CURLcode res) {
+    if(!b->z) return 0;
+    if(!b->refused) {
+        long status = 0;
+        curl_easy_getinfo(b->curl, CURLINFO_RESPONSE_CODE, &status);
+        if(b->conn && res == CURLE_OK && status > 0 && status < 400) b->conn->gzip_upload = 1;
+        return 0;
+    }
+    curl_off_t up, down;
+    transport_wire_bytes(b->curl, &up, &down);
+    b->wire_up += up;
+    b->wire_down += down;
+    transport_unlink_header(b);
+    free(b->z);
+    b->z = NULL;
+    b->refused = 0;
+    b->resent_plain = 1;
+    b->received = 0;
+    curl_easy_setopt(b->curl, CURLOPT_HTTPHEADER, *headers);
+    curl_easy_setopt(b->curl, CURLOPT_POSTFIELDS, b->data);
+    curl_easy_setopt(b->curl, CURLOPT_POSTFIELDSIZE, (long)b->len);
+    return 1;
+}
+
+// Before sending the same body again (see ratelimit.h): count the bytes of
+// the attempt that failed and start the upload over.
+__attribute__((unused)) static void transport_rewind(struct transport_body *b) {
+    curl_off_t up, down;
+    transport_wire_bytes(b->curl, &up, &down);
+    b->wire_up += up;
+    b->wire_down += down;
+    b->received = 0;
+    if(b->stream) attach_seek(b->stream, 0, SEEK_SET);
+}
+
+static void transport_print_bytes(curl_off_t bytes) {
+    if(bytes < 10240) printf("%ld B", (long)bytes);
+    else if(bytes < 10 * 1024 * 1024) printf("%.1f kB", bytes / 1024.0);
+    else printf("%.1f MB", bytes / (1024.0 * 1024.0));
+}
+
+// Account for the transfer and free the compressed copy. report: print the
+// per-turn line in low-bandwidth mode.
+__attribute__((unused)) static void transport_body_done(struct transport_body *b, int report) {
+    curl_off_t up, down;
+    transport_wire_bytes(b->curl, &up, &down);
+    up += b->wire_up;
+    down += b->wire_down;
+    // a host that took plain JSON right after refusing gzip won't take it later
+    if(b->resent_plain && b->conn) {
+        long status = 0;
+        curl_easy_getinfo(b->curl, CURLINFO_RESPONSE_CODE, &status);
+        if(status > 0 && status < 400) b->conn->gzip_upload = -1;
+    }
+    transport_wire_sent += up;
+    transport_json_sent += b->len;
+    transport_wire_received += down;
+    transport_json_received += b->received;
+    if(report && transport_low_bandwidth_mode()) {
+        printf("(sent ");
+        transport_print_bytes(up);
+        printf(" of ");
+        transport_print_bytes(b->len);
+        printf(", received ");
+        transport_print_bytes(down);
+        printf(" of ");
+        transport_print_bytes(b->received);
+        curl_off_t json = transport_json_sent + transport_json_received;
+        curl_off_t wire = transport_wire_sent + transport_wire_received;
+        if(json > 0) printf("; session %.0f%% on the wire", 100.0 * wire / json);
+        printf(")\n");
+    }
+    free(b->z);
+    b->z = NULL;
+    attach_stream_free(b->stream);
+    b->stream = NULL;
+    transport_unlink_header(b);
+}
+
+static size_t transport_discard(void *contents, size_t size, size_t nmemb, void *userp) {
+    (void)contents;
+    (void)userp;
+    return size * nmemb;
+}
+
+static void transport_warm_start(struct transport_warm *w) {
+    CURL *curl = curl_easy_init();
+    if(!curl) return;
+    transport_setup_options(curl);
+    curl_easy_setopt(curl, CURLOPT_URL, w->url);
+    curl_easy_setopt(curl, CURLOPT_NOBODY, 1L);
+    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, transport_discard);
+    curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT, 10L);
+    curl_easy_setopt(curl, CURLOPT_TIMEOUT, 20L);
+    if(curl_multi_add_handle(transport_warm_multi, curl) != CURLM_OK) {
+        curl_easy_cleanup(curl);
+        return;
+    }
+    w->curl = curl;
+    w->last_used = time(NULL);
+}
+
+// Keep url's host warm from now on; the first warm-up starts right away.
+// Call after transport_init, once per provider the session may talk to.
+__attribute__((unused)) static void transport_warm(const char *url) {
+    const char *idle = getenv("LLM_WARM_IDLE");
+    const char *on = getenv("LLM_WARM");
+    if(idle && idle[0]) transport_warm_idle = atoi(idle);
+    if(on && strcmp(on, "0") == 0) transport_warm_idle = 0;
+    if(transport_warm_idle <= 0 || transport_num_warms >= TRANSPORT_MAX_HOSTS) return;
+    char host[128], other[128];
+    transport_host(url, host, sizeof(host));
+    for(int i = 0; i < transport_num_warms; i++) {
+        transport_host(transport_warms[i].url, other, sizeof(other));
+        if(strcmp(host, other) == 0) return;
+    }
+    if(!transport_warm_multi) transport_warm_multi = curl_multi_init();
+    if(!transport_warm_multi) return;
+    if(!transport_last_request) transport_last_request = time(NULL);
+    struct transport_warm *w = &transport_warms[transport_num_warms++];
+    snprintf(w->url, sizeof(w->url), "%s", url);
+    w->curl = NULL;
+    transport_warm_start(w);
+}
+
+// The prompt-wait hook (repl_idle): drives the warm-ups, reaps finished ones
+// and starts new ones where the host has been idle too long. Returns the
+// multi handle to wait on, NULL if none is in flight, and in *timeout_ms how
+// long the wait may take at most (-1: no limit).
+__attribute__((unused)) static CURLM *transport_warm_tick(int *timeout_ms) {
+    *timeout_ms = -1;
+    if(!transport_warm_multi) return NULL;
+    int running;
+    curl_multi_perform(transport_warm_multi, &running);
+    CURLMsg *msg;
+    int left;
+    while((msg = curl_multi_info_read(transport_warm_multi, &left))) {
+        if(msg->msg != CURLMSG_DONE) continue;
+        for(int i = 0; i < transport_num_warms; i++) {
+            struct transport_warm *w = &transport_warms[i];
+            if(w->curl != msg->easy_handle) continue;
+            curl_multi_remove_handle(transport_warm_multi, w->curl);
+            curl_easy_cleanup(w->curl);
+            w->curl = NULL;
+        }
+    }
+    time_t now = time(NULL);
+    int in_flight = 0;
+    for(int i = 0; i < transport_num_warms; i++) {
+        struct transport_warm *w = &transport_warms[i];
+        time_t last = w->last_used > transport_last_request ? w->last_used : transport_last_request;
+        if(!w->curl && now - transport_last_request < TRANSPORT_WARM_GIVE_UP) {
+            if(now - last >= transport_warm_idle) transport_warm_start(w);
+            else if(*timeout_ms < 0 || (last + transport_warm_idle - now) * 1000 < *timeout_ms) {
+                *timeout_ms = (int)(last + transport_warm_idle - now) * 1000;
+            }
+        }
+        in_flight += w->curl != NULL;
+    }
+    if(!in_flight) return NULL;
+    long curl_timeout = -1;
+    curl_multi_timeout(transport_warm_multi, &curl_timeout);
+    if(curl_timeout < 0 || curl_timeout > 1000) curl_timeout = 1000;
+    if(*timeout_ms < 0 || curl_timeout < *timeout_ms) *timeout_ms = (int)curl_timeout;
+    return transport_warm_multi;
+}
+
+__attribute__((unused)) static void transport_cleanup(void) {
+    transport_warm_cancel();
+    if(transport_warm_multi) curl_multi_cleanup(transport_warm_multi);
+    transport_warm_multi = NULL;
+    transport_num_warms = 0;
+    for(int i = 0; i < transport_num_conns; i++) {
+        curl_easy_cleanup(transport_conns[i].curl);
+    }
+    transport_num_conns = 0;
+    if(transport_share) curl_share_cleanup(transport_share);
+    transport_share = NULL;
+    curl_global_cleanup();
+}
+
+#endif
@@ -1,305 +1,669 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <curl/curl.h>
-#include <cjson/cJSON.h>
+#include "transport.h"
+#include "jsonscan.h"
+#include "catalog.h"
+#include "modelsearch.h"
+#include "history.h"
+#include "repl.h"
+#include "respcache.h"
+#include "batch.h"
+#include "route.h"
+#include "metrics.h"
+#include "ratelimit.h"
 
 #define BUFFER_SIZE 10240
-#define MAX_MESSAGES 100
+#define MAX_SELECTABLE_MODELS 500
+#define DEFAULT_MODEL "chatgpt-4o-latest"
 
-struct memory {
-    char *response;
-    size_t size;
+// A chat reply is read for two strings and the token usage, picked out as
+// the body downloads
+struct reply {
+    struct json_scanner scan;
+    char *text;
+    char *error;
+    long input_tokens, output_tokens, cache_written, cache_read;   // -1: not reported
+    int64_t parse_us;
 };
 
-typedef struct {
-    char role[16];     // "user" or "assistant"
-    char *content;
-} Message;
-
-Message history[MAX_MESSAGES];
-int history_size = 0;
-
 const char *openai_api_key = NULL;
 const char *anthropic_api_key = NULL;
+// LLM_OPENAI_URL and LLM_ANTHROPIC_URL override the bases
+char openai_chat_url[512], openai_models_url[512];
+char anthropic_messages_url[512], anthropic_models_url[512];
+struct catalog openai_catalog;
+struct catalog anthropic_catalog;
+char *selectable_models[MAX_SELECTABLE_MODELS];
+int num_selectable_models = 0;
+
+static const char *openai_reply_paths[] = { "choices[0].message.content", "error.message", "usage.prompt_tokens",
+                                            "usage.completion_tokens" };
+static const char *claude_reply_paths[] = { "content[0].text", "error.message", "usage.input_tokens",
+                                            "usage.output_tokens", "usage.cache_creation_input_tokens",
+                                            "usage.cache_read_input_tokens" };
 
+// Anthropic prompt caching, on unless LLM_PROMPT_CACHE=0
+static int claude_prompt_cache = 1;
+static long claude_tokens_input = 0, claude_tokens_cache_read = 0;
+
+static void reply_value(int path, int type, const char *value, size_t len, void *userp) {
+    struct reply *r = (struct reply *)userp;
+    if(type == JSON_NUMBER && path >= 2) {
+        long n = strtol(value, NULL, 10);
+        if(path == 2) r->input_tokens = n;
+        else if(path == 3) r->output_tokens = n;
+        else if(path == 4) r->cache_written = n;
+        else r->cache_read = n;
+        return;
+    }
+    if(type != JSON_STRING) return;
+    char **dst = path == 0 ? &r->text : &r->error;
+    if(!*dst) *dst = strdup(value);
+}
 static size_t write_callback(void *contents, size_t size, size_t nmemb, void *userp) {
     size_t realsize = size * nmemb;
-    struct memory *mem = (struct memory *)userp;
-
-    char *ptr = realloc(mem->response, mem->size + realsize + 1);
-    if(ptr == NULL) {
-        fprintf(stderr, "realloc returned NULL.\n");
-        return 0;
+    struct reply *r = (struct reply *)userp;
+    int64_t start = metrics_now_us();
+    json_scan_feed(&r->scan, contents, realsize);
+    r->parse_us += metrics_now_us() - start;
+    return realsize;
+}
+static void reply_free(struct reply *r) {
+    free(r->text);
+    free(r->error);
+    json_scan_free(&r->scan);
+}
+// Both providers are revalidated concurrently; a warm cache costs nothing.
+// The search runs over both lists at once, see modelsearch.h
+void list_available_models(const char *query) {
+    for(int i = 0; i < num_selectable_models; i++) {
+        free(selectable_models[i]);
+        selectable_models[i] = NULL;
     }
-    mem->response = ptr;
-    memcpy(&(mem->response[mem->size]), contents, realsize);
-    mem->size += realsize;
-    mem->response[mem->size] = 0;
+    num_selectable_models = 0;
+    struct catalog *cats[2];
+    int n = 0;
+    if (openai_api_key) cats[n++] = &openai_catalog;
+    if (anthropic_api_key) cats[n++] = &anthropic_catalog;
+    catalog_refresh(cats, n);
+    int listed = model_search(cats, n, query, selectable_models, MAX_SELECTABLE_MODELS);
+    num_selectable_models = listed > 0 ? listed : 0;
+}
 
-    return realsize;
+// The OpenAI and Anthropic model lists carry no context length
+static long guess_context_length(const char *model) {
+    if (strstr(model, "claude")) return 200000;
+    if (strstr(model, "gpt-4.1")) return 1047576;
+    if (strstr(model, "gpt-5")) return 400000;
+    if (strstr(model, "gpt-4o") || strstr(model, "gpt-4-turbo")) return 128000;
+    if (strstr(model, "gpt-3.5")) return 16385;
+    return 0;
 }
-void add_message(const char *role, const char *content) {
-    if(history_size >= MAX_MESSAGES) {
-        free(history[0].content);
-        memmove(&history[0], &history[1], (MAX_MESSAGES - 1) * sizeof(Message));
-        history_size--;
+void update_context_budget(const char *model) {
+    history_set_context(guess_context_length(model), 4096);
+}
+
+// input_tokens only counts what was neither read from nor written to the
+// cache. Nothing is printed for prompts too short to be cached.
+static void claude_print_cache_usage(CURL *curl, const struct reply *r) {
+    if(r->input_tokens < 0) return;
+    long written = r->cache_written > 0 ? r->cache_written : 0, read = r->cache_read > 0 ? r->cache_read : 0;
+    long input = r->input_tokens + written + read;
+    claude_tokens_input += input;
+    claude_tokens_cache_read += read;
+    if(written + read == 0) return;
+    double first_byte = 0;
+    curl_easy_getinfo(curl, CURLINFO_STARTTRANSFER_TIME, &first_byte);
+    printf("(prompt cache: %ld of %ld input tokens read, %ld written; first byte after %.2f s; session %.0f%% read)\n",
+           read, input, written, first_byte,
+           claude_tokens_input > 0 ? 100.0 * claude_tokens_cache_read / claude_tokens_input : 0.0);
+}
+
+// One request of a turn. A turn starts with one; when it is slower than
+// its model usually is, or fails, a second one races it (see route.h) and
+// whichever answers first is kept.
+struct attempt {
+    char model[128];
+    int claude;
+    const char *url;
+    CURL *curl;
+    int pooled;               // curl is the transport's handle for the host
+    char *body;
+    size_t body_len;
+    long tokens;                    // estimate for the body, charged to the rate limit
+    struct curl_slist *headers;
+    struct transport_body upload;
+    struct reply reply;
+    struct metrics_sample metrics;
+    struct ratelimit_bucket *limit;
+    struct ratelimit_info limits;
+    int retries;
+    double retry_at;          // failed, to be sent again then; 0: not
+    double started;
+    int running, finished, parsed, ok;
+    int reported;             // its error has been printed
+    CURLcode result;
+};
+
+static double attempt_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static struct ratelimit_bucket *chat_limit(const char *model) {
+    return ratelimit_find(strstr(model, "claude") ? anthropic_messages_url : openai_chat_url, model);
+}
+
+// Build the provider's request for model from the history. Returns 0 if
+// that provider has no key or the message does not fit the model.
+static int attempt_prepare(struct attempt *a, const char *model) {
+    memset(a, 0, sizeof(*a));
+    snprintf(a->model, sizeof(a->model), "%s", model);
+    a->reply.input_tokens = a->reply.output_tokens = a->reply.cache_written = a->reply.cache_read = -1;
+    metrics_begin(&a->metrics, model);
+    a->claude = strstr(model, "claude") != NULL;
+    a->limit = chat_limit(model);
+    ratelimit_info_reset(&a->limits);
+    char header[256];
+    if(a->claude) {
+        if (!anthropic_api_key) {
+            fprintf(stderr, "missing ANTHROPIC_API_KEY\n");
+            return 0;
+        }
+        a->url = anthropic_messages_url;
+        snprintf(header, sizeof(header), "x-api-key: %s", anthropic_api_key);
+        a->headers = curl_slist_append(a->headers, header);
+        a->headers = curl_slist_append(a->headers, "anthropic-version: 2023-06-01");
+    } else {
+        if (!openai_api_key) {
+            fprintf(stderr, "missing OPENAI_API_KEY\n");
+            return 0;
+        }
+        a->url = openai_chat_url;
+        snprintf(header, sizeof(header), "Authorization: Bearer %s", openai_api_key);
+        a->headers = curl_slist_append(a->headers, header);
     }
-    strcpy(history[history_size].role, role);
-    history[history_size].content = strdup(content);
-    history_size++;
+    a->headers = curl_slist_append(a->headers, "Content-Type: application/json");
+    update_context_budget(model);
+    int64_t build_start = metrics_now_us();
+    size_t len;
+    const char *body;
+    if(!a->claude) body = history_request_body(model, NULL, NULL, &len);
+    else if(claude_prompt_cache) body = history_request_body_cached(model, ",\"max_tokens\":4096", NULL, &len);
+    else body = history_request_body(model, ",\"max_tokens\":4096", NULL, &len);
+    a->metrics.build_us = metrics_now_us() - build_start;
+    if(!body) return 0;
+    // the history's body buffer is rebuilt for the other attempt
+    a->body = malloc(len);
+    if(!a->body) return 0;
+    memcpy(a->body, body, len);
+    a->body_len = len;
+    a->tokens = history_body_tokens;
+    return 1;
 }
 
-cJSON *build_messages_json() {
-    cJSON *messages = cJSON_CreateArray();
-    for(int i = 0; i < history_size; i++) {
-        cJSON *msg = cJSON_CreateObject();
-        cJSON_AddStringToObject(msg, "role", history[i].role);
-        cJSON_AddStringToObject(msg, "content", history[i].content);
-        cJSON_AddItemToArray(messages, msg);
+static int attempt_start(struct attempt *a, const struct attempt *other) {
+    // the pooled handle, unless the other attempt is on it already;
+    // transport_handle resets it, so don't even ask for it then
+    struct transport_conn *conn = transport_conn_for(a->url);
+    int busy = conn && other && other->curl == conn->curl;
+    CURL *pooled = busy ? NULL : transport_handle(a->url);
+    if(pooled) {
+        a->curl = pooled;
+        a->pooled = 1;
+    } else {
+        a->curl = curl_easy_init();
+        if(!a->curl) return 0;
+        transport_setup(a->curl);
+        curl_easy_setopt(a->curl, CURLOPT_PIPEWAIT, 0L);
     }
-    return messages;
+    json_scan_init(&a->reply.scan, a->claude ? claude_reply_paths : openai_reply_paths, a->claude ? 6 : 4,
+                   reply_value, &a->reply);
+    curl_easy_setopt(a->curl, CURLOPT_URL, a->url);
+    curl_easy_setopt(a->curl, CURLOPT_HTTPHEADER, a->headers);
+    transport_post(&a->upload, a->curl, a->url, &a->headers, a->body, a->body_len, write_callback, &a->reply, 1);
+    curl_easy_setopt(a->curl, CURLOPT_HEADERFUNCTION, ratelimit_header);
+    curl_easy_setopt(a->curl, CURLOPT_HEADERDATA, (void *)&a->limits);
+    if(curl_multi_add_handle(repl_multi, a->curl) != CURLM_OK) return 0;
+    a->started = attempt_now();
+    a->running = 1;
+    return 1;
 }
-void list_available_models() {
-    if (openai_api_key) {
-        CURL *curl = curl_easy_init();
-        if(!curl) return;
-        struct memory chunk = {0};
-        struct curl_slist *headers = NULL;
-        char auth_header[256];
-        snprintf(auth_header, sizeof(auth_header), "Authorization: Bearer %s", openai_api_key);
-        headers = curl_slist_append(headers, auth_header);
-        curl_easy_setopt(curl, CURLOPT_URL, "https://api.openai.com/v1/models");
-        curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
-        curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, write_callback);
-        curl_easy_setopt(curl, CURLOPT_WRITEDATA, (void *)&chunk);
-        printf("Fetching OpenAI models...\n");
-        CURLcode res = curl_easy_perform(curl);
-        if(res == CURLE_OK) {
-            cJSON *json = cJSON_Parse(chunk.response);
-            if(json) {
-                cJSON *data = cJSON_GetObjectItem(json, "data");
-                if(cJSON_IsArray(data)) {
-                    printf("--- OpenAI Models ---\n");
-                    cJSON *model;
-                    cJSON_ArrayForEach(model, data) {
-                        cJSON *id = cJSON_GetObjectItem(model, "id");
-                        if(cJSON_IsString(id) && strstr(id->valuestring, "gpt")) {
-                            printf("- %s\n", id->valuestring);
-                        }
-                    }
-                }
-                cJSON_Delete(json);
-            }
-        }
-        free(chunk.response);
-        curl_slist_free_all(headers);
-        curl_easy_cleanup(curl);
+
+// The transfer is over. Returns 0 if it was only a refused gzip probe and
+// has been sent again, or was turned away and will be (retry_at, see
+// ratelimit.h).
+static int attempt_done(struct attempt *a, CURLcode res) {
+    curl_multi_remove_handle(repl_multi, a->curl);
+    if(transport_retry(&a->upload, &a->headers, res)) {
+        curl_multi_add_handle(repl_multi, a->curl);
+        return 0;
     }
-    if (anthropic_api_key) {
-        CURL *curl = curl_easy_init();
-        if(!curl) return;   
-        struct memory chunk = {0};
-        struct curl_slist *headers = NULL;
-        char api_key_header[256];
-        snprintf(api_key_header, sizeof(api_key_header), "x-api-key: %s", anthropic_api_key);
-        headers = curl_slist_append(headers, api_key_header);
-        headers = curl_slist_append(headers, "anthropic-version: 2023-06-01");
-        curl_easy_setopt(curl, CURLOPT_URL, "https://api.anthropic.com/v1/models");
-        curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
-        curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, write_callback);
-        curl_easy_setopt(curl, CURLOPT_WRITEDATA, (void *)&chunk);
-        printf("Fetching Anthropic models...\n");
-        CURLcode res = curl_easy_perform(curl);
-        if (res == CURLE_OK) {
-            cJSON *json = cJSON_Parse(chunk.response);
-            if(json) {
-                cJSON *data = cJSON_GetObjectItem(json, "data");
-                if(cJSON_IsArray(data)) {
-                    printf("--- Anthropic Claude Models ---\n");
-                    cJSON *model;
-                    cJSON_ArrayForEach(model, data) {
-                        cJSON *id = cJSON_GetObjectItem(model, "id");
-                        if(cJSON_IsString(id)) {
-                            printf("- %s\n", id->valuestring);
-                        }
-                    }
-                }
-                cJSON_Delete(json);
-            }
-        }
-        free(chunk.response);
-        curl_slist_free_all(headers);
-        curl_easy_cleanup(curl);
+    a->running = 0;
+    a->result = res;
+    a->parsed = res == CURLE_OK && json_scan_finish(&a->reply.scan);
+    a->ok = a->parsed && a->reply.text;
+    route_record(a->model, attempt_now() - a->started, a->ok);
+    ratelimit_update(a->limit, &a->limits);
+    if(!a->ok && ratelimit_retry(a->limit, &a->limits, res, a->retries, a->model)) {
+        a->retries++;
+        a->retry_at = attempt_now() + ratelimit_delay(a->limit, a->tokens);
+        return 0;
     }
+    a->finished = 1;
+    return 1;
 }
 
-void chat_with_openai(const char *model, const char *message) {
-    if (!openai_api_key) {
-        fprintf(stderr, "missing OPENAI_API_KEY\n");
-        return;
+// Send a turned-away request again, with a fresh reply
+static int attempt_restart(struct attempt *a) {
+    a->retry_at = 0;
+    reply_free(&a->reply);
+    memset(&a->reply, 0, sizeof(a->reply));
+    a->reply.input_tokens = a->reply.output_tokens = a->reply.cache_written = a->reply.cache_read = -1;
+    json_scan_init(&a->reply.scan, a->claude ? claude_reply_paths : openai_reply_paths, a->claude ? 6 : 4,
+                   reply_value, &a->reply);
+    a->parsed = a->ok = 0;
+    ratelimit_info_reset(&a->limits);
+    transport_rewind(&a->upload);
+    ratelimit_sent(a->limit, a->tokens);
+    if(curl_multi_add_handle(repl_multi, a->curl) != CURLM_OK) {
+        a->finished = 1;
+        a->result = CURLE_FAILED_INIT;
+        return 0;
     }
-    CURL *curl = curl_easy_init();
-    if(!curl) return;
-    struct memory chunk = {0};
-    struct curl_slist *headers = NULL;
-    char auth_header[256];
-    snprintf(auth_header, sizeof(auth_header), "Authorization: Bearer %s", openai_api_key);
-    headers = curl_slist_append(headers, auth_header);
-    headers = curl_slist_append(headers, "Content-Type: application/json");
+    a->started = attempt_now();
+    a->running = 1;
+    return 1;
+}
 
-    cJSON *root = cJSON_CreateObject();
-    cJSON_AddStringToObject(root, "model", model);
-    cJSON *messages_json = build_messages_json();
-    cJSON_AddItemToObject(root, "messages", messages_json);
-    char *postdata = cJSON_PrintUnformatted(root);
-    curl_easy_setopt(curl, CURLOPT_URL, "https://api.openai.com/v1/chat/completions");
-    curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
-    curl_easy_setopt(curl, CURLOPT_POSTFIELDS, postdata);
-    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, write_callback);
-    curl_easy_setopt(curl, CURLOPT_WRITEDATA, (void *)&chunk);
-    CURLcode res = curl_easy_perform(curl);
-    if(res != CURLE_OK) {
-        fprintf(stderr, "curl_easy_perform() failed: %s\n", curl_easy_strerror(res));
+static void attempt_print_error(struct attempt *a) {
+    if(a->reported || !a->finished) return;
+    a->reported = 1;
+    if(a->result != CURLE_OK) {
+        fprintf(stderr, "curl_easy_perform() failed: %s\n", curl_easy_strerror(a->result));
+    } else if(!a->parsed) {
+        fprintf(stderr, "damn JSON\n");
+    } else if(a->reply.error) {
+        fprintf(stderr, "API Error: %s\n", a->reply.error);
     } else {
-        cJSON *json = cJSON_Parse(chunk.response);
-        if(json) {
-            cJSON *choices = cJSON_GetObjectItem(json, "choices");
-            if(cJSON_IsArray(choices) && cJSON_GetArraySize(choices) > 0) {
-                cJSON *first_choice = cJSON_GetArrayItem(choices, 0);
-                cJSON *message_obj = cJSON_GetObjectItem(first_choice, "message");
-                if(message_obj) {
-                    cJSON *content = cJSON_GetObjectItem(message_obj, "content");
-                    if(cJSON_IsString(content)) {
-                        printf("AI: %s\n", content->valuestring);
-                        add_message("assistant", content->valuestring);
-                    }
-                }
-            } else {
-                 cJSON *error = cJSON_GetObjectItem(json, "error");
-                 if (error) {
-                     cJSON *error_message = cJSON_GetObjectItem(error, "message");
-                     if (cJSON_IsString(error_message)) {
-                         fprintf(stderr, "API Error: %s\n", error_message->valuestring);
-                     }
-                 } else {
-                    printf("Well, something surely happens...\n");
-                 }
-            }
-            cJSON_Delete(json);
-        } else {
-            fprintf(stderr, "damn JSON\n");
-        }
+        printf("Well, something surely happens...\n");
     }
-    free(postdata);
-    free(chunk.response);
-    curl_slist_free_all(headers);
-    curl_easy_cleanup(curl);
-    cJSON_Delete(root);
 }
-void chat_with_claude(const char *model, const char *message) {
-    if (!anthropic_api_key) {
-        fprintf(stderr, "missing ANTHROPIC_API_KEY\n");
-        return;
+
+// File a finished request with metrics.h; a cancelled loser is left out,
+// it neither failed nor answered.
+static void attempt_metrics(struct attempt *a) {
+    struct reply *r = &a->reply;
+    if(r->input_tokens >= 0) {
+        // Anthropic leaves what came from or went to the cache out of input_tokens
+        a->metrics.prompt_tokens = r->input_tokens + (r->cache_written > 0 ? r->cache_written : 0) +
+                                   (r->cache_read > 0 ? r->cache_read : 0);
     }
-    CURL *curl = curl_easy_init();
-    if(!curl) return;
+    a->metrics.completion_tokens = r->output_tokens;
+    a->metrics.parse_us = r->parse_us;
+    a->metrics.text = r->text;
+    metrics_finish(&a->metrics, a->curl, a->ok);
+}
 
-    struct memory chunk = {0};
-    struct curl_slist *headers = NULL;
-    char api_key_header[256];
-    snprintf(api_key_header, sizeof(api_key_header), "x-api-key: %s", anthropic_api_key);
-    headers = curl_slist_append(headers, api_key_header);
-    headers = curl_slist_append(headers, "anthropic-version: 2023-06-01");
-    headers = curl_slist_append(headers, "Content-Type: application/json");
-    cJSON *root = cJSON_CreateObject();
-    cJSON_AddStringToObject(root, "model", model);
-    cJSON_AddNumberToObject(root, "max_tokens", 4096);
-    cJSON *messages_json = build_messages_json();
-    cJSON_AddItemToObject(root, "messages", messages_json);
-    char *postdata = cJSON_PrintUnformatted(root);
-    curl_easy_setopt(curl, CURLOPT_URL, "https://api.anthropic.com/v1/messages");
-    curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
-    curl_easy_setopt(curl, CURLOPT_POSTFIELDS, postdata);
-    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, write_callback);
-    curl_easy_setopt(curl, CURLOPT_WRITEDATA, (void *)&chunk);
-    CURLcode res = curl_easy_perform(curl);
-    if(res != CURLE_OK) {
-        fprintf(stderr, "curl_easy_perform() failed: %s\n", curl_easy_strerror(res));
-    } else {
-        cJSON *json = cJSON_Parse(chunk.response);
-        if(json) {
-            cJSON *content_array = cJSON_GetObjectItem(json, "content");
-            if(cJSON_IsArray(content_array) && cJSON_GetArraySize(content_array) > 0) {
-                cJSON *first_content = cJSON_GetArrayItem(content_array, 0);
-                cJSON *text = cJSON_GetObjectItem(first_content, "text");
-                if(cJSON_IsString(text)) {
-                    printf("AI: %s\n", text->valuestring);
-                    add_message("assistant", text->valuestring);
+// report: print the low-bandwidth line for this transfer
+static void attempt_free(struct attempt *a, int report) {
+    if(a->finished) attempt_metrics(a);
+    if(a->running) curl_multi_remove_handle(repl_multi, a->curl);
+    if(a->curl) transport_body_done(&a->upload, report);
+    if(a->curl && !a->pooled) curl_easy_cleanup(a->curl);
+    reply_free(&a->reply);
+    curl_slist_free_all(a->headers);
+    free(a->body);
+}
+
+// The prompt, with whatever was /attach'ed to it
+static void add_user_message(const char *text) {
+    size_t parts_len;
+    int tokens;
+    char *parts = attach_take(&parts_len, &tokens);
+    add_message_parts("user", text, parts, parts_len, tokens);
+    free(parts);
+}
+
+void chat_message(const char *model, const char *message) {
+    add_user_message(message);
+    const char *chosen = model;
+    char fallback_model[128];
+    const char *fallback = route_fallback(model, fallback_model, sizeof(fallback_model));
+    // no key for the fallback's provider: no hedging
+    if(fallback && (strstr(fallback, "claude") ? !anthropic_api_key : !openai_api_key)) fallback = NULL;
+    if(fallback && route_prefer_fallback(model, fallback)) {
+        const char *swap = model;
+        model = fallback;
+        fallback = swap;
+    }
+    struct attempt tries[2];
+    int n = 1;
+    if(!attempt_prepare(&tries[0], model)) {
+        attempt_free(&tries[0], 0);
+        history_drop_newest();
+        history_release_body();
+        return;
+    }
+    char *cached = rcache_get(tries[0].url, tries[0].body, tries[0].body_len);
+    if(cached) {
+        printf("AI: %s\n", cached);
+        add_message("assistant", cached);
+        free(cached);
+        attempt_free(&tries[0], 0);
+        history_release_body();
+        return;
+    }
+    // held back while the provider's limits say it would be turned away
+    if(ratelimit_wait(tries[0].limit, tries[0].tokens, 0)) {
+        printf("(cancelled)\n");
+        attempt_free(&tries[0], 0);
+        history_release_body();
+        return;
+    }
+    if(!attempt_start(&tries[0], NULL)) {
+        fprintf(stderr, "Could not start the request\n");
+        attempt_free(&tries[0], 0);
+        history_release_body();
+        return;
+    }
+    double hedge_at = tries[0].started + route_hedge_delay(model);
+    int winner = -1, cancelled = 0;
+    repl_take_interrupt();
+    while(winner < 0) {
+        int still;
+        if(curl_multi_perform(repl_multi, &still) != CURLM_OK) break;
+        CURLMsg *msg;
+        int left;
+        while((msg = curl_multi_info_read(repl_multi, &left))) {
+            if(msg->msg != CURLMSG_DONE) continue;
+            for(int i = 0; i < n; i++) {
+                struct attempt *a = &tries[i];
+                if(!a->running || a->curl != msg->easy_handle) continue;
+                if(!attempt_done(a, msg->data.result)) {
+                    // turned away and sent again after a backoff; the fallback
+                    // is asked right away and races the retry
+                    if(a->retry_at > 0 && n == 1 && fallback) hedge_at = 0;
+                    continue;
+                }
+                if(a->ok) {
+                    if(winner < 0) winner = i;
+                } else if(n == 1 && fallback) {
+                    // failover: don't drop the turn while there is someone else to ask
+                    attempt_print_error(a);
+                    hedge_at = 0;
                 }
-            } else { // Handle API errors
-                 cJSON *error = cJSON_GetObjectItem(json, "error");
-                 if (error) {
-                     cJSON *error_message = cJSON_GetObjectItem(error, "message");
-                     if (cJSON_IsString(error_message)) {
-                         fprintf(stderr, "API Error: %s\n", error_message->valuestring);
-                     }
-                 } else {
-                    printf("Something surely happens...\n");
-                 }
             }
-            cJSON_Delete(json);
-        } else {
-            fprintf(stderr, "damn JSON\n");
         }
+        if(winner >= 0) break;
+        double now = attempt_now();
+        for(int i = 0; i < n; i++) {
+            if(tries[i].retry_at > 0 && now >= tries[i].retry_at) attempt_restart(&tries[i]);
+        }
+        if(n == 1 && fallback && now >= hedge_at) {
+            // not while its limits say it would be turned away
+            double wait = ratelimit_delay(chat_limit(fallback), tries[0].tokens);
+            if(wait > 0) {
+                hedge_at = now + wait;
+                continue;
+            }
+            if(tries[0].running) printf("(no answer after %.1f s, also asking %s)\n", now - tries[0].started, fallback);
+            else printf("(asking %s instead)\n", fallback);
+            fflush(stdout);
+            route_find(model)->hedged++;
+            if(attempt_prepare(&tries[1], fallback) && attempt_start(&tries[1], &tries[0])) {
+                ratelimit_sent(tries[1].limit, tries[1].tokens);
+                n = 2;
+            } else {
+                attempt_free(&tries[1], 0);
+            }
+            fallback = NULL;
+            continue;
+        }
+        int running = 0;
+        double wake = n == 1 && fallback ? hedge_at : now + 1;
+        for(int i = 0; i < n; i++) {
+            running += tries[i].running || tries[i].retry_at > 0;
+            if(tries[i].retry_at > 0 && tries[i].retry_at < wake) wake = tries[i].retry_at;
+        }
+        if(running == 0) break;
+        long timeout = 1000;
+        if(wake > now && (wake - now) * 1000 < timeout) timeout = (long)((wake - now) * 1000) + 1;
+        else if(wake <= now) timeout = 1;
+        if(repl_poll(repl_multi, (int)timeout)) {
+            cancelled = 1;
+            break;
+        }
+    }
+    if(cancelled) {
+        printf("(cancelled)\n");
+    } else if(winner >= 0) {
+        struct attempt *w = &tries[winner];
+        if(winner > 0) route_find(tries[0].model)->hedge_wins++;
+        int64_t render_start = metrics_now_us();
+        if(winner > 0 && strcmp(w->model, tries[0].model) != 0) printf("AI (%s): %s\n", w->model, w->reply.text);
+        else printf("AI: %s\n", w->reply.text);
+        w->metrics.render_us = metrics_now_us() - render_start;
+        add_message("assistant", w->reply.text);
+        rcache_put(w->url, w->body, w->body_len, w->reply.text);
+        if(w->claude) claude_print_cache_usage(w->curl, &w->reply);
+        // the loser is given up on
+        for(int i = 0; i < n; i++) {
+            if(tries[i].running) route_record_cancelled(tries[i].model, attempt_now() - tries[i].started);
+        }
+    } else {
+        for(int i = 0; i < n; i++) attempt_print_error(&tries[i]);
     }
-    free(postdata);
-    free(chunk.response);
-    curl_slist_free_all(headers);
-    curl_easy_cleanup(curl);
-    cJSON_Delete(root);
+    // the loser first, so the winner's line includes it in the session total
+    for(int i = 0; i < n; i++) {
+        if(i != winner) attempt_free(&tries[i], 0);
+    }
+    if(winner >= 0) attempt_free(&tries[winner], 1);
+    update_context_budget(chosen);
+    history_release_body();
 }
-void chat_message(const char *model, const char *message) {
-    add_message("user", message);
+
+// --batch: lines are routed to OpenAI or Anthropic by model name, like chat_message
+static struct curl_slist *openai_batch_headers = NULL;
+static struct curl_slist *claude_batch_headers = NULL;
+static const char *openai_batch_paths[] = { "choices[0].message.content", "error.message", "usage.completion_tokens" };
+static const char *claude_batch_paths[] = { "content[0].text", "error.message", "usage.output_tokens" };
+static int tui_batch_target(const char *model, struct batch_target *target) {
+    char header[256];
     if (strstr(model, "claude") != NULL) {
-        chat_with_claude(model, message);
-    } else {
-        chat_with_openai(model, message);
+        if (!anthropic_api_key) {
+            fprintf(stderr, "missing ANTHROPIC_API_KEY\n");
+            return 0;
+        }
+        if (!claude_batch_headers) {
+            snprintf(header, sizeof(header), "x-api-key: %s", anthropic_api_key);
+            claude_batch_headers = curl_slist_append(claude_batch_headers, header);
+            claude_batch_headers = curl_slist_append(claude_batch_headers, "anthropic-version: 2023-06-01");
+            claude_batch_headers = curl_slist_append(claude_batch_headers, "Content-Type: application/json");
+        }
+        target->url = anthropic_messages_url;
+        target->headers = claude_batch_headers;
+        target->before = ",\"max_tokens\":4096";
+        target->paths = claude_batch_paths;
+        return 1;
+    }
+    if (!openai_api_key) {
+        fprintf(stderr, "missing OPENAI_API_KEY\n");
+        return 0;
+    }
+    if (!openai_batch_headers) {
+        snprintf(header, sizeof(header), "Authorization: Bearer %s", openai_api_key);
+        openai_batch_headers = curl_slist_append(openai_batch_headers, header);
+        openai_batch_headers = curl_slist_append(openai_batch_headers, "Content-Type: application/json");
     }
+    target->url = openai_chat_url;
+    target->headers = openai_batch_headers;
+    target->paths = openai_batch_paths;
+    return 1;
 }
 
-int main() {
+int main(int argc, char **argv) {
+    struct batch_options batch = { .model = DEFAULT_MODEL };
+    const char *resume = journal_parse_args(&argc, argv);
+    int batch_mode = batch_parse_args(argc, argv, &batch);
+    if(batch_mode < 0) return 1;
     openai_api_key = getenv("OPENAI_API_KEY");
     anthropic_api_key = getenv("ANTHROPIC_API_KEY");
     if(!openai_api_key && !anthropic_api_key) {
         fprintf(stderr, "Where are your API keys?\n");
         return 1;
     }
+    const char *prompt_cache = getenv("LLM_PROMPT_CACHE");
+    if(prompt_cache && strcmp(prompt_cache, "0") == 0) claude_prompt_cache = 0;
+    transport_init();
+    // cached answers have to be reproducible, see respcache.h
+    if(rcache_wanted()) history_options = RCACHE_OPTIONS;
+    transport_url(openai_chat_url, sizeof(openai_chat_url), "LLM_OPENAI_URL", "https://api.openai.com/v1", "/chat/completions");
+    transport_url(openai_models_url, sizeof(openai_models_url), "LLM_OPENAI_URL", "https://api.openai.com/v1", "/models");
+    transport_url(anthropic_messages_url, sizeof(anthropic_messages_url), "LLM_ANTHROPIC_URL", "https://api.anthropic.com/v1", "/messages");
+    transport_url(anthropic_models_url, sizeof(anthropic_models_url), "LLM_ANTHROPIC_URL", "https://api.anthropic.com/v1", "/models");
+    if(batch_mode) {
+        int status = batch_run(&batch, tui_batch_target);
+        rcache_close();
+        metrics_close();
+        curl_slist_free_all(openai_batch_headers);
+        curl_slist_free_all(claude_batch_headers);
+        transport_cleanup();
+        return status;
+    }
+    char model[128] = DEFAULT_MODEL;
+    journal_enabled = 1;
+    if(resume && !history_resume(resume, model, sizeof(model))) return 1;
+    route_configure();
+    route_load();
+    catalog_init(&openai_catalog, "openai", openai_models_url);
+    catalog_init(&anthropic_catalog, "anthropic", anthropic_models_url);
+    if (openai_api_key) {
+        char auth_header[256];
+        snprintf(auth_header, sizeof(auth_header), "Authorization: Bearer %s", openai_api_key);
+        catalog_add_header(&openai_catalog, auth_header);
+    }
+    if (anthropic_api_key) {
+        char api_key_header[256];
+        snprintf(api_key_header, sizeof(api_key_header), "x-api-key: %s", anthropic_api_key);
+        catalog_add_header(&anthropic_catalog, api_key_header);
+        catalog_add_header(&anthropic_catalog, "anthropic-version: 2023-06-01");
+    }
 
+    repl_init();
+    // connect while the first prompt is being typed
+    if (openai_api_key) transport_warm(openai_chat_url);
+    if (anthropic_api_key) transport_warm(anthropic_messages_url);
+    repl_idle = transport_warm_tick;
     char input[2048];
-    char model[128] = "chatgpt-4o-latest"; // Default model
-    printf("Commands: /model to change model, /quit to exit\n");
+    printf("Commands: /model [words ctx>=128k price<1 in:image sort:name] to find and change model, /attach <file> to send a text file or image with the next message (/detach drops them), /pin to always send the last message, /unpin, /fork [name] to branch the conversation here, /undo to take back the last turn, /branches to list them, /switch <branch>, /mem for memory use, /cache for response cache stats, /routes for latency per model, /stats for request timings, /quit to exit (Ctrl-C stops an answer)\n");
     printf("Current Model: %s\n", model);
+    update_context_budget(model);
 
     while(1) {
         printf("> ");
-        if(!fgets(input, sizeof(input), stdin)) break;
+        if(!repl_gets(input, sizeof(input))) break;
         input[strcspn(input, "\n")] = 0;
         if(strlen(input) == 0) continue; 
         if(strcmp(input, "/quit") == 0) break;
-        if(strcmp(input, "/model") == 0) {
-            list_available_models();
-            printf("Enter model name to use: ");
-            if(fgets(model, sizeof(model), stdin)) {
-                model[strcspn(model, "\n")] = 0;
+        if(strcmp(input, "/mem") == 0) {
+            history_print_mem();
+            continue;
+        }
+        if(strcmp(input, "/cache") == 0) {
+            rcache_print_stats();
+            continue;
+        }
+        if(strcmp(input, "/stats") == 0) {
+            metrics_print();
+            ratelimit_print();
+            continue;
+        }
+        if(strcmp(input, "/routes") == 0) {
+            route_print();
+            continue;
+        }
+        if(strncmp(input, "/attach", 7) == 0 && (input[7] == ' ' || input[7] == 0)) {
+            const char *path = input + 7 + strspn(input + 7, " ");
+            if(path[0]) attach_add(path);
+            else attach_list();
+            continue;
+        }
+        if(strcmp(input, "/detach") == 0) {
+            attach_clear();
+            continue;
+        }
+        if(strcmp(input, "/pin") == 0) {
+            history_pin_last();
+            continue;
+        }
+        if(strcmp(input, "/unpin") == 0) {
+            history_unpin_all();
+            continue;
+        }
+        if(strcmp(input, "/undo") == 0) {
+            history_undo();
+            continue;
+        }
+        if(strcmp(input, "/branches") == 0) {
+            history_list_branches();
+            continue;
+        }
+        if(strncmp(input, "/fork", 5) == 0 && (input[5] == ' ' || input[5] == 0)) {
+            history_fork(input + 5 + strspn(input + 5, " "));
+            continue;
+        }
+        if(strncmp(input, "/switch", 7) == 0 && (input[7] == ' ' || input[7] == 0)) {
+            const char *which = input + 7 + strspn(input + 7, " ");
+            if(which[0]) history_switch(which);
+            else history_list_branches();
+            continue;
+        }
+        if(strncmp(input, "/model", 6) == 0 && (input[6] == ' ' || input[6] == 0)) {
+            const char *query = input + 6 + strspn(input + 6, " ");
+            list_available_models(query);
+            char choice[sizeof(model)] = "";
+            if(query[0] && (num_selectable_models == 1 || (num_selectable_models > 1 && strcmp(selectable_models[0], query) == 0))) {
+                snprintf(choice, sizeof(choice), "%s", selectable_models[0]);
+            } else if(query[0] && num_selectable_models == 0 && !strpbrk(query, " <>=:")) {
+                // not in the lists (they lag behind new models): take it as a name
+                snprintf(choice, sizeof(choice), "%s", query);
+            } else {
+                // a number from the list, or any model name
+                printf("Enter model number or name to use: ");
+                if(!repl_gets(choice, sizeof(choice))) continue;
+                choice[strcspn(choice, "\n")] = 0;
+                char *endptr;
+                long n = strtol(choice, &endptr, 10);
+                if(endptr != choice && *endptr == 0 && n > 0 && n <= num_selectable_models) {
+                    snprintf(choice, sizeof(choice), "%s", selectable_models[n - 1]);
+                }
+            }
+            if(choice[0]) {
+                snprintf(model, sizeof(model), "%s", choice);
                 printf("Model set to: %s\n", model);
+                update_context_budget(model);
+                history_set_model(model);
             }
             continue;
         }
         chat_message(model, input);
     }
-    for(int i = 0; i < history_size; i++) {
-        if(history[i].content) free(history[i].content);
+    history_free();
+    route_save();
+    for(int i = 0; i < num_selectable_models; i++) {
+        free(selectable_models[i]);
     }
+    model_index_cleanup();
+    catalog_free(&openai_catalog);
+    catalog_free(&anthropic_catalog);
+    rcache_close();
+    metrics_close();
+    repl_cleanup();
+    transport_cleanup();
     return 0;
 }